@@ -0,0 +1,393 @@
+/* Times each installed backend opening and decoding a corpus of images, and
+ * the work the render path does on what they decode, writing the results to
+ * stdout as JSON. Runs headless: the canvas needs an OpenGL context, so GL
+ * drawing itself isn't timed, only the CPU side of getting images ready to
+ * draw at a given scale.
+ *
+ * Usage: bench [-q] [path...]
+ *
+ * PNGs and SVGs of a few sizes are generated with cairo, so there's always
+ * something to decode. Any files, or directories of files, given on the
+ * command line are added to the corpus for the other formats. -q runs each
+ * case only once, as a smoke test.
+ */
+#include "backend.h"
+#include "backends.h"
+#include "bitmap.h"
+#include "image.h"
+#include "list.h"
+#include "module.h"
+#include "source.h"
+
+#include <cairo/cairo.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Each case is run until it's taken this long, in seconds, within these
+ * bounds on the number of runs */
+#define MIN_DURATION 0.5
+#define MIN_RUNS 3
+#define MAX_RUNS 200
+
+/* The sizes of the generated images */
+static const int corpus_sizes[] = {256, 1024, 4096};
+
+/* The scales the render path is timed at */
+static const double render_scales[] = {0.125, 0.25, 0.5, 1.0, 2.0};
+
+/* The backends imv tries, and those among them that are modules, once loaded */
+static const struct imv_backend_entry *backends;
+static size_t backends_len;
+static struct imv_module **modules;
+
+/* Non-public function from imv_image */
+struct imv_bitmap *imv_image_get_bitmap(const struct imv_image *image);
+
+/* Options and state shared by every case */
+static struct {
+  bool quick;
+  /* whether a result has been written yet, for the commas between them */
+  bool any_results;
+} bench;
+
+static double cur_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  const double x = *(const double *)a;
+  const double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void write_string(const char *str)
+{
+  putchar('"');
+  for (const char *c = str; *c; ++c) {
+    if (*c == '"' || *c == '\\') {
+      printf("\\%c", *c);
+    } else if ((unsigned char)*c < 0x20) {
+      printf("\\u%04x", *c);
+    } else {
+      putchar(*c);
+    }
+  }
+  putchar('"');
+}
+
+/* Write one result, from the durations of each run, in seconds, sorting
+ * them as it goes. scale is left out if it's 0. */
+static void write_result(const char *name, const char *backend,
+    const char *file, double scale, double *times, int runs)
+{
+  qsort(times, runs, sizeof *times, compare_doubles);
+  double total = 0.0;
+  for (int i = 0; i < runs; ++i) {
+    total += times[i];
+  }
+
+  printf("%s\n    {\"case\": ", bench.any_results ? "," : "");
+  write_string(name);
+  printf(", \"backend\": ");
+  write_string(backend);
+  printf(", \"file\": ");
+  write_string(file);
+  if (scale > 0.0) {
+    printf(", \"scale\": %g", scale);
+  }
+  printf(", \"runs\": %d, \"min_ms\": %.4f, \"median_ms\": %.4f, "
+      "\"mean_ms\": %.4f, \"max_ms\": %.4f}", runs, times[0] * 1e3,
+      times[runs / 2] * 1e3, total / runs * 1e3, times[runs - 1] * 1e3);
+  bench.any_results = true;
+}
+
+/* Whether another run of a case is needed, given those done so far */
+static bool more_runs(int runs, double elapsed)
+{
+  if (bench.quick) {
+    return runs < 1;
+  }
+  return runs < MIN_RUNS || (elapsed < MIN_DURATION && runs < MAX_RUNS);
+}
+
+static const struct imv_backend *entry_backend(size_t i)
+{
+  if (!backends[i].backend && !modules[i]) {
+    modules[i] = imv_module_create(backends[i].name);
+  }
+  return modules[i] ? imv_module_backend(modules[i]) : backends[i].backend;
+}
+
+static void store_image(struct imv_source_message *message)
+{
+  struct imv_image **image = message->user_data;
+  if (message->preview) {
+    imv_image_free(message->image);
+    return;
+  }
+  imv_image_free(*image);
+  *image = message->image;
+}
+
+/* Time opening the file, and decoding its first frame, returning the
+ * decoded image, or NULL if the backend can't read it */
+static struct imv_image *bench_decode(const struct imv_backend_entry *entry,
+    const struct imv_backend *backend, const char *path, const char *file)
+{
+  double open_times[MAX_RUNS], decode_times[MAX_RUNS];
+  double open_total = 0.0, decode_total = 0.0;
+  struct imv_image *image = NULL;
+  int runs = 0;
+
+  while (more_runs(runs, open_total + decode_total)) {
+    struct imv_source *src = NULL;
+    const double start = cur_time();
+    if (backend->open_path(path, &src) != BACKEND_SUCCESS) {
+      break;
+    }
+    const double opened = cur_time();
+
+    imv_image_free(image);
+    image = NULL;
+
+    /* Prefetches are loaded without previews, so this times one decode */
+    imv_source_set_priority(src, IMV_SOURCE_PRIORITY_PREFETCH);
+    imv_source_set_callback(src, store_image, &image);
+    imv_source_load_first_frame(src);
+    const double decoded = cur_time();
+    imv_source_free(src);
+
+    if (!image) {
+      break;
+    }
+    open_times[runs] = opened - start;
+    decode_times[runs] = decoded - opened;
+    open_total += open_times[runs];
+    decode_total += decode_times[runs];
+    ++runs;
+  }
+
+  if (runs > 0) {
+    write_result("open_path", entry->name, file, 0.0, open_times, runs);
+    write_result("first_frame", entry->name, file, 0.0, decode_times, runs);
+  }
+  return image;
+}
+
+/* Time the work done to draw an image at each scale: rasterising vector
+ * images, and building the mipmaps bitmaps are drawn from when shrunk */
+static void bench_render(const char *backend, const char *file,
+    struct imv_image *image)
+{
+  double times[MAX_RUNS];
+
+  if (imv_image_is_vector(image)) {
+    for (size_t s = 0; s < sizeof render_scales / sizeof *render_scales; ++s) {
+      double total = 0.0;
+      int runs = 0;
+      while (more_runs(runs, total)) {
+        const double start = cur_time();
+        struct imv_bitmap *raster = imv_image_rasterize(image, render_scales[s]);
+        times[runs] = cur_time() - start;
+        imv_bitmap_free(raster);
+        total += times[runs++];
+      }
+      write_result("rasterize", backend, file, render_scales[s], times, runs);
+    }
+    return;
+  }
+
+  struct imv_bitmap *bitmap = imv_image_get_bitmap(image);
+  if (!bitmap) {
+    return;
+  }
+
+  double total = 0.0;
+  int runs = 0;
+  while (more_runs(runs, total)) {
+    struct imv_image *copy = imv_image_create_from_bitmap(imv_bitmap_clone(bitmap));
+    const double start = cur_time();
+    imv_image_generate_mipmaps(copy);
+    times[runs] = cur_time() - start;
+    imv_image_free(copy);
+    total += times[runs++];
+  }
+  write_result("mipmaps", backend, file, 0.0, times, runs);
+}
+
+static void bench_file(const char *path)
+{
+  unsigned char header[4096];
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return;
+  }
+  const size_t len = fread(header, 1, sizeof header, f);
+  fclose(f);
+
+  const char *file = strrchr(path, '/');
+  file = file ? file + 1 : path;
+
+  for (size_t i = 0; i < backends_len; ++i) {
+    const struct imv_backend_entry *entry = &backends[i];
+    if (entry->sniff && !entry->sniff(header, len)) {
+      continue;
+    }
+    const struct imv_backend *backend = entry_backend(i);
+    if (!backend || !backend->open_path) {
+      continue;
+    }
+
+    struct imv_image *image = bench_decode(entry, backend, path, file);
+    if (image) {
+      bench_render(entry->name, file, image);
+      imv_image_free(image);
+    }
+  }
+}
+
+/* Fill a surface with something that doesn't compress away to nothing */
+static void draw_pattern(cairo_t *cairo, int size)
+{
+  cairo_set_source_rgb(cairo, 0.2, 0.3, 0.4);
+  cairo_paint(cairo);
+  srand(size);
+  for (int i = 0; i < 200; ++i) {
+    cairo_set_source_rgba(cairo, rand() / (double)RAND_MAX,
+        rand() / (double)RAND_MAX, rand() / (double)RAND_MAX, 0.6);
+    cairo_rectangle(cairo, rand() % size, rand() % size,
+        1 + rand() % (size / 4), 1 + rand() % (size / 4));
+    cairo_fill(cairo);
+  }
+}
+
+static void write_png(struct list *corpus, const char *dir, int size)
+{
+  char path[4096];
+  snprintf(path, sizeof path, "%s/generated-%d.png", dir, size);
+
+  cairo_surface_t *surface =
+    cairo_image_surface_create(CAIRO_FORMAT_ARGB32, size, size);
+  cairo_t *cairo = cairo_create(surface);
+  draw_pattern(cairo, size);
+  cairo_destroy(cairo);
+  if (cairo_surface_write_to_png(surface, path) == CAIRO_STATUS_SUCCESS) {
+    list_append(corpus, strdup(path));
+  }
+  cairo_surface_destroy(surface);
+}
+
+static void write_svg(struct list *corpus, const char *dir, int size)
+{
+  char path[4096];
+  snprintf(path, sizeof path, "%s/generated-%d.svg", dir, size);
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    return;
+  }
+
+  fprintf(f, "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+      "width=\"%d\" height=\"%d\">\n", size, size);
+  srand(size);
+  for (int i = 0; i < 200; ++i) {
+    fprintf(f, "<circle cx=\"%d\" cy=\"%d\" r=\"%d\" "
+        "fill=\"#%06x\" fill-opacity=\"0.6\"/>\n", rand() % size,
+        rand() % size, 1 + rand() % (size / 8), rand() & 0xffffff);
+  }
+  fputs("</svg>\n", f);
+  fclose(f);
+  list_append(corpus, strdup(path));
+}
+
+static void add_path(struct list *corpus, const char *path)
+{
+  struct stat st;
+  if (stat(path, &st)) {
+    fprintf(stderr, "bench: can't read %s\n", path);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    list_append(corpus, strdup(path));
+    return;
+  }
+
+  DIR *dir = opendir(path);
+  if (!dir) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    char child[4096];
+    snprintf(child, sizeof child, "%s/%s", path, entry->d_name);
+    add_path(corpus, child);
+  }
+  closedir(dir);
+}
+
+int main(int argc, char **argv)
+{
+  backends = imv_backends_list(&backends_len);
+  modules = calloc(backends_len, sizeof *modules);
+
+  struct list *corpus = list_create();
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-q")) {
+      bench.quick = true;
+    } else {
+      add_path(corpus, argv[i]);
+    }
+  }
+
+  const char *tmp = getenv("TMPDIR");
+  char dir[4096];
+  snprintf(dir, sizeof dir, "%s/imv-bench-XXXXXX", tmp ? tmp : "/tmp");
+  if (!mkdtemp(dir)) {
+    perror("bench: mkdtemp");
+    return 1;
+  }
+  const size_t generated = corpus->len;
+  for (size_t i = 0; i < sizeof corpus_sizes / sizeof *corpus_sizes; ++i) {
+    write_png(corpus, dir, corpus_sizes[i]);
+    write_svg(corpus, dir, corpus_sizes[i]);
+  }
+
+  printf("{\n  \"version\": ");
+  write_string(IMV_VERSION);
+  printf(",\n  \"backends\": [");
+  for (size_t i = 0; i < backends_len; ++i) {
+    printf("%s", i == 0 ? "" : ", ");
+    write_string(backends[i].name);
+  }
+  printf("],\n  \"results\": [");
+
+  for (size_t i = 0; i < corpus->len; ++i) {
+    bench_file(corpus->items[i]);
+  }
+  printf("\n  ]\n}\n");
+
+  for (size_t i = generated; i < corpus->len; ++i) {
+    unlink(corpus->items[i]);
+  }
+  rmdir(dir);
+  list_deep_free(corpus);
+  for (size_t i = 0; i < backends_len; ++i) {
+    imv_module_free(modules[i]);
+  }
+  free(modules);
+  return 0;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
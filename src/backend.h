@@ -1,9 +1,11 @@
 #ifndef IMV_BACKEND_H
 #define IMV_BACKEND_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 struct imv_source;
+struct imv_stream;
 
 enum backend_result {
 
@@ -37,6 +39,13 @@ struct imv_backend {
   /* License the backend is used under */
   const char *license;
 
+  /* Optional. Given the start of a file, returns true if it's in a format
+   * this backend reads. A backend that returns false isn't asked to open the
+   * file at all, so it must only do so for files it certainly can't read.
+   * Backends without it are tried after all those that recognise a file.
+   */
+  bool (*sniff)(const unsigned char *header, size_t len);
+
   /* Tries to open the given path. If successful, BACKEND_SUCCESS is returned
    * and src will point to an imv_source instance for the given path.
    */
@@ -46,6 +55,14 @@ struct imv_backend {
    * and src will point to an imv_source instance for the given data.
    */
   enum backend_result (*open_memory)(void *data, size_t len, struct imv_source **src);
+
+  /* Optional. Tries to read from a stream whose data may still be arriving,
+   * decoding as it does. If successful, BACKEND_SUCCESS is returned and src
+   * will point to an imv_source instance, holding its own reference to the
+   * stream. Backends without it are given the stream's data through
+   * open_memory once it has all arrived.
+   */
+  enum backend_result (*open_stream)(struct imv_stream *stream, struct imv_source **src);
 };
 
 #endif
@@ -9,8 +9,10 @@
 #include <stdlib.h>
 
 struct private {
-  char *path;
   FIMEMORY *memory;
+  /* the mapped file memory reads from, if opened by path */
+  void *data;
+  size_t len;
   FREE_IMAGE_FORMAT format;
   FIMULTIBITMAP *multibitmap;
   FIBITMAP *last_frame;
@@ -28,9 +30,6 @@ static void free_private(void *raw_private)
 
   struct private *private = raw_private;
 
-  free(private->path);
-  private->path = NULL;
-
   if (private->memory) {
     FreeImage_CloseMemory(private->memory);
     private->memory = NULL;
@@ -46,12 +45,14 @@ static void free_private(void *raw_private)
     private->last_frame = NULL;
   }
 
+  /* Only once nothing's left reading from it */
+  imv_source_unmap_file(private->data, private->len);
   free(private);
 }
 
 static struct imv_image *to_image(FIBITMAP *in_bmp)
 {
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
   bmp->width = FreeImage_GetWidth(in_bmp);
   bmp->height = FreeImage_GetHeight(in_bmp);
   bmp->format = IMV_ARGB;
@@ -97,8 +98,10 @@ static FIBITMAP *normalise_bitmap(FIBITMAP *input)
   return output;
 }
 
-static void first_frame(void *raw_private, struct imv_image **image, int *frametime)
+static void first_frame(void *raw_private, struct imv_image **image, int *frametime,
+    struct imv_source_token *token)
 {
+  (void)token;
   *image = NULL;
   *frametime = 0;
 
@@ -109,20 +112,9 @@ static void first_frame(void *raw_private, struct imv_image **image, int *framet
   struct private *private = raw_private;
 
   if (private->format == FIF_GIF) {
-    if (private->path) {
-      private->multibitmap = FreeImage_OpenMultiBitmap(FIF_GIF, private->path,
-          /* don't create file */ 0,
-          /* read only */ 1,
-          /* keep in memory */ 1,
-          /* flags */ GIF_LOAD256);
-    } else if (private->memory) {
-      private->multibitmap = FreeImage_LoadMultiBitmapFromMemory(FIF_GIF,
-          private->memory,
-          /* flags */ GIF_LOAD256);
-    } else {
-      imv_log(IMV_ERROR, "private->path and private->memory both NULL");
-      return;
-    }
+    private->multibitmap = FreeImage_LoadMultiBitmapFromMemory(FIF_GIF,
+        private->memory,
+        /* flags */ GIF_LOAD256);
 
     if (!private->multibitmap) {
       imv_log(IMV_ERROR, "first frame already loaded");
@@ -147,12 +139,8 @@ static void first_frame(void *raw_private, struct imv_image **image, int *framet
   } else { /* not a gif */
     private->num_frames = 1;
     int flags = (private->format == FIF_JPEG) ? JPEG_EXIFROTATE : 0;
-    FIBITMAP *fibitmap = NULL;
-    if (private->path) {
-      fibitmap = FreeImage_Load(private->format, private->path, flags);
-    } else if (private->memory) {
-      fibitmap = FreeImage_LoadFromMemory(private->format, private->memory, flags);
-    }
+    FIBITMAP *fibitmap = FreeImage_LoadFromMemory(private->format,
+        private->memory, flags);
     if (!fibitmap) {
       imv_log(IMV_ERROR, "FreeImage_Load returned NULL");
       return;
@@ -169,8 +157,10 @@ static void first_frame(void *raw_private, struct imv_image **image, int *framet
   *image = to_image(bmp);
 }
 
-static void next_frame(void *raw_private, struct imv_image **image, int *frametime)
+static void next_frame(void *raw_private, struct imv_image **image, int *frametime,
+    struct imv_source_token *token)
 {
+  (void)token;
   *image = NULL;
   *frametime = 0;
 
@@ -265,25 +255,49 @@ static void next_frame(void *raw_private, struct imv_image **image, int *frameti
   *image = to_image(private->last_frame);
 }
 
+static void frame_info(void *raw_private, int *index, int *count)
+{
+  struct private *private = raw_private;
+  /* next_frame has already moved past the frame just loaded */
+  *index = (private->next_frame + private->num_frames - 1) % private->num_frames;
+  *count = private->num_frames;
+}
+
 static const struct imv_source_vtable vtable = {
   .load_first_frame = first_frame,
   .load_next_frame = next_frame,
+  .frame_info = frame_info,
   .free = free_private
 };
 
 static enum backend_result open_path(const char *path, struct imv_source **src)
 {
   imv_log(IMV_DEBUG, "freeimage: open_path(%s)\n", path);
-  FREE_IMAGE_FORMAT fmt = FreeImage_GetFileType(path, 0);
+
+  /* Loading from the mapped file leaves the page cache doing the buffering,
+   * rather than FreeImage's stdio. Some of its formats seek about, so it
+   * isn't read sequentially. */
+  void *data;
+  size_t len;
+  if (!imv_source_map_file(path, false, &data, &len)) {
+    return BACKEND_BAD_PATH;
+  }
+
+  FIMEMORY *fmem = FreeImage_OpenMemory(data, len);
+  FREE_IMAGE_FORMAT fmt = FreeImage_GetFileTypeFromMemory(fmem, 0);
 
   if (fmt == FIF_UNKNOWN) {
     imv_log(IMV_DEBUG, "freeimage: unknown file format\n");
+    FreeImage_CloseMemory(fmem);
+    imv_source_unmap_file(data, len);
     return BACKEND_UNSUPPORTED;
   }
 
   struct private *private = calloc(1, sizeof(struct private));
   private->format = fmt;
-  private->path = strdup(path);
+  private->memory = fmem;
+  private->data = data;
+  private->len = len;
 
   *src = imv_source_create(&vtable, private);
   return BACKEND_SUCCESS;
@@ -303,7 +317,6 @@ static enum backend_result open_memory(void *data, size_t len, struct imv_source
   struct private *private = calloc(1, sizeof(struct private));
   private->format = fmt;
   private->memory = fmem;
-  private->path = NULL;
 
   *src = imv_source_create(&vtable, private);
   return BACKEND_SUCCESS;
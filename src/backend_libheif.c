@@ -5,10 +5,17 @@
 #include "backend.h"
 #include "bitmap.h"
 #include "image.h"
+#include "pixels.h"
 #include "source_private.h"
 
 struct private {
-  struct heif_image *img;
+  struct heif_context *ctx;
+  /* the top level images, the primary one first, which make up the pages */
+  heif_item_id *ids;
+  int num_ids;
+  /* the mapped file the context reads from, if opened by path */
+  void *data;
+  size_t len;
 };
 
 static void free_private(void *raw_private)
@@ -17,96 +24,211 @@ static void free_private(void *raw_private)
     return;
   }
   struct private *private = raw_private;
-  heif_image_release(private->img);
+  free(private->ids);
+  heif_context_free(private->ctx);
+  imv_source_unmap_file(private->data, private->len);
   free(private);
 }
 
-static void load_image(void *raw_private, struct imv_image **image, int *frametime)
+static void release_image(void *data)
 {
-  *image = NULL;
-  *frametime = 0;
+  heif_image_release(data);
+}
 
-  struct private *private = raw_private;
+static struct imv_bitmap *decode(const struct heif_image_handle *handle)
+{
+  struct heif_image *img;
+  struct heif_error err = heif_decode_image(handle, &img, heif_colorspace_RGB,
+      heif_chroma_interleaved_RGBA, NULL);
+  if (err.code != heif_error_Ok) {
+    return NULL;
+  }
 
   int stride;
-  const uint8_t *data = heif_image_get_plane_readonly(private->img, heif_channel_interleaved, &stride);
+  const uint8_t *data = heif_image_get_plane_readonly(img, heif_channel_interleaved, &stride);
 
-  int width = heif_image_get_width(private->img, heif_channel_interleaved);
-  int height = heif_image_get_height(private->img, heif_channel_interleaved);
-  unsigned char *bitmap = malloc(width * height * 4);
-  memcpy(bitmap, data, width * height * 4);
+  int width = heif_image_get_width(img, heif_channel_interleaved);
+  int height = heif_image_get_height(img, heif_channel_interleaved);
 
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
   bmp->width = width,
   bmp->height = height,
   bmp->format = IMV_ABGR;
-  bmp->data = bitmap;
-  *image = imv_image_create_from_bitmap(bmp);
-}
 
-static const struct imv_source_vtable vtable = {
-  .load_first_frame = load_image,
-  .free = free_private,
-};
+  /* Bitmaps are tightly packed. libheif only pads rows to keep them
+   * aligned, so most images can be shown straight from its own buffer, and
+   * the others are copied out of it. */
+  if ((size_t)stride == 4 * (size_t)width) {
+    bmp->data = (unsigned char *)data;
+    bmp->release = release_image;
+    bmp->release_data = img;
+    return bmp;
+  }
 
-struct heif_error get_primary_image(struct heif_context *ctx, struct heif_image **img)
+  bmp->data = malloc((size_t)width * height * 4);
+  imv_pixels_copy_rows(bmp->data, 4 * (size_t)width, data, stride,
+      4 * (size_t)width, height);
+  heif_image_release(img);
+  return bmp;
+}
+
+/* Get the handle of the page the load is for, which the caller releases */
+static struct heif_image_handle *get_page(struct private *private,
+    struct imv_source_token *token)
 {
+  const int page = imv_source_token_page(token);
+  if (page < 0 || page >= private->num_ids) {
+    return NULL;
+  }
+
   struct heif_image_handle *handle;
-  struct heif_error err = heif_context_get_primary_image_handle(ctx, &handle);
-  if (err.code != heif_error_Ok) {
-    return err;
+  struct heif_error err = heif_context_get_image_handle(private->ctx,
+      private->ids[page], &handle);
+  return err.code == heif_error_Ok ? handle : NULL;
+}
+
+static void load_image(void *raw_private, struct imv_image **image, int *frametime,
+    struct imv_source_token *token)
+{
+  *image = NULL;
+  *frametime = 0;
+
+  struct private *private = raw_private;
+  struct heif_image_handle *handle = get_page(private, token);
+  if (!handle) {
+    return;
   }
 
-  err = heif_decode_image(handle, img, heif_colorspace_RGB, heif_chroma_interleaved_RGBA, NULL);
+  struct imv_bitmap *bmp = decode(handle);
   heif_image_handle_release(handle);
-  return err;
+  if (bmp) {
+    *image = imv_image_create_from_bitmap(bmp);
+  }
 }
 
-static enum backend_result open_path(const char *path, struct imv_source **src)
+static void load_preview(void *raw_private, struct imv_image **image,
+    struct imv_source_token *token)
 {
-  struct heif_context *ctx = heif_context_alloc();
-  struct heif_error err = heif_context_read_from_file(ctx, path, NULL); // TODO: error
-  if (err.code != heif_error_Ok) {
+  *image = NULL;
+
+  struct private *private = raw_private;
+  struct heif_image_handle *handle = get_page(private, token);
+  if (!handle) {
+    return;
+  }
+
+  /* Use the file's own thumbnail, if it has one */
+  heif_item_id id;
+  struct heif_image_handle *thumbnail = NULL;
+  if (heif_image_handle_get_list_of_thumbnail_IDs(handle, &id, 1) < 1
+      || heif_image_handle_get_thumbnail(handle, id, &thumbnail).code
+        != heif_error_Ok) {
+    heif_image_handle_release(handle);
+    return;
+  }
+
+  struct imv_bitmap *bmp = decode(thumbnail);
+  heif_image_handle_release(thumbnail);
+  if (bmp) {
+    *image = imv_image_create_from_reduced_bitmap(bmp,
+        heif_image_handle_get_width(handle),
+        heif_image_handle_get_height(handle));
+  }
+  heif_image_handle_release(handle);
+}
+
+static int page_count(void *raw_private)
+{
+  struct private *private = raw_private;
+  return private->num_ids;
+}
+
+static const struct imv_source_vtable vtable = {
+  .load_first_frame = load_image,
+  .load_preview = load_preview,
+  .page_count = page_count,
+  .free = free_private,
+};
+
+/* Decoding is left until the source is loaded, in the background, so only
+ * the list of images is fetched here. map and map_len are the mapped file ctx
+ * reads from, if any, which the source takes ownership of. */
+static enum backend_result create_source(struct heif_context *ctx,
+    void *map, size_t map_len, struct imv_source **src)
+{
+  heif_item_id primary;
+  const int num_ids = heif_context_get_number_of_top_level_images(ctx);
+  if (num_ids < 1
+      || heif_context_get_primary_image_ID(ctx, &primary).code != heif_error_Ok) {
     heif_context_free(ctx);
-    if (err.code == heif_error_Input_does_not_exist) {
-      return BACKEND_BAD_PATH;
-    }
+    imv_source_unmap_file(map, map_len);
     return BACKEND_UNSUPPORTED;
   }
 
-  struct heif_image *img;
-  err = get_primary_image(ctx, &img);
-  heif_context_free(ctx);
-  if (err.code != heif_error_Ok) {
-    return BACKEND_UNSUPPORTED;
+  /* The primary image is the one to show first, wherever it's listed */
+  heif_item_id *ids = malloc(num_ids * sizeof *ids);
+  int num_pages = heif_context_get_list_of_top_level_image_IDs(ctx, ids, num_ids);
+  int index = 0;
+  while (index < num_pages && ids[index] != primary) {
+    ++index;
   }
+  if (index == num_pages) {
+    num_pages = 1;
+  } else {
+    memmove(ids + 1, ids, index * sizeof *ids);
+  }
+  ids[0] = primary;
+
+  /* Images made of a grid of tiles, as most photos are, are decoded a tile
+   * on each thread */
+  heif_context_set_max_decoding_threads(ctx, imv_source_parallel_threads());
 
   struct private *private = malloc(sizeof *private);
-  private->img = img;
+  private->ctx = ctx;
+  private->ids = ids;
+  private->num_ids = num_pages;
+  private->data = map;
+  private->len = map_len;
   *src = imv_source_create(&vtable, private);
   return BACKEND_SUCCESS;
 }
 
-static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+static enum backend_result open_path(const char *path, struct imv_source **src)
 {
+  /* Boxes can come in any order, so it isn't read sequentially */
+  void *data;
+  size_t len;
+  if (!imv_source_map_file(path, false, &data, &len)) {
+    return BACKEND_BAD_PATH;
+  }
+
   struct heif_context *ctx = heif_context_alloc();
-  struct heif_error err = heif_context_read_from_memory_without_copy(ctx, data, len, NULL);
+  struct heif_error err = heif_context_read_from_memory_without_copy(ctx,
+      data, len, NULL);
   if (err.code != heif_error_Ok) {
     heif_context_free(ctx);
+    imv_source_unmap_file(data, len);
     return BACKEND_UNSUPPORTED;
   }
 
-  struct heif_image *img;
-  err = get_primary_image(ctx, &img);
-  heif_context_free(ctx);
+  return create_source(ctx, data, len, src);
+}
+
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  struct heif_context *ctx = heif_context_alloc();
+  struct heif_error err = heif_context_read_from_memory_without_copy(ctx, data, len, NULL);
   if (err.code != heif_error_Ok) {
+    heif_context_free(ctx);
     return BACKEND_UNSUPPORTED;
   }
 
-  struct private *private = malloc(sizeof *private);
-  private->img = img;
-  *src = imv_source_create(&vtable, private);
-  return BACKEND_SUCCESS;
+  return create_source(ctx, NULL, 0, src);
+}
+
+static bool sniff(const unsigned char *header, size_t len)
+{
+  return heif_check_filetype(header, (int)len) != heif_filetype_no;
 }
 
 const struct imv_backend imv_backend_libheif = {
@@ -114,6 +236,7 @@ const struct imv_backend imv_backend_libheif = {
   .description = "ISO/IEC 23008-12:2017 HEIF file format decoder and encoder.",
   .website = "http://www.libheif.org",
   .license = "GNU Lesser General Public License",
+  .sniff = &sniff,
   .open_path = &open_path,
   .open_memory = &open_memory,
 };
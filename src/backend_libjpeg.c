@@ -1,148 +1,689 @@
 #include "backend.h"
 #include "bitmap.h"
 #include "image.h"
+#include "sniff.h"
 #include "source.h"
 #include "source_private.h"
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/mman.h>
 #include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
 
 #include <turbojpeg.h>
 
+/* Images with at least this many pixels are decoded in bands on several
+ * threads, when their restart markers allow it */
+#define PARALLEL_MIN_PIXELS (8 * 1024 * 1024)
+
+/* Each band must be at least this many restart intervals tall, as each one
+ * also decodes an interval either side of it */
+#define MIN_BAND_INTERVALS 4
+
+/* Scratch buffers bigger than this are given back once a band's decoded,
+ * rather than kept for the next */
+#define MAX_KEPT_SCRATCH (32 * 1024 * 1024)
+
+/* Each thread keeps a decompressor, and the buffers bands are decoded with,
+ * for whichever image it decodes next. Slideshows and prefetching would
+ * otherwise set them up and tear them down again for every image. */
+struct context {
+  tjhandle handle;
+  /* a band's JPEG, and its decoded pixels */
+  unsigned char *scratch[2];
+  size_t scratch_len[2];
+};
+
+static void *create_context(void)
+{
+  tjhandle handle = tjInitDecompress();
+  if (!handle) {
+    return NULL;
+  }
+  struct context *context = calloc(1, sizeof *context);
+  context->handle = handle;
+  return context;
+}
+
+static void destroy_context(void *raw_context)
+{
+  struct context *context = raw_context;
+  tjDestroy(context->handle);
+  free(context->scratch[0]);
+  free(context->scratch[1]);
+  free(context);
+}
+
+static struct imv_source_thread_context thread_context = {
+  .create = create_context,
+  .destroy = destroy_context,
+};
+
+/* Get the calling thread's context, or NULL if there's no decompressor */
+static struct context *get_context(void)
+{
+  return imv_source_thread_context(&thread_context);
+}
+
+/* Get scratch buffer i, at least len bytes long */
+static unsigned char *get_scratch(struct context *context, int i, size_t len)
+{
+  if (context->scratch_len[i] < len) {
+    free(context->scratch[i]);
+    context->scratch[i] = malloc(len);
+    context->scratch_len[i] = context->scratch[i] ? len : 0;
+  }
+  return context->scratch[i];
+}
+
+/* Give back any scratch buffers too big to be worth keeping */
+static void trim_scratch(struct context *context)
+{
+  for (int i = 0; i < 2; ++i) {
+    if (context->scratch_len[i] > MAX_KEPT_SCRATCH) {
+      free(context->scratch[i]);
+      context->scratch[i] = NULL;
+      context->scratch_len[i] = 0;
+    }
+  }
+}
+
+/* Where a baseline JPEG's restart intervals are, found the first time it's
+ * decoded, if it can be split up along them */
+struct layout {
+  /* the offset of the frame header's height field, and of the entropy coded
+   * data, which everything before makes up the header of each band */
+  size_t height_offset;
+  size_t header_len;
+  /* pixel rows per restart interval */
+  int interval_rows;
+  /* where each interval's entropy coded data starts and ends */
+  size_t num_intervals;
+  size_t *starts;
+  size_t *ends;
+};
+
 struct private {
-  int fd;
+  /* data is a mapped file, rather than belonging to open_memory's caller */
+  bool mapped;
   void *data;
   size_t len;
-  tjhandle jpeg;
   int width;
   int height;
+  /* greyscale images are decoded as they are, rather than to RGBA */
+  bool grey;
+  /* the chroma subsampling, which sets how finely regions can be cropped */
+  int subsamp;
+  /* set once the layout has been looked for, which is NULL if the image
+   * can't be decoded in parallel */
+  bool layout_found;
+  struct layout *layout;
 };
 
+static void free_layout(struct layout *layout)
+{
+  if (layout) {
+    free(layout->starts);
+    free(layout->ends);
+    free(layout);
+  }
+}
+
 static void free_private(void *raw_private)
 {
   if (!raw_private) {
     return;
   }
   struct private *private = raw_private;
-  tjDestroy(private->jpeg);
-  if (private->fd >= 0) {
-    munmap(private->data, private->len);
-    close(private->fd);
-  } else {
-    free(private->data);
+  free_layout(private->layout);
+  if (private->mapped) {
+    imv_source_unmap_file(private->data, private->len);
   }
   private->data = NULL;
 
   free(private);
 }
 
-static void load_image(void *raw_private, struct imv_image **image, int *frametime)
+/* Pick the smallest of turbojpeg's 1/2, 1/4 and 1/8 scaling factors that
+ * still reaches the edge of the target box, to save decoding pixels that
+ * would only be thrown away when the image is shrunk to fit. These are the
+ * factors libjpeg-turbo can apply for free as part of the IDCT. */
+static void choose_decode_size(struct private *private,
+    struct imv_source_token *token, int *width, int *height)
 {
-  *image = NULL;
-  *frametime = 0;
+  *width = private->width;
+  *height = private->height;
 
-  struct private *private = raw_private;
+  int target_width, target_height;
+  if (!imv_source_token_target_size(token, &target_width, &target_height)) {
+    return;
+  }
 
-  void *bitmap = malloc(private->height * private->width * 4);
-  int rcode = tjDecompress2(private->jpeg, private->data, private->len,
-      bitmap, private->width, 0, private->height, TJPF_RGBA, TJFLAG_FASTDCT);
+  int num_factors = 0;
+  const tjscalingfactor *factors = tjGetScalingFactors(&num_factors);
 
-  if (rcode) {
-    free(bitmap);
-    return;
+  for (int denom = 8; denom > 1; denom /= 2) {
+    for (int i = 0; i < num_factors; ++i) {
+      if (factors[i].num != 1 || factors[i].denom != denom) {
+        continue;
+      }
+
+      const int scaled_width = TJSCALED(private->width, factors[i]);
+      const int scaled_height = TJSCALED(private->height, factors[i]);
+      if (scaled_width >= target_width || scaled_height >= target_height) {
+        *width = scaled_width;
+        *height = scaled_height;
+        return;
+      }
+    }
   }
+}
 
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  bmp->width = private->width;
-  bmp->height = private->height;
-  bmp->format = IMV_ABGR;
-  bmp->data = bitmap;
-  *image = imv_image_create_from_bitmap(bmp);
+/* Work out whether the image can be split into bands of whole restart
+ * intervals, each of them a whole number of MCU rows. Only single scan
+ * Huffman coded images, baseline or extended, qualify. */
+static struct layout *find_layout(const unsigned char *data, size_t len)
+{
+  if (len < 4 || data[0] != 0xff || data[1] != 0xd8) {
+    return NULL;
+  }
+
+  size_t pos = 2;
+  size_t height_offset = 0;
+  int width = 0, height = 0, components = 0;
+  int max_h = 1, max_v = 1;
+  unsigned restart_mcus = 0;
+  while (true) {
+    if (pos + 4 > len || data[pos] != 0xff) {
+      return NULL;
+    }
+    const unsigned char marker = data[pos + 1];
+    if (marker == 0xff) {
+      /* fill byte */
+      ++pos;
+      continue;
+    }
+    const size_t seg_len = (data[pos + 2] << 8) | data[pos + 3];
+    if (seg_len < 2 || pos + 2 + seg_len > len) {
+      return NULL;
+    }
+    const unsigned char *seg = data + pos + 4;
+
+    if (marker == 0xc0 || marker == 0xc1) {
+      if (seg_len < 8) {
+        return NULL;
+      }
+      height_offset = pos + 5;
+      height = (seg[1] << 8) | seg[2];
+      width = (seg[3] << 8) | seg[4];
+      components = seg[5];
+      if (seg_len < 8 + 3 * (size_t)components) {
+        return NULL;
+      }
+      for (int i = 0; i < components; ++i) {
+        const int h = seg[7 + 3 * i] >> 4;
+        const int v = seg[7 + 3 * i] & 15;
+        max_h = h > max_h ? h : max_h;
+        max_v = v > max_v ? v : max_v;
+      }
+    } else if (marker >= 0xc2 && marker <= 0xcf
+        && marker != 0xc4 && marker != 0xc8) {
+      /* progressive, lossless or arithmetic coded */
+      return NULL;
+    } else if (marker == 0xdd && seg_len >= 4) {
+      restart_mcus = (seg[0] << 8) | seg[1];
+    } else if (marker == 0xda) {
+      /* Every component has to be in the one scan */
+      if (!height_offset || seg[0] != components) {
+        return NULL;
+      }
+      pos += 2 + seg_len;
+      break;
+    }
+    pos += 2 + seg_len;
+  }
+
+  if (width == 0 || height == 0 || restart_mcus == 0) {
+    return NULL;
+  }
+
+  /* A single component scan isn't interleaved, so its MCUs are single
+   * blocks */
+  const int mcu_width = components == 1 ? 8 : 8 * max_h;
+  const int mcu_height = components == 1 ? 8 : 8 * max_v;
+  const unsigned mcus_per_row = (width + mcu_width - 1) / mcu_width;
+  const unsigned mcu_rows = (height + mcu_height - 1) / mcu_height;
+  if (restart_mcus % mcus_per_row) {
+    return NULL;
+  }
+  const unsigned interval_mcu_rows = restart_mcus / mcus_per_row;
+  const size_t num_intervals = (mcu_rows + interval_mcu_rows - 1) / interval_mcu_rows;
+  if (num_intervals < 2 * MIN_BAND_INTERVALS) {
+    return NULL;
+  }
+
+  struct layout *layout = calloc(1, sizeof *layout);
+  layout->height_offset = height_offset;
+  layout->header_len = pos;
+  layout->interval_rows = interval_mcu_rows * mcu_height;
+  layout->starts = malloc(num_intervals * sizeof *layout->starts);
+  layout->ends = malloc(num_intervals * sizeof *layout->ends);
+
+  /* Find the restart markers. Any other marker ends the scan, and a 0xff
+   * in the data itself is always followed by a stuffed zero. */
+  size_t found = 0;
+  layout->starts[0] = pos;
+  while (pos + 1 < len) {
+    const unsigned char *next = memchr(data + pos, 0xff, len - 1 - pos);
+    if (!next) {
+      break;
+    }
+    pos = next - data;
+    const unsigned char byte = data[pos + 1];
+    if (byte == 0x00 || byte == 0xff) {
+      pos += 1 + (byte == 0x00);
+      continue;
+    }
+    if (found == num_intervals) {
+      break;
+    }
+    layout->ends[found++] = pos;
+    if (byte < 0xd0 || byte > 0xd7) {
+      break;
+    }
+    if (found < num_intervals) {
+      layout->starts[found] = pos + 2;
+    }
+    pos += 2;
+  }
+
+  if (found != num_intervals) {
+    free_layout(layout);
+    return NULL;
+  }
+  layout->num_intervals = num_intervals;
+  return layout;
 }
 
-static const struct imv_source_vtable vtable = {
-  .load_first_frame = load_image,
-  .free = free_private
+/* One image being decoded in bands */
+struct banded_decode {
+  const struct private *private;
+  const struct layout *layout;
+  /* the scaling factor's denominator, and the decoded image */
+  int denom;
+  int width;
+  int height;
+  int pixel_format;
+  size_t bytes_per_pixel;
+  unsigned char *bitmap;
+  struct band *bands;
+  /* checked between bands, so a decode that's no longer wanted stops */
+  struct imv_source_token *token;
 };
 
-static enum backend_result open_path(const char *path, struct imv_source **src)
+struct band {
+  /* the restart intervals the band covers */
+  size_t first;
+  size_t last;
+  bool ok;
+};
+
+/* The first row of interval i, scaled */
+static int interval_row(const struct banded_decode *decode, size_t i)
+{
+  const int row = (int)i * decode->layout->interval_rows;
+  const int full = row < decode->private->height ? row : decode->private->height;
+  return (full + decode->denom - 1) / decode->denom;
+}
+
+/* Each band is turned into a JPEG of its own: the image's header with the
+ * height changed, and the intervals it covers, with their restart markers
+ * numbered from the start again. Fancy upsampling blends chroma across rows,
+ * so an interval either side is decoded with it, and thrown away. */
+static bool decode_band(struct banded_decode *decode, struct band *band)
 {
-  struct private private;
+  const struct private *private = decode->private;
+  const struct layout *layout = decode->layout;
+  const unsigned char *data = private->data;
 
-  private.fd = open(path, O_RDONLY);
-  if (private.fd < 0) {
-    return BACKEND_BAD_PATH;
+  struct context *context = get_context();
+  if (!context) {
+    return false;
   }
 
-  off_t len = lseek(private.fd, 0, SEEK_END);
-  if (len < 0) {
-    close(private.fd);
-    return BACKEND_BAD_PATH;
+  const size_t first = band->first > 0 ? band->first - 1 : 0;
+  const size_t last = band->last < layout->num_intervals ? band->last + 1
+    : layout->num_intervals;
+
+  size_t len = layout->header_len + 2;
+  for (size_t i = first; i < last; ++i) {
+    len += layout->ends[i] - layout->starts[i] + 2;
+  }
+  unsigned char *jpeg = get_scratch(context, 0, len);
+  if (!jpeg) {
+    return false;
+  }
+  unsigned char *out = jpeg;
+  memcpy(out, data, layout->header_len);
+  const int top = (int)first * layout->interval_rows;
+  int rows = (int)(last - first) * layout->interval_rows;
+  if (top + rows > private->height) {
+    rows = private->height - top;
+  }
+  out[layout->height_offset] = rows >> 8;
+  out[layout->height_offset + 1] = rows & 0xff;
+  out += layout->header_len;
+  for (size_t i = first; i < last; ++i) {
+    if (i > first) {
+      *out++ = 0xff;
+      *out++ = 0xd0 + (i - first - 1) % 8;
+    }
+    const size_t interval_len = layout->ends[i] - layout->starts[i];
+    memcpy(out, data + layout->starts[i], interval_len);
+    out += interval_len;
   }
+  *out++ = 0xff;
+  *out++ = 0xd9;
 
-  private.len = len;
+  const int decoded_top = interval_row(decode, first);
+  const int decoded_rows = interval_row(decode, last) - decoded_top;
+  const size_t pitch = decode->width * decode->bytes_per_pixel;
+  unsigned char *pixels = get_scratch(context, 1, decoded_rows * pitch);
 
-  private.data = mmap(NULL, private.len, PROT_READ, MAP_PRIVATE, private.fd, 0);
-  if (private.data == MAP_FAILED || !private.data) {
-    close(private.fd);
-    return BACKEND_BAD_PATH;
+  const bool ok = pixels && !tjDecompress2(context->handle, jpeg, len, pixels,
+      decode->width, 0, decoded_rows, decode->pixel_format, TJFLAG_FASTDCT);
+
+  if (ok) {
+    const int band_top = interval_row(decode, band->first);
+    const int band_rows = interval_row(decode, band->last) - band_top;
+    memcpy(decode->bitmap + band_top * pitch,
+        pixels + (band_top - decoded_top) * pitch, band_rows * pitch);
   }
+  trim_scratch(context);
+  return ok;
+}
 
-  private.jpeg = tjInitDecompress();
-  if (!private.jpeg) {
-    munmap(private.data, private.len);
-    close(private.fd);
-    return BACKEND_UNSUPPORTED;
+static void band_job(size_t index, void *data)
+{
+  struct banded_decode *decode = data;
+  struct band *band = &decode->bands[index];
+  if (imv_source_token_cancelled(decode->token)) {
+    return;
+  }
+  band->ok = decode_band(decode, band);
+}
+
+/* Decode into bitmap in bands, on as many threads as there are cores. The
+ * bands are independent as every restart interval starts from scratch.
+ * Returns false if the image can't be split up, or a band fails, setting
+ * cancelled if that's because the image is no longer wanted. */
+static bool decode_in_bands(struct private *private, int width, int height,
+    int pixel_format, unsigned char *bitmap, struct imv_source_token *token,
+    bool *cancelled)
+{
+  *cancelled = false;
+  if ((size_t)private->width * private->height < PARALLEL_MIN_PIXELS) {
+    return false;
+  }
+  if (!private->layout_found) {
+    private->layout = find_layout(private->data, private->len);
+    private->layout_found = true;
+  }
+  if (!private->layout) {
+    return false;
+  }
+
+  size_t num_bands = private->layout->num_intervals / MIN_BAND_INTERVALS;
+  if (num_bands > (size_t)imv_source_parallel_threads()) {
+    num_bands = imv_source_parallel_threads();
+  }
+  if (num_bands < 2) {
+    return false;
+  }
+
+  int denom = 1;
+  while (denom < 8 && (private->width + denom - 1) / denom != width) {
+    denom *= 2;
+  }
+
+  struct banded_decode decode = {
+    .private = private,
+    .layout = private->layout,
+    .denom = denom,
+    .width = width,
+    .height = height,
+    .pixel_format = pixel_format,
+    .bytes_per_pixel = pixel_format == TJPF_GRAY ? 1 : 4,
+    .bitmap = bitmap,
+    .bands = calloc(num_bands, sizeof *decode.bands),
+    .token = token,
+  };
+
+  const size_t intervals = private->layout->num_intervals;
+  for (size_t i = 0; i < num_bands; ++i) {
+    decode.bands[i].first = intervals * i / num_bands;
+    decode.bands[i].last = intervals * (i + 1) / num_bands;
+  }
+
+  imv_source_run_parallel(num_bands, band_job, &decode);
+  *cancelled = imv_source_token_cancelled(token);
+
+  bool ok = !*cancelled;
+  for (size_t i = 0; i < num_bands; ++i) {
+    ok = ok && decode.bands[i].ok;
+  }
+  free(decode.bands);
+  return ok;
+}
+
+/* Decode at the given size, which must be one of turbojpeg's scaled sizes.
+ * Returns NULL if it fails, or is cancelled part way through. */
+static struct imv_image *decode(struct private *private, int width, int height,
+    struct imv_source_token *token)
+{
+  const enum imv_pixelformat format = private->grey ? IMV_GREY : IMV_ABGR;
+  const int pixel_format = private->grey ? TJPF_GRAY : TJPF_RGBA;
+  void *bitmap = malloc((size_t)height * width * imv_bitmap_bytes_per_pixel(format));
+  int rcode = 0;
+  bool cancelled;
+  if (!decode_in_bands(private, width, height, pixel_format, bitmap, token,
+        &cancelled)) {
+    if (cancelled || imv_source_token_cancelled(token)) {
+      free(bitmap);
+      return NULL;
+    }
+    struct context *context = get_context();
+    rcode = !context || tjDecompress2(context->handle, private->data,
+        private->len, bitmap, width, 0, height, pixel_format, TJFLAG_FASTDCT);
   }
 
-  int rcode = tjDecompressHeader(private.jpeg, private.data, private.len,
-      &private.width, &private.height);
   if (rcode) {
-    tjDestroy(private.jpeg);
-    munmap(private.data, private.len);
-    close(private.fd);
-    return BACKEND_UNSUPPORTED;
+    free(bitmap);
+    return NULL;
   }
 
-  struct private *new_private = malloc(sizeof private);
-  memcpy(new_private, &private, sizeof private);
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
+  bmp->width = width;
+  bmp->height = height;
+  bmp->format = format;
+  bmp->data = bitmap;
 
-  *src = imv_source_create(&vtable, new_private);
-  return BACKEND_SUCCESS;
+  if (width == private->width && height == private->height) {
+    return imv_image_create_from_bitmap(bmp);
+  }
+  return imv_image_create_from_reduced_bitmap(bmp, private->width, private->height);
 }
 
-static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+static void load_image(void *raw_private, struct imv_image **image, int *frametime,
+    struct imv_source_token *token)
 {
-  struct private private;
+  *image = NULL;
+  *frametime = 0;
 
-  private.fd = -1;
-  private.data = data;
-  private.len = len;
+  struct private *private = raw_private;
 
-  private.jpeg = tjInitDecompress();
-  if (!private.jpeg) {
-    return BACKEND_UNSUPPORTED;
+  int width, height;
+  choose_decode_size(private, token, &width, &height);
+  *image = decode(private, width, height, token);
+}
+
+/* Images smaller than this decode quickly enough not to need a preview */
+#define PREVIEW_MIN_PIXELS (2 * 1024 * 1024)
+
+static void load_preview(void *raw_private, struct imv_image **image,
+    struct imv_source_token *token)
+{
+  *image = NULL;
+
+  struct private *private = raw_private;
+
+  int width, height;
+  choose_decode_size(private, token, &width, &height);
+  if ((size_t)width * height < PREVIEW_MIN_PIXELS) {
+    return;
   }
 
-  int rcode = tjDecompressHeader(private.jpeg, private.data, private.len,
-      &private.width, &private.height);
-  if (rcode) {
-    tjDestroy(private.jpeg);
+  /* A 1/8 scale decode only has to do the DC part of the IDCT */
+  const tjscalingfactor eighth = { 1, 8 };
+  const int preview_width = TJSCALED(private->width, eighth);
+  const int preview_height = TJSCALED(private->height, eighth);
+  if (preview_width >= width) {
+    return;
+  }
+
+  *image = decode(private, preview_width, preview_height, token);
+}
+
+#ifdef TJ_NUMINIT
+/* Decode part of the image, which TurboJPEG 3 can do without decoding the
+ * rest, at the coarsest of its 1/2, 1/4 and 1/8 factors that's still at
+ * least the scale asked for. Crops can only start on an MCU boundary, so
+ * the left edge is moved out to the nearest one. */
+static void load_region(void *raw_private, int x, int y, int width, int height,
+    double scale, struct imv_image **image, struct imv_source_token *token)
+{
+  (void)token;
+  *image = NULL;
+
+  struct private *private = raw_private;
+  struct context *context = get_context();
+  if (!context || private->subsamp < 0) {
+    return;
+  }
+
+  int denom = 8;
+  while (denom > 1 && 1.0 / denom < scale) {
+    denom /= 2;
+  }
+  const tjscalingfactor factor = { 1, denom };
+  const int scaled_width = TJSCALED(private->width, factor);
+  const int scaled_height = TJSCALED(private->height, factor);
+  const int mcu_width = TJSCALED(tjMCUWidth[private->subsamp], factor);
+
+  int x0 = x / denom;
+  int y0 = y / denom;
+  int x1 = (x + width + denom - 1) / denom;
+  int y1 = (y + height + denom - 1) / denom;
+  x0 -= x0 % mcu_width;
+  x0 = x0 < 0 ? 0 : x0;
+  y0 = y0 < 0 ? 0 : y0;
+  x1 = x1 > scaled_width ? scaled_width : x1;
+  y1 = y1 > scaled_height ? scaled_height : y1;
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+
+  const tjregion crop = { x0, y0, x1 - x0, y1 - y0 };
+  const enum imv_pixelformat format = private->grey ? IMV_GREY : IMV_ABGR;
+  const int pixel_format = private->grey ? TJPF_GRAY : TJPF_RGBA;
+  void *bitmap = malloc((size_t)crop.w * crop.h * imv_bitmap_bytes_per_pixel(format));
+
+  const bool ok = bitmap
+    && !tj3DecompressHeader(context->handle, private->data, private->len)
+    && !tj3Set(context->handle, TJPARAM_FASTDCT, 1)
+    && !tj3SetScalingFactor(context->handle, factor)
+    && !tj3SetCroppingRegion(context->handle, crop)
+    && !tj3Decompress8(context->handle, private->data, private->len, bitmap,
+        0, pixel_format);
+
+  /* The handle's shared with whole image decodes on this thread */
+  tj3SetCroppingRegion(context->handle, TJUNCROPPED);
+  tj3SetScalingFactor(context->handle, TJUNSCALED);
+
+  if (!ok) {
+    free(bitmap);
+    return;
+  }
+
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
+  bmp->width = crop.w;
+  bmp->height = crop.h;
+  bmp->format = format;
+  bmp->data = bitmap;
+
+  /* Scaled sizes are rounded up, so the last row and column may cover less
+   * than denom full resolution pixels */
+  const int region_x = x0 * denom;
+  const int region_y = y0 * denom;
+  const int region_x1 = x1 * denom < private->width ? x1 * denom : private->width;
+  const int region_y1 = y1 * denom < private->height ? y1 * denom : private->height;
+  *image = imv_image_create_from_region(bmp, private->width, private->height,
+      region_x, region_y, region_x1 - region_x, region_y1 - region_y);
+}
+#endif
+
+static const struct imv_source_vtable vtable = {
+  .load_first_frame = load_image,
+  .load_preview = load_preview,
+#ifdef TJ_NUMINIT
+  .load_region = load_region,
+#endif
+  .free = free_private
+};
+
+/* Read the header of a JPEG, taking ownership of data if it's mapped */
+static enum backend_result open_jpeg(void *data, size_t len, bool mapped,
+    struct imv_source **src)
+{
+  struct context *context = get_context();
+  int width, height, subsamp = 0;
+  if (!context || tjDecompressHeader2(context->handle, data, len,
+        &width, &height, &subsamp)) {
+    if (mapped) {
+      imv_source_unmap_file(data, len);
+    }
     return BACKEND_UNSUPPORTED;
   }
 
-  struct private *new_private = malloc(sizeof private);
-  memcpy(new_private, &private, sizeof private);
+  struct private *private = calloc(1, sizeof *private);
+  private->mapped = mapped;
+  private->data = data;
+  private->len = len;
+  private->width = width;
+  private->height = height;
+  private->grey = subsamp == TJSAMP_GRAY;
+  private->subsamp = subsamp;
 
-  *src = imv_source_create(&vtable, new_private);
+  *src = imv_source_create(&vtable, private);
   return BACKEND_SUCCESS;
 }
 
+static enum backend_result open_path(const char *path, struct imv_source **src)
+{
+  void *data;
+  size_t len;
+  if (!imv_source_map_file(path, true, &data, &len)) {
+    return BACKEND_BAD_PATH;
+  }
+  return open_jpeg(data, len, true, src);
+}
+
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  return open_jpeg(data, len, false, src);
+}
+
 const struct imv_backend imv_backend_libjpeg = {
   .name = "libjpeg-turbo",
   .description = "Fast JPEG codec based on libjpeg. "
@@ -150,6 +691,7 @@ const struct imv_backend imv_backend_libjpeg = {
                  "of the Independent JPEG Group.",
   .website = "https://libjpeg-turbo.org/",
   .license = "The Modified BSD License",
+  .sniff = &imv_sniff_jpeg,
   .open_path = &open_path,
   .open_memory = &open_memory,
 };
@@ -2,21 +2,28 @@
 #include "bitmap.h"
 #include "image.h"
 #include "log.h"
+#include "sniff.h"
 #include "source.h"
 #include "source_private.h"
 
-#include <fcntl.h>
 #include <libnsgif.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <unistd.h>
+
+/* Enough frame buffers to cover the frame on screen, the one queued up after
+ * it, and the one being decoded */
+#define MAX_SPARE_FRAMES 3
 
 struct private {
   int current_frame;
   gif_animation gif;
   void *data;
   size_t len;
+  /* recycles the buffers of frames that are no longer needed */
+  struct imv_bitmap_pool *frames;
+  /* the last frame handed over, and the id of its image */
+  int last_frame;
+  unsigned long last_id;
 };
 
 static void* bitmap_create(int width, int height)
@@ -70,44 +77,92 @@ static void free_private(void *raw_private)
 
   struct private *private = raw_private;
   gif_finalise(&private->gif);
-  munmap(private->data, private->len);
+  imv_bitmap_pool_free(private->frames);
+  /* only set if the data was mapped by open_path */
+  imv_source_unmap_file(private->data, private->len);
   free(private);
 }
 
-static void push_current_image(struct private *private,
+/* A frame decoded straight on top of the last one handed over can only
+ * differ from it where it redraws, and where the last one was cleared away
+ * by its disposal method, restoring either the background or what was
+ * there before it. decoded is the frame libnsgif held before decoding. */
+static void set_damage(struct private *private, struct imv_image *image,
+    int decoded)
+{
+  const int frame = private->current_frame;
+  if (frame == 0 || !private->last_id || private->last_frame != frame - 1
+      || decoded != frame - 1) {
+    return;
+  }
+
+  const gif_frame *cur = &private->gif.frames[frame];
+  const gif_frame *prev = &private->gif.frames[frame - 1];
+  int x0 = cur->redraw_x;
+  int y0 = cur->redraw_y;
+  int x1 = x0 + cur->redraw_width;
+  int y1 = y0 + cur->redraw_height;
+  if (prev->disposal_method >= 2) {
+    const int px1 = prev->redraw_x + prev->redraw_width;
+    const int py1 = prev->redraw_y + prev->redraw_height;
+    x0 = (int)prev->redraw_x < x0 ? (int)prev->redraw_x : x0;
+    y0 = (int)prev->redraw_y < y0 ? (int)prev->redraw_y : y0;
+    x1 = px1 > x1 ? px1 : x1;
+    y1 = py1 > y1 ? py1 : y1;
+  }
+
+  const int width = private->gif.width;
+  const int height = private->gif.height;
+  x1 = x1 < width ? x1 : width;
+  y1 = y1 < height ? y1 : height;
+  if (x0 > x1 || y0 > y1) {
+    x0 = x1;
+    y0 = y1;
+  }
+  imv_image_set_damage(image, private->last_id, x0, y0, x1 - x0, y1 - y0);
+}
+
+static void push_current_image(struct private *private, int decoded,
     struct imv_image **image, int *frametime)
 {
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  bmp->width = private->gif.width;
-  bmp->height = private->gif.height;
-  bmp->format = IMV_ABGR;
-  size_t len = 4 * bmp->width * bmp->height;
-  bmp->data = malloc(len);
+  /* libnsgif composites each frame on top of the last in its own buffer, so
+   * a copy is still needed, but the buffer it goes into is recycled */
+  struct imv_bitmap *bmp = imv_bitmap_pool_get(private->frames);
+  size_t len = 4 * (size_t)bmp->width * bmp->height;
   memcpy(bmp->data, private->gif.frame_image, len);
 
   *image = imv_image_create_from_bitmap(bmp);
   *frametime = private->gif.frames[private->current_frame].frame_delay * 10.0;
+
+  set_damage(private, *image, decoded);
+  private->last_frame = private->current_frame;
+  private->last_id = imv_image_id(*image);
 }
 
-static void first_frame(void *raw_private, struct imv_image **image, int *frametime)
+static void first_frame(void *raw_private, struct imv_image **image, int *frametime,
+    struct imv_source_token *token)
 {
+  (void)token;
   *image = NULL;
   *frametime = 0;
 
   struct private *private = raw_private;
   private->current_frame = 0;
 
+  const int decoded = private->gif.decoded_frame;
   gif_result code = gif_decode_frame(&private->gif, private->current_frame);
   if (code != GIF_OK) {
     imv_log(IMV_DEBUG, "libnsgif: failed to decode first frame\n");
     return;
   }
 
-  push_current_image(private, image, frametime);
+  push_current_image(private, decoded, image, frametime);
 }
 
-static void next_frame(void *raw_private, struct imv_image **image, int *frametime)
+static void next_frame(void *raw_private, struct imv_image **image, int *frametime,
+    struct imv_source_token *token)
 {
+  (void)token;
   *image = NULL;
   *frametime = 0;
 
@@ -116,18 +171,27 @@ static void next_frame(void *raw_private, struct imv_image **image, int *frameti
   private->current_frame++;
   private->current_frame %= private->gif.frame_count;
 
+  const int decoded = private->gif.decoded_frame;
   gif_result code = gif_decode_frame(&private->gif, private->current_frame);
   if (code != GIF_OK) {
     imv_log(IMV_DEBUG, "libnsgif: failed to decode a frame\n");
     return;
   }
 
-  push_current_image(private, image, frametime);
+  push_current_image(private, decoded, image, frametime);
+}
+
+static void frame_info(void *raw_private, int *index, int *count)
+{
+  struct private *private = raw_private;
+  *index = private->current_frame;
+  *count = private->gif.frame_count;
 }
 
 static const struct imv_source_vtable vtable = {
   .load_first_frame = first_frame,
   .load_next_frame = next_frame,
+  .frame_info = frame_info,
   .free = free_private
 };
 
@@ -148,6 +212,8 @@ static enum backend_result open_memory(void *data, size_t len, struct imv_source
     return BACKEND_UNSUPPORTED;
   }
 
+  private->frames = imv_bitmap_pool_create(private->gif.width,
+      private->gif.height, IMV_ABGR, MAX_SPARE_FRAMES);
   *src = imv_source_create(&vtable, private);
   return BACKEND_SUCCESS;
 }
@@ -156,20 +222,9 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
 {
   imv_log(IMV_DEBUG, "libnsgif: open_path(%s)\n", path);
 
-  int fd = open(path, O_RDONLY);
-  if (fd < 0) {
-    return BACKEND_BAD_PATH;
-  }
-
-  off_t len = lseek(fd, 0, SEEK_END);
-  if (len < 0) {
-    close(fd);
-    return BACKEND_BAD_PATH;
-  }
-
-  void *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
-  close(fd);
-  if (data == MAP_FAILED || !data) {
+  void *data;
+  size_t len;
+  if (!imv_source_map_file(path, true, &data, &len)) {
     return BACKEND_BAD_PATH;
   }
 
@@ -185,7 +240,7 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
 
   if (code != GIF_OK) {
     gif_finalise(&private->gif);
-    munmap(private->data, private->len);
+    imv_source_unmap_file(private->data, private->len);
     free(private);
     imv_log(IMV_DEBUG, "libsngif: unsupported file\n");
     return BACKEND_UNSUPPORTED;
@@ -195,6 +250,8 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
   imv_log(IMV_DEBUG, "libnsgif: width=%d\n", private->gif.width);
   imv_log(IMV_DEBUG, "libnsgif: height=%d\n", private->gif.height);
 
+  private->frames = imv_bitmap_pool_create(private->gif.width,
+      private->gif.height, IMV_ABGR, MAX_SPARE_FRAMES);
   *src = imv_source_create(&vtable, private);
   return BACKEND_SUCCESS;
 }
@@ -205,6 +262,7 @@ const struct imv_backend imv_backend_libnsgif = {
   .description = "Tiny GIF decoding library from the NetSurf project",
   .website = "https://www.netsurf-browser.org/projects/libnsgif/",
   .license = "MIT",
+  .sniff = &imv_sniff_gif,
   .open_path = &open_path,
   .open_memory = &open_memory,
 };
@@ -2,17 +2,41 @@
 #include "bitmap.h"
 #include "image.h"
 #include "log.h"
+#include "sniff.h"
 #include "source.h"
 #include "source_private.h"
+#include "stream.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <png.h>
 
+/* The length of the signature every PNG starts with */
+#define PNG_SIG_LEN 8
+
+/* A slow load shows what it's read so far at most this often, in seconds,
+ * checking every PARTIAL_ROWS rows. Loads quicker than this never pay for the copies. */
+#define PARTIAL_INTERVAL 0.2
+#define PARTIAL_ROWS 64
+
+/* Interlaced images at least this many pixels show every pass but the last
+ * as it's finished, from coarse blocks to fine detail */
+#define PARTIAL_PASS_PIXELS (512 * 1024)
+
 struct private {
-  FILE *file;
+  /* the mapped file or the stream being read, and how far into it */
+  void *data;
+  size_t len;
+  struct imv_stream *stream;
+  size_t offset;
+  /* the load in progress, if any, so waiting on the stream can give up */
+  struct imv_source_token *token;
   png_structp png;
   png_infop info;
+  int passes;
+  enum imv_pixelformat format;
 };
 
 static void free_private(void *raw_private)
@@ -23,47 +47,140 @@ static void free_private(void *raw_private)
 
   struct private *private = raw_private;
   png_destroy_read_struct(&private->png, &private->info, NULL);
-  if (private->file) {
-    fclose(private->file);
-  }
+  imv_source_unmap_file(private->data, private->len);
+  imv_stream_unref(private->stream);
   free(private);
 }
 
-static void load_image(void *raw_private, struct imv_image **image, int *frametime)
+static void read_mapped(png_structp png, png_bytep data, size_t len)
+{
+  struct private *private = png_get_io_ptr(png);
+  if (private->len - private->offset < len) {
+    png_error(png, "unexpected end of file");
+  }
+  memcpy(data, (unsigned char *)private->data + private->offset, len);
+  private->offset += len;
+}
+
+static void read_stream(png_structp png, png_bytep data, size_t len)
+{
+  struct private *private = png_get_io_ptr(png);
+  const size_t got = imv_stream_read(private->stream, private->offset, data,
+      len, private->token);
+  private->offset += got;
+  if (got < len) {
+    png_error(png, "unexpected end of stream");
+  }
+}
+
+static double cur_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (double)ts.tv_nsec * 0.000000001;
+}
+
+/* Send a copy of what's been decoded so far to be shown while the rest is.
+ * Rows from first_unread onwards haven't been written yet, and are left
+ * transparent. */
+static void send_partial(struct private *private, unsigned char *pixels,
+    size_t row_len, int first_unread, struct imv_source_token *token)
+{
+  const int width = png_get_image_width(private->png, private->info);
+  const int height = png_get_image_height(private->png, private->info);
+
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
+  bmp->width = width;
+  bmp->height = height;
+  bmp->format = private->format;
+  bmp->data = malloc(height * row_len);
+  memcpy(bmp->data, pixels, first_unread * row_len);
+  memset(bmp->data + first_unread * row_len, 0,
+      (height - first_unread) * row_len);
+  imv_source_token_send_partial(token, imv_image_create_from_bitmap(bmp));
+}
+
+static void load_image(void *raw_private, struct imv_image **image, int *frametime,
+    struct imv_source_token *token)
 {
   *image = NULL;
   *frametime = 0;
 
   struct private *private = raw_private;
+  private->token = token;
   if (setjmp(png_jmpbuf(private->png))) {
+    private->token = NULL;
     return;
   }
 
   const int width = png_get_image_width(private->png, private->info);
   const int height = png_get_image_height(private->png, private->info);
 
+  /* Interlaced images are read into the rows of every pass at once, so they
+   * start out blank rather than showing whatever the memory held */
+  const bool interlaced = private->passes > 1;
   png_bytep *rows = malloc(sizeof(png_bytep) * height);
   size_t row_len = png_get_rowbytes(private->png, private->info);
-  rows[0] = malloc(height * row_len);
+  rows[0] = interlaced ? calloc(height, row_len) : malloc(height * row_len);
   for (int y = 1; y < height; ++y) {
     rows[y] = rows[0] + row_len * y;
   }
 
   if (setjmp(png_jmpbuf(private->png))) {
+    free(rows[0]);
+    free(rows);
+    private->token = NULL;
     return;
   }
 
-  png_read_image(private->png, rows);
+  /* Read row by row, rather than with png_read_image, so that we can give up
+   * part way through if the image is no longer wanted, and show what's been
+   * read so far if it's taking a while. An interlaced image is read as
+   * display rows, so that each pass fills in the gaps left by the last, from
+   * coarse blocks to the final pixels. */
+  double last_sent = cur_time();
+  for (int pass = 0; pass < private->passes; ++pass) {
+    for (int y = 0; y < height; ++y) {
+      if (imv_source_token_cancelled(token)) {
+        free(rows[0]);
+        free(rows);
+        private->token = NULL;
+        return;
+      }
+      if (interlaced) {
+        png_read_row(private->png, NULL, rows[y]);
+      } else {
+        png_read_row(private->png, rows[y], NULL);
+      }
+
+      /* Large interlaced images show each pass but the last as it's
+       * finished, and any slow load shows its progress every so often */
+      const bool show_pass = interlaced && y == height - 1
+        && pass < private->passes - 1
+        && (size_t)width * height >= PARTIAL_PASS_PIXELS;
+      if (!show_pass && ((y + 1) % PARTIAL_ROWS != 0 || y == height - 1)) {
+        continue;
+      }
+      const double now = cur_time();
+      if ((show_pass || now - last_sent >= PARTIAL_INTERVAL)
+          && imv_source_token_want_partial(token)) {
+        send_partial(private, rows[0], row_len, interlaced ? height : y + 1,
+            token);
+        last_sent = now;
+      }
+    }
+  }
+
   void *raw_bmp = rows[0];
   free(rows);
-  fclose(private->file);
-  private->file = NULL;
-
+  private->token = NULL;
+  imv_source_unmap_file(private->data, private->len);
+  private->data = NULL;
 
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
   bmp->width = width;
   bmp->height = height;
-  bmp->format = IMV_ABGR;
+  bmp->format = private->format;
   bmp->data = raw_bmp;
   *image = imv_image_create_from_bitmap(bmp);
 }
@@ -73,26 +190,14 @@ static const struct imv_source_vtable vtable = {
   .free = free_private
 };
 
-static enum backend_result open_path(const char *path, struct imv_source **src)
+/* Read the header and set up decoding, from either a file or a stream, whose
+ * signature has already been checked. Takes ownership of private. */
+static enum backend_result open_png(struct private *private,
+    struct imv_source **src)
 {
-
-  unsigned char header[8];
-  FILE *f = fopen(path, "rb");
-  if (!f) {
-    return BACKEND_BAD_PATH;
-  }
-  fread(header, 1, sizeof header, f);
-  if (png_sig_cmp(header, 0, sizeof header)) {
-    fclose(f);
-    return BACKEND_UNSUPPORTED;
-  }
-
-  struct private *private = calloc(1, sizeof *private);
-  private->file = f;
   private->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   if (!private->png) {
-    fclose(private->file);
-    free(private);
+    free_private(private);
     return BACKEND_UNSUPPORTED;
   }
 
@@ -101,29 +206,34 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
 
   private->info = png_create_info_struct(private->png);
   if (!private->info) {
-    png_destroy_read_struct(&private->png, NULL, NULL);
-    fclose(private->file);
-    free(private);
+    free_private(private);
     return BACKEND_UNSUPPORTED;
   }
 
   if (setjmp(png_jmpbuf(private->png))) {
-    png_destroy_read_struct(&private->png, &private->info, NULL);
-    fclose(private->file);
-    free(private);
+    free_private(private);
     return BACKEND_UNSUPPORTED;
   }
 
-  png_init_io(private->png, private->file);
-  png_set_sig_bytes(private->png, sizeof header);
+  png_set_read_fn(private->png, private,
+      private->stream ? read_stream : read_mapped);
+  png_set_sig_bytes(private->png, PNG_SIG_LEN);
   png_read_info(private->png, private->info);
 
-  /* Tell libpng to give us a consistent output format */
-  png_set_gray_to_rgb(private->png);
-  png_set_filler(private->png, 0xff, PNG_FILLER_AFTER);
+  /* Tell libpng to give us a consistent output format. Opaque greyscale is
+   * left as a single channel, which the canvas expands when drawing. */
+  private->format = IMV_ABGR;
+  if (png_get_color_type(private->png, private->info) == PNG_COLOR_TYPE_GRAY
+      && !png_get_valid(private->png, private->info, PNG_INFO_tRNS)) {
+    private->format = IMV_GREY;
+  } else {
+    png_set_gray_to_rgb(private->png);
+    png_set_filler(private->png, 0xff, PNG_FILLER_AFTER);
+  }
   png_set_strip_16(private->png);
   png_set_expand(private->png);
   png_set_packing(private->png);
+  private->passes = png_set_interlace_handling(private->png);
   png_read_update_info(private->png, private->info);
   imv_log(IMV_DEBUG, "libpng: info width=%d height=%d bit_depth=%d color_type=%d\n",
       png_get_image_width(private->png, private->info),
@@ -131,15 +241,44 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
       png_get_bit_depth(private->png, private->info),
       png_get_color_type(private->png, private->info));
 
-  if (setjmp(png_jmpbuf(private->png))) {
-    png_destroy_read_struct(&private->png, &private->info, NULL);
-    fclose(private->file);
-    free(private);
+  *src = imv_source_create(&vtable, private);
+  return BACKEND_SUCCESS;
+}
+
+static enum backend_result open_path(const char *path, struct imv_source **src)
+{
+  void *data;
+  size_t len;
+  if (!imv_source_map_file(path, true, &data, &len)) {
+    return BACKEND_BAD_PATH;
+  }
+  if (len < PNG_SIG_LEN || png_sig_cmp(data, 0, PNG_SIG_LEN)) {
+    imv_source_unmap_file(data, len);
     return BACKEND_UNSUPPORTED;
   }
 
-  *src = imv_source_create(&vtable, private);
-  return BACKEND_SUCCESS;
+  struct private *private = calloc(1, sizeof *private);
+  private->data = data;
+  private->len = len;
+  private->offset = PNG_SIG_LEN;
+  return open_png(private, src);
+}
+
+/* Rows are decoded as the data for them arrives, rather than once all of it
+ * has */
+static enum backend_result open_stream(struct imv_stream *stream,
+    struct imv_source **src)
+{
+  unsigned char header[PNG_SIG_LEN];
+  if (imv_stream_read(stream, 0, header, sizeof header, NULL) != sizeof header
+      || png_sig_cmp(header, 0, sizeof header)) {
+    return BACKEND_UNSUPPORTED;
+  }
+
+  struct private *private = calloc(1, sizeof *private);
+  private->stream = imv_stream_ref(stream);
+  private->offset = sizeof header;
+  return open_png(private, src);
 }
 
 const struct imv_backend imv_backend_libpng = {
@@ -147,6 +286,8 @@ const struct imv_backend imv_backend_libpng = {
   .description = "The official PNG reference implementation",
   .website = "http://www.libpng.org/pub/png/libpng.html",
   .license = "The libpng license",
+  .sniff = &imv_sniff_png,
   .open_path = &open_path,
+  .open_stream = &open_stream,
 };
 
@@ -1,5 +1,6 @@
 #include "backend.h"
 #include "image.h"
+#include "sniff.h"
 #include "source.h"
 #include "source_private.h"
 
@@ -23,7 +24,38 @@ static void free_private(void *raw_private)
   free(raw_private);
 }
 
-static void load_image(void *raw_private, struct imv_image **image, int *frametime)
+/* The first raster is made while loading, at the size the image will be
+ * shrunk to fit if it's going to be, so it can be shown straight away */
+static double initial_scale(struct imv_image *image,
+    struct imv_source_token *token)
+{
+  int target_width, target_height;
+  const int width = imv_image_width(image);
+  const int height = imv_image_height(image);
+  if (!imv_source_token_target_size(token, &target_width, &target_height)
+      || width <= 0 || height <= 0) {
+    return 1.0;
+  }
+
+  double scale = (double)target_width / width;
+  if ((double)target_height / height < scale) {
+    scale = (double)target_height / height;
+  }
+  return scale < 1.0 ? scale : 1.0;
+}
+
+static void render_svg(void *handle, cairo_t *cairo)
+{
+  rsvg_handle_render_cairo(handle, cairo);
+}
+
+static void free_svg(void *handle)
+{
+  g_object_unref(handle);
+}
+
+static void load_image(void *raw_private, struct imv_image **image, int *frametime,
+    struct imv_source_token *token)
 {
   *image = NULL;
   *frametime = 0;
@@ -39,9 +71,22 @@ static void load_image(void *raw_private, struct imv_image **image, int *frameti
     handle = rsvg_handle_new_from_file(private->path, &error);
   }
 
-  if (handle) {
-    *image = imv_image_create_from_svg(handle);
+  if (!handle) {
+    return;
   }
+
+  RsvgDimensionData dim;
+  rsvg_handle_get_dimensions(handle, &dim);
+  *image = imv_image_create_from_vector(dim.width, dim.height, render_svg,
+      free_svg, handle);
+  if (imv_source_token_cancelled(token)) {
+    imv_image_free(*image);
+    *image = NULL;
+    return;
+  }
+
+  const double scale = initial_scale(*image, token);
+  imv_image_set_raster(*image, imv_image_rasterize(*image, scale), scale);
 }
 
 static const struct imv_source_vtable vtable = {
@@ -101,6 +146,7 @@ const struct imv_backend imv_backend_librsvg = {
   .description = "SVG library developed by GNOME",
   .website = "https://wiki.gnome.org/Projects/LibRsvg",
   .license = "GNU Lesser General Public License v2.1+",
+  .sniff = &imv_sniff_svg,
   .open_path = &open_path,
   .open_memory = &open_memory,
 };
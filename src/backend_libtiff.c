@@ -1,34 +1,70 @@
 #include "backend.h"
 #include "bitmap.h"
 #include "image.h"
+#include "sniff.h"
 #include "source.h"
 #include "source_private.h"
 
+#include <math.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <tiffio.h>
 
-struct private {
-  TIFF *tiff;
+/* Images with at least this many pixels are read on several threads, when
+ * they're split into enough strips or tiles */
+#define PARALLEL_MIN_PIXELS (4 * 1024 * 1024)
+
+/* Where a TIFF handle reads from. Every handle on the same data needs one of
+ * its own. */
+struct reader {
   void *data;
   size_t pos, len;
+};
+
+/* One resolution of the image, the full one or a reduced one from a pyramid */
+struct level {
+  toff_t offset;
   int width;
   int height;
 };
 
+/* One image of a multi-page file. Most files have just the one. */
+struct page {
+  /* the full resolution image comes first, then any reduced ones */
+  struct level *levels;
+  size_t num_levels;
+};
+
+struct private {
+  TIFF *tiff;
+  struct reader reader;
+  /* data is a mapped file, rather than belonging to open_memory's caller */
+  bool mapped;
+  struct page *pages;
+  size_t num_pages;
+};
+
 static tsize_t mem_read(thandle_t data, tdata_t buffer, tsize_t len)
 {
-  struct private *private = (struct private*)data;
-  memcpy(buffer, (char*)private->data + private->pos, len);
-  private->pos += len;
+  struct reader *reader = (struct reader*)data;
+  /* A damaged file can point past its end */
+  if (reader->pos >= reader->len) {
+    return 0;
+  }
+  if ((size_t)len > reader->len - reader->pos) {
+    len = reader->len - reader->pos;
+  }
+  memcpy(buffer, (char*)reader->data + reader->pos, len);
+  reader->pos += len;
   return len;
 }
 
 static tsize_t mem_write(thandle_t data, tdata_t buffer, tsize_t len)
 {
-  struct private *private = (struct private*)data;
-  memcpy((char*)private->data + private->pos, buffer, len);
-  private->pos += len;
+  struct reader *reader = (struct reader*)data;
+  memcpy((char*)reader->data + reader->pos, buffer, len);
+  reader->pos += len;
   return len;
 }
 
@@ -40,23 +76,31 @@ static int mem_close(thandle_t data)
 
 static toff_t mem_seek(thandle_t data, toff_t pos, int whence)
 {
-  struct private *private = (struct private*)data;
+  struct reader *reader = (struct reader*)data;
   if (whence == SEEK_SET) {
-    private->pos = pos;
+    reader->pos = pos;
   } else if (whence == SEEK_CUR) {
-    private->pos += pos;
+    reader->pos += pos;
   } else if (whence == SEEK_END) {
-    private->pos = private->len + pos;
+    reader->pos = reader->len + pos;
   } else {
     return -1;
   }
-  return private->pos;
+  return reader->pos;
 }
 
 static toff_t mem_size(thandle_t data)
 {
-  struct private *private = (struct private*)data;
-  return private->len;
+  struct reader *reader = (struct reader*)data;
+  return reader->len;
+}
+
+static TIFF *open_client(struct reader *reader)
+{
+  reader->pos = 0;
+  return TIFFClientOpen("-", "rm", (thandle_t)reader,
+      &mem_read, &mem_write, &mem_seek, &mem_close, &mem_size,
+      NULL, NULL);
 }
 
 static void free_private(void *raw_private)
@@ -68,91 +112,587 @@ static void free_private(void *raw_private)
   struct private *private = raw_private;
   TIFFClose(private->tiff);
   private->tiff = NULL;
+  if (private->mapped) {
+    imv_source_unmap_file(private->reader.data, private->reader.len);
+  }
 
+  for (size_t i = 0; i < private->num_pages; ++i) {
+    free(private->pages[i].levels);
+  }
+  free(private->pages);
   free(private);
 }
 
-static void load_image(void *raw_private, struct imv_image **image, int *frametime)
+/* Number of rows decoded between checks for cancellation */
+#define ROWS_PER_BAND 256
+
+/* Read the current directory with the TIFFRGBAImage interface, one band at a
+ * time where the orientation allows it */
+static bool read_serial(struct private *private, int width, int height,
+    uint32_t *bitmap, struct imv_source_token *token)
 {
-  *image = NULL;
-  *frametime = 0;
+  char emsg[1024];
+  TIFFRGBAImage img;
+  if (!TIFFRGBAImageOK(private->tiff, emsg)
+      || !TIFFRGBAImageBegin(&img, private->tiff, 0, emsg)) {
+    return false;
+  }
+  img.req_orientation = ORIENTATION_TOPLEFT;
 
-  struct private *private = raw_private;
+  /* Only images stored top to bottom can be read in bands, as libtiff flips
+   * each band independently. Anything else is read in one go. */
+  uint16_t orientation = ORIENTATION_TOPLEFT;
+  TIFFGetFieldDefaulted(private->tiff, TIFFTAG_ORIENTATION, &orientation);
+  const int band_height = orientation == ORIENTATION_TOPLEFT
+    || orientation == ORIENTATION_TOPRIGHT
+    ? ROWS_PER_BAND : height;
+
+  for (int y = 0; y < height; y += band_height) {
+    const int rows = height - y < band_height ? height - y : band_height;
+
+    img.row_offset = y;
+    img.col_offset = 0;
+    int rcode = imv_source_token_cancelled(token) ? 0
+      : TIFFRGBAImageGet(&img, bitmap + (size_t)y * width, width, rows);
+
+    /* 1 = success, unlike the rest of *nix */
+    if (rcode != 1) {
+      TIFFRGBAImageEnd(&img);
+      return false;
+    }
+  }
+  TIFFRGBAImageEnd(&img);
+  return true;
+}
+
+/* A level being read a row of strips or tiles at a time, on several threads.
+ * Each thread has a TIFF handle of its own, as they can't be shared. */
+struct parallel_read {
+  const struct private *private;
+  const struct level *level;
+  struct imv_source_token *token;
+  uint32_t *bitmap;
+  bool tiled;
+  /* the size of each tile, or the width and rows of each strip */
+  uint32_t chunk_width;
+  uint32_t chunk_height;
+  uint32_t chunk_rows;
+  size_t num_tasks;
+  bool *ok;
+};
+
+/* Copy a chunk read by TIFFReadRGBATile or TIFFReadRGBAStrip into place.
+ * They return it bottom row first, tiles always padded out to full height,
+ * strips cut short at the bottom of the image. */
+static void copy_chunk(const struct parallel_read *read, const uint32_t *raster,
+    uint32_t x, uint32_t y, uint32_t raster_rows)
+{
+  const uint32_t width = read->level->width;
+  const uint32_t height = read->level->height;
+  const uint32_t rows = height - y < read->chunk_height ? height - y
+    : read->chunk_height;
+  const uint32_t cols = width - x < read->chunk_width ? width - x
+    : read->chunk_width;
+  for (uint32_t r = 0; r < rows; ++r) {
+    memcpy(read->bitmap + (size_t)(y + r) * width + x,
+        raster + (size_t)(raster_rows - 1 - r) * read->chunk_width,
+        cols * sizeof *raster);
+  }
+}
+
+static bool read_chunk_rows(struct parallel_read *read, TIFF *tiff,
+    uint32_t first, uint32_t last, uint32_t *raster)
+{
+  const uint32_t width = read->level->width;
+  const uint32_t height = read->level->height;
+  for (uint32_t row = first; row < last; ++row) {
+    if (imv_source_token_cancelled(read->token)) {
+      return false;
+    }
+    const uint32_t y = row * read->chunk_height;
+    if (read->tiled) {
+      for (uint32_t x = 0; x < width; x += read->chunk_width) {
+        if (!TIFFReadRGBATile(tiff, x, y, raster)) {
+          return false;
+        }
+        copy_chunk(read, raster, x, y, read->chunk_height);
+      }
+    } else {
+      if (!TIFFReadRGBAStrip(tiff, y, raster)) {
+        return false;
+      }
+      const uint32_t rows = height - y < read->chunk_height ? height - y
+        : read->chunk_height;
+      copy_chunk(read, raster, 0, y, rows);
+    }
+  }
+  return true;
+}
+
+static void read_task(size_t index, void *data)
+{
+  struct parallel_read *read = data;
+  const uint32_t first = read->chunk_rows * index / read->num_tasks;
+  const uint32_t last = read->chunk_rows * (index + 1) / read->num_tasks;
+
+  struct reader reader = read->private->reader;
+  TIFF *tiff = open_client(&reader);
+  if (!tiff) {
+    return;
+  }
+
+  if (TIFFSetSubDirectory(tiff, read->level->offset)) {
+    uint32_t *raster = malloc((size_t)read->chunk_width * read->chunk_height
+        * sizeof *raster);
+    read->ok[index] = read_chunk_rows(read, tiff, first, last, raster);
+    free(raster);
+  }
+  TIFFClose(tiff);
+}
+
+/* Read the level in rows of strips or tiles spread over several threads.
+ * Returns false, leaving the bitmap as it was, if the image isn't laid out in
+ * a way that allows it, or true with the outcome in ok. */
+static bool read_parallel(struct private *private, const struct level *level,
+    uint32_t *bitmap, struct imv_source_token *token, bool *ok)
+{
+  const int num_threads = imv_source_parallel_threads();
+  if (num_threads < 2
+      || (size_t)level->width * level->height < PARALLEL_MIN_PIXELS) {
+    return false;
+  }
+
+  /* The RGBA strip and tile readers always hand back rows bottom up, which
+   * is only a flip away from the right way round for the usual orientation */
+  char emsg[1024];
+  uint16_t orientation = ORIENTATION_TOPLEFT;
+  TIFFGetFieldDefaulted(private->tiff, TIFFTAG_ORIENTATION, &orientation);
+  if (orientation != ORIENTATION_TOPLEFT
+      || !TIFFRGBAImageOK(private->tiff, emsg)) {
+    return false;
+  }
+
+  struct parallel_read read = {
+    .private = private,
+    .level = level,
+    .token = token,
+    .bitmap = bitmap,
+    .tiled = TIFFIsTiled(private->tiff),
+  };
+  if (read.tiled) {
+    if (!TIFFGetField(private->tiff, TIFFTAG_TILEWIDTH, &read.chunk_width)
+        || !TIFFGetField(private->tiff, TIFFTAG_TILELENGTH, &read.chunk_height)) {
+      return false;
+    }
+  } else {
+    read.chunk_width = level->width;
+    read.chunk_height = level->height;
+    TIFFGetFieldDefaulted(private->tiff, TIFFTAG_ROWSPERSTRIP, &read.chunk_height);
+  }
+  if (read.chunk_width == 0 || read.chunk_height == 0) {
+    return false;
+  }
+  if (read.chunk_height > (uint32_t)level->height) {
+    read.chunk_height = level->height;
+  }
+
+  read.chunk_rows = (level->height + read.chunk_height - 1) / read.chunk_height;
+  if (read.chunk_rows < 2) {
+    return false;
+  }
+  read.num_tasks = read.chunk_rows < (uint32_t)num_threads ? read.chunk_rows
+    : (uint32_t)num_threads;
+  read.ok = calloc(read.num_tasks, sizeof *read.ok);
+
+  imv_source_run_parallel(read.num_tasks, read_task, &read);
+
+  *ok = true;
+  for (size_t i = 0; i < read.num_tasks; ++i) {
+    *ok = *ok && read.ok[i];
+  }
+  free(read.ok);
+  return true;
+}
+
+static struct imv_image *read_level(struct private *private,
+    const struct page *page, const struct level *level,
+    struct imv_source_token *token)
+{
+  if (!TIFFSetSubDirectory(private->tiff, level->offset)) {
+    return NULL;
+  }
 
   /* libtiff suggests using their own allocation routines to support systems
    * with segmented memory. I have no desire to support that, so I'm just
    * going to use vanilla malloc/free. Systems where that isn't acceptable
    * don't have upstream support from imv.
    */
-  void *bitmap = malloc(private->height * private->width * 4);
-  int rcode = TIFFReadRGBAImageOriented(private->tiff, private->width, private->height,
-      bitmap, ORIENTATION_TOPLEFT, 0);
+  uint32_t *bitmap = malloc((size_t)level->height * level->width * 4);
+
+  bool ok;
+  if (!read_parallel(private, level, bitmap, token, &ok)) {
+    ok = read_serial(private, level->width, level->height, bitmap, token);
+  }
+  if (!ok) {
+    free(bitmap);
+    return NULL;
+  }
+
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
+  bmp->width = level->width;
+  bmp->height = level->height;
+  bmp->format = IMV_ABGR;
+  bmp->data = (unsigned char *)bitmap;
+  if (level == &page->levels[0]) {
+    return imv_image_create_from_bitmap(bmp);
+  }
+  return imv_image_create_from_reduced_bitmap(bmp, page->levels[0].width,
+      page->levels[0].height);
+}
+
+/* The smallest level that still fills the size the image will be shown at,
+ * or the full image if that isn't known */
+static const struct level *choose_level(const struct page *page,
+    struct imv_source_token *token)
+{
+  const struct level *best = &page->levels[0];
+  int target_width, target_height;
+  if (!imv_source_token_target_size(token, &target_width, &target_height)) {
+    return best;
+  }
 
-  /* 1 = success, unlike the rest of *nix */
-  if (rcode != 1) {
+  for (size_t i = 1; i < page->num_levels; ++i) {
+    const struct level *level = &page->levels[i];
+    if ((level->width >= target_width || level->height >= target_height)
+        && level->width < best->width) {
+      best = level;
+    }
+  }
+  return best;
+}
+
+static void load_image(void *raw_private, struct imv_image **image, int *frametime,
+    struct imv_source_token *token)
+{
+  *frametime = 0;
+
+  *image = NULL;
+
+  struct private *private = raw_private;
+  const int index = imv_source_token_page(token);
+  if (index < 0 || (size_t)index >= private->num_pages) {
     return;
   }
+  const struct page *page = &private->pages[index];
+  *image = read_level(private, page, choose_level(page, token), token);
+}
+
+/* A pyramid's smallest level makes a preview, if it's small enough to be
+ * much quicker to read than the level that's going to be loaded */
+static void load_preview(void *raw_private, struct imv_image **image,
+    struct imv_source_token *token)
+{
+  *image = NULL;
+
+  struct private *private = raw_private;
+  const int index = imv_source_token_page(token);
+  if (index < 0 || (size_t)index >= private->num_pages) {
+    return;
+  }
+  const struct page *page = &private->pages[index];
+  const struct level *smallest = &page->levels[page->num_levels - 1];
+  const struct level *chosen = choose_level(page, token);
+  if (smallest->width * 4 > chosen->width) {
+    return;
+  }
+  *image = read_level(private, page, smallest, token);
+}
+
+/* The smallest level at least scale times the size of the full image */
+static const struct level *choose_region_level(const struct page *page,
+    double scale)
+{
+  const struct level *best = &page->levels[0];
+  for (size_t i = 1; i < page->num_levels; ++i) {
+    const struct level *level = &page->levels[i];
+    if (level->width >= scale * page->levels[0].width
+        && level->width < best->width) {
+      best = level;
+    }
+  }
+  return best;
+}
+
+/* Read the strips or tiles of a level that a region of the full image
+ * covers, from whichever level has enough detail for the scale. Only the
+ * usual orientation is handled, as the strip and tile readers leave any
+ * other to the caller. */
+static void load_region(void *raw_private, int x, int y, int width, int height,
+    double scale, struct imv_image **image, struct imv_source_token *token)
+{
+  *image = NULL;
+
+  struct private *private = raw_private;
+  const int index = imv_source_token_page(token);
+  if (index < 0 || (size_t)index >= private->num_pages) {
+    return;
+  }
+  const struct page *page = &private->pages[index];
+  const struct level *full = &page->levels[0];
+  const struct level *level = choose_region_level(page, scale);
+  if (!TIFFSetSubDirectory(private->tiff, level->offset)) {
+    return;
+  }
+
+  char emsg[1024];
+  uint16_t orientation = ORIENTATION_TOPLEFT;
+  TIFFGetFieldDefaulted(private->tiff, TIFFTAG_ORIENTATION, &orientation);
+  if (orientation != ORIENTATION_TOPLEFT
+      || !TIFFRGBAImageOK(private->tiff, emsg)) {
+    return;
+  }
+
+  const bool tiled = TIFFIsTiled(private->tiff);
+  uint32_t chunk_width = level->width;
+  uint32_t chunk_height = level->height;
+  if (tiled) {
+    if (!TIFFGetField(private->tiff, TIFFTAG_TILEWIDTH, &chunk_width)
+        || !TIFFGetField(private->tiff, TIFFTAG_TILELENGTH, &chunk_height)) {
+      return;
+    }
+  } else {
+    TIFFGetFieldDefaulted(private->tiff, TIFFTAG_ROWSPERSTRIP, &chunk_height);
+  }
+  if (chunk_width == 0 || chunk_height == 0) {
+    return;
+  }
+  if (chunk_height > (uint32_t)level->height) {
+    chunk_height = level->height;
+  }
+
+  /* The region in the level's pixels, out to whole tiles, or whole strips
+   * in height, as the columns of a strip can be cropped in place */
+  const double level_scale = (double)level->width / full->width;
+  int x0 = (int)(x * level_scale);
+  int y0 = (int)(y * level_scale);
+  int x1 = (int)ceil((x + width) * level_scale);
+  int y1 = (int)ceil((y + height) * level_scale);
+  x0 = x0 < 0 ? 0 : x0 - (tiled ? x0 % chunk_width : 0);
+  y0 = y0 < 0 ? 0 : y0 - y0 % chunk_height;
+  x1 = x1 > level->width ? level->width : x1;
+  y1 = y1 > level->height ? level->height : y1;
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+  const uint32_t region_width = x1 - x0;
+  const uint32_t region_height = y1 - y0;
+
+  uint32_t *bitmap = malloc((size_t)region_width * region_height * sizeof *bitmap);
+  uint32_t *raster = malloc((size_t)chunk_width * chunk_height * sizeof *raster);
+  bool ok = bitmap && raster;
 
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  bmp->width = private->width;
-  bmp->height = private->height;
+  /* Both readers hand chunks back bottom row first. Tiles are always padded
+   * out to full height, strips are cut short at the bottom of the image. */
+  for (uint32_t cy = y0; ok && cy < (uint32_t)y1; cy += chunk_height) {
+    ok = !imv_source_token_cancelled(token);
+    const uint32_t rows = level->height - cy < chunk_height
+      ? level->height - cy : chunk_height;
+    const uint32_t raster_rows = tiled ? chunk_height : rows;
+    for (uint32_t cx = tiled ? x0 : 0; ok && cx < (uint32_t)x1; cx += chunk_width) {
+      ok = tiled ? TIFFReadRGBATile(private->tiff, cx, cy, raster)
+        : TIFFReadRGBAStrip(private->tiff, cy, raster);
+      const uint32_t from = cx < (uint32_t)x0 ? x0 - cx : 0;
+      const uint32_t end = cx + chunk_width < (uint32_t)x1 ? chunk_width
+        : x1 - cx;
+      for (uint32_t r = 0; ok && r < rows && cy + r < (uint32_t)y1; ++r) {
+        memcpy(bitmap + (size_t)(cy + r - y0) * region_width + cx + from - x0,
+            raster + (size_t)(raster_rows - 1 - r) * chunk_width + from,
+            (end - from) * sizeof *raster);
+      }
+    }
+  }
+  free(raster);
+  if (!ok) {
+    free(bitmap);
+    return;
+  }
+
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
+  bmp->width = region_width;
+  bmp->height = region_height;
   bmp->format = IMV_ABGR;
-  bmp->data = bitmap;
-  *image = imv_image_create_from_bitmap(bmp);
+  bmp->data = (unsigned char *)bitmap;
+
+  /* Back to full resolution pixels, with the far edges of the level pinned
+   * to those of the image */
+  const int full_x0 = (int)(x0 / level_scale);
+  const int full_y0 = (int)(y0 / level_scale);
+  const int full_x1 = x1 == level->width ? full->width : (int)(x1 / level_scale);
+  const int full_y1 = y1 == level->height ? full->height : (int)(y1 / level_scale);
+  *image = imv_image_create_from_region(bmp, full->width, full->height,
+      full_x0, full_y0, full_x1 - full_x0, full_y1 - full_y0);
+}
+
+static int page_count(void *raw_private)
+{
+  struct private *private = raw_private;
+  return (int)private->num_pages;
 }
 
 static const struct imv_source_vtable vtable = {
   .load_first_frame = load_image,
+  .load_preview = load_preview,
+  .load_region = load_region,
+  .page_count = page_count,
   .free = free_private
 };
 
-static enum backend_result open_path(const char *path, struct imv_source **src)
+/* Add the current directory to a page as one of its levels, the first being
+ * the full resolution image */
+static void add_level(struct page *page, TIFF *tiff)
 {
-  struct private private;
+  struct level level = {
+    .offset = TIFFCurrentDirOffset(tiff),
+  };
+  TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &level.width);
+  TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &level.height);
 
-  private.tiff = TIFFOpen(path, "r");
-  if (!private.tiff) {
-    /* Header is read, so no BAD_PATH check here */
-    return BACKEND_UNSUPPORTED;
+  /* Pyramids often come with a label or overview marked as reduced too, so
+   * only directories that are the same shape count */
+  if (page->num_levels > 0) {
+    const struct level *full = &page->levels[0];
+    const long long error = (long long)level.width * full->height
+      - (long long)level.height * full->width;
+    const int margin = full->width > full->height ? full->width : full->height;
+    if (level.width <= 0 || level.height <= 0
+        || level.width >= full->width
+        || error > margin || error < -margin) {
+      return;
+    }
   }
 
-  TIFFGetField(private.tiff, TIFFTAG_IMAGEWIDTH, &private.width);
-  TIFFGetField(private.tiff, TIFFTAG_IMAGELENGTH, &private.height);
+  page->levels = realloc(page->levels,
+      (page->num_levels + 1) * sizeof *page->levels);
+  page->levels[page->num_levels++] = level;
+}
 
-  struct private *new_private = malloc(sizeof private);
-  memcpy(new_private, &private, sizeof private);
+/* Add the reduced resolution versions of the current directory, given as
+ * SubIFDs, to its page */
+static void add_subifds(struct page *page, TIFF *tiff)
+{
+  uint16_t num_subifds = 0;
+  toff_t *subifds = NULL;
+  if (!TIFFGetField(tiff, TIFFTAG_SUBIFD, &num_subifds, &subifds)
+      || num_subifds == 0) {
+    return;
+  }
 
-  *src = imv_source_create(&vtable, new_private);
-  return BACKEND_SUCCESS;
+  /* The array belongs to the directory, which is about to change */
+  toff_t *offsets = malloc(num_subifds * sizeof *offsets);
+  memcpy(offsets, subifds, num_subifds * sizeof *offsets);
+  for (uint16_t i = 0; i < num_subifds; ++i) {
+    if (TIFFSetSubDirectory(tiff, offsets[i])) {
+      add_level(page, tiff);
+    }
+  }
+  free(offsets);
 }
 
-static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+/* Each directory in the main chain is a page of its own, unless it's marked
+ * as a reduced version of the page before. Pages can have reduced versions
+ * in their SubIFDs too. */
+static void find_pages(struct private *private)
 {
-  struct private *private = malloc(sizeof *private);
-  private->data = data;
-  private->len = len;
-  private->pos = 0;
-  private->tiff = TIFFClientOpen("-", "rm", (thandle_t)private,
-      &mem_read, &mem_write, &mem_seek, &mem_close, &mem_size,
-      NULL, NULL);
+  /* Visiting SubIFDs loses the place in the main chain, so that's walked
+   * first */
+  size_t num_dirs = 0;
+  toff_t *dirs = NULL;
+  bool *reduced = NULL;
+  do {
+    dirs = realloc(dirs, (num_dirs + 1) * sizeof *dirs);
+    reduced = realloc(reduced, (num_dirs + 1) * sizeof *reduced);
+    uint32_t type = 0;
+    TIFFGetField(private->tiff, TIFFTAG_SUBFILETYPE, &type);
+    dirs[num_dirs] = TIFFCurrentDirOffset(private->tiff);
+    reduced[num_dirs] = num_dirs > 0 && (type & FILETYPE_REDUCEDIMAGE);
+    ++num_dirs;
+  } while (TIFFReadDirectory(private->tiff));
+
+  for (size_t i = 0; i < num_dirs; ++i) {
+    if (!TIFFSetSubDirectory(private->tiff, dirs[i])) {
+      continue;
+    }
+    if (reduced[i] && private->num_pages > 0) {
+      add_level(&private->pages[private->num_pages - 1], private->tiff);
+      continue;
+    }
+    private->pages = realloc(private->pages,
+        (private->num_pages + 1) * sizeof *private->pages);
+    struct page *page = &private->pages[private->num_pages++];
+    *page = (struct page){0};
+    add_level(page, private->tiff);
+    add_subifds(page, private->tiff);
+  }
+  free(dirs);
+  free(reduced);
+
+  TIFFSetDirectory(private->tiff, 0);
+}
+
+/* Open a TIFF from memory, taking ownership of private */
+static enum backend_result open_tiff(struct private *private,
+    struct imv_source **src)
+{
+  private->tiff = open_client(&private->reader);
   if (!private->tiff) {
     /* Header is read, so no BAD_PATH check here */
+    if (private->mapped) {
+      imv_source_unmap_file(private->reader.data, private->reader.len);
+    }
     free(private);
     return BACKEND_UNSUPPORTED;
   }
 
-  TIFFGetField(private->tiff, TIFFTAG_IMAGEWIDTH, &private->width);
-  TIFFGetField(private->tiff, TIFFTAG_IMAGELENGTH, &private->height);
+  find_pages(private);
+  if (private->num_pages == 0) {
+    free_private(private);
+    return BACKEND_UNSUPPORTED;
+  }
 
   *src = imv_source_create(&vtable, private);
   return BACKEND_SUCCESS;
 }
 
+static enum backend_result open_path(const char *path, struct imv_source **src)
+{
+  /* Directories and strips can be anywhere, so it isn't read sequentially */
+  void *data;
+  size_t len;
+  if (!imv_source_map_file(path, false, &data, &len)) {
+    return BACKEND_BAD_PATH;
+  }
+
+  struct private *private = calloc(1, sizeof *private);
+  private->reader.data = data;
+  private->reader.len = len;
+  private->mapped = true;
+  return open_tiff(private, src);
+}
+
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  struct private *private = calloc(1, sizeof *private);
+  private->reader.data = data;
+  private->reader.len = len;
+  return open_tiff(private, src);
+}
+
 const struct imv_backend imv_backend_libtiff = {
   .name = "libtiff",
   .description = "The de-facto tiff library",
   .website = "http://www.libtiff.org/",
   .license = "MIT",
+  .sniff = &imv_sniff_tiff,
   .open_path = &open_path,
   .open_memory = &open_memory,
 };
@@ -0,0 +1,294 @@
+#include "backend.h"
+#include "bitmap.h"
+#include "image.h"
+#include "log.h"
+#include "sniff.h"
+#include "source.h"
+#include "source_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <webp/decode.h>
+#include <webp/demux.h>
+
+/* Enough frame buffers to cover the frame on screen, the one queued up after
+ * it, and the one being decoded */
+#define MAX_SPARE_FRAMES 3
+
+/* Frames without a duration are shown for this long, in milliseconds, as
+ * browsers do. A frametime of 0 would mean a still image. */
+#define DEFAULT_FRAME_DURATION 100
+
+struct private {
+  /* the file's contents, and whether they were mapped by open_path */
+  void *data;
+  size_t len;
+  bool mapped;
+  /* set for animations, stills are decoded straight into their bitmap */
+  WebPAnimDecoder *decoder;
+  int width, height;
+  int frame_count;
+  /* recycles the buffers of frames that are no longer needed */
+  struct imv_bitmap_pool *frames;
+  /* the frame last handed over, counting from 0, the time it ended at, and
+   * the id of its image */
+  int current_frame;
+  int timestamp;
+  unsigned long last_id;
+};
+
+static void free_private(void *raw_private)
+{
+  if (!raw_private) {
+    return;
+  }
+
+  struct private *private = raw_private;
+  WebPAnimDecoderDelete(private->decoder);
+  imv_bitmap_pool_free(private->frames);
+  if (private->mapped) {
+    imv_source_unmap_file(private->data, private->len);
+  }
+  free(private);
+}
+
+/* Get the area a frame, counting from 0, draws over, and whether it's cleared
+ * to the background once it's done with */
+static bool frame_rect(struct private *private, int frame, int *x0, int *y0,
+    int *x1, int *y1, bool *disposed)
+{
+  const WebPDemuxer *demux = WebPAnimDecoderGetDemuxer(private->decoder);
+  WebPIterator iter;
+  if (!WebPDemuxGetFrame(demux, frame + 1, &iter)) {
+    return false;
+  }
+  *x0 = iter.x_offset;
+  *y0 = iter.y_offset;
+  *x1 = iter.x_offset + iter.width;
+  *y1 = iter.y_offset + iter.height;
+  *disposed = iter.dispose_method == WEBP_MUX_DISPOSE_BACKGROUND;
+  WebPDemuxReleaseIterator(&iter);
+  return true;
+}
+
+/* A frame composited straight on top of the last one handed over can only
+ * differ from it where it draws, and where the last one was cleared away */
+static void set_damage(struct private *private, struct imv_image *image,
+    int prev_frame)
+{
+  const int frame = private->current_frame;
+  if (frame == 0 || !private->last_id || prev_frame != frame - 1) {
+    return;
+  }
+
+  int x0, y0, x1, y1;
+  int px0, py0, px1, py1;
+  bool disposed, prev_disposed;
+  if (!frame_rect(private, frame, &x0, &y0, &x1, &y1, &disposed)
+      || !frame_rect(private, prev_frame, &px0, &py0, &px1, &py1,
+        &prev_disposed)) {
+    return;
+  }
+
+  if (prev_disposed) {
+    x0 = px0 < x0 ? px0 : x0;
+    y0 = py0 < y0 ? py0 : y0;
+    x1 = px1 > x1 ? px1 : x1;
+    y1 = py1 > y1 ? py1 : y1;
+  }
+
+  const int width = private->width;
+  const int height = private->height;
+  x1 = x1 < width ? x1 : width;
+  y1 = y1 < height ? y1 : height;
+  if (x0 > x1 || y0 > y1) {
+    x0 = x1;
+    y0 = y1;
+  }
+  imv_image_set_damage(image, private->last_id, x0, y0, x1 - x0, y1 - y0);
+}
+
+/* Decode the next frame of the animation, going back to the first after the
+ * last */
+static void next_frame(void *raw_private, struct imv_image **image, int *frametime,
+    struct imv_source_token *token)
+{
+  (void)token;
+  *image = NULL;
+  *frametime = 0;
+
+  struct private *private = raw_private;
+  const int prev_frame = private->current_frame;
+  if (!WebPAnimDecoderHasMoreFrames(private->decoder)) {
+    WebPAnimDecoderReset(private->decoder);
+    private->current_frame = -1;
+    private->timestamp = 0;
+  }
+
+  uint8_t *pixels;
+  int timestamp;
+  if (!WebPAnimDecoderGetNext(private->decoder, &pixels, &timestamp)) {
+    imv_log(IMV_DEBUG, "libwebp: failed to decode a frame\n");
+    /* Start again from the beginning next time */
+    WebPAnimDecoderReset(private->decoder);
+    private->current_frame = -1;
+    private->timestamp = 0;
+    private->last_id = 0;
+    return;
+  }
+  private->current_frame++;
+
+  /* The decoder composites each frame on top of the last in its own buffer,
+   * so a copy is still needed, but the buffer it goes into is recycled */
+  struct imv_bitmap *bmp = imv_bitmap_pool_get(private->frames);
+  memcpy(bmp->data, pixels, imv_bitmap_bytes(bmp));
+
+  *image = imv_image_create_from_bitmap(bmp);
+  *frametime = timestamp - private->timestamp;
+  if (*frametime <= 0) {
+    *frametime = DEFAULT_FRAME_DURATION;
+  }
+  private->timestamp = timestamp;
+
+  set_damage(private, *image, prev_frame);
+  private->last_id = imv_image_id(*image);
+}
+
+static void first_frame(void *raw_private, struct imv_image **image, int *frametime,
+    struct imv_source_token *token)
+{
+  *image = NULL;
+  *frametime = 0;
+
+  struct private *private = raw_private;
+  if (private->decoder) {
+    WebPAnimDecoderReset(private->decoder);
+    private->current_frame = -1;
+    private->timestamp = 0;
+    private->last_id = 0;
+    next_frame(private, image, frametime, token);
+    return;
+  }
+
+  /* A still image is decoded straight into its bitmap, with no copy */
+  const int width = private->width;
+  const int height = private->height;
+  const size_t stride = 4 * (size_t)width;
+  unsigned char *pixels = malloc(stride * height);
+  if (!WebPDecodeRGBAInto(private->data, private->len, pixels,
+        stride * height, (int)stride)) {
+    imv_log(IMV_DEBUG, "libwebp: failed to decode image\n");
+    free(pixels);
+    return;
+  }
+
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
+  bmp->width = width;
+  bmp->height = height;
+  bmp->format = IMV_ABGR;
+  bmp->data = pixels;
+  *image = imv_image_create_from_bitmap(bmp);
+}
+
+static void frame_info(void *raw_private, int *index, int *count)
+{
+  struct private *private = raw_private;
+  *index = private->current_frame;
+  *count = private->frame_count;
+}
+
+static const struct imv_source_vtable vtable = {
+  .load_first_frame = first_frame,
+  .load_next_frame = next_frame,
+  .frame_info = frame_info,
+  .free = free_private
+};
+
+static const struct imv_source_vtable still_vtable = {
+  .load_first_frame = first_frame,
+  .free = free_private
+};
+
+/* Work out whether the file is an animation, and set up decoding for it.
+ * Takes ownership of data if mapped. */
+static enum backend_result open_webp(void *data, size_t len, bool mapped,
+    struct imv_source **src)
+{
+  if (!WebPGetInfo(data, len, NULL, NULL)) {
+    if (mapped) {
+      imv_source_unmap_file(data, len);
+    }
+    return BACKEND_UNSUPPORTED;
+  }
+
+  struct private *private = calloc(1, sizeof *private);
+  private->data = data;
+  private->len = len;
+  private->mapped = mapped;
+  private->current_frame = -1;
+
+  /* The container says how many frames there are without decoding any */
+  const WebPData webp_data = {
+    .bytes = data,
+    .size = len,
+  };
+  WebPDemuxer *demux = WebPDemux(&webp_data);
+  if (!demux) {
+    free_private(private);
+    return BACKEND_UNSUPPORTED;
+  }
+  private->width = WebPDemuxGetI(demux, WEBP_FF_CANVAS_WIDTH);
+  private->height = WebPDemuxGetI(demux, WEBP_FF_CANVAS_HEIGHT);
+  private->frame_count = WebPDemuxGetI(demux, WEBP_FF_FRAME_COUNT);
+  WebPDemuxDelete(demux);
+
+  imv_log(IMV_DEBUG, "libwebp: width=%d height=%d frames=%d\n",
+      private->width, private->height, private->frame_count);
+
+  if (private->frame_count < 2) {
+    *src = imv_source_create(&still_vtable, private);
+    return BACKEND_SUCCESS;
+  }
+
+  WebPAnimDecoderOptions options;
+  WebPAnimDecoderOptionsInit(&options);
+  options.color_mode = MODE_RGBA;
+  options.use_threads = 1;
+  private->decoder = WebPAnimDecoderNew(&webp_data, &options);
+  if (!private->decoder) {
+    free_private(private);
+    return BACKEND_UNSUPPORTED;
+  }
+
+  private->frames = imv_bitmap_pool_create(private->width, private->height,
+      IMV_ABGR, MAX_SPARE_FRAMES);
+  *src = imv_source_create(&vtable, private);
+  return BACKEND_SUCCESS;
+}
+
+static enum backend_result open_path(const char *path, struct imv_source **src)
+{
+  imv_log(IMV_DEBUG, "libwebp: open_path(%s)\n", path);
+
+  void *data;
+  size_t len;
+  if (!imv_source_map_file(path, true, &data, &len)) {
+    return BACKEND_BAD_PATH;
+  }
+  return open_webp(data, len, true, src);
+}
+
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  return open_webp(data, len, false, src);
+}
+
+const struct imv_backend imv_backend_libwebp = {
+  .name = "libwebp",
+  .description = "WebP image format decoder from Google",
+  .website = "https://developers.google.com/speed/webp",
+  .license = "BSD 3-Clause",
+  .sniff = &imv_sniff_webp,
+  .open_path = &open_path,
+  .open_memory = &open_memory,
+};
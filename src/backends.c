@@ -0,0 +1,66 @@
+#include "backends.h"
+#include "sniff.h"
+
+extern const struct imv_backend imv_backend_freeimage;
+extern const struct imv_backend imv_backend_libpng;
+extern const struct imv_backend imv_backend_librsvg;
+extern const struct imv_backend imv_backend_libtiff;
+extern const struct imv_backend imv_backend_libjpeg;
+extern const struct imv_backend imv_backend_libnsgif;
+extern const struct imv_backend imv_backend_libheif;
+extern const struct imv_backend imv_backend_libwebp;
+
+/* Backends built as modules are in the same place they would be if linked
+ * in, so the same ones are tried first. The final entry only keeps the array
+ * from being empty, and isn't counted. */
+static const struct imv_backend_entry backends[] = {
+#ifdef IMV_BACKEND_LIBTIFF
+  {"libtiff", &imv_backend_libtiff, &imv_sniff_tiff},
+#elif defined(IMV_MODULE_LIBTIFF)
+  {"libtiff", NULL, &imv_sniff_tiff},
+#endif
+#ifdef IMV_BACKEND_LIBPNG
+  {"libpng", &imv_backend_libpng, &imv_sniff_png},
+#elif defined(IMV_MODULE_LIBPNG)
+  {"libpng", NULL, &imv_sniff_png},
+#endif
+#ifdef IMV_BACKEND_LIBJPEG
+  {"libjpeg", &imv_backend_libjpeg, &imv_sniff_jpeg},
+#elif defined(IMV_MODULE_LIBJPEG)
+  {"libjpeg", NULL, &imv_sniff_jpeg},
+#endif
+#ifdef IMV_BACKEND_LIBRSVG
+  {"librsvg", &imv_backend_librsvg, &imv_sniff_svg},
+#elif defined(IMV_MODULE_LIBRSVG)
+  {"librsvg", NULL, &imv_sniff_svg},
+#endif
+#ifdef IMV_BACKEND_LIBNSGIF
+  {"libnsgif", &imv_backend_libnsgif, &imv_sniff_gif},
+#elif defined(IMV_MODULE_LIBNSGIF)
+  {"libnsgif", NULL, &imv_sniff_gif},
+#endif
+#ifdef IMV_BACKEND_LIBWEBP
+  {"libwebp", &imv_backend_libwebp, &imv_sniff_webp},
+#elif defined(IMV_MODULE_LIBWEBP)
+  {"libwebp", NULL, &imv_sniff_webp},
+#endif
+#ifdef IMV_BACKEND_FREEIMAGE
+  {"freeimage", &imv_backend_freeimage, NULL},
+#elif defined(IMV_MODULE_FREEIMAGE)
+  {"freeimage", NULL, NULL},
+#endif
+#ifdef IMV_BACKEND_LIBHEIF
+  {"libheif", &imv_backend_libheif, &imv_sniff_heif},
+#elif defined(IMV_MODULE_LIBHEIF)
+  {"libheif", NULL, &imv_sniff_heif},
+#endif
+  {NULL, NULL, NULL},
+};
+
+const struct imv_backend_entry *imv_backends_list(size_t *len)
+{
+  *len = sizeof backends / sizeof *backends - 1;
+  return backends;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
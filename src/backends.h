@@ -0,0 +1,29 @@
+#ifndef IMV_BACKENDS_H
+#define IMV_BACKENDS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct imv_backend;
+
+/* A backend imv was built with, either linked in or as a module */
+struct imv_backend_entry {
+  /* the backend's name, which is also its module's */
+  const char *name;
+
+  /* the backend, or NULL if it's a module that has to be loaded first */
+  const struct imv_backend *backend;
+
+  /* recognises the files the backend reads without needing it loaded, or
+   * NULL if the format can't be told from the header */
+  bool (*sniff)(const unsigned char *header, size_t len);
+};
+
+/* The backends imv was built with, in the order they're tried, so imv, the
+ * benchmarks and imv-thumbnail all decode the same files the same way. len is
+ * set to the number of them. */
+const struct imv_backend_entry *imv_backends_list(size_t *len);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
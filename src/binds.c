@@ -1,33 +1,60 @@
 #include "binds.h"
+#include "commands.h"
 #include "list.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 struct bind_node {
   char *key; /* input key to reach this node */
-  struct list *commands; /* commands to run for this node, or NULL if not leaf node */
+  uint32_t hash; /* hash of key */
+  struct list *commands; /* compiled commands to run for this node, or NULL if not leaf node */
   struct list *suffixes; /* list of bind_node* suffixes, or NULL if leaf node */
+  /* suffixes by key hash, open addressed, with at least half the slots free */
+  struct bind_node **index;
+  size_t index_cap;
 };
 
 struct imv_binds {
   struct bind_node bind_tree;
+  struct imv_commands *commands;
+  /* the node reached by the keys pressed so far */
+  struct bind_node *current;
   struct list *keys;
+  /* command lists that were replaced while they may have been running, which
+   * are freed once they can't be */
+  struct list *retired;
   bool aborting_sequence;
 };
 
-static int compare_node_key(const void* item, const void *key)
+/* 32-bit FNV-1a */
+static uint32_t hash_key(const char *key)
 {
-  const struct bind_node *node = item;
-  const char *keystr = key;
-  return strcmp(node->key, keystr);
+  uint32_t hash = 0x811c9dc5u;
+  for(const unsigned char *c = (const unsigned char*)key; *c; ++c) {
+    hash ^= *c;
+    hash *= 0x01000193u;
+  }
+  return hash;
 }
 
 static void init_bind_node(struct bind_node *bn)
 {
   bn->key = NULL;
+  bn->hash = 0;
   bn->commands = NULL;
   bn->suffixes = list_create();
+  bn->index = NULL;
+  bn->index_cap = 0;
+}
+
+static void free_commands(struct list *commands)
+{
+  for(size_t i = 0; i < commands->len; ++i) {
+    imv_compiled_command_free(commands->items[i]);
+  }
+  list_free(commands);
 }
 
 static void destroy_bind_node(struct bind_node *bn)
@@ -37,16 +64,86 @@ static void destroy_bind_node(struct bind_node *bn)
   }
   free(bn->key);
   if(bn->commands) {
-    list_deep_free(bn->commands);
+    free_commands(bn->commands);
   }
   list_deep_free(bn->suffixes);
+  free(bn->index);
+}
+
+static struct bind_node *find_child(const struct bind_node *node, const char *key)
+{
+  if(!node->index) {
+    return NULL;
+  }
+  const uint32_t hash = hash_key(key);
+  const size_t mask = node->index_cap - 1;
+  for(size_t i = hash & mask; node->index[i]; i = (i + 1) & mask) {
+    struct bind_node *child = node->index[i];
+    if(child->hash == hash && !strcmp(child->key, key)) {
+      return child;
+    }
+  }
+  return NULL;
+}
+
+static void index_child(struct bind_node *node, struct bind_node *child)
+{
+  const size_t mask = node->index_cap - 1;
+  size_t i = child->hash & mask;
+  while(node->index[i]) {
+    i = (i + 1) & mask;
+  }
+  node->index[i] = child;
+}
+
+static struct bind_node *add_child(struct bind_node *node, const char *key)
+{
+  struct bind_node *child = malloc(sizeof *child);
+  init_bind_node(child);
+  child->key = strdup(key);
+  child->hash = hash_key(key);
+  list_append(node->suffixes, child);
+
+  if(node->suffixes->len * 2 > node->index_cap) {
+    /* Rebuild the index at twice the size */
+    free(node->index);
+    node->index_cap = node->index_cap ? node->index_cap * 2 : 8;
+    node->index = calloc(node->index_cap, sizeof *node->index);
+    for(size_t i = 0; i < node->suffixes->len; ++i) {
+      index_child(node, node->suffixes->items[i]);
+    }
+  } else {
+    index_child(node, child);
+  }
+  return child;
+}
+
+/* Running a command may change the binds, so the commands of a bind being
+ * replaced are kept until the next key press */
+static void retire_commands(struct imv_binds *binds, struct bind_node *node)
+{
+  if(node->commands) {
+    list_append(binds->retired, node->commands);
+    node->commands = NULL;
+  }
 }
 
-struct imv_binds *imv_binds_create(void)
+static void free_retired(struct imv_binds *binds)
+{
+  for(size_t i = 0; i < binds->retired->len; ++i) {
+    free_commands(binds->retired->items[i]);
+  }
+  list_clear(binds->retired);
+}
+
+struct imv_binds *imv_binds_create(struct imv_commands *commands)
 {
   struct imv_binds *binds = calloc(1, sizeof *binds);
   init_bind_node(&binds->bind_tree);
+  binds->commands = commands;
+  binds->current = &binds->bind_tree;
   binds->keys = list_create();
+  binds->retired = list_create();
   return binds;
 }
 
@@ -54,6 +151,8 @@ void imv_binds_free(struct imv_binds *binds)
 {
   destroy_bind_node(&binds->bind_tree);
   list_deep_free(binds->keys);
+  free_retired(binds);
+  list_free(binds->retired);
   free(binds);
 }
 
@@ -67,6 +166,9 @@ enum bind_result imv_binds_add(struct imv_binds *binds, const struct list *keys,
     return BIND_INVALID_KEYS;
   }
 
+  /* The trie's changing under any sequence in progress */
+  imv_bind_clear_input(binds);
+
   /* Prepare our return code */
   int result = BIND_SUCCESS;
 
@@ -80,16 +182,9 @@ enum bind_result imv_binds_add(struct imv_binds *binds, const struct list *keys,
     }
 
     /* Find / create a child with the current key */
-    struct bind_node *next_node = NULL;
-    int child_index = list_find(node->suffixes, &compare_node_key, keys->items[i]);
-    if(child_index == -1) {
-      /* Create our new node */
-      next_node = malloc(sizeof *next_node);
-      init_bind_node(next_node);
-      next_node->key = strdup(keys->items[i]);
-      list_append(node->suffixes, next_node);
-    } else {
-      next_node = node->suffixes->items[child_index];
+    struct bind_node *next_node = find_child(node, keys->items[i]);
+    if(!next_node) {
+      next_node = add_child(node, keys->items[i]);
     }
 
     /* We've now found the correct node for this key */
@@ -102,7 +197,7 @@ enum bind_result imv_binds_add(struct imv_binds *binds, const struct list *keys,
         break;
       } else {
         /* Otherwise we just need to append a new command to the existing bind. */
-        list_append(next_node->commands, strdup(command));
+        list_append(next_node->commands, imv_command_compile(binds->commands, command));
         result = BIND_SUCCESS;
         break;
       }
@@ -115,7 +210,7 @@ enum bind_result imv_binds_add(struct imv_binds *binds, const struct list *keys,
         result = BIND_CONFLICTS;
       } else {
         next_node->commands = list_create();
-        list_append(next_node->commands, strdup(command));
+        list_append(next_node->commands, imv_command_compile(binds->commands, command));
       }
     } else {
       /* Otherwise, move down the trie */
@@ -128,73 +223,61 @@ enum bind_result imv_binds_add(struct imv_binds *binds, const struct list *keys,
 
 void imv_binds_clear(struct imv_binds *binds)
 {
+  imv_bind_clear_input(binds);
+  /* Only the commands, which may be running, outlive the trie */
+  struct list *stack = list_create();
+  list_append(stack, &binds->bind_tree);
+  while(stack->len > 0) {
+    struct bind_node *node = stack->items[--stack->len];
+    retire_commands(binds, node);
+    for(size_t i = 0; i < node->suffixes->len; ++i) {
+      list_append(stack, node->suffixes->items[i]);
+    }
+  }
+  list_free(stack);
   destroy_bind_node(&binds->bind_tree);
   init_bind_node(&binds->bind_tree);
 }
 
 void imv_binds_clear_key(struct imv_binds *binds, const struct list *keys)
 {
+  imv_bind_clear_input(binds);
   struct bind_node *node = &binds->bind_tree;
 
   for(size_t i = 0; i < keys->len; ++i) {
     /* Traverse the trie to find the right node for the input keys */
-    int child_index = list_find(node->suffixes, &compare_node_key, keys->items[i]);
-    if(child_index == -1) {
+    node = find_child(node, keys->items[i]);
+    if(!node) {
       /* No such node, no more work to do */
       return;
-    } else {
-      node = node->suffixes->items[child_index];
     }
   }
 
   /* We've now found the correct node for the input */
 
   /* Clear the commands for this node */
-  if(node->commands) {
-    list_deep_free(node->commands);
-    node->commands = NULL;
-  }
+  retire_commands(binds, node);
 }
 
-enum lookup_result {
-  LOOKUP_PARTIAL,
-  LOOKUP_INVALID,
-  LOOKUP_MATCH,
-};
-
-static enum lookup_result bind_lookup(struct bind_node *node, struct list *keys, struct list **out_list)
+const struct list *imv_bind_input_buffer(struct imv_binds *binds)
 {
-  for(size_t part = 0; part < keys->len; ++part) {
-    const char* cur_key = keys->items[part];
-    int found = 0;
-    for(size_t i = 0; i < node->suffixes->len; ++i) {
-      struct bind_node* cur_node = node->suffixes->items[i];
-      if(strcmp(cur_node->key, cur_key) == 0) {
-        node = node->suffixes->items[i];
-        found = 1;
-        break;
-      }
-    }
-    if(!found) {
-      return LOOKUP_INVALID;
-    }
-  }
-
-  if(node->commands) {
-    *out_list = node->commands;
-    return LOOKUP_MATCH;
-  }
-  return LOOKUP_PARTIAL;
+  return binds->keys;
 }
 
 void imv_bind_clear_input(struct imv_binds *binds)
 {
-  list_deep_free(binds->keys);
-  binds->keys = list_create();
+  for(size_t i = 0; i < binds->keys->len; ++i) {
+    free(binds->keys->items[i]);
+  }
+  list_clear(binds->keys);
+  binds->current = &binds->bind_tree;
 }
 
-struct list *imv_bind_handle_event(struct imv_binds *binds, const char *event)
+const struct list *imv_bind_handle_event(struct imv_binds *binds, const char *event)
 {
+  /* Whatever the last bind ran is finished with by now */
+  free_retired(binds);
+
   /* If the user hits Escape twice in a row, treat that as backtracking out
    * of the current key sequence. */
   if (!strcmp("Escape", event)) {
@@ -212,22 +295,21 @@ struct list *imv_bind_handle_event(struct imv_binds *binds, const char *event)
     binds->aborting_sequence = false;
   }
 
-  list_append(binds->keys, strdup(event));
-
-  struct list *commands = NULL;
-  enum lookup_result result = bind_lookup(&binds->bind_tree, binds->keys, &commands);
-  if(result == LOOKUP_PARTIAL) {
-    return NULL;
-  } else if(result == LOOKUP_MATCH) {
-    imv_bind_clear_input(binds);
-    return commands;
-  } else if(result == LOOKUP_INVALID) {
+  /* Each key moves one step down the trie from where the keys before it
+   * left off, so nothing's allocated unless a sequence is in progress */
+  struct bind_node *node = find_child(binds->current, event);
+  if(!node) {
     imv_bind_clear_input(binds);
     return NULL;
   }
 
-  /* Should not happen */
-  imv_bind_clear_input(binds);
+  if(node->commands) {
+    imv_bind_clear_input(binds);
+    return node->commands;
+  }
+
+  binds->current = node;
+  list_append(binds->keys, strdup(event));
   return NULL;
 }
 
@@ -4,6 +4,7 @@
 #include <unistd.h>
 
 struct imv_binds;
+struct imv_commands;
 struct list;
 
 enum bind_result {
@@ -13,8 +14,10 @@ enum bind_result {
   BIND_CONFLICTS,
 };
 
-/* Create an imv_binds instance */
-struct imv_binds *imv_binds_create(void);
+/* Create an imv_binds instance. Bound commands are compiled with cmds as
+ * they're bound, any that aren't registered or aliased yet are looked up
+ * again when they're run */
+struct imv_binds *imv_binds_create(struct imv_commands *cmds);
 
 /* Clean up an imv_binds instance */
 void imv_binds_free(struct imv_binds *binds);
@@ -34,8 +37,10 @@ const struct list *imv_bind_input_buffer(struct imv_binds *binds);
 /* Abort the current input key sequence */
 void imv_bind_clear_input(struct imv_binds *binds);
 
-/* Handle an input event, if a bind is triggered, return its command */
-struct list *imv_bind_handle_event(struct imv_binds *binds, const char *event);
+/* Handle an input event, if a bind is triggered, return its list of compiled
+ * commands, for imv_command_exec_list. The list stays valid until the next
+ * event, even if the binds change in the meantime. */
+const struct list *imv_bind_handle_event(struct imv_binds *binds, const char *event);
 
 /* Convert a string (such as from a config) to a key list */
 struct list *imv_bind_parse_keys(const char *keys);
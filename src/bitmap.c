@@ -1,12 +1,41 @@
 #include "bitmap.h"
 
+#include "pixels.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+struct imv_bitmap_pool {
+  pthread_mutex_t lock;
+  /* one for the creator, and one for each bitmap it's handed out */
+  int refcount;
+  /* set once the creator's done with the pool, so nothing's worth keeping */
+  bool released;
+  int width;
+  int height;
+  enum imv_pixelformat format;
+  int max_spare;
+  int num_spare;
+  unsigned char **spare;
+};
+
+size_t imv_bitmap_bytes_per_pixel(enum imv_pixelformat format)
+{
+  return format == IMV_GREY ? 1 : 4;
+}
+
+size_t imv_bitmap_bytes(const struct imv_bitmap *bmp)
+{
+  return imv_bitmap_bytes_per_pixel(bmp->format) * bmp->width * bmp->height;
+}
+
 struct imv_bitmap *imv_bitmap_clone(struct imv_bitmap *bmp)
 {
-  struct imv_bitmap *copy = malloc(sizeof *copy);
-  const size_t num_bytes = 4 * bmp->width * bmp->height;
+  struct imv_bitmap *copy = calloc(1, sizeof *copy);
+  const size_t num_bytes = imv_bitmap_bytes(bmp);
   copy->width = bmp->width;
   copy->height = bmp->height;
   copy->format = bmp->format;
@@ -15,8 +44,240 @@ struct imv_bitmap *imv_bitmap_clone(struct imv_bitmap *bmp)
   return copy;
 }
 
+/* Average each of the four 8-bit channels packed into a pair of pixels, in
+ * one go, without unpacking them. One rounds down and the other up, so that
+ * using one after the other doesn't bias the result. */
+static inline uint32_t average_down(uint32_t a, uint32_t b)
+{
+  return (a & b) + (((a ^ b) & 0xfefefefe) >> 1);
+}
+
+static inline uint32_t average_up(uint32_t a, uint32_t b)
+{
+  return (a | b) - (((a ^ b) & 0xfefefefe) >> 1);
+}
+
+static void downscale_grey(const struct imv_bitmap *bmp, struct imv_bitmap *half)
+{
+  for (int y = 0; y < half->height; ++y) {
+    const unsigned char *row0 = bmp->data + (size_t)(2 * y) * bmp->width;
+    const unsigned char *row1 = 2 * y + 1 < bmp->height ? row0 + bmp->width : row0;
+    unsigned char *out = half->data + (size_t)y * half->width;
+
+    for (int x = 0; x < half->width; ++x) {
+      const int x0 = 2 * x;
+      const int x1 = x0 + 1 < bmp->width ? x0 + 1 : x0;
+      out[x] = (row0[x0] + row0[x1] + row1[x0] + row1[x1] + 2) >> 2;
+    }
+  }
+}
+
+struct imv_bitmap *imv_bitmap_downscale(const struct imv_bitmap *bmp)
+{
+  struct imv_bitmap *half = calloc(1, sizeof *half);
+  half->width = (bmp->width + 1) / 2;
+  half->height = (bmp->height + 1) / 2;
+  half->format = bmp->format;
+  half->data = malloc(imv_bitmap_bytes(half));
+
+  if (bmp->format == IMV_GREY) {
+    downscale_grey(bmp, half);
+    return half;
+  }
+
+  const uint32_t *src = (const uint32_t *)bmp->data;
+  uint32_t *dst = (uint32_t *)half->data;
+
+  for (int y = 0; y < half->height; ++y) {
+    /* An odd row or column at the end is averaged with itself */
+    const uint32_t *row0 = src + (size_t)(2 * y) * bmp->width;
+    const uint32_t *row1 = 2 * y + 1 < bmp->height ? row0 + bmp->width : row0;
+    uint32_t *out = dst + (size_t)y * half->width;
+
+    for (int x = 0; x < half->width; ++x) {
+      const int x0 = 2 * x;
+      const int x1 = x0 + 1 < bmp->width ? x0 + 1 : x0;
+      out[x] = average_up(average_down(row0[x0], row0[x1]),
+                          average_down(row1[x0], row1[x1]));
+    }
+  }
+
+  return half;
+}
+
+/* Blend two packed pixels, with weight out of 256 given to b */
+static inline uint32_t lerp(uint32_t a, uint32_t b, uint32_t weight)
+{
+  const uint32_t a_rb = a & 0x00ff00ff, a_ga = (a >> 8) & 0x00ff00ff;
+  const uint32_t b_rb = b & 0x00ff00ff, b_ga = (b >> 8) & 0x00ff00ff;
+  const uint32_t rb = (a_rb * (256 - weight) + b_rb * weight) >> 8;
+  const uint32_t ga = (a_ga * (256 - weight) + b_ga * weight) >> 8;
+  return (rb & 0x00ff00ff) | ((ga & 0x00ff00ff) << 8);
+}
+
+/* Blend two luminance values, with weight out of 256 given to b */
+static inline uint32_t lerp_grey(uint32_t a, uint32_t b, uint32_t weight)
+{
+  return (a * (256 - weight) + b * weight) >> 8;
+}
+
+struct imv_bitmap *imv_bitmap_resize(const struct imv_bitmap *bmp,
+    int width, int height)
+{
+  struct imv_bitmap *out = calloc(1, sizeof *out);
+  out->width = width;
+  out->height = height;
+  out->format = bmp->format;
+  out->data = malloc(imv_bitmap_bytes(out));
+
+  const bool grey = bmp->format == IMV_GREY;
+  const uint32_t *src = (const uint32_t *)bmp->data;
+  uint32_t *dst = (uint32_t *)out->data;
+
+  /* Positions in the source are tracked in 1/256ths of a pixel, sampling
+   * at the centre of each destination pixel */
+  const int64_t step_x = ((int64_t)bmp->width << 8) / width;
+  const int64_t step_y = ((int64_t)bmp->height << 8) / height;
+
+  for (int y = 0; y < height; ++y) {
+    int64_t sy = (2 * y + 1) * step_y / 2 - 128;
+    sy = sy < 0 ? 0 : sy;
+    const int y0 = (int)(sy >> 8) < bmp->height - 1 ? (int)(sy >> 8) : bmp->height - 1;
+    const int y1 = y0 + 1 < bmp->height ? y0 + 1 : y0;
+    const uint32_t wy = (uint32_t)(sy & 0xff);
+
+    for (int x = 0; x < width; ++x) {
+      int64_t sx = (2 * x + 1) * step_x / 2 - 128;
+      sx = sx < 0 ? 0 : sx;
+      const int x0 = (int)(sx >> 8) < bmp->width - 1 ? (int)(sx >> 8) : bmp->width - 1;
+      const int x1 = x0 + 1 < bmp->width ? x0 + 1 : x0;
+      const uint32_t wx = (uint32_t)(sx & 0xff);
+
+      if (grey) {
+        const unsigned char *row0 = bmp->data + (size_t)y0 * bmp->width;
+        const unsigned char *row1 = bmp->data + (size_t)y1 * bmp->width;
+        out->data[(size_t)y * width + x] =
+          lerp_grey(lerp_grey(row0[x0], row0[x1], wx),
+                    lerp_grey(row1[x0], row1[x1], wx), wy);
+      } else {
+        const uint32_t *row0 = src + (size_t)y0 * bmp->width;
+        const uint32_t *row1 = src + (size_t)y1 * bmp->width;
+        dst[(size_t)y * width + x] = lerp(lerp(row0[x0], row0[x1], wx),
+                                          lerp(row1[x0], row1[x1], wx), wy);
+      }
+    }
+  }
+
+  return out;
+}
+
+struct imv_bitmap *imv_bitmap_to_argb(const struct imv_bitmap *bmp)
+{
+  struct imv_bitmap *out = calloc(1, sizeof *out);
+  out->width = bmp->width;
+  out->height = bmp->height;
+  out->format = IMV_ARGB;
+  out->data = malloc(imv_bitmap_bytes(out));
+
+  const size_t num_pixels = (size_t)bmp->width * bmp->height;
+  uint32_t *dst = (uint32_t *)out->data;
+  if (bmp->format == IMV_GREY) {
+    imv_pixels_grey_to_argb(dst, bmp->data, num_pixels);
+  } else if (bmp->format == IMV_ABGR) {
+    imv_pixels_swap_rb(dst, (const uint32_t *)bmp->data, num_pixels);
+  } else {
+    memcpy(out->data, bmp->data, imv_bitmap_bytes(out));
+  }
+  return out;
+}
+
+static void pool_unref(struct imv_bitmap_pool *pool)
+{
+  /* Called with the lock held, which is released */
+  const bool last = --pool->refcount == 0;
+  pthread_mutex_unlock(&pool->lock);
+
+  if (last) {
+    for (int i = 0; i < pool->num_spare; ++i) {
+      free(pool->spare[i]);
+    }
+    free(pool->spare);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+  }
+}
+
 void imv_bitmap_free(struct imv_bitmap *bmp)
 {
-  free(bmp->data);
+  if (bmp->release) {
+    bmp->release(bmp->release_data);
+    free(bmp);
+    return;
+  }
+
+  struct imv_bitmap_pool *pool = bmp->pool;
+  if (!pool) {
+    free(bmp->data);
+    free(bmp);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  if (!pool->released && pool->num_spare < pool->max_spare) {
+    pool->spare[pool->num_spare++] = bmp->data;
+  } else {
+    free(bmp->data);
+  }
   free(bmp);
+  pool_unref(pool);
+}
+
+struct imv_bitmap_pool *imv_bitmap_pool_create(int width, int height,
+    enum imv_pixelformat format, int max_spare)
+{
+  struct imv_bitmap_pool *pool = calloc(1, sizeof *pool);
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->refcount = 1;
+  pool->width = width;
+  pool->height = height;
+  pool->format = format;
+  pool->max_spare = max_spare > 0 ? max_spare : 0;
+  pool->spare = calloc(pool->max_spare > 0 ? pool->max_spare : 1, sizeof *pool->spare);
+  return pool;
+}
+
+void imv_bitmap_pool_free(struct imv_bitmap_pool *pool)
+{
+  if (!pool) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->released = true;
+  for (int i = 0; i < pool->num_spare; ++i) {
+    free(pool->spare[i]);
+  }
+  pool->num_spare = 0;
+  pool_unref(pool);
+}
+
+struct imv_bitmap *imv_bitmap_pool_get(struct imv_bitmap_pool *pool)
+{
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
+  bmp->width = pool->width;
+  bmp->height = pool->height;
+  bmp->format = pool->format;
+  bmp->pool = pool;
+
+  pthread_mutex_lock(&pool->lock);
+  ++pool->refcount;
+  if (pool->num_spare > 0) {
+    bmp->data = pool->spare[--pool->num_spare];
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (!bmp->data) {
+    bmp->data = malloc(imv_bitmap_bytes(bmp));
+  }
+  return bmp;
 }
@@ -1,22 +1,73 @@
 #ifndef IMV_BITMAP_H
 #define IMV_BITMAP_H
 
+#include <stddef.h>
+
 enum imv_pixelformat {
   IMV_ARGB,
   IMV_ABGR,
+  /* one byte of luminance per pixel, for opaque greyscale images, which the
+   * canvas expands as it draws them */
+  IMV_GREY,
 };
 
+struct imv_bitmap_pool;
+
 struct imv_bitmap {
   int width;
   int height;
   enum imv_pixelformat format;
   unsigned char *data;
+  /* if set, data came from this pool and is returned to it when freed */
+  struct imv_bitmap_pool *pool;
+  /* if set, data belongs to someone else, such as a decoder the pixels were
+   * left in, and is handed back by calling release with release_data when
+   * the bitmap's freed */
+  void (*release)(void *release_data);
+  void *release_data;
 };
 
+/* The number of bytes each pixel of a format takes */
+size_t imv_bitmap_bytes_per_pixel(enum imv_pixelformat format);
+
+/* The number of bytes a bitmap's pixels take */
+size_t imv_bitmap_bytes(const struct imv_bitmap *bmp);
+
 /* Copy an imv_bitmap */
 struct imv_bitmap *imv_bitmap_clone(struct imv_bitmap *bmp);
 
+/* Create a copy of a bitmap at half the width and height, rounded up, with
+ * each pixel the average of the 2x2 block of pixels it replaces */
+struct imv_bitmap *imv_bitmap_downscale(const struct imv_bitmap *bmp);
+
+/* Create a copy of a bitmap scaled to the given size, by bilinear
+ * interpolation. Only suitable for shrinking by up to half, beyond that
+ * imv_bitmap_downscale should be used first, to avoid aliasing */
+struct imv_bitmap *imv_bitmap_resize(const struct imv_bitmap *bmp,
+    int width, int height);
+
+/* Create a copy of a bitmap in IMV_ARGB format */
+struct imv_bitmap *imv_bitmap_to_argb(const struct imv_bitmap *bmp);
+
 /* Clean up a bitmap */
 void imv_bitmap_free(struct imv_bitmap *bmp);
 
+/* imv_bitmap_pool recycles the pixel buffers of bitmaps that are all the same
+ * size, such as the frames of an animation. Bitmaps taken from a pool hand
+ * their buffer back when they're freed, so once it's warmed up a steady
+ * stream of frames needs no new buffers. Safe to use from any thread.
+ */
+
+/* Creates a pool for width x height bitmaps, which keeps up to max_spare
+ * unused buffers for reuse */
+struct imv_bitmap_pool *imv_bitmap_pool_create(int width, int height,
+    enum imv_pixelformat format, int max_spare);
+
+/* Releases the creator's hold on the pool. Bitmaps from it may still be
+ * freed afterwards, the pool is cleaned up along with the last of them */
+void imv_bitmap_pool_free(struct imv_bitmap_pool *pool);
+
+/* Create a bitmap using a buffer from the pool. Its pixels are undefined */
+struct imv_bitmap *imv_bitmap_pool_get(struct imv_bitmap_pool *pool);
+
 #endif
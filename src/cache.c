@@ -0,0 +1,287 @@
+#include "cache.h"
+
+#include "image.h"
+#include "list.h"
+#include "source.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct cache_entry {
+  char *path;
+  struct imv_source *source;
+  struct imv_image *image;
+  int frametime;
+  size_t bytes;
+  /* when the user last viewed it, zero if they never have */
+  unsigned long viewed;
+};
+
+struct imv_cache {
+  /* the entries being prefetched, from most to least important, followed by
+   * the rest, from most to least recently viewed */
+  struct list *entries;
+  size_t num_wanted;
+  size_t bytes;
+  size_t max_bytes;
+  unsigned long clock;
+  unsigned long hits;
+  unsigned long misses;
+};
+
+static void free_entry(struct cache_entry *entry)
+{
+  if (entry->source) {
+    imv_source_async_free(entry->source);
+  }
+  imv_image_free(entry->image);
+  free(entry->path);
+  free(entry);
+}
+
+static ssize_t find_path(struct imv_cache *cache, const char *path)
+{
+  for (size_t i = 0; i < cache->entries->len; ++i) {
+    struct cache_entry *entry = cache->entries->items[i];
+    if (!strcmp(entry->path, path)) {
+      return (ssize_t)i;
+    }
+  }
+  return -1;
+}
+
+/* Take an entry out of the list, without freeing it */
+static struct cache_entry *unlink_at(struct imv_cache *cache, size_t index)
+{
+  struct cache_entry *entry = cache->entries->items[index];
+  cache->bytes -= entry->bytes;
+  list_remove(cache->entries, index);
+  if (index < cache->num_wanted) {
+    --cache->num_wanted;
+  }
+  return entry;
+}
+
+static void remove_at(struct imv_cache *cache, size_t index)
+{
+  free_entry(unlink_at(cache, index));
+}
+
+static void enforce_budget(struct imv_cache *cache)
+{
+  /* Evict the least recently viewed images first, then the least important
+   * of those being prefetched */
+  for (size_t i = cache->entries->len; i > 0 && cache->bytes > cache->max_bytes; --i) {
+    struct cache_entry *entry = cache->entries->items[i - 1];
+    if (entry->image) {
+      remove_at(cache, i - 1);
+    }
+  }
+}
+
+struct imv_cache *imv_cache_create(size_t max_bytes)
+{
+  struct imv_cache *cache = calloc(1, sizeof *cache);
+  cache->entries = list_create();
+  cache->max_bytes = max_bytes;
+  return cache;
+}
+
+void imv_cache_free(struct imv_cache *cache)
+{
+  if (!cache) {
+    return;
+  }
+  imv_cache_clear(cache);
+  list_free(cache->entries);
+  free(cache);
+}
+
+void imv_cache_set_max_bytes(struct imv_cache *cache, size_t max_bytes)
+{
+  cache->max_bytes = max_bytes;
+  enforce_budget(cache);
+}
+
+bool imv_cache_contains(struct imv_cache *cache, const char *path)
+{
+  return find_path(cache, path) != -1;
+}
+
+bool imv_cache_is_loading(struct imv_cache *cache, const char *path)
+{
+  const ssize_t index = find_path(cache, path);
+  if (index == -1) {
+    return false;
+  }
+  const struct cache_entry *entry = cache->entries->items[index];
+  return entry->source && !entry->image;
+}
+
+bool imv_cache_is_full(struct imv_cache *cache)
+{
+  size_t wanted_bytes = 0;
+  for (size_t i = 0; i < cache->num_wanted; ++i) {
+    const struct cache_entry *entry = cache->entries->items[i];
+    wanted_bytes += entry->bytes;
+  }
+  return wanted_bytes >= cache->max_bytes;
+}
+
+size_t imv_cache_bytes(struct imv_cache *cache)
+{
+  return cache->bytes;
+}
+
+void imv_cache_get_stats(struct imv_cache *cache, struct imv_cache_stats *stats)
+{
+  memset(stats, 0, sizeof *stats);
+  stats->bytes = cache->bytes;
+  stats->max_bytes = cache->max_bytes;
+  stats->hits = cache->hits;
+  stats->misses = cache->misses;
+  for (size_t i = 0; i < cache->entries->len; ++i) {
+    const struct cache_entry *entry = cache->entries->items[i];
+    if (entry->image) {
+      ++stats->images;
+      if (i >= cache->num_wanted) {
+        ++stats->recent;
+      }
+    }
+  }
+}
+
+void imv_cache_insert(struct imv_cache *cache, const char *path,
+    struct imv_source *src, struct imv_image *image, int frametime)
+{
+  ssize_t existing = find_path(cache, path);
+  if (existing != -1) {
+    remove_at(cache, existing);
+  }
+
+  struct cache_entry *entry = calloc(1, sizeof *entry);
+  entry->path = strdup(path);
+  entry->source = src;
+  entry->image = image;
+  entry->frametime = frametime;
+  entry->bytes = image ? imv_image_bytes(image) : 0;
+  cache->bytes += entry->bytes;
+
+  if (image) {
+    entry->viewed = ++cache->clock;
+    list_insert(cache->entries, cache->num_wanted, entry);
+  } else {
+    list_insert(cache->entries, cache->num_wanted++, entry);
+  }
+  enforce_budget(cache);
+}
+
+bool imv_cache_take(struct imv_cache *cache, const char *path,
+    struct imv_source **src, struct imv_image **image, int *frametime)
+{
+  ssize_t index = find_path(cache, path);
+  if (index == -1) {
+    ++cache->misses;
+    return false;
+  }
+
+  struct cache_entry *entry = unlink_at(cache, index);
+  if (entry->image) {
+    ++cache->hits;
+  } else {
+    ++cache->misses;
+  }
+  *src = entry->source;
+  *image = entry->image;
+  *frametime = entry->frametime;
+  free(entry->path);
+  free(entry);
+  return true;
+}
+
+bool imv_cache_store(struct imv_cache *cache, struct imv_source *src,
+    struct imv_image *image, int frametime)
+{
+  for (size_t i = 0; i < cache->entries->len; ++i) {
+    struct cache_entry *entry = cache->entries->items[i];
+    if (entry->source != src) {
+      continue;
+    }
+
+    if (!image) {
+      /* Keep the entry, but without a source, to remember it's broken */
+      imv_source_async_free(entry->source);
+      entry->source = NULL;
+      return true;
+    }
+
+    /* Only the first frame is kept, any later frames are discarded */
+    if (entry->image) {
+      imv_image_free(image);
+      return true;
+    }
+
+    entry->image = image;
+    entry->frametime = frametime;
+    entry->bytes = imv_image_bytes(image);
+    cache->bytes += entry->bytes;
+    enforce_budget(cache);
+    return true;
+  }
+  return false;
+}
+
+static int compare_viewed(const void *a, const void *b)
+{
+  const struct cache_entry *x = *(struct cache_entry *const *)a;
+  const struct cache_entry *y = *(struct cache_entry *const *)b;
+  return x->viewed < y->viewed ? 1 : x->viewed > y->viewed ? -1 : 0;
+}
+
+void imv_cache_retain(struct imv_cache *cache, const struct list *paths)
+{
+  struct list *kept = list_create();
+  for (size_t i = 0; i < paths->len; ++i) {
+    ssize_t index = find_path(cache, paths->items[i]);
+    if (index != -1) {
+      list_append(kept, cache->entries->items[index]);
+      list_remove(cache->entries, index);
+    }
+  }
+  const size_t num_wanted = kept->len;
+
+  /* Of the rest, finished images are worth keeping in case the user goes
+   * back to them, but loads in progress aren't worth finishing */
+  struct list *recent = list_create();
+  for (size_t i = 0; i < cache->entries->len; ++i) {
+    struct cache_entry *entry = cache->entries->items[i];
+    if (entry->image) {
+      list_append(recent, entry);
+    } else {
+      cache->bytes -= entry->bytes;
+      free_entry(entry);
+    }
+  }
+  qsort(recent->items, recent->len, sizeof *recent->items, &compare_viewed);
+  for (size_t i = 0; i < recent->len; ++i) {
+    list_append(kept, recent->items[i]);
+  }
+  list_free(recent);
+
+  list_free(cache->entries);
+  cache->entries = kept;
+  cache->num_wanted = num_wanted;
+  enforce_budget(cache);
+}
+
+void imv_cache_clear(struct imv_cache *cache)
+{
+  while (cache->entries->len > 0) {
+    remove_at(cache, cache->entries->len - 1);
+  }
+  cache->bytes = 0;
+  cache->num_wanted = 0;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
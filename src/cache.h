@@ -0,0 +1,97 @@
+#ifndef IMV_CACHE_H
+#define IMV_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* imv_cache holds open sources, and the images decoded from them, for paths
+ * other than the one currently being displayed. This allows the neighbours of
+ * the current image to be decoded ahead of time, and swapped in instantly when
+ * the user navigates to them. Images the user has recently viewed are kept
+ * too, for as long as there's room, with the least recently viewed evicted
+ * first.
+ */
+struct imv_cache;
+
+/* A summary of what the cache holds, and how useful it's been */
+struct imv_cache_stats {
+  size_t bytes;
+  size_t max_bytes;
+  /* entries with a decoded image, and how many of those are only kept
+   * because they were recently viewed */
+  size_t images;
+  size_t recent;
+  /* lookups by imv_cache_take that found a decoded image, and that didn't */
+  unsigned long hits;
+  unsigned long misses;
+};
+
+struct imv_image;
+struct imv_source;
+struct list;
+
+/* Creates an imv_cache instance, which holds at most max_bytes of decoded
+ * images */
+struct imv_cache *imv_cache_create(size_t max_bytes);
+
+/* Cleans up an imv_cache instance, and everything it holds */
+void imv_cache_free(struct imv_cache *cache);
+
+/* Change the number of bytes of decoded images the cache may hold */
+void imv_cache_set_max_bytes(struct imv_cache *cache, size_t max_bytes);
+
+/* Returns true if the cache has an entry for the given path */
+bool imv_cache_contains(struct imv_cache *cache, const char *path);
+
+/* Returns true if the cache has an entry for the given path whose image is
+ * still being decoded */
+bool imv_cache_is_loading(struct imv_cache *cache, const char *path);
+
+/* Returns true if the cache can't hold any more prefetched images. Recently
+ * viewed images don't count, they make way for prefetching as needed. */
+bool imv_cache_is_full(struct imv_cache *cache);
+
+/* Returns the number of bytes of decoded images currently held */
+size_t imv_cache_bytes(struct imv_cache *cache);
+
+/* Fill in a summary of the cache's contents and hit rate */
+void imv_cache_get_stats(struct imv_cache *cache, struct imv_cache_stats *stats);
+
+/* Adds an entry for the given path. The cache takes ownership of src and of
+ * the reference to image. image may be NULL if the source is still loading,
+ * in which case the entry is given the lowest priority of those being
+ * prefetched. src may be NULL to record that the path could not be opened.
+ * An entry added with its image is taken to be one the user has just been
+ * looking at, and becomes the most recently viewed.
+ */
+void imv_cache_insert(struct imv_cache *cache, const char *path,
+    struct imv_source *src, struct imv_image *image, int frametime);
+
+/* Removes the entry for the given path, handing ownership of its source and
+ * image to the caller. Either may be NULL, if the path failed to open or the
+ * image is still loading. Returns false if there is no entry for the path.
+ */
+bool imv_cache_take(struct imv_cache *cache, const char *path,
+    struct imv_source **src, struct imv_image **image, int *frametime);
+
+/* Stores the result of a source's load. A NULL image records that the load
+ * failed. Returns false if the source does not belong to the cache, in which
+ * case the caller retains ownership of image.
+ */
+bool imv_cache_store(struct imv_cache *cache, struct imv_source *src,
+    struct imv_image *image, int frametime);
+
+/* Marks the entries for the given list of paths as the ones being
+ * prefetched, in order of priority, first being the most important. Any other
+ * entry that's finished decoding is kept as recently viewed, and any still
+ * loading is dropped. If the cache is over budget the least recently viewed
+ * images are dropped, then the least important prefetched ones.
+ */
+void imv_cache_retain(struct imv_cache *cache, const struct list *paths);
+
+/* Drops every entry */
+void imv_cache_clear(struct imv_cache *cache);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -2,34 +2,362 @@
 
 #include "image.h"
 #include "log.h"
+#include "pixels.h"
 
+#define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
+#include <GL/glext.h>
 #include <assert.h>
 #include <cairo/cairo.h>
 #include <pango/pangocairo.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <math.h>
 
-#ifdef IMV_BACKEND_LIBRSVG
-#include <librsvg/rsvg.h>
-#endif
+/* Bitmaps are uploaded in tiles of at most this size, so that images larger
+ * than the maximum texture size can be drawn, and so only the parts of an
+ * image that are actually visible need uploading.
+ */
+#define TILE_SIZE 1024
+
+/* Tiles overlap their neighbours by this many pixels, so that filtering
+ * across the edges between tiles doesn't leave seams */
+#define TILE_BORDER 1
+
+/* Tiles are staged through a ring of pixel buffer objects, so that the
+ * driver can copy one to the GPU while the next is being filled */
+#define NUM_PBOS 4
+
+/* Enough levels for every mipmap an image can have, plus the bitmap itself */
+#define MAX_LEVELS 17
+
+/* Thumbnails are packed into a texture atlas of at most this size */
+#define ATLAS_SIZE 4096
+
+/* How many laid out strings of text to keep. The overlay and prompt tend to
+ * show the same few over and over. */
+#define NUM_LAYOUTS 8
+
+struct tile {
+  GLuint texture;
+  bool uploaded;
+  /* the size of the texture, border included */
+  int width, height;
+  /* the part of the tile, in bitmap pixels, that's changed since it was
+   * uploaded, if damaged is set */
+  bool damaged;
+  int damage_x0, damage_y0, damage_x1, damage_y1;
+};
+
+/* A place for one thumbnail in the atlas */
+struct atlas_slot {
+  /* id of the thumbnail uploaded to it, if any */
+  unsigned long id;
+  bool used;
+  /* the last batch it was drawn in, to pick the least recently used */
+  unsigned batch;
+};
+
+/* A string of text, shaped and laid out in the canvas's font */
+struct text_layout {
+  char *text;
+  PangoLayout *layout;
+  /* when it was last drawn, to pick the least recently used */
+  unsigned long used;
+};
+
+/* The tiles covering one bitmap, be it the image's bitmap or a mipmap */
+struct tile_set {
+  int cols, rows;
+  struct tile *tiles;
+};
+
+/* The tiles uploaded from one image's bitmap, and enough of its details to
+ * spot a new bitmap that happens to reuse the same address */
+struct tile_cache {
+  struct imv_bitmap *bitmap;
+  unsigned char *data;
+  int width, height;
+  /* the id of the image the bitmap belongs to, so that a frame that only
+   * changes part of it can just have that part uploaded */
+  unsigned long image_id;
+  /* tiles for the bitmap and each of its mipmaps */
+  struct tile_set levels[MAX_LEVELS];
+};
+
+/* How a texture's channels map to RGBA. The shaders swizzle them into
+ * place, so bitmaps can be uploaded as plain bytes whatever their format. */
+enum channel_order {
+  ORDER_RGBA,
+  ORDER_BGRA,
+  ORDER_GBAR,
+  ORDER_ABGR,
+  /* luminance in the first channel, expanded to opaque grey */
+  ORDER_GREY,
+};
+
+/* A corner of a triangle, in framebuffer pixels, with its texture
+ * coordinates in texels */
+struct vertex {
+  GLfloat x, y;
+  GLfloat s, t;
+  /* an enum channel_order, as the atlas mixes thumbnails of both formats */
+  GLfloat order;
+};
+
+/* An affine transform applied to vertices before they're drawn:
+ * x' = m[0] * x + m[2] * y + m[4], y' = m[1] * x + m[3] * y + m[5] */
+struct transform {
+  double m[6];
+};
+
+static const struct transform identity = {{1, 0, 0, 1, 0, 0}};
+
+enum {
+  ATTRIB_POSITION,
+  ATTRIB_TEXCOORD,
+  ATTRIB_ORDER,
+};
 
 struct imv_canvas {
   cairo_surface_t *surface;
   cairo_t *cairo;
   PangoFontDescription *font;
+  struct {
+    struct text_layout entries[NUM_LAYOUTS];
+    unsigned long clock;
+  } layouts;
   GLuint texture;
+  /* a 2x2 chequerboard, repeated to fill the background */
+  GLuint checkers;
+  /* the size texture was last allocated at, 0 if it needs reallocating */
+  int texture_width, texture_height;
   int width;
   int height;
+  /* the area drawn on since the surface was last cleared, and whether any of
+   * it has changed since it was uploaded to texture */
+  struct {
+    int x0, y0, x1, y1;
+    bool dirty;
+  } content;
+  int tile_size;
+  struct {
+    /* zero if pixel buffer objects aren't supported */
+    GLuint buffers[NUM_PBOS];
+    int next;
+  } pbo;
+  struct tile_cache cache;
+  /* a region of an image decoded in more detail is drawn over the image
+   * itself, so it has tiles of its own */
+  struct tile_cache region_cache;
+  /* when tile uploads for the frame being drawn have to stop, with any left
+   * out filled in from a coarser level, or 0 if there's no limit */
+  double deadline;
   struct {
-    struct imv_bitmap *bitmap;
     GLuint texture;
-  } cache;
+    /* the atlas is a grid of cols x rows slots, each slot_size square */
+    int slot_size;
+    int cols, rows;
+    struct atlas_slot *slots;
+    unsigned batch;
+  } atlas;
+  /* the target used for tiles, the atlas and texture */
+  GLenum target;
+  bool gles;
+  /* whether single channel GL_RED textures are available, rather than the
+   * legacy GL_LUMINANCE */
+  bool red_textures;
+  struct {
+    /* zero if the fixed function pipeline is drawn with instead */
+    GLuint program;
+    GLint transform, texture_size;
+    /* the vertex array is only needed, and only created, for GL 3 and up */
+    GLuint vao, vbo;
+  } shader;
 };
 
+/* Find the context's version, noting whether it's OpenGL ES */
+static void get_version(bool *gles, int *major, int *minor)
+{
+  const char *version = (const char *)glGetString(GL_VERSION);
+  const char *prefix = "OpenGL ES ";
+  *major = *minor = 0;
+  *gles = version && !strncmp(version, prefix, strlen(prefix));
+  if (version) {
+    sscanf(*gles ? version + strlen(prefix) : version, "%d.%d", major, minor);
+  }
+}
+
+/* Pixel buffer objects are core from OpenGL 2.1 and OpenGL ES 3.0 */
+static bool supports_pbo(void)
+{
+  bool gles;
+  int major, minor;
+  get_version(&gles, &major, &minor);
+  if (gles ? major >= 3 : major > 2 || (major == 2 && minor >= 1)) {
+    return true;
+  } else if (gles) {
+    return false;
+  }
+
+  const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+  return extensions && strstr(extensions, "GL_ARB_pixel_buffer_object");
+}
+
+static const char *legacy_defines =
+  "#define ATTRIBUTE attribute\n"
+  "#define VARYING varying\n"
+  "#define TEXTURE texture2D\n"
+  "#define FRAG_COLOR gl_FragColor\n";
+
+static const char *vertex_defines =
+  "#define ATTRIBUTE in\n"
+  "#define VARYING out\n";
+
+static const char *fragment_defines =
+  "#define VARYING in\n"
+  "#define TEXTURE texture\n"
+  "out vec4 frag_color;\n"
+  "#define FRAG_COLOR frag_color\n";
+
+static const char *vertex_source =
+  "uniform mat3 u_transform;\n"
+  "uniform vec2 u_texture_size;\n"
+  "ATTRIBUTE vec2 a_position;\n"
+  "ATTRIBUTE vec2 a_texcoord;\n"
+  "ATTRIBUTE float a_order;\n"
+  "VARYING vec2 v_texcoord;\n"
+  "VARYING float v_order;\n"
+  "void main()\n"
+  "{\n"
+  "  v_texcoord = a_texcoord / u_texture_size;\n"
+  "  v_order = a_order;\n"
+  "  gl_Position = vec4((u_transform * vec3(a_position, 1.0)).xy, 0.0, 1.0);\n"
+  "}\n";
+
+static const char *fragment_source =
+  "uniform sampler2D u_texture;\n"
+  "VARYING vec2 v_texcoord;\n"
+  "VARYING float v_order;\n"
+  "void main()\n"
+  "{\n"
+  "  vec4 color = TEXTURE(u_texture, v_texcoord);\n"
+  "  if (v_order < 0.5) {\n"
+  "    FRAG_COLOR = color;\n"
+  "  } else if (v_order < 1.5) {\n"
+  "    FRAG_COLOR = color.bgra;\n"
+  "  } else if (v_order < 2.5) {\n"
+  "    FRAG_COLOR = color.gbar;\n"
+  "  } else if (v_order < 3.5) {\n"
+  "    FRAG_COLOR = color.abgr;\n"
+  "  } else {\n"
+  "    FRAG_COLOR = vec4(color.rrr, 1.0);\n"
+  "  }\n"
+  "}\n";
+
+static GLuint compile_shader(GLenum type, const char *version,
+                             const char *defines, const char *source)
+{
+  GLuint shader = glCreateShader(type);
+  const char *sources[] = {version, defines, source};
+  glShaderSource(shader, 3, sources, NULL);
+  glCompileShader(shader);
+
+  GLint compiled = GL_FALSE;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+  if (!compiled) {
+    char info[1024] = "";
+    glGetShaderInfoLog(shader, sizeof info, NULL, info);
+    imv_log(IMV_WARNING, "canvas: failed to compile shader: %s\n", info);
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+/* Set up the shader based renderer, if the context is new enough for it.
+ * Core profiles and OpenGL ES don't have the fixed function pipeline at all,
+ * and elsewhere the shaders save the driver emulating it. */
+static void create_program(struct imv_canvas *canvas)
+{
+  int major, minor;
+  get_version(&canvas->gles, &major, &minor);
+
+  const char *version;
+  bool modern = true;
+  if (canvas->gles) {
+    if (major < 3) {
+      return;
+    }
+    version = "#version 300 es\nprecision highp float;\n";
+  } else if (major > 3 || (major == 3 && minor >= 2)) {
+    version = "#version 150\n";
+  } else if (major == 3) {
+    version = "#version 130\n";
+  } else if (major == 2 && minor >= 1) {
+    version = "#version 120\n";
+    modern = false;
+  } else {
+    return;
+  }
+
+  GLuint vertex = compile_shader(GL_VERTEX_SHADER, version,
+      modern ? vertex_defines : legacy_defines, vertex_source);
+  GLuint fragment = compile_shader(GL_FRAGMENT_SHADER, version,
+      modern ? fragment_defines : legacy_defines, fragment_source);
+  if (!vertex || !fragment) {
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+    return;
+  }
+
+  GLuint program = glCreateProgram();
+  glAttachShader(program, vertex);
+  glAttachShader(program, fragment);
+  glBindAttribLocation(program, ATTRIB_POSITION, "a_position");
+  glBindAttribLocation(program, ATTRIB_TEXCOORD, "a_texcoord");
+  glBindAttribLocation(program, ATTRIB_ORDER, "a_order");
+  glLinkProgram(program);
+  glDeleteShader(vertex);
+  glDeleteShader(fragment);
+
+  GLint linked = GL_FALSE;
+  glGetProgramiv(program, GL_LINK_STATUS, &linked);
+  if (!linked) {
+    char info[1024] = "";
+    glGetProgramInfoLog(program, sizeof info, NULL, info);
+    imv_log(IMV_WARNING, "canvas: failed to link shaders: %s\n", info);
+    glDeleteProgram(program);
+    return;
+  }
+
+  canvas->shader.program = program;
+  canvas->shader.transform = glGetUniformLocation(program, "u_transform");
+  canvas->shader.texture_size = glGetUniformLocation(program, "u_texture_size");
+  glUseProgram(program);
+  glUniform1i(glGetUniformLocation(program, "u_texture"), 0);
+  glUseProgram(0);
+
+  glGenBuffers(1, &canvas->shader.vbo);
+  if (major >= 3) {
+    glGenVertexArrays(1, &canvas->shader.vao);
+    canvas->red_textures = true;
+  }
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 struct imv_canvas *imv_canvas_create(int width, int height)
 {
   struct imv_canvas *canvas = calloc(1, sizeof *canvas);
@@ -45,17 +373,71 @@ struct imv_canvas *imv_canvas_create(int width, int height)
   glGenTextures(1, &canvas->texture);
   assert(canvas->texture);
 
+  /* Shaders sample from ordinary textures, which are only limited to powers
+   * of two on hardware too old to run them */
+  create_program(canvas);
+  canvas->target = canvas->shader.program ? GL_TEXTURE_2D : GL_TEXTURE_RECTANGLE;
+
+  GLint max_size = 0;
+  glGetIntegerv(canvas->shader.program
+      ? GL_MAX_TEXTURE_SIZE : GL_MAX_RECTANGLE_TEXTURE_SIZE, &max_size);
+  canvas->tile_size = TILE_SIZE;
+  if (max_size > 2 * TILE_BORDER && max_size - 2 * TILE_BORDER < TILE_SIZE) {
+    canvas->tile_size = max_size - 2 * TILE_BORDER;
+  }
+
+  if (supports_pbo()) {
+    glGenBuffers(NUM_PBOS, canvas->pbo.buffers);
+  }
+
+  /* Rows of greyscale pixels needn't be a multiple of four bytes long */
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
   canvas->width = width;
   canvas->height = height;
 
   return canvas;
 }
 
+static void free_tile_set(struct tile_set *set)
+{
+  for (int i = 0; i < set->cols * set->rows; ++i) {
+    if (set->tiles[i].texture) {
+      glDeleteTextures(1, &set->tiles[i].texture);
+    }
+  }
+  free(set->tiles);
+  set->tiles = NULL;
+  set->cols = set->rows = 0;
+}
+
+static void free_tiles(struct tile_cache *cache)
+{
+  for (int i = 0; i < MAX_LEVELS; ++i) {
+    free_tile_set(&cache->levels[i]);
+  }
+  cache->bitmap = NULL;
+  cache->image_id = 0;
+}
+
+static void free_layouts(struct imv_canvas *canvas)
+{
+  for (int i = 0; i < NUM_LAYOUTS; ++i) {
+    struct text_layout *entry = &canvas->layouts.entries[i];
+    if (entry->layout) {
+      g_object_unref(entry->layout);
+    }
+    free(entry->text);
+    memset(entry, 0, sizeof *entry);
+  }
+}
+
 void imv_canvas_free(struct imv_canvas *canvas)
 {
   if (!canvas) {
     return;
   }
+  free_layouts(canvas);
   pango_font_description_free(canvas->font);
   canvas->font = NULL;
   cairo_destroy(canvas->cairo);
@@ -63,12 +445,138 @@ void imv_canvas_free(struct imv_canvas *canvas)
   cairo_surface_destroy(canvas->surface);
   canvas->surface = NULL;
   glDeleteTextures(1, &canvas->texture);
-  if (canvas->cache.texture) {
-    glDeleteTextures(1, &canvas->cache.texture);
+  if (canvas->checkers) {
+    glDeleteTextures(1, &canvas->checkers);
+  }
+  free_tiles(&canvas->cache);
+  free_tiles(&canvas->region_cache);
+  if (canvas->atlas.texture) {
+    glDeleteTextures(1, &canvas->atlas.texture);
+  }
+  free(canvas->atlas.slots);
+  if (canvas->pbo.buffers[0]) {
+    glDeleteBuffers(NUM_PBOS, canvas->pbo.buffers);
+  }
+  if (canvas->shader.program) {
+    glDeleteProgram(canvas->shader.program);
+    glDeleteBuffers(1, &canvas->shader.vbo);
+  }
+  if (canvas->shader.vao) {
+    glDeleteVertexArrays(1, &canvas->shader.vao);
   }
   free(canvas);
 }
 
+/* Write the two triangles covering a rectangle, and the part of the texture
+ * drawn on it */
+static void add_rectangle(struct vertex *v, double l, double t, double r, double b,
+                          double sl, double st, double sr, double sb,
+                          enum channel_order order)
+{
+  const struct vertex corners[4] = {
+    {l, t, sl, st, order},
+    {r, t, sr, st, order},
+    {r, b, sr, sb, order},
+    {l, b, sl, sb, order},
+  };
+  v[0] = corners[0];
+  v[1] = corners[1];
+  v[2] = corners[2];
+  v[3] = corners[0];
+  v[4] = corners[2];
+  v[5] = corners[3];
+}
+
+/* Draw triangles textured from texture, to a framebuffer of the given size.
+ * The texture's filtering is left to the caller. */
+static void draw_triangles(struct imv_canvas *canvas, GLenum target,
+                           GLuint texture, int texture_width, int texture_height,
+                           int width, int height, const struct transform *transform,
+                           const struct vertex *vertices, size_t count, bool blend)
+{
+  const double *m = transform->m;
+
+  if (blend) {
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  }
+
+  if (!canvas->shader.program) {
+    const GLdouble matrix[16] = {
+      m[0], m[1], 0, 0,
+      m[2], m[3], 0, 0,
+      0,    0,    1, 0,
+      m[4], m[5], 0, 1,
+    };
+    glPushMatrix();
+    glOrtho(0.0, width, height, 0.0, 0.0, 10.0);
+    glMultMatrixd(matrix);
+
+    glEnable(target);
+    glBindTexture(target, texture);
+
+    /* Rectangle textures are addressed in texels, the rest are normalised */
+    const double ds = target == GL_TEXTURE_RECTANGLE ? 1.0 : 1.0 / texture_width;
+    const double dt = target == GL_TEXTURE_RECTANGLE ? 1.0 : 1.0 / texture_height;
+    glBegin(GL_TRIANGLES);
+    for (size_t i = 0; i < count; ++i) {
+      glTexCoord2d(vertices[i].s * ds, vertices[i].t * dt);
+      glVertex2f(vertices[i].x, vertices[i].y);
+    }
+    glEnd();
+
+    glBindTexture(target, 0);
+    glDisable(target);
+    glPopMatrix();
+  } else {
+    /* Fold the projection from pixels, with y down, to clip space into the
+     * transform */
+    const double sx = 2.0 / width;
+    const double sy = -2.0 / height;
+    const GLfloat matrix[9] = {
+      sx * m[0],       sy * m[1],       0,
+      sx * m[2],       sy * m[3],       0,
+      sx * m[4] - 1.0, sy * m[5] + 1.0, 1,
+    };
+
+    glUseProgram(canvas->shader.program);
+    glUniformMatrix3fv(canvas->shader.transform, 1, GL_FALSE, matrix);
+    glUniform2f(canvas->shader.texture_size, texture_width, texture_height);
+    glBindTexture(GL_TEXTURE_2D, texture);
+
+    if (canvas->shader.vao) {
+      glBindVertexArray(canvas->shader.vao);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, canvas->shader.vbo);
+    glBufferData(GL_ARRAY_BUFFER, count * sizeof *vertices, vertices, GL_STREAM_DRAW);
+    glVertexAttribPointer(ATTRIB_POSITION, 2, GL_FLOAT, GL_FALSE, sizeof *vertices,
+        (void *)offsetof(struct vertex, x));
+    glVertexAttribPointer(ATTRIB_TEXCOORD, 2, GL_FLOAT, GL_FALSE, sizeof *vertices,
+        (void *)offsetof(struct vertex, s));
+    glVertexAttribPointer(ATTRIB_ORDER, 1, GL_FLOAT, GL_FALSE, sizeof *vertices,
+        (void *)offsetof(struct vertex, order));
+    glEnableVertexAttribArray(ATTRIB_POSITION);
+    glEnableVertexAttribArray(ATTRIB_TEXCOORD);
+    glEnableVertexAttribArray(ATTRIB_ORDER);
+
+    glDrawArrays(GL_TRIANGLES, 0, count);
+
+    glDisableVertexAttribArray(ATTRIB_POSITION);
+    glDisableVertexAttribArray(ATTRIB_TEXCOORD);
+    glDisableVertexAttribArray(ATTRIB_ORDER);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if (canvas->shader.vao) {
+      glBindVertexArray(0);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glUseProgram(0);
+  }
+
+  if (blend) {
+    glDisable(GL_BLEND);
+  }
+}
+
 void imv_canvas_resize(struct imv_canvas *canvas, int width, int height)
 {
   cairo_destroy(canvas->cairo);
@@ -76,6 +584,9 @@ void imv_canvas_resize(struct imv_canvas *canvas, int width, int height)
 
   canvas->width = width;
   canvas->height = height;
+  canvas->texture_width = 0;
+  canvas->texture_height = 0;
+  memset(&canvas->content, 0, sizeof canvas->content);
 
   canvas->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
                                                canvas->width, canvas->height);
@@ -84,13 +595,44 @@ void imv_canvas_resize(struct imv_canvas *canvas, int width, int height)
   assert(canvas->cairo);
 }
 
+/* Grow the content area to cover a rectangle that's been drawn on */
+static void add_content(struct imv_canvas *canvas, int x, int y, int width, int height)
+{
+  int x0 = x < 0 ? 0 : x;
+  int y0 = y < 0 ? 0 : y;
+  int x1 = x + width > canvas->width ? canvas->width : x + width;
+  int y1 = y + height > canvas->height ? canvas->height : y + height;
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+
+  if (canvas->content.x0 < canvas->content.x1) {
+    x0 = x0 < canvas->content.x0 ? x0 : canvas->content.x0;
+    y0 = y0 < canvas->content.y0 ? y0 : canvas->content.y0;
+    x1 = x1 > canvas->content.x1 ? x1 : canvas->content.x1;
+    y1 = y1 > canvas->content.y1 ? y1 : canvas->content.y1;
+  }
+  canvas->content.x0 = x0;
+  canvas->content.y0 = y0;
+  canvas->content.x1 = x1;
+  canvas->content.y1 = y1;
+  canvas->content.dirty = true;
+}
+
 void imv_canvas_clear(struct imv_canvas *canvas)
 {
-  cairo_save(canvas->cairo);
-  cairo_set_source_rgba(canvas->cairo, 0, 0, 0, 0);
-  cairo_set_operator(canvas->cairo, CAIRO_OPERATOR_SOURCE);
-  cairo_paint(canvas->cairo);
-  cairo_restore(canvas->cairo);
+  /* Only what was drawn on needs wiping */
+  if (canvas->content.x0 < canvas->content.x1) {
+    cairo_save(canvas->cairo);
+    cairo_set_source_rgba(canvas->cairo, 0, 0, 0, 0);
+    cairo_set_operator(canvas->cairo, CAIRO_OPERATOR_SOURCE);
+    cairo_rectangle(canvas->cairo, canvas->content.x0, canvas->content.y0,
+        canvas->content.x1 - canvas->content.x0,
+        canvas->content.y1 - canvas->content.y0);
+    cairo_fill(canvas->cairo);
+    cairo_restore(canvas->cairo);
+  }
+  memset(&canvas->content, 0, sizeof canvas->content);
 }
 
 void imv_canvas_color(struct imv_canvas *canvas, float r, float g, float b, float a)
@@ -102,33 +644,87 @@ void imv_canvas_fill_rectangle(struct imv_canvas *canvas, int x, int y, int widt
 {
   cairo_rectangle(canvas->cairo, x, y, width, height);
   cairo_fill(canvas->cairo);
+  add_content(canvas, x, y, width, height);
 }
 
 void imv_canvas_fill(struct imv_canvas *canvas)
 {
   cairo_rectangle(canvas->cairo, 0, 0, canvas->width, canvas->height);
   cairo_fill(canvas->cairo);
+  add_content(canvas, 0, 0, canvas->width, canvas->height);
 }
 
-void imv_canvas_fill_checkers(struct imv_canvas *canvas, int size)
+void imv_canvas_draw_checkers(struct imv_canvas *canvas, int size)
 {
-  for (int x = 0; x < canvas->width; x += size) {
-    for (int y = 0; y < canvas->height; y += size) {
-      float color = ((x/size + y/size) % 2 == 0) ? 0.25 : 0.75;
-      cairo_set_source_rgba(canvas->cairo, color, color, color, 1);
-      cairo_rectangle(canvas->cairo, x, y, size, size);
-      cairo_fill(canvas->cairo);
-    }
+  if (!canvas->checkers) {
+    /* One texel per square, dark in the top left like the rest */
+    static const unsigned char pattern[] = {
+       64,  64,  64, 255,   191, 191, 191, 255,
+      191, 191, 191, 255,    64,  64,  64, 255,
+    };
+    glGenTextures(1, &canvas->checkers);
+    glBindTexture(GL_TEXTURE_2D, canvas->checkers);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 2, 2, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, pattern);
   }
+
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+
+  /* Each texel covers one square, repeating across the viewport */
+  struct vertex vertices[6];
+  add_rectangle(vertices, 0, 0, viewport[2], viewport[3],
+      0, 0, viewport[2] / (double)size, viewport[3] / (double)size, ORDER_RGBA);
+  draw_triangles(canvas, GL_TEXTURE_2D, canvas->checkers, 2, 2,
+      viewport[2], viewport[3], &identity, vertices, 6, false);
 }
 
 void imv_canvas_font(struct imv_canvas *canvas, const char *name, int size)
 {
+  /* Anything laid out in the old font is no use now */
+  free_layouts(canvas);
   pango_font_description_set_family(canvas->font, name);
   pango_font_description_set_weight(canvas->font, PANGO_WEIGHT_NORMAL);
   pango_font_description_set_absolute_size(canvas->font, size * PANGO_SCALE);
 }
 
+/* Find text's layout, laying it out if it isn't in the cache already */
+static PangoLayout *get_layout(struct imv_canvas *canvas, const char *text)
+{
+  struct text_layout *oldest = &canvas->layouts.entries[0];
+  for (int i = 0; i < NUM_LAYOUTS; ++i) {
+    struct text_layout *entry = &canvas->layouts.entries[i];
+    if (entry->text && !strcmp(entry->text, text)) {
+      entry->used = ++canvas->layouts.clock;
+      /* The cairo context may have been replaced since */
+      pango_cairo_update_layout(canvas->cairo, entry->layout);
+      return entry->layout;
+    }
+    if (entry->used < oldest->used) {
+      oldest = entry;
+    }
+  }
+
+  if (oldest->layout) {
+    g_object_unref(oldest->layout);
+  }
+  free(oldest->text);
+
+  oldest->text = strdup(text);
+  oldest->layout = pango_cairo_create_layout(canvas->cairo);
+  pango_layout_set_font_description(oldest->layout, canvas->font);
+  pango_layout_set_text(oldest->layout, text, -1);
+  oldest->used = ++canvas->layouts.clock;
+  return oldest->layout;
+}
+
 int imv_canvas_printf(struct imv_canvas *canvas, int x, int y, const char *fmt, ...)
 {
   char line[1024];
@@ -136,92 +732,434 @@ int imv_canvas_printf(struct imv_canvas *canvas, int x, int y, const char *fmt,
   va_start(args, fmt);
   vsnprintf(line, sizeof line, fmt, args);
 
-  PangoLayout *layout = pango_cairo_create_layout(canvas->cairo);
-  pango_layout_set_font_description(layout, canvas->font);
-  pango_layout_set_text(layout, line, -1);
+  PangoLayout *layout = get_layout(canvas, line);
 
   cairo_move_to(canvas->cairo, x, y);
   pango_cairo_show_layout(canvas->cairo, layout);
 
-  PangoRectangle extents;
-  pango_layout_get_pixel_extents(layout, NULL, &extents);
-
-  g_object_unref(layout);
+  PangoRectangle ink, extents;
+  pango_layout_get_pixel_extents(layout, &ink, &extents);
+  add_content(canvas, x + ink.x, y + ink.y, ink.width, ink.height);
 
   va_end(args);
   return extents.width;
 }
 
+static int convert_pixelformat(enum imv_pixelformat fmt)
+{
+  /* opengl uses RGBA order, not ARGB, so we get it to
+   * flip the bytes around so ARGB -> BGRA
+   */
+  if (fmt == IMV_ARGB) {
+    return GL_BGRA;
+  } else if (fmt == IMV_ABGR) {
+    return GL_RGBA;
+  } else {
+    imv_log(IMV_WARNING, "Unknown pixel format. Defaulting to ARGB\n");
+    return GL_BGRA;
+  }
+}
+
+/* Work out how pixels of the given format are uploaded, and so how the
+ * texture's channels are ordered */
+static void pixel_transfer(const struct imv_canvas *canvas,
+                           enum imv_pixelformat fmt, GLint *internal,
+                           GLenum *format, GLenum *type,
+                           enum channel_order *order)
+{
+  *internal = GL_RGBA8;
+
+  /* Greyscale is uploaded as is, a quarter the size of the RGBA it
+   * represents. Luminance textures expand themselves, red ones are expanded
+   * by the shader. */
+  if (fmt == IMV_GREY) {
+    *internal = canvas->red_textures ? GL_R8 : GL_LUMINANCE8;
+    *format = canvas->red_textures ? GL_RED : GL_LUMINANCE;
+    *type = GL_UNSIGNED_BYTE;
+    *order = canvas->shader.program ? ORDER_GREY : ORDER_RGBA;
+    return;
+  }
+
+  if (!canvas->shader.program) {
+    *format = convert_pixelformat(fmt);
+    *type = GL_UNSIGNED_INT_8_8_8_8_REV;
+    *order = ORDER_RGBA;
+    return;
+  }
+
+  /* OpenGL ES can't unpack 32 bit pixels, so they're uploaded as bytes, in
+   * whatever order they happen to be in memory */
+  if (fmt != IMV_ARGB && fmt != IMV_ABGR) {
+    imv_log(IMV_WARNING, "Unknown pixel format. Defaulting to ARGB\n");
+    fmt = IMV_ARGB;
+  }
+  const uint32_t probe = 1;
+  const bool little_endian = *(const unsigned char *)&probe == 1;
+  *format = GL_RGBA;
+  *type = GL_UNSIGNED_BYTE;
+  if (little_endian) {
+    *order = fmt == IMV_ARGB ? ORDER_BGRA : ORDER_RGBA;
+  } else {
+    *order = fmt == IMV_ARGB ? ORDER_GBAR : ORDER_ABGR;
+  }
+}
+
 void imv_canvas_draw(struct imv_canvas *canvas)
 {
-  GLint viewport[4];
-  glGetIntegerv(GL_VIEWPORT, viewport);
-  glPushMatrix();
-  glOrtho(0.0, 1.0, 1.0, 0.0, 0.0, 10.0);
+  const int x0 = canvas->content.x0;
+  const int y0 = canvas->content.y0;
+  const int x1 = canvas->content.x1;
+  const int y1 = canvas->content.y1;
+  if (x0 >= x1 || y0 >= y1) {
+    /* Nothing's been drawn */
+    return;
+  }
 
-  void *data = cairo_image_surface_get_data(canvas->surface);
+  /* Cairo's ARGB32 is the same as an ARGB bitmap */
+  GLint internal;
+  GLenum format, type;
+  enum channel_order order;
+  pixel_transfer(canvas, IMV_ARGB, &internal, &format, &type, &order);
 
-  glEnable(GL_TEXTURE_RECTANGLE);
-  glBindTexture(GL_TEXTURE_RECTANGLE, canvas->texture);
+  glBindTexture(canvas->target, canvas->texture);
 
-  glPixelStorei(GL_UNPACK_ROW_LENGTH, canvas->width);
-  glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
-  glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
-  glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA8, canvas->width, canvas->height,
-               0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, data);
+  if (canvas->texture_width != canvas->width
+      || canvas->texture_height != canvas->height) {
+    glTexImage2D(canvas->target, 0, internal, canvas->width, canvas->height,
+                 0, format, type, NULL);
+    glTexParameteri(canvas->target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(canvas->target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(canvas->target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(canvas->target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    canvas->texture_width = canvas->width;
+    canvas->texture_height = canvas->height;
+    canvas->content.dirty = true;
+  }
 
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-  glBegin(GL_TRIANGLE_FAN);
-  glTexCoord2i(0,             0);              glVertex2i(0.0, 0.0);
-  glTexCoord2i(canvas->width, 0);              glVertex2i(1.0, 0.0);
-  glTexCoord2i(canvas->width, canvas->height); glVertex2i(1.0, 1.0);
-  glTexCoord2i(0,             canvas->height); glVertex2i(0.0, 1.0);
-  glEnd();
-  glDisable(GL_BLEND);
+  /* Only the part that's been drawn on is uploaded, and only if it's changed
+   * since last time */
+  if (canvas->content.dirty) {
+    cairo_surface_flush(canvas->surface);
+    void *data = cairo_image_surface_get_data(canvas->surface);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, canvas->width);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, y0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, x0);
+    glTexSubImage2D(canvas->target, 0, x0, y0, x1 - x0, y1 - y0,
+                    format, type, data);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+    canvas->content.dirty = false;
+  }
 
-  glBindTexture(GL_TEXTURE_RECTANGLE, 0);
-  glDisable(GL_TEXTURE_RECTANGLE);
-  glPopMatrix();
+  struct vertex vertices[6];
+  add_rectangle(vertices, x0, y0, x1, y1, x0, y0, x1, y1, order);
+  draw_triangles(canvas, canvas->target, canvas->texture,
+      canvas->width, canvas->height, canvas->width, canvas->height,
+      &identity, vertices, 6, true);
 }
 
 struct imv_bitmap *imv_image_get_bitmap(const struct imv_image *image);
+struct imv_bitmap *imv_image_get_mipmap(const struct imv_image *image, int level);
+bool imv_image_get_damage(const struct imv_image *image, unsigned long base,
+    int *x, int *y, int *width, int *height);
 
-static int convert_pixelformat(enum imv_pixelformat fmt)
+/* Find the area of the bitmap a tile's texture holds, its border included.
+ * The border only exists where there's a neighbouring tile. */
+static void tile_bounds(const struct imv_canvas *canvas,
+                        const struct imv_bitmap *bitmap, int col, int row,
+                        int *x0, int *y0, int *x1, int *y1)
 {
-  /* opengl uses RGBA order, not ARGB, so we get it to
-   * flip the bytes around so ARGB -> BGRA
-   */
-  if (fmt == IMV_ARGB) {
-    return GL_BGRA;
-  } else if (fmt == IMV_ABGR) {
-    return GL_RGBA;
+  const int size = canvas->tile_size;
+  *x0 = col * size;
+  *y0 = row * size;
+  *x1 = *x0 + size < bitmap->width ? *x0 + size : bitmap->width;
+  *y1 = *y0 + size < bitmap->height ? *y0 + size : bitmap->height;
+  *x0 -= *x0 > 0 ? TILE_BORDER : 0;
+  *y0 -= *y0 > 0 ? TILE_BORDER : 0;
+  *x1 += *x1 < bitmap->width ? TILE_BORDER : 0;
+  *y1 += *y1 < bitmap->height ? TILE_BORDER : 0;
+}
+
+/* Mark the parts of the uploaded tiles within a rectangle of the bitmap as
+ * needing to be uploaded again */
+static void damage_tiles(struct imv_canvas *canvas, struct tile_cache *cache,
+                         struct imv_bitmap *bitmap,
+                         int x0, int y0, int x1, int y1)
+{
+  struct tile_set *set = &cache->levels[0];
+  for (int row = 0; row < set->rows; ++row) {
+    for (int col = 0; col < set->cols; ++col) {
+      struct tile *tile = &set->tiles[row * set->cols + col];
+      int tx0, ty0, tx1, ty1;
+      tile_bounds(canvas, bitmap, col, row, &tx0, &ty0, &tx1, &ty1);
+      tx0 = x0 > tx0 ? x0 : tx0;
+      ty0 = y0 > ty0 ? y0 : ty0;
+      tx1 = x1 < tx1 ? x1 : tx1;
+      ty1 = y1 < ty1 ? y1 : ty1;
+      if (!tile->uploaded || tx0 >= tx1 || ty0 >= ty1) {
+        continue;
+      }
+      if (tile->damaged) {
+        tx0 = tile->damage_x0 < tx0 ? tile->damage_x0 : tx0;
+        ty0 = tile->damage_y0 < ty0 ? tile->damage_y0 : ty0;
+        tx1 = tile->damage_x1 > tx1 ? tile->damage_x1 : tx1;
+        ty1 = tile->damage_y1 > ty1 ? tile->damage_y1 : ty1;
+      }
+      tile->damaged = true;
+      tile->damage_x0 = tx0;
+      tile->damage_y0 = ty0;
+      tile->damage_x1 = tx1;
+      tile->damage_y1 = ty1;
+    }
+  }
+}
+
+/* Check whether the tiles were made from the given image bitmap, and if not
+ * mark every tile as needing an upload, or just the parts that differ if it's
+ * a frame that only changes part of the one before */
+static void prepare_tiles(struct imv_canvas *canvas, struct tile_cache *cache,
+                          struct imv_image *image, struct imv_bitmap *bitmap,
+                          bool cache_invalidated)
+{
+  const bool same_bitmap = cache->bitmap == bitmap
+    && cache->data == bitmap->data
+    && cache->width == bitmap->width
+    && cache->height == bitmap->height;
+
+  if (same_bitmap && !cache_invalidated) {
+    return;
+  }
+
+  int x, y, w, h;
+  const bool partial = !cache_invalidated && cache->bitmap
+    && cache->width == bitmap->width
+    && cache->height == bitmap->height
+    && bitmap == imv_image_get_bitmap(image)
+    && imv_image_get_damage(image, cache->image_id, &x, &y, &w, &h);
+
+  /* The textures are kept, as the next image is often the same size */
+  for (int i = partial ? 1 : 0; i < MAX_LEVELS; ++i) {
+    struct tile_set *set = &cache->levels[i];
+    for (int j = 0; j < set->cols * set->rows; ++j) {
+      set->tiles[j].uploaded = false;
+      set->tiles[j].damaged = false;
+    }
+  }
+  if (partial) {
+    damage_tiles(canvas, cache, bitmap, x, y, x + w, y + h);
+  }
+
+  cache->bitmap = bitmap;
+  cache->data = bitmap->data;
+  cache->width = bitmap->width;
+  cache->height = bitmap->height;
+  cache->image_id = imv_image_id(image);
+}
+
+/* Get the tiles for a level, making sure the grid matches its bitmap */
+static struct tile_set *get_tile_set(struct imv_canvas *canvas,
+                                     struct tile_cache *cache, int level,
+                                     struct imv_bitmap *bitmap)
+{
+  struct tile_set *set = &cache->levels[level];
+  const int cols = (bitmap->width + canvas->tile_size - 1) / canvas->tile_size;
+  const int rows = (bitmap->height + canvas->tile_size - 1) / canvas->tile_size;
+
+  if (cols != set->cols || rows != set->rows) {
+    free_tile_set(set);
+    set->tiles = calloc((size_t)cols * rows, sizeof *set->tiles);
+    set->cols = cols;
+    set->rows = rows;
+  }
+  return set;
+}
+
+/* Find the region of the bitmap, in bitmap pixels, that's visible in the
+ * viewport. The viewport's corners are taken back through the image's
+ * transform, and the bounding box of the result is used. */
+static void visible_region(const GLint viewport[4], struct imv_bitmap *bitmap,
+                           double left, double top, double pixel_scale,
+                           double center_x, double center_y,
+                           double rotation, bool mirrored,
+                           int *x0, int *y0, int *x1, int *y1)
+{
+  const double corners[4][2] = {
+    {0, 0}, {viewport[2], 0}, {viewport[2], viewport[3]}, {0, viewport[3]},
+  };
+  const double theta = -rotation * M_PI / 180.0;
+  const double c = cos(theta);
+  const double s = sin(theta);
+
+  double min_x = INFINITY, min_y = INFINITY;
+  double max_x = -INFINITY, max_y = -INFINITY;
+  for (int i = 0; i < 4; ++i) {
+    const double dx = (corners[i][0] - center_x) * (mirrored ? -1 : 1);
+    const double dy = corners[i][1] - center_y;
+    const double x = dx * c - dy * s;
+    const double y = dx * s + dy * c;
+    const double bx = (x + center_x - left) / pixel_scale;
+    const double by = (y + center_y - top) / pixel_scale;
+    min_x = bx < min_x ? bx : min_x;
+    min_y = by < min_y ? by : min_y;
+    max_x = bx > max_x ? bx : max_x;
+    max_y = by > max_y ? by : max_y;
+  }
+
+  *x0 = min_x < 0 ? 0 : (int)floor(min_x);
+  *y0 = min_y < 0 ? 0 : (int)floor(min_y);
+  *x1 = max_x > bitmap->width ? bitmap->width : (int)ceil(max_x);
+  *y1 = max_y > bitmap->height ? bitmap->height : (int)ceil(max_y);
+}
+
+/* Copy a tile's pixels into the next pixel buffer object, returning false
+ * if that's not possible. The texture upload can then be sourced from the
+ * buffer, which lets the driver return straight away and copy to the GPU in
+ * the background, instead of stalling until the transfer is complete. */
+static bool stage_tile(struct imv_canvas *canvas, struct imv_bitmap *bitmap,
+                       int x, int y, int w, int h)
+{
+  if (!canvas->pbo.buffers[0]) {
+    return false;
+  }
+
+  const size_t bpp = imv_bitmap_bytes_per_pixel(bitmap->format);
+  const size_t row_bytes = bpp * w;
+  const size_t size = row_bytes * h;
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, canvas->pbo.buffers[canvas->pbo.next]);
+  canvas->pbo.next = (canvas->pbo.next + 1) % NUM_PBOS;
+
+  /* Respecifying the storage orphans any transfer still using the old one,
+   * rather than waiting for it */
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+  unsigned char *dst = canvas->gles
+    ? glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT)
+    : glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+  if (!dst) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return false;
+  }
+
+  const unsigned char *src = bitmap->data + bpp * ((size_t)y * bitmap->width + x);
+  imv_pixels_copy_rows(dst, row_bytes, src, bpp * bitmap->width, row_bytes, h);
+
+  if (!glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER)) {
+    /* The buffer's contents were lost, so fall back to a direct upload */
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return false;
+  }
+  return true;
+}
+
+static void upload_tile(struct imv_canvas *canvas, struct imv_bitmap *bitmap,
+                        struct tile *tile, int x, int y, int w, int h)
+{
+  if (!tile->texture) {
+    glGenTextures(1, &tile->texture);
+  }
+  glBindTexture(canvas->target, tile->texture);
+
+  GLint internal;
+  GLenum format, type;
+  enum channel_order order;
+  pixel_transfer(canvas, bitmap->format, &internal, &format, &type, &order);
+
+  if (stage_tile(canvas, bitmap, x, y, w, h)) {
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+    glTexImage2D(canvas->target, 0, internal, w, h, 0, format, type, NULL);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
   } else {
-    imv_log(IMV_WARNING, "Unknown pixel format. Defaulting to ARGB\n");
-    return GL_BGRA;
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, bitmap->width);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, y);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, x);
+    glTexImage2D(canvas->target, 0, internal, w, h, 0, format, type, bitmap->data);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
   }
+
+  glTexParameteri(canvas->target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(canvas->target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  tile->uploaded = true;
+  tile->damaged = false;
+  tile->width = w;
+  tile->height = h;
 }
 
-static void draw_bitmap(struct imv_canvas *canvas,
-                        struct imv_bitmap *bitmap,
-                        int bx, int by, double scale,
-                        double rotation, bool mirrored,
-                        enum upscaling_method upscaling_method,
-                        bool cache_invalidated)
+/* Upload the damaged part of a tile that's already bound. x and y are where
+ * its texture starts in the bitmap. */
+static void update_tile(struct imv_canvas *canvas, struct imv_bitmap *bitmap,
+                        struct tile *tile, int x, int y)
 {
-  GLint viewport[4];
-  glGetIntegerv(GL_VIEWPORT, viewport);
+  const int x0 = tile->damage_x0;
+  const int y0 = tile->damage_y0;
+  const int w = tile->damage_x1 - x0;
+  const int h = tile->damage_y1 - y0;
+  tile->damaged = false;
 
-  glPushMatrix();
-  glOrtho(0.0, viewport[2], viewport[3], 0.0, 0.0, 10.0);
+  GLint internal;
+  GLenum format, type;
+  enum channel_order order;
+  pixel_transfer(canvas, bitmap->format, &internal, &format, &type, &order);
 
-  if (!canvas->cache.texture) {
-    glGenTextures(1, &canvas->cache.texture);
+  if (stage_tile(canvas, bitmap, x0, y0, w, h)) {
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+    glTexSubImage2D(canvas->target, 0, x0 - x, y0 - y, w, h, format, type, NULL);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  } else {
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, bitmap->width);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, y0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, x0);
+    glTexSubImage2D(canvas->target, 0, x0 - x, y0 - y, w, h, format, type,
+        bitmap->data);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
   }
+}
 
-  const int format = convert_pixelformat(bitmap->format);
+/* Fill in for a tile of bitmap that's been left out for time, from the same
+ * part of a coarse level small enough to be a single tile */
+static void draw_coarse(struct imv_canvas *canvas, struct tile_cache *cache,
+                        struct imv_bitmap *coarse, int coarse_level,
+                        const struct imv_bitmap *bitmap,
+                        int x0, int y0, int x1, int y1,
+                        double l, double t, double r, double b,
+                        const GLint viewport[4],
+                        const struct transform *transform,
+                        enum channel_order order)
+{
+  struct tile_set *set = get_tile_set(canvas, cache, coarse_level, coarse);
+  struct tile *tile = &set->tiles[0];
+  if (!tile->uploaded) {
+    upload_tile(canvas, coarse, tile, 0, 0, coarse->width, coarse->height);
+  } else {
+    glBindTexture(canvas->target, tile->texture);
+    if (tile->damaged) {
+      update_tile(canvas, coarse, tile, 0, 0);
+    }
+  }
+  glTexParameteri(canvas->target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(canvas->target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-  glBindTexture(GL_TEXTURE_RECTANGLE, canvas->cache.texture);
+  const double sx = (double)coarse->width / bitmap->width;
+  const double sy = (double)coarse->height / bitmap->height;
+  struct vertex vertices[6];
+  add_rectangle(vertices, l, t, r, b, x0 * sx, y0 * sy, x1 * sx, y1 * sy, order);
+  draw_triangles(canvas, canvas->target, tile->texture,
+      tile->width, tile->height, viewport[2], viewport[3],
+      transform, vertices, 6, true);
+}
+
+static void draw_bitmap(struct imv_canvas *canvas, struct tile_cache *cache,
+                        struct imv_bitmap *bitmap, int level,
+                        struct imv_bitmap *coarse, int coarse_level,
+                        int width, int height,
+                        int rx, int ry, int rw,
+                        int bx, int by, double scale,
+                        double rotation, bool mirrored,
+                        enum upscaling_method upscaling_method)
+{
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
 
   GLint upscaling = 0;
   if (upscaling_method == UPSCALING_LINEAR) {
@@ -233,55 +1171,99 @@ static void draw_bitmap(struct imv_canvas *canvas,
     abort();
   }
 
-  if (canvas->cache.bitmap != bitmap || cache_invalidated) {
-    glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, upscaling);
-    glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, upscaling);
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, bitmap->width);
-    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
-    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
-    glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA8, bitmap->width, bitmap->height,
-        0, format, GL_UNSIGNED_INT_8_8_8_8_REV, bitmap->data);
-  }
-  canvas->cache.bitmap = bitmap;
+  struct tile_set *set = get_tile_set(canvas, cache, level, bitmap);
 
-  glEnable(GL_TEXTURE_RECTANGLE);
+  /* The bitmap covers the region rx, ry, rw wide of an image width by height,
+   * which is usually all of it. The region may be larger than the bitmap,
+   * if it was decoded at a reduced resolution, in which case it's stretched
+   * to fit. Either way it turns about the centre of the whole image. */
+  const double left = bx + rx * scale;
+  const double top = by + ry * scale;
+  const int center_x = bx + width * scale / 2;
+  const int center_y = by + height * scale / 2;
+  const double pixel_scale = scale * rw / bitmap->width;
 
-  glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, upscaling);
+  int vis_x0, vis_y0, vis_x1, vis_y1;
+  visible_region(viewport, bitmap, left, top, pixel_scale, center_x, center_y,
+      rotation, mirrored, &vis_x0, &vis_y0, &vis_x1, &vis_y1);
 
-  const int left = bx;
-  const int top = by;
-  const int right = left + bitmap->width * scale;
-  const int bottom = top + bitmap->height * scale;
-  const int center_x = left + bitmap->width * scale / 2;
-  const int center_y = top + bitmap->height * scale / 2;
+  /* Rotate, then mirror, about the image's centre */
+  const double theta = rotation * M_PI / 180.0;
+  const double c = cos(theta);
+  const double s = sin(theta);
+  const double mx = mirrored ? -1 : 1;
+  struct transform transform = {{mx * c, s, -mx * s, c, 0, 0}};
+  transform.m[4] = center_x - (transform.m[0] * center_x + transform.m[2] * center_y);
+  transform.m[5] = center_y - (transform.m[1] * center_x + transform.m[3] * center_y);
 
-  glTranslated(center_x, center_y, 0);
-  if (mirrored) {
-    glScaled(-1, 1, 1);
-  }
-  glRotated(rotation, 0, 0, 1);
-  glTranslated(-center_x, -center_y, 0);
+  GLint internal;
+  GLenum format, type;
+  enum channel_order order;
+  pixel_transfer(canvas, bitmap->format, &internal, &format, &type, &order);
+
+  const int size = canvas->tile_size;
+  for (int row = vis_y0 / size; row < set->rows && row * size < vis_y1; ++row) {
+    for (int col = vis_x0 / size; col < set->cols && col * size < vis_x1; ++col) {
+      struct tile *tile = &set->tiles[row * set->cols + col];
+
+      /* The area of the bitmap the tile covers, without its border */
+      const int x0 = col * size;
+      const int y0 = row * size;
+      const int x1 = x0 + size < bitmap->width ? x0 + size : bitmap->width;
+      const int y1 = y0 + size < bitmap->height ? y0 + size : bitmap->height;
 
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+      /* The border only exists where there's a neighbouring tile */
+      const int border_left = x0 > 0 ? TILE_BORDER : 0;
+      const int border_top = y0 > 0 ? TILE_BORDER : 0;
+      const int border_right = x1 < bitmap->width ? TILE_BORDER : 0;
+      const int border_bottom = y1 < bitmap->height ? TILE_BORDER : 0;
 
-  glBegin(GL_TRIANGLE_FAN);
-  glTexCoord2i(0,             0);              glVertex2i(left, top);
-  glTexCoord2i(bitmap->width, 0);              glVertex2i(right, top);
-  glTexCoord2i(bitmap->width, bitmap->height); glVertex2i(right, bottom);
-  glTexCoord2i(0,             bitmap->height); glVertex2i(left, bottom);
-  glEnd();
+      const double l = left + x0 * pixel_scale;
+      const double t = top + y0 * pixel_scale;
+      const double r = left + x1 * pixel_scale;
+      const double b = top + y1 * pixel_scale;
 
-  glDisable(GL_BLEND);
+      if (!tile->uploaded && coarse && canvas->deadline != 0.0
+          && now() > canvas->deadline) {
+        draw_coarse(canvas, cache, coarse, coarse_level, bitmap,
+            x0, y0, x1, y1, l, t, r, b, viewport, &transform, order);
+        continue;
+      }
 
-  glBindTexture(GL_TEXTURE_RECTANGLE, 0);
-  glDisable(GL_TEXTURE_RECTANGLE);
-  glPopMatrix();
+      if (!tile->uploaded) {
+        upload_tile(canvas, bitmap, tile, x0 - border_left, y0 - border_top,
+            x1 - x0 + border_left + border_right,
+            y1 - y0 + border_top + border_bottom);
+      } else {
+        glBindTexture(canvas->target, tile->texture);
+        if (tile->damaged) {
+          update_tile(canvas, bitmap, tile, x0 - border_left, y0 - border_top);
+        }
+      }
+
+      glTexParameteri(canvas->target, GL_TEXTURE_MIN_FILTER, upscaling);
+      glTexParameteri(canvas->target, GL_TEXTURE_MAG_FILTER, upscaling);
+
+      const int tl = border_left;
+      const int tt = border_top;
+      const int tr = border_left + x1 - x0;
+      const int tb = border_top + y1 - y0;
+
+      struct vertex vertices[6];
+      add_rectangle(vertices, l, t, r, b, tl, tt, tr, tb, order);
+      draw_triangles(canvas, canvas->target, tile->texture,
+          tile->width, tile->height, viewport[2], viewport[3],
+          &transform, vertices, 6, true);
+    }
+  }
 }
 
-#ifdef IMV_BACKEND_LIBRSVG
-RsvgHandle *imv_image_get_svg(const struct imv_image *image);
-#endif
+struct imv_bitmap *imv_image_get_raster(const struct imv_image *image);
+
+void imv_canvas_set_budget(struct imv_canvas *canvas, double seconds)
+{
+  canvas->deadline = seconds > 0.0 ? now() + seconds : 0.0;
+}
 
 void imv_canvas_draw_image(struct imv_canvas *canvas, struct imv_image *image,
                            int x, int y, double scale,
@@ -289,29 +1271,230 @@ void imv_canvas_draw_image(struct imv_canvas *canvas, struct imv_image *image,
                            enum upscaling_method upscaling_method,
                            bool cache_invalidated)
 {
+  /* Vector images are drawn from their latest raster, scaled to fit until
+   * a better one is ready */
   struct imv_bitmap *bitmap = imv_image_get_bitmap(image);
-  if (bitmap) {
-    draw_bitmap(canvas, bitmap, x, y, scale, rotation, mirrored,
-                upscaling_method, cache_invalidated);
+  if (!bitmap) {
+    bitmap = imv_image_get_raster(image);
+  }
+  if (!bitmap) {
     return;
   }
 
-#ifdef IMV_BACKEND_LIBRSVG
-  RsvgHandle *svg = imv_image_get_svg(image);
-  if (svg) {
-    imv_canvas_clear(canvas);
-    cairo_translate(canvas->cairo, x, y);
-    cairo_scale(canvas->cairo, scale, scale);
-    cairo_translate(canvas->cairo, imv_image_width(image) / 2, imv_image_height(image) / 2);
-    if (mirrored) {
-      cairo_scale(canvas->cairo, -1, 1);
+  /* A region is drawn over the whole image it's part of, so the two are
+   * cached apart to save each knocking the other's tiles out */
+  int rx, ry, rw, rh;
+  const bool region = imv_image_get_region(image, &rx, &ry, &rw, &rh);
+  struct tile_cache *cache = region ? &canvas->region_cache : &canvas->cache;
+
+  prepare_tiles(canvas, cache, image, bitmap, cache_invalidated);
+
+  /* Use the smallest mipmap that's still at least as big as the image is
+   * being drawn, so minification never has to do more than halve it. While
+   * the view's moving, one half the size will do, as it's only seen for a
+   * moment. */
+  const bool draft = canvas->deadline != 0.0;
+  const double drawn_width = rw * scale * (draft ? 0.5 : 1.0);
+  int level = 0;
+  for (int i = 1; i < MAX_LEVELS; ++i) {
+    struct imv_bitmap *mipmap = imv_image_get_mipmap(image, i);
+    if (!mipmap || mipmap->width < drawn_width) {
+      break;
+    }
+    bitmap = mipmap;
+    level = i;
+  }
+
+  /* The level tiles left out for time are filled in from */
+  struct imv_bitmap *coarse = NULL;
+  int coarse_level = 0;
+  for (int i = level + 1; draft && i < MAX_LEVELS; ++i) {
+    struct imv_bitmap *mipmap = imv_image_get_mipmap(image, i);
+    if (!mipmap) {
+      break;
+    }
+    if (mipmap->width <= canvas->tile_size && mipmap->height <= canvas->tile_size) {
+      coarse = mipmap;
+      coarse_level = i;
+      break;
+    }
+  }
+
+  draw_bitmap(canvas, cache, bitmap, level, coarse, coarse_level,
+              imv_image_width(image), imv_image_height(image), rx, ry, rw,
+              x, y, scale, rotation, mirrored, upscaling_method);
+}
+
+/* Make sure the atlas is laid out for thumbnails of the given size, returning
+ * false if it can't hold any */
+static bool prepare_atlas(struct imv_canvas *canvas, int slot_size)
+{
+  if (canvas->atlas.texture && canvas->atlas.slot_size == slot_size) {
+    return canvas->atlas.cols > 0;
+  }
+
+  GLint max_size = 0;
+  glGetIntegerv(canvas->shader.program
+      ? GL_MAX_TEXTURE_SIZE : GL_MAX_RECTANGLE_TEXTURE_SIZE, &max_size);
+  const int size = max_size > 0 && max_size < ATLAS_SIZE ? max_size : ATLAS_SIZE;
+
+  free(canvas->atlas.slots);
+  canvas->atlas.slot_size = slot_size;
+  canvas->atlas.cols = slot_size > 0 ? size / slot_size : 0;
+  canvas->atlas.rows = canvas->atlas.cols;
+  canvas->atlas.slots = calloc((size_t)canvas->atlas.cols * canvas->atlas.rows,
+      sizeof *canvas->atlas.slots);
+
+  if (!canvas->atlas.texture) {
+    glGenTextures(1, &canvas->atlas.texture);
+  }
+  glBindTexture(canvas->target, canvas->atlas.texture);
+  glTexImage2D(canvas->target, 0, GL_RGBA8,
+      canvas->atlas.cols * slot_size, canvas->atlas.rows * slot_size, 0,
+      GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glTexParameteri(canvas->target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(canvas->target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glBindTexture(canvas->target, 0);
+
+  return canvas->atlas.cols > 0;
+}
+
+/* Find the slot holding a thumbnail, uploading it to the least recently used
+ * slot if it's not already there. Returns -1 if every slot is already in use
+ * by the current batch. Expects the atlas texture to be bound. */
+static int get_atlas_slot(struct imv_canvas *canvas,
+                          const struct imv_canvas_thumbnail *thumbnail)
+{
+  const int num_slots = canvas->atlas.cols * canvas->atlas.rows;
+  int victim = -1;
+
+  for (int i = 0; i < num_slots; ++i) {
+    struct atlas_slot *slot = &canvas->atlas.slots[i];
+    if (slot->used && slot->id == thumbnail->id) {
+      slot->batch = canvas->atlas.batch;
+      return i;
     }
-    cairo_rotate(canvas->cairo, rotation * M_PI / 180.0);
-    cairo_translate(canvas->cairo, -imv_image_width(image) / 2, -imv_image_height(image) / 2);
-    rsvg_handle_render_cairo(svg, canvas->cairo);
-    cairo_identity_matrix(canvas->cairo);
-    imv_canvas_draw(canvas);
+    if (slot->used && slot->batch == canvas->atlas.batch) {
+      continue;
+    }
+    if (victim == -1 || !slot->used
+        || (canvas->atlas.slots[victim].used
+          && slot->batch < canvas->atlas.slots[victim].batch)) {
+      victim = i;
+    }
+  }
+
+  if (victim == -1) {
+    return -1;
+  }
+
+  /* The atlas is RGBA, so greyscale thumbnails are expanded to fit it */
+  struct imv_bitmap *bitmap = thumbnail->bitmap;
+  struct imv_bitmap *expanded = NULL;
+  if (bitmap->format == IMV_GREY) {
+    bitmap = expanded = imv_bitmap_to_argb(bitmap);
+  }
+  const int size = canvas->atlas.slot_size;
+  const int w = bitmap->width < size ? bitmap->width : size;
+  const int h = bitmap->height < size ? bitmap->height : size;
+  const int x = (victim % canvas->atlas.cols) * size;
+  const int y = (victim / canvas->atlas.cols) * size;
+
+  GLint internal;
+  GLenum format, type;
+  enum channel_order order;
+  pixel_transfer(canvas, bitmap->format, &internal, &format, &type, &order);
+
+  if (stage_tile(canvas, bitmap, 0, 0, w, h)) {
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+    glTexSubImage2D(canvas->target, 0, x, y, w, h, format, type, NULL);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  } else {
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, bitmap->width);
+    glTexSubImage2D(canvas->target, 0, x, y, w, h, format, type, bitmap->data);
+  }
+  if (expanded) {
+    imv_bitmap_free(expanded);
+  }
+
+  struct atlas_slot *slot = &canvas->atlas.slots[victim];
+  slot->id = thumbnail->id;
+  slot->used = true;
+  slot->batch = canvas->atlas.batch;
+  return victim;
+}
+
+void imv_canvas_draw_thumbnails(struct imv_canvas *canvas,
+                                const struct imv_canvas_thumbnail *thumbnails,
+                                size_t count, int size,
+                                enum upscaling_method upscaling_method)
+{
+  if (count == 0 || !prepare_atlas(canvas, size)) {
     return;
   }
-#endif
+
+  const GLint filter = upscaling_method == UPSCALING_NEAREST_NEIGHBOUR
+    ? GL_NEAREST : GL_LINEAR;
+
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+
+  int *slots = malloc(count * sizeof *slots);
+  struct vertex *vertices = malloc(6 * count * sizeof *vertices);
+  const int atlas_width = canvas->atlas.cols * size;
+  const int atlas_height = canvas->atlas.rows * size;
+
+  /* If there are more thumbnails than slots they're drawn in several
+   * batches, reusing the slots each time */
+  size_t start = 0;
+  while (start < count) {
+    ++canvas->atlas.batch;
+
+    glBindTexture(canvas->target, canvas->atlas.texture);
+    glTexParameteri(canvas->target, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(canvas->target, GL_TEXTURE_MAG_FILTER, filter);
+
+    size_t end = start;
+    for (; end < count; ++end) {
+      slots[end] = get_atlas_slot(canvas, &thumbnails[end]);
+      if (slots[end] < 0) {
+        break;
+      }
+    }
+
+    for (size_t i = start; i < end; ++i) {
+      const struct imv_canvas_thumbnail *thumbnail = &thumbnails[i];
+      const int w = thumbnail->bitmap->width < size ? thumbnail->bitmap->width : size;
+      const int h = thumbnail->bitmap->height < size ? thumbnail->bitmap->height : size;
+
+      /* Sample from half a texel in, so filtering never picks up the
+       * neighbouring slots */
+      const double tl = (slots[i] % canvas->atlas.cols) * size + 0.5;
+      const double tt = (slots[i] / canvas->atlas.cols) * size + 0.5;
+      const double tr = tl + w - 1.0;
+      const double tb = tt + h - 1.0;
+
+      const double l = thumbnail->x;
+      const double t = thumbnail->y;
+      const double r = thumbnail->x + thumbnail->width;
+      const double b = thumbnail->y + thumbnail->height;
+
+      GLint internal;
+      GLenum format, type;
+      enum channel_order order;
+      const enum imv_pixelformat fmt = thumbnail->bitmap->format == IMV_GREY
+        ? IMV_ARGB : thumbnail->bitmap->format;
+      pixel_transfer(canvas, fmt, &internal, &format, &type, &order);
+      add_rectangle(&vertices[6 * (i - start)], l, t, r, b, tl, tt, tr, tb, order);
+    }
+
+    draw_triangles(canvas, canvas->target, canvas->atlas.texture,
+        atlas_width, atlas_height, viewport[2], viewport[3],
+        &identity, vertices, 6 * (end - start), true);
+
+    start = end;
+  }
+
+  free(vertices);
+  free(slots);
 }
@@ -2,7 +2,9 @@
 #define IMV_CANVAS_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
+struct imv_bitmap;
 struct imv_canvas;
 struct imv_image;
 
@@ -33,8 +35,10 @@ void imv_canvas_fill_rectangle(struct imv_canvas *canvas, int x, int y, int widt
 /* Fill the whole canvas with the current color */
 void imv_canvas_fill(struct imv_canvas *canvas);
 
-/* Fill the whole canvas with a chequerboard pattern */
-void imv_canvas_fill_checkers(struct imv_canvas *canvas, int size);
+/* Draw a chequerboard of size pixel squares over the whole of the current
+ * OpenGL framebuffer. It's drawn directly, rather than on the canvas, from a
+ * tiny repeating texture that's only uploaded once. */
+void imv_canvas_draw_checkers(struct imv_canvas *canvas, int size);
 
 /* Select the font to draw text with */
 void imv_canvas_font(struct imv_canvas *canvas, const char *name, int size);
@@ -45,6 +49,12 @@ int imv_canvas_printf(struct imv_canvas *canvas, int x, int y, const char *fmt,
 /* Blit the canvas to the current OpenGL framebuffer */
 void imv_canvas_draw(struct imv_canvas *canvas);
 
+/* Limit how long the images drawn from now until the next call spend
+ * uploading tiles, for a frame drawn while the view's moving. Such images are
+ * also drawn from a coarser mipmap than usual, and tiles left out for time
+ * are filled in from a low resolution one. 0 draws at full quality. */
+void imv_canvas_set_budget(struct imv_canvas *canvas, double seconds);
+
 /* Blit the given image to the current OpenGL framebuffer */
 void imv_canvas_draw_image(struct imv_canvas *canvas, struct imv_image *image,
                            int x, int y, double scale,
@@ -52,4 +62,22 @@ void imv_canvas_draw_image(struct imv_canvas *canvas, struct imv_image *image,
                            enum upscaling_method upscaling_method,
                            bool cache_invalidated);
 
+/* A small bitmap for imv_canvas_draw_thumbnails, and where to draw it. id
+ * identifies the bitmap's contents: it must change whenever they do, and
+ * never be reused for different contents. */
+struct imv_canvas_thumbnail {
+  unsigned long id;
+  struct imv_bitmap *bitmap;
+  int x, y, width, height;
+};
+
+/* Draw a batch of bitmaps, none larger than size pixels in each dimension,
+ * each stretched to its own rectangle. They're packed into a single texture
+ * atlas, so each one is only uploaded the first time it's drawn, and the
+ * whole batch is drawn in one go. */
+void imv_canvas_draw_thumbnails(struct imv_canvas *canvas,
+                                const struct imv_canvas_thumbnail *thumbnails,
+                                size_t count, int size,
+                                enum upscaling_method upscaling_method);
+
 #endif
@@ -54,44 +54,133 @@ void imv_command_alias(struct imv_commands *cmds, const char *command, const cha
   list_append(cmds->command_list, cmd);
 }
 
-int imv_command_exec(struct imv_commands *cmds, const char *command, void *data)
-{
-  struct list *args = list_from_string(command, ' ');
-  int ret = 1;
+struct imv_compiled_command {
+  /* the command as run, after alias expansion, which argstr points into */
+  char *text;
+  struct list *args;
+  const char *argstr;
+  void (*handler)(struct list *args, const char *argstr, void *data);
 
+  /* where a command that wasn't found is looked up again, and what as */
+  struct imv_commands *cmds;
+  char *source;
+};
+
+/* Takes ownership of text and args */
+static struct imv_compiled_command *compile_args(struct imv_commands *cmds,
+    char *text, struct list *args)
+{
   if(args->len > 0) {
     for(size_t i = 0; i < cmds->command_list->len; ++i) {
       struct command *cmd = cmds->command_list->items[i];
-      if(!strcmp(cmd->command, args->items[0])) {
-        if(cmd->handler) {
-          /* argstr = all args as a single string */
-          const char *argstr = command + strlen(cmd->command) + 1;
-          cmd->handler(args, argstr, data);
-          ret = 0;
-        } else if(cmd->alias) {
-          char *new_args = list_to_string(args, " ", 1);
-          size_t cmd_len = strlen(cmd->alias) + 1 + strlen(new_args) + 1;
-          char *new_cmd = malloc(cmd_len);
-          snprintf(new_cmd, cmd_len, "%s %s", cmd->alias, new_args);
-          ret = imv_command_exec(cmds, new_cmd, data);
-          free(new_args);
-          free(new_cmd);
+      if(strcmp(cmd->command, args->items[0])) {
+        continue;
+      }
+      if(cmd->handler) {
+        struct imv_compiled_command *compiled = malloc(sizeof *compiled);
+        compiled->text = text;
+        compiled->args = args;
+        compiled->handler = cmd->handler;
+        /* argstr = all args as a single string */
+        compiled->argstr = text + strspn(text, " ") + strlen(cmd->command);
+        if(*compiled->argstr == ' ') {
+          ++compiled->argstr;
         }
-        break;
+        return compiled;
+      } else if(cmd->alias) {
+        char *new_args = list_to_string(args, " ", 1);
+        size_t cmd_len = strlen(cmd->alias) + 1 + strlen(new_args) + 1;
+        char *new_cmd = malloc(cmd_len);
+        snprintf(new_cmd, cmd_len, "%s %s", cmd->alias, new_args);
+        free(new_args);
+        free(text);
+        list_deep_free(args);
+        return compile_args(cmds, new_cmd, list_from_string(new_cmd, ' '));
       }
+      break;
     }
   }
 
-  list_deep_free(args);
+  /* No such command, which is only found out when it's run */
+  struct imv_compiled_command *compiled = malloc(sizeof *compiled);
+  compiled->text = text;
+  compiled->args = args;
+  compiled->argstr = "";
+  compiled->handler = NULL;
+  return compiled;
+}
+
+struct imv_compiled_command *imv_command_compile(struct imv_commands *cmds,
+    const char *command)
+{
+  struct imv_compiled_command *compiled =
+    compile_args(cmds, strdup(command), list_from_string(command, ' '));
+  compiled->cmds = cmds;
+  compiled->source = compiled->handler ? NULL : strdup(command);
+  return compiled;
+}
+
+void imv_compiled_command_free(struct imv_compiled_command *compiled)
+{
+  if(!compiled) {
+    return;
+  }
+  list_deep_free(compiled->args);
+  free(compiled->text);
+  free(compiled->source);
+  free(compiled);
+}
+
+/* Look a command that wasn't found when it was compiled up again, in case
+ * it's been registered or aliased since, such as by a later config section */
+static void recompile(struct imv_compiled_command *compiled)
+{
+  struct imv_compiled_command *fresh = compile_args(compiled->cmds,
+      strdup(compiled->source), list_from_string(compiled->source, ' '));
+  if(fresh->handler) {
+    list_deep_free(compiled->args);
+    free(compiled->text);
+    free(compiled->source);
+    compiled->text = fresh->text;
+    compiled->args = fresh->args;
+    compiled->argstr = fresh->argstr;
+    compiled->handler = fresh->handler;
+    compiled->source = NULL;
+    free(fresh);
+  } else {
+    list_deep_free(fresh->args);
+    free(fresh->text);
+    free(fresh);
+  }
+}
+
+int imv_command_exec_compiled(struct imv_compiled_command *compiled,
+    void *data)
+{
+  if(!compiled->handler) {
+    recompile(compiled);
+  }
+  if(!compiled->handler) {
+    return 1;
+  }
+  compiled->handler(compiled->args, compiled->argstr, data);
+  return 0;
+}
+
+int imv_command_exec(struct imv_commands *cmds, const char *command, void *data)
+{
+  struct imv_compiled_command *compiled = imv_command_compile(cmds, command);
+  /* It's only just been looked up, there's no point trying again */
+  const int ret = compiled->handler ? imv_command_exec_compiled(compiled, data) : 1;
+  imv_compiled_command_free(compiled);
   return ret;
 }
 
-int imv_command_exec_list(struct imv_commands *cmds, struct list *commands, void *data)
+int imv_command_exec_list(const struct list *commands, void *data)
 {
   int ret = 0;
   for(size_t i = 0; i < commands->len; ++i) {
-    const char *command = commands->items[i];
-    ret += imv_command_exec(cmds, command, data);
+    ret += imv_command_exec_compiled(commands->items[i], data);
   }
   return ret;
 }
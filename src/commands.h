@@ -21,11 +21,30 @@ void imv_command_register(struct imv_commands *cmds, const char *command,
  */
 void imv_command_alias(struct imv_commands *cmds, const char *command, const char *alias);
 
+/* A command split into its arguments, with any alias expanded and its
+ * handler looked up already, so that it can be run any number of times
+ * without parsing or allocating anything */
+struct imv_compiled_command;
+
+/* Compile a command. Handlers and aliases are looked up as they are now. A
+ * command that doesn't exist yet still compiles, and is looked up again each
+ * time it's executed until it's found, so it may be registered or aliased
+ * after it's compiled. */
+struct imv_compiled_command *imv_command_compile(struct imv_commands *cmds,
+    const char *command);
+
+/* Clean up a compiled command */
+void imv_compiled_command_free(struct imv_compiled_command *compiled);
+
+/* Execute a compiled command. Returns non-zero if there's no such command */
+int imv_command_exec_compiled(struct imv_compiled_command *compiled,
+    void *data);
+
 /* Execute a single command */
 int imv_command_exec(struct imv_commands *cmds, const char *command, void *data);
 
-/* Execute a list of commands */
-int imv_command_exec_list(struct imv_commands *cmds, struct list *commands, void *data);
+/* Execute a list of compiled commands */
+int imv_command_exec_list(const struct list *commands, void *data);
 
 #endif
 
@@ -0,0 +1,675 @@
+#include "disk_cache.h"
+
+#include "bitmap.h"
+#include "image.h"
+#include "list.h"
+#include "log.h"
+#include "pool.h"
+#include "source.h"
+#include "source_private.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define ENTRY_MAGIC "imvcache"
+#define ENTRY_VERSION 1
+#define ENTRY_SUFFIX ".imv"
+
+/* Keys are checked against the one stored in the entry, so this only guards
+ * against reading nonsense from a corrupt entry */
+#define MAX_KEY_LEN (PATH_MAX + 64)
+
+/* Written at the start of every entry. The key follows, then the pixels,
+ * starting at data_offset, which is page aligned. */
+struct entry_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t key_len;
+  int32_t width;
+  int32_t height;
+  int32_t full_width;
+  int32_t full_height;
+  uint32_t format;
+  uint32_t reserved;
+  uint64_t data_offset;
+};
+
+struct imv_disk_cache {
+  char *dir;
+  size_t max_bytes;
+  /* entries are mapped rather than read, and kept at whatever resolution
+   * they were decoded at */
+  bool shared;
+
+  /* a single thread, so that entries are written, and evicted, in order */
+  struct imv_pool *pool;
+
+  /* store jobs that haven't run yet, so that they can be cleaned up if the
+   * cache is freed first */
+  pthread_mutex_t lock;
+  struct list *pending;
+};
+
+struct store_job {
+  struct imv_disk_cache *cache;
+  char *key;
+  char *entry_path;
+  struct imv_image *image;
+  int level;
+};
+
+struct private {
+  int fd;
+  bool map;
+  struct entry_header header;
+};
+
+/* An entry's pixels mapped into memory, which is unmapped once the bitmap
+ * pointing into it is freed */
+struct mapping {
+  void *addr;
+  size_t len;
+};
+
+/* Non-public functions from imv_image */
+struct imv_bitmap *imv_image_get_bitmap(const struct imv_image *image);
+struct imv_bitmap *imv_image_get_mipmap(const struct imv_image *image, int level);
+
+static const struct imv_source_vtable vtable;
+
+/* Returns a newly allocated string, formatted as by printf */
+static char *format(const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  const int len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  if (len < 0) {
+    return NULL;
+  }
+
+  char *str = malloc((size_t)len + 1);
+  va_start(args, fmt);
+  vsnprintf(str, (size_t)len + 1, fmt, args);
+  va_end(args);
+  return str;
+}
+
+char *imv_disk_cache_default_dir(void)
+{
+  const char *xdg_cache = getenv("XDG_CACHE_HOME");
+  if (xdg_cache && *xdg_cache) {
+    return format("%s/imv", xdg_cache);
+  }
+
+  const char *home = getenv("HOME");
+  if (home && *home) {
+    return format("%s/.cache/imv", home);
+  }
+  return NULL;
+}
+
+char *imv_disk_cache_shared_dir(void)
+{
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  if (runtime && *runtime) {
+    return format("%s/imv-shared", runtime);
+  }
+  return NULL;
+}
+
+/* Create dir, and any missing parents */
+static bool make_dirs(const char *dir)
+{
+  char *path = strdup(dir);
+  for (char *p = path + 1; *p; ++p) {
+    if (*p != '/') {
+      continue;
+    }
+    *p = '\0';
+    if (mkdir(path, 0700) && errno != EEXIST) {
+      free(path);
+      return false;
+    }
+    *p = '/';
+  }
+  const bool ok = !mkdir(path, 0700) || errno == EEXIST;
+  free(path);
+  return ok;
+}
+
+/* Entries are identified by the image's path, along with enough about the
+ * file to notice when it's been replaced */
+static char *make_key(const char *path, const struct stat *st)
+{
+  return format("%s\n%lld.%09ld\n%lld", path,
+      (long long)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec,
+      (long long)st->st_size);
+}
+
+/* 64-bit FNV-1a */
+static uint64_t hash_key(const char *key)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (const unsigned char *c = (const unsigned char*)key; *c; ++c) {
+    hash ^= *c;
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static char *make_entry_path(struct imv_disk_cache *cache, const char *key)
+{
+  return format("%s/%016" PRIx64 ENTRY_SUFFIX, cache->dir, hash_key(key));
+}
+
+static size_t pixel_bytes(const struct entry_header *header)
+{
+  return (size_t)header->width * (size_t)header->height
+    * imv_bitmap_bytes_per_pixel(header->format);
+}
+
+static bool read_all(int fd, void *buf, size_t len, off_t offset)
+{
+  unsigned char *p = buf;
+  while (len > 0) {
+    ssize_t ret = pread(fd, p, len, offset);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return false;
+    }
+    p += ret;
+    len -= (size_t)ret;
+    offset += ret;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t len, off_t offset)
+{
+  const unsigned char *p = buf;
+  while (len > 0) {
+    ssize_t ret = pwrite(fd, p, len, offset);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return false;
+    }
+    p += ret;
+    len -= (size_t)ret;
+    offset += ret;
+  }
+  return true;
+}
+
+struct eviction_entry {
+  char *path;
+  struct timespec mtime;
+  size_t bytes;
+};
+
+static int compare_mtime(const void *a, const void *b)
+{
+  const struct eviction_entry *lhs = *(const struct eviction_entry * const*)a;
+  const struct eviction_entry *rhs = *(const struct eviction_entry * const*)b;
+  if (lhs->mtime.tv_sec != rhs->mtime.tv_sec) {
+    return lhs->mtime.tv_sec < rhs->mtime.tv_sec ? -1 : 1;
+  }
+  if (lhs->mtime.tv_nsec != rhs->mtime.tv_nsec) {
+    return lhs->mtime.tv_nsec < rhs->mtime.tv_nsec ? -1 : 1;
+  }
+  return 0;
+}
+
+/* Remove the least recently used entries until the cache is within budget.
+ * An entry's mtime is refreshed whenever it's used, so it gives the order. */
+static void evict(struct imv_disk_cache *cache)
+{
+  DIR *dir = opendir(cache->dir);
+  if (!dir) {
+    return;
+  }
+
+  struct list *entries = list_create();
+  size_t total = 0;
+  const size_t suffix_len = strlen(ENTRY_SUFFIX);
+
+  struct dirent *dirent;
+  while ((dirent = readdir(dir))) {
+    const size_t name_len = strlen(dirent->d_name);
+    if (name_len <= suffix_len
+        || strcmp(dirent->d_name + name_len - suffix_len, ENTRY_SUFFIX)) {
+      continue;
+    }
+
+    struct stat st;
+    if (fstatat(dirfd(dir), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW)
+        || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    struct eviction_entry *entry = calloc(1, sizeof *entry);
+    entry->path = format("%s/%s", cache->dir, dirent->d_name);
+    if (!entry->path) {
+      free(entry);
+      continue;
+    }
+    entry->mtime = st.st_mtim;
+    entry->bytes = (size_t)st.st_size;
+    total += entry->bytes;
+    list_append(entries, entry);
+  }
+  closedir(dir);
+
+  qsort(entries->items, entries->len, sizeof *entries->items, compare_mtime);
+
+  for (size_t i = 0; i < entries->len; ++i) {
+    struct eviction_entry *entry = entries->items[i];
+    if (total > cache->max_bytes && !unlink(entry->path)) {
+      total -= entry->bytes;
+    }
+    free(entry->path);
+    free(entry);
+  }
+  list_free(entries);
+}
+
+static void evict_job(void *cache)
+{
+  evict(cache);
+}
+
+static void free_store_job(struct store_job *job)
+{
+  imv_image_free(job->image);
+  free(job->entry_path);
+  free(job->key);
+  free(job);
+}
+
+static bool write_entry(struct store_job *job)
+{
+  const struct imv_bitmap *bmp = imv_image_get_mipmap(job->image, job->level);
+  if (!bmp) {
+    return false;
+  }
+
+  const size_t key_len = strlen(job->key);
+  const long page_size = sysconf(_SC_PAGESIZE);
+  const size_t align = page_size > 0 ? (size_t)page_size : 4096;
+  const size_t data_offset =
+    (sizeof(struct entry_header) + key_len + align - 1) / align * align;
+
+  struct entry_header header = {
+    .version = ENTRY_VERSION,
+    .key_len = (uint32_t)key_len,
+    .width = bmp->width,
+    .height = bmp->height,
+    .full_width = imv_image_width(job->image),
+    .full_height = imv_image_height(job->image),
+    .format = bmp->format,
+    .data_offset = data_offset,
+  };
+  memcpy(header.magic, ENTRY_MAGIC, sizeof header.magic);
+
+  /* Write to a temporary file first, so that a partially written entry is
+   * never mistaken for a complete one */
+  char *tmp_path = format("%s/.tmp-XXXXXX", job->cache->dir);
+  if (!tmp_path) {
+    return false;
+  }
+
+  int fd = mkstemp(tmp_path);
+  if (fd == -1) {
+    free(tmp_path);
+    return false;
+  }
+
+  bool ok = write_all(fd, &header, sizeof header, 0)
+    && write_all(fd, job->key, key_len, sizeof header)
+    && write_all(fd, bmp->data, pixel_bytes(&header), (off_t)data_offset);
+  ok = !close(fd) && ok;
+
+  if (ok) {
+    ok = !rename(tmp_path, job->entry_path);
+  }
+  if (!ok) {
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+  return ok;
+}
+
+static void write_job(void *raw_job)
+{
+  struct store_job *job = raw_job;
+  struct imv_disk_cache *cache = job->cache;
+
+  pthread_mutex_lock(&cache->lock);
+  for (size_t i = 0; i < cache->pending->len; ++i) {
+    if (cache->pending->items[i] == job) {
+      list_remove(cache->pending, i);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  if (write_entry(job)) {
+    evict(cache);
+  } else {
+    imv_log(IMV_DEBUG, "disk cache: failed to write %s\n", job->entry_path);
+  }
+  free_store_job(job);
+}
+
+static struct imv_disk_cache *create(const char *dir, size_t max_bytes,
+    bool shared)
+{
+  if (!make_dirs(dir) || access(dir, R_OK | W_OK | X_OK)) {
+    imv_log(IMV_WARNING, "disk cache: can't use %s: %s\n", dir, strerror(errno));
+    return NULL;
+  }
+
+  struct imv_pool *pool = imv_pool_create(1);
+  if (!pool) {
+    return NULL;
+  }
+
+  struct imv_disk_cache *cache = calloc(1, sizeof *cache);
+  cache->dir = strdup(dir);
+  cache->max_bytes = max_bytes;
+  cache->shared = shared;
+  cache->pool = pool;
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->pending = list_create();
+
+  /* The budget may have shrunk since the cache was last used */
+  imv_pool_push(cache->pool, IMV_POOL_PRIORITY_LOW, evict_job, cache);
+  return cache;
+}
+
+struct imv_disk_cache *imv_disk_cache_create(const char *dir, size_t max_bytes)
+{
+  return create(dir, max_bytes, false);
+}
+
+struct imv_disk_cache *imv_disk_cache_create_shared(const char *dir,
+    size_t max_bytes)
+{
+  return create(dir, max_bytes, true);
+}
+
+void imv_disk_cache_free(struct imv_disk_cache *cache)
+{
+  if (!cache) {
+    return;
+  }
+
+  imv_pool_free(cache->pool);
+
+  for (size_t i = 0; i < cache->pending->len; ++i) {
+    free_store_job(cache->pending->items[i]);
+  }
+  list_free(cache->pending);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->dir);
+  free(cache);
+}
+
+static void free_private(void *raw_private)
+{
+  struct private *private = raw_private;
+  close(private->fd);
+  free(private);
+}
+
+static void unmap_entry(void *raw_mapping)
+{
+  struct mapping *mapping = raw_mapping;
+  munmap(mapping->addr, mapping->len);
+  free(mapping);
+}
+
+/* Map the entry, so that every instance showing it shares the one copy of
+ * its pixels. The mapping's private, so anything that writes to them only
+ * copies the pages it touches. Entries are only ever replaced by renaming a
+ * new file over them, never truncated, so the pages stay valid for as long
+ * as they're mapped, even once the entry's been evicted. */
+static unsigned char *map_pixels(struct private *private,
+    struct mapping **mapping)
+{
+  const size_t len = (size_t)private->header.data_offset
+    + pixel_bytes(&private->header);
+  void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+      private->fd, 0);
+  if (addr == MAP_FAILED) {
+    return NULL;
+  }
+
+  *mapping = malloc(sizeof **mapping);
+  (*mapping)->addr = addr;
+  (*mapping)->len = len;
+  return (unsigned char *)addr + private->header.data_offset;
+}
+
+static void load_image(void *raw_private, struct imv_image **image,
+    int *frametime, struct imv_source_token *token)
+{
+  (void)token;
+  *image = NULL;
+  *frametime = 0;
+
+  struct private *private = raw_private;
+  const struct entry_header *header = &private->header;
+
+  unsigned char *data = NULL;
+  struct mapping *mapping = NULL;
+  if (private->map) {
+    data = map_pixels(private, &mapping);
+    if (!data) {
+      return;
+    }
+  } else {
+    const size_t len = pixel_bytes(header);
+    data = malloc(len);
+    if (!data) {
+      return;
+    }
+
+    if (!read_all(private->fd, data, len, (off_t)header->data_offset)) {
+      free(data);
+      return;
+    }
+  }
+
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
+  bmp->width = header->width;
+  bmp->height = header->height;
+  bmp->format = header->format;
+  bmp->data = data;
+  if (mapping) {
+    bmp->release = unmap_entry;
+    bmp->release_data = mapping;
+  }
+
+  if (header->width == header->full_width
+      && header->height == header->full_height) {
+    *image = imv_image_create_from_bitmap(bmp);
+  } else {
+    *image = imv_image_create_from_reduced_bitmap(bmp,
+        header->full_width, header->full_height);
+  }
+}
+
+static const struct imv_source_vtable vtable = {
+  .load_first_frame = load_image,
+  .free = free_private
+};
+
+static bool valid_header(const struct entry_header *header, off_t file_size)
+{
+  return !memcmp(header->magic, ENTRY_MAGIC, sizeof header->magic)
+    && header->version == ENTRY_VERSION
+    && header->key_len <= MAX_KEY_LEN
+    && header->width > 0 && header->height > 0
+    && header->full_width >= header->width
+    && header->full_height >= header->height
+    && (header->format == IMV_ARGB || header->format == IMV_ABGR
+      || header->format == IMV_GREY)
+    && header->data_offset >= sizeof *header + header->key_len
+    && (uint64_t)file_size >= header->data_offset + pixel_bytes(header);
+}
+
+bool imv_disk_cache_open(struct imv_disk_cache *cache, const char *path,
+    struct imv_source **src)
+{
+  struct stat st;
+  if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+
+  char *key = make_key(path, &st);
+  if (!key) {
+    return false;
+  }
+
+  char *entry_path = make_entry_path(cache, key);
+  if (!entry_path) {
+    free(key);
+    return false;
+  }
+
+  int fd = open(entry_path, O_RDONLY | O_CLOEXEC);
+  free(entry_path);
+  if (fd == -1) {
+    free(key);
+    return false;
+  }
+
+  struct entry_header header;
+  struct stat entry_st;
+  bool hit = !fstat(fd, &entry_st)
+    && read_all(fd, &header, sizeof header, 0)
+    && valid_header(&header, entry_st.st_size);
+
+  /* Different keys can share a hash, so make sure it's the right entry */
+  if (hit) {
+    const size_t key_len = strlen(key);
+    char *stored_key = malloc(header.key_len + 1);
+    hit = header.key_len == key_len
+      && read_all(fd, stored_key, key_len, sizeof header)
+      && !memcmp(stored_key, key, key_len);
+    free(stored_key);
+  }
+  free(key);
+
+  if (!hit) {
+    close(fd);
+    return false;
+  }
+
+  /* Mark the entry as recently used, so it's the last to be evicted */
+  futimens(fd, NULL);
+
+  struct private *private = calloc(1, sizeof *private);
+  private->fd = fd;
+  private->map = cache->shared;
+  private->header = header;
+  *src = imv_source_create(&vtable, private);
+  return true;
+}
+
+bool imv_disk_cache_is_source(const struct imv_source *src)
+{
+  return imv_source_get_vtable(src) == &vtable;
+}
+
+/* Pick the smallest of the image's mipmaps that still reaches the edge of the
+ * box, or -1 if there's no point storing one */
+static int choose_level(struct imv_image *image, int width, int height)
+{
+  struct imv_bitmap *bmp = imv_image_get_mipmap(image, 0);
+  if (!bmp || width <= 0 || height <= 0) {
+    return -1;
+  }
+
+  int level = 0;
+  for (;;) {
+    struct imv_bitmap *next = imv_image_get_mipmap(image, level + 1);
+    if (!next || (next->width < width && next->height < height)) {
+      break;
+    }
+    bmp = next;
+    ++level;
+  }
+
+  /* Reading back anything over half the full image's pixels is unlikely to
+   * beat decoding it again */
+  const size_t stored = (size_t)bmp->width * (size_t)bmp->height;
+  const size_t full = (size_t)imv_image_width(image) * (size_t)imv_image_height(image);
+  if (stored * 2 > full) {
+    return -1;
+  }
+  return level;
+}
+
+void imv_disk_cache_store(struct imv_disk_cache *cache, const char *path,
+    struct imv_image *image, int width, int height)
+{
+  /* Mapping a shared entry is always quicker than decoding, whatever its
+   * size */
+  int level = -1;
+  if (cache->shared) {
+    level = imv_image_get_mipmap(image, 0) ? 0 : -1;
+  } else {
+    level = choose_level(image, width, height);
+  }
+  if (level < 0) {
+    return;
+  }
+
+  struct stat st;
+  if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+    return;
+  }
+
+  char *key = make_key(path, &st);
+  if (!key) {
+    return;
+  }
+
+  struct store_job *job = calloc(1, sizeof *job);
+  job->cache = cache;
+  job->key = key;
+  job->entry_path = make_entry_path(cache, key);
+  job->image = imv_image_ref(image);
+  job->level = level;
+  if (!job->entry_path) {
+    free_store_job(job);
+    return;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  list_append(cache->pending, job);
+  pthread_mutex_unlock(&cache->lock);
+
+  imv_pool_push(cache->pool, IMV_POOL_PRIORITY_LOW, write_job, job);
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
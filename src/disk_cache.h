@@ -0,0 +1,68 @@
+#ifndef IMV_DISK_CACHE_H
+#define IMV_DISK_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* imv_disk_cache keeps screen sized copies of decoded images on disk, so that
+ * large images can be shown again in later sessions without decoding them.
+ * Entries are keyed by path, modification time and size, so a file that has
+ * changed is decoded afresh. Pixels are stored uncompressed and page aligned,
+ * so loading an entry is a single read.
+ *
+ * A shared cache instead lives in memory, such as under $XDG_RUNTIME_DIR, and
+ * keeps images at whatever resolution they were decoded at. Its entries are
+ * mapped rather than read, so every imv showing an image shares one copy of
+ * its pixels, and only the first has to decode it.
+ */
+struct imv_disk_cache;
+
+struct imv_image;
+struct imv_source;
+
+/* Returns the default directory for the disk cache, $XDG_CACHE_HOME/imv or
+ * $HOME/.cache/imv, or NULL if neither is set. Caller is responsible for
+ * freeing the result */
+char *imv_disk_cache_default_dir(void);
+
+/* Returns the default directory for the shared cache, $XDG_RUNTIME_DIR/
+ * imv-shared, or NULL if that isn't set. Caller is responsible for freeing
+ * the result */
+char *imv_disk_cache_shared_dir(void);
+
+/* Creates an imv_disk_cache instance in the given directory, creating the
+ * directory if needed. Once the entries exceed max_bytes the least recently
+ * used are removed, in the background. Returns NULL if the directory can't
+ * be used.
+ */
+struct imv_disk_cache *imv_disk_cache_create(const char *dir, size_t max_bytes);
+
+/* Creates an imv_disk_cache instance whose entries are shared, as above,
+ * and which otherwise behaves as imv_disk_cache_create */
+struct imv_disk_cache *imv_disk_cache_create_shared(const char *dir,
+    size_t max_bytes);
+
+/* Cleans up an imv_disk_cache instance. Waits for any write in progress, but
+ * drops the ones still queued */
+void imv_disk_cache_free(struct imv_disk_cache *cache);
+
+/* If there's an up to date entry for path, opens a source that loads it and
+ * returns true. The source's image has the dimensions of the full image. */
+bool imv_disk_cache_open(struct imv_disk_cache *cache, const char *path,
+    struct imv_source **src);
+
+/* Returns true if src was opened by imv_disk_cache_open */
+bool imv_disk_cache_is_source(const struct imv_source *src);
+
+/* Stores a copy of image as the entry for path, in the background. The copy
+ * is the smallest of the image's mipmaps that still reaches the edge of a
+ * width x height box. Nothing is stored if that wouldn't be much smaller than
+ * the full image, as it would be no quicker to load than decoding again.
+ * A shared cache stores the image as it is, and ignores the box.
+ */
+void imv_disk_cache_store(struct imv_disk_cache *cache, const char *path,
+    struct imv_image *image, int width, int height);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
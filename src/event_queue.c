@@ -0,0 +1,163 @@
+#include "event_queue.h"
+
+#include "window.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef IMV_HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+/* A growable array of events */
+struct event_buffer {
+  struct imv_event *events;
+  size_t len;
+  size_t cap;
+};
+
+struct imv_event_queue {
+  /* protects pushed and woken */
+  pthread_mutex_t lock;
+
+  /* events pushed since the consumer last took them */
+  struct event_buffer pushed;
+
+  /* set once the fd's been made readable, until the queue's found empty */
+  bool woken;
+
+  /* events taken by the consumer, but not popped yet. The two buffers are
+   * swapped rather than copied, so neither side allocates once they've
+   * grown big enough. */
+  struct event_buffer taken;
+  size_t next;
+
+  /* the eventfd, or the two ends of a pipe where there's no eventfd */
+  int fds[2];
+};
+
+static void set_nonblocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL);
+  if (flags != -1) {
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  }
+}
+
+struct imv_event_queue *imv_event_queue_create(void)
+{
+  struct imv_event_queue *queue = calloc(1, sizeof *queue);
+  pthread_mutex_init(&queue->lock, NULL);
+  queue->fds[0] = queue->fds[1] = -1;
+#ifdef IMV_HAVE_EVENTFD
+  queue->fds[0] = queue->fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+  if (queue->fds[0] == -1 && !pipe(queue->fds)) {
+    set_nonblocking(queue->fds[0]);
+    set_nonblocking(queue->fds[1]);
+  }
+  return queue;
+}
+
+void imv_event_queue_free(struct imv_event_queue *queue)
+{
+  if (!queue) {
+    return;
+  }
+  if (queue->fds[0] != -1) {
+    close(queue->fds[0]);
+  }
+  if (queue->fds[1] != queue->fds[0] && queue->fds[1] != -1) {
+    close(queue->fds[1]);
+  }
+  free(queue->pushed.events);
+  free(queue->taken.events);
+  pthread_mutex_destroy(&queue->lock);
+  free(queue);
+}
+
+int imv_event_queue_fd(struct imv_event_queue *queue)
+{
+  return queue->fds[0];
+}
+
+/* Must be called with the queue locked, see imv_event_queue_push */
+static void wake(struct imv_event_queue *queue)
+{
+#ifdef IMV_HAVE_EVENTFD
+  if (queue->fds[0] == queue->fds[1]) {
+    const uint64_t one = 1;
+    while (write(queue->fds[1], &one, sizeof one) == -1 && errno == EINTR);
+    return;
+  }
+#endif
+  const char byte = 0;
+  while (write(queue->fds[1], &byte, 1) == -1 && errno == EINTR);
+}
+
+/* Must be called with the queue locked, so a wake can't be lost */
+static void clear_wake(struct imv_event_queue *queue)
+{
+  /* Reading an eventfd resets it, a pipe has to be drained */
+  if (queue->fds[0] == queue->fds[1]) {
+    uint64_t count;
+    (void)!read(queue->fds[0], &count, sizeof count);
+    return;
+  }
+  char buf[64];
+  while (read(queue->fds[0], buf, sizeof buf) > 0);
+}
+
+void imv_event_queue_push(struct imv_event_queue *queue,
+    const struct imv_event *e)
+{
+  pthread_mutex_lock(&queue->lock);
+  struct event_buffer *buffer = &queue->pushed;
+  if (buffer->len == buffer->cap) {
+    buffer->cap = buffer->cap ? buffer->cap * 2 : 64;
+    buffer->events = realloc(buffer->events, buffer->cap * sizeof *buffer->events);
+  }
+  buffer->events[buffer->len++] = *e;
+
+  /* Only the first event since the queue was last emptied needs to wake the
+   * main loop, it takes the rest along with it. The write happens under the
+   * lock, or the consumer could find the queue empty and clear the fd before
+   * it lands, leaving the fd readable with nothing to clear it. */
+  if (!queue->woken) {
+    queue->woken = true;
+    wake(queue);
+  }
+  pthread_mutex_unlock(&queue->lock);
+}
+
+bool imv_event_queue_pop(struct imv_event_queue *queue, struct imv_event *e)
+{
+  if (queue->next == queue->taken.len) {
+    queue->taken.len = 0;
+    queue->next = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    struct event_buffer swap = queue->taken;
+    queue->taken = queue->pushed;
+    queue->pushed = swap;
+    if (queue->taken.len == 0 && queue->woken) {
+      queue->woken = false;
+      clear_wake(queue);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    if (queue->taken.len == 0) {
+      return false;
+    }
+  }
+
+  *e = queue->taken.events[queue->next++];
+  return true;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
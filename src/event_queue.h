@@ -0,0 +1,35 @@
+#ifndef IMV_EVENT_QUEUE_H
+#define IMV_EVENT_QUEUE_H
+
+#include <stdbool.h>
+
+struct imv_event;
+
+/* imv_event_queue passes events from any thread to the main loop. Events
+ * are copied into memory rather than written down a pipe, so pushing one
+ * never blocks and costs no syscall unless the queue was empty, when the
+ * file descriptor is made readable to wake the main loop.
+ */
+struct imv_event_queue;
+
+/* Creates an imv_event_queue instance */
+struct imv_event_queue *imv_event_queue_create(void);
+
+/* Cleans up an imv_event_queue instance. Events still in it are dropped,
+ * without freeing anything they point to. */
+void imv_event_queue_free(struct imv_event_queue *queue);
+
+/* Returns a file descriptor that's readable while events are waiting */
+int imv_event_queue_fd(struct imv_event_queue *queue);
+
+/* Add a copy of e to the queue. Safe to call from any thread. */
+void imv_event_queue_push(struct imv_event_queue *queue,
+    const struct imv_event *e);
+
+/* Take the oldest event from the queue, returning false if it's empty. Must
+ * only be called from one thread. */
+bool imv_event_queue_pop(struct imv_event_queue *queue, struct imv_event *e);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
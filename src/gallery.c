@@ -0,0 +1,458 @@
+#include "gallery.h"
+
+#include "bitmap.h"
+#include "image.h"
+#include "list.h"
+#include "navigator.h"
+#include "source.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The most thumbnails to decode at once. Enough to keep every worker busy,
+ * without holding too many files open. */
+#define MAX_LOADING 32
+
+/* Thumbnails are decoded up to this many screens ahead of the visible rows,
+ * and kept up to KEEP_SCREENS away, so that scrolling back is instant */
+#define LOOKAHEAD_SCREENS 1
+#define KEEP_SCREENS 2
+
+struct thumbnail {
+  char *path;
+  /* set while the thumbnail is being decoded */
+  struct imv_source *source;
+  /* the decoded thumbnail, scaled to fit within the thumbnail size */
+  struct imv_bitmap *bitmap;
+  /* identifies the bitmap to the canvas' atlas */
+  unsigned long id;
+  bool failed;
+};
+
+struct imv_gallery {
+  struct imv_navigator *nav;
+  imv_gallery_open_func open;
+  void *open_data;
+
+  /* size of a thumbnail, and the space around it */
+  int size;
+  int padding;
+
+  size_t selection;
+  ssize_t top_row;
+  /* whether the view moves to follow the selection, or the other way round */
+  bool follow_selection;
+
+  /* layout */
+  int width;
+  int height;
+  int cell;
+  int cols;
+  int margin;
+  /* number of paths at the last layout */
+  size_t len;
+
+  struct list *thumbnails;
+  size_t num_loading;
+  unsigned long next_id;
+
+  /* set when the decodes wanted may have changed */
+  bool dirty;
+  bool need_redraw;
+};
+
+/* Non-public function from imv_image */
+struct imv_bitmap *imv_image_get_mipmap(const struct imv_image *image, int level);
+
+struct imv_gallery *imv_gallery_create(struct imv_navigator *nav,
+    imv_gallery_open_func open, void *data)
+{
+  struct imv_gallery *gallery = calloc(1, sizeof *gallery);
+  gallery->nav = nav;
+  gallery->open = open;
+  gallery->open_data = data;
+  gallery->thumbnails = list_create();
+  gallery->follow_selection = true;
+  gallery->dirty = true;
+  imv_gallery_set_thumbnail_size(gallery, 256);
+  return gallery;
+}
+
+void imv_gallery_free(struct imv_gallery *gallery)
+{
+  if (!gallery) {
+    return;
+  }
+  imv_gallery_clear(gallery);
+  list_free(gallery->thumbnails);
+  free(gallery);
+}
+
+static void free_thumbnail(struct imv_gallery *gallery, struct thumbnail *thumbnail)
+{
+  if (thumbnail->source) {
+    imv_source_async_free(thumbnail->source);
+    --gallery->num_loading;
+  }
+  if (thumbnail->bitmap) {
+    imv_bitmap_free(thumbnail->bitmap);
+  }
+  free(thumbnail->path);
+  free(thumbnail);
+}
+
+void imv_gallery_clear(struct imv_gallery *gallery)
+{
+  while (gallery->thumbnails->len > 0) {
+    free_thumbnail(gallery, gallery->thumbnails->items[gallery->thumbnails->len - 1]);
+    list_remove(gallery->thumbnails, gallery->thumbnails->len - 1);
+  }
+  gallery->dirty = true;
+  gallery->need_redraw = true;
+}
+
+void imv_gallery_set_thumbnail_size(struct imv_gallery *gallery, int size)
+{
+  if (size < 16) {
+    size = 16;
+  }
+  if (size == gallery->size) {
+    return;
+  }
+
+  /* The existing thumbnails are the wrong size now */
+  imv_gallery_clear(gallery);
+  gallery->size = size;
+  gallery->padding = size / 16 > 4 ? size / 16 : 4;
+  /* Force the grid to be laid out again */
+  gallery->cols = 0;
+}
+
+void imv_gallery_select(struct imv_gallery *gallery, ssize_t index)
+{
+  const size_t len = imv_navigator_length(gallery->nav);
+  if (index < 0 || len == 0) {
+    index = 0;
+  } else if ((size_t)index >= len) {
+    index = (ssize_t)len - 1;
+  }
+  gallery->selection = (size_t)index;
+  gallery->follow_selection = true;
+  gallery->dirty = true;
+  gallery->need_redraw = true;
+}
+
+size_t imv_gallery_selection(struct imv_gallery *gallery)
+{
+  return gallery->selection;
+}
+
+void imv_gallery_move(struct imv_gallery *gallery, ssize_t paths, ssize_t rows)
+{
+  const int cols = gallery->cols > 0 ? gallery->cols : 1;
+  const ssize_t index = (ssize_t)gallery->selection + paths + rows * cols;
+
+  /* Moving a row past either end stops in the same column */
+  if (paths == 0 && rows != 0
+      && (index < 0 || (size_t)index >= imv_navigator_length(gallery->nav))) {
+    return;
+  }
+  imv_gallery_select(gallery, index);
+}
+
+void imv_gallery_scroll(struct imv_gallery *gallery, ssize_t rows)
+{
+  gallery->top_row += rows;
+  gallery->follow_selection = false;
+  gallery->dirty = true;
+  gallery->need_redraw = true;
+}
+
+static struct thumbnail *find_thumbnail(struct imv_gallery *gallery,
+    const char *path)
+{
+  for (size_t i = 0; i < gallery->thumbnails->len; ++i) {
+    struct thumbnail *thumbnail = gallery->thumbnails->items[i];
+    if (!strcmp(thumbnail->path, path)) {
+      return thumbnail;
+    }
+  }
+  return NULL;
+}
+
+/* Start decoding the thumbnail for the path at index, if it's not already
+ * decoded or underway. Returns false once no more decodes can be started. */
+static bool request(struct imv_gallery *gallery, size_t index)
+{
+  if (gallery->num_loading >= MAX_LOADING) {
+    return false;
+  }
+
+  const char *path = imv_navigator_at(gallery->nav, index);
+  if (!path || find_thumbnail(gallery, path)) {
+    return true;
+  }
+
+  struct thumbnail *thumbnail = calloc(1, sizeof *thumbnail);
+  thumbnail->path = strdup(path);
+  list_append(gallery->thumbnails, thumbnail);
+
+  struct imv_source *src = NULL;
+  if (!gallery->open(path, &src, gallery->open_data)) {
+    thumbnail->failed = true;
+    return true;
+  }
+
+  thumbnail->source = src;
+  ++gallery->num_loading;
+  imv_source_set_priority(src, IMV_SOURCE_PRIORITY_PREFETCH);
+  imv_source_set_target_size(src, gallery->size, gallery->size);
+  imv_source_async_load_first_frame(src);
+  return true;
+}
+
+/* Drop the thumbnails for any paths outside of [first, last) */
+static void retain(struct imv_gallery *gallery, size_t first, size_t last)
+{
+  struct list *kept = list_create();
+  for (size_t i = first; i < last; ++i) {
+    const char *path = imv_navigator_at(gallery->nav, i);
+    for (size_t j = 0; path && j < gallery->thumbnails->len; ++j) {
+      struct thumbnail *thumbnail = gallery->thumbnails->items[j];
+      if (!strcmp(thumbnail->path, path)) {
+        list_append(kept, thumbnail);
+        list_remove(gallery->thumbnails, j);
+        break;
+      }
+    }
+  }
+
+  while (gallery->thumbnails->len > 0) {
+    free_thumbnail(gallery, gallery->thumbnails->items[gallery->thumbnails->len - 1]);
+    list_remove(gallery->thumbnails, gallery->thumbnails->len - 1);
+  }
+  list_free(gallery->thumbnails);
+  gallery->thumbnails = kept;
+}
+
+void imv_gallery_update(struct imv_gallery *gallery, int width, int height)
+{
+  const int cell = gallery->size + 2 * gallery->padding;
+  const int cols = width / cell > 1 ? width / cell : 1;
+  if (width != gallery->width || height != gallery->height || cols != gallery->cols) {
+    gallery->width = width;
+    gallery->height = height;
+    gallery->cell = cell;
+    gallery->cols = cols;
+    gallery->margin = width > cols * cell ? (width - cols * cell) / 2 : 0;
+    gallery->dirty = true;
+    gallery->need_redraw = true;
+  }
+
+  const size_t len = imv_navigator_length(gallery->nav);
+  if (len != gallery->len) {
+    gallery->len = len;
+    gallery->dirty = true;
+    gallery->need_redraw = true;
+  }
+  if (gallery->selection >= len && len > 0) {
+    gallery->selection = len - 1;
+  }
+
+  if (!gallery->dirty) {
+    return;
+  }
+  gallery->dirty = false;
+
+  const ssize_t total_rows = ((ssize_t)len + cols - 1) / cols;
+  const ssize_t visible_rows = (height + cell - 1) / cell;
+  const ssize_t full_rows = height / cell > 1 ? height / cell : 1;
+  const ssize_t selected_row = (ssize_t)gallery->selection / cols;
+
+  if (gallery->follow_selection) {
+    if (selected_row < gallery->top_row) {
+      gallery->top_row = selected_row;
+    } else if (selected_row >= gallery->top_row + full_rows) {
+      gallery->top_row = selected_row - full_rows + 1;
+    }
+  }
+
+  const ssize_t max_top = total_rows > full_rows ? total_rows - full_rows : 0;
+  if (gallery->top_row > max_top) {
+    gallery->top_row = max_top;
+  }
+  if (gallery->top_row < 0) {
+    gallery->top_row = 0;
+  }
+
+  /* Scrolling drags the selection along, to keep it in view */
+  if (!gallery->follow_selection && len > 0) {
+    ssize_t row = selected_row;
+    if (row < gallery->top_row) {
+      row = gallery->top_row;
+    } else if (row >= gallery->top_row + full_rows) {
+      row = gallery->top_row + full_rows - 1;
+    }
+    ssize_t index = (ssize_t)gallery->selection + (row - selected_row) * cols;
+    gallery->selection = (size_t)index < len ? (size_t)index : len - 1;
+  }
+
+  const size_t screen = (size_t)(visible_rows * cols);
+  const size_t first = (size_t)gallery->top_row * cols;
+  const size_t last = first + screen < len ? first + screen : len;
+
+  const size_t keep_first = first > KEEP_SCREENS * screen
+    ? first - KEEP_SCREENS * screen : 0;
+  const size_t keep_last = last + KEEP_SCREENS * screen < len
+    ? last + KEEP_SCREENS * screen : len;
+  retain(gallery, keep_first, keep_last);
+
+  /* What's visible comes first, then what's just below, then just above */
+  const size_t ahead = last + LOOKAHEAD_SCREENS * screen < len
+    ? last + LOOKAHEAD_SCREENS * screen : len;
+  const size_t behind = first > LOOKAHEAD_SCREENS * screen
+    ? first - LOOKAHEAD_SCREENS * screen : 0;
+
+  bool more = true;
+  for (size_t i = first; more && i < ahead; ++i) {
+    more = request(gallery, i);
+  }
+  for (size_t i = first; more && i > behind; --i) {
+    more = request(gallery, i - 1);
+  }
+}
+
+/* Scale an image's bitmap down to fit within size x size. Its mipmaps are
+ * used to get most of the way there, if it has them. */
+static struct imv_bitmap *make_thumbnail(struct imv_image *image, int size)
+{
+  struct imv_bitmap *bmp = imv_image_get_mipmap(image, 0);
+  if (!bmp) {
+    return NULL;
+  }
+
+  int width = bmp->width, height = bmp->height;
+  if (width > size || height > size) {
+    if (width >= height) {
+      height = (int)((long long)height * size / width);
+      width = size;
+    } else {
+      width = (int)((long long)width * size / height);
+      height = size;
+    }
+    width = width > 0 ? width : 1;
+    height = height > 0 ? height : 1;
+  }
+
+  for (int level = 1;; ++level) {
+    struct imv_bitmap *mipmap = imv_image_get_mipmap(image, level);
+    if (!mipmap || mipmap->width < width || mipmap->height < height) {
+      break;
+    }
+    bmp = mipmap;
+  }
+
+  /* Images without mipmaps, such as animations, are halved here instead */
+  struct imv_bitmap *owned = NULL;
+  while (bmp->width >= 2 * width && bmp->height >= 2 * height) {
+    struct imv_bitmap *half = imv_bitmap_downscale(bmp);
+    if (owned) {
+      imv_bitmap_free(owned);
+    }
+    bmp = owned = half;
+  }
+
+  struct imv_bitmap *thumbnail = bmp->width == width && bmp->height == height
+    ? imv_bitmap_clone(bmp)
+    : imv_bitmap_resize(bmp, width, height);
+  if (owned) {
+    imv_bitmap_free(owned);
+  }
+  return thumbnail;
+}
+
+bool imv_gallery_store(struct imv_gallery *gallery, struct imv_source *src,
+    struct imv_image *image)
+{
+  for (size_t i = 0; i < gallery->thumbnails->len; ++i) {
+    struct thumbnail *thumbnail = gallery->thumbnails->items[i];
+    if (thumbnail->source != src) {
+      continue;
+    }
+
+    imv_source_async_free(thumbnail->source);
+    thumbnail->source = NULL;
+    --gallery->num_loading;
+
+    thumbnail->bitmap = image ? make_thumbnail(image, gallery->size) : NULL;
+    thumbnail->id = ++gallery->next_id;
+    thumbnail->failed = !thumbnail->bitmap;
+    imv_image_free(image);
+
+    /* There's room to start another decode, if any were held back */
+    gallery->dirty = true;
+    gallery->need_redraw = true;
+    return true;
+  }
+  return false;
+}
+
+bool imv_gallery_needs_redraw(struct imv_gallery *gallery)
+{
+  return gallery->need_redraw;
+}
+
+void imv_gallery_draw(struct imv_gallery *gallery, struct imv_canvas *canvas,
+    enum upscaling_method upscaling_method)
+{
+  gallery->need_redraw = false;
+  if (gallery->cols == 0) {
+    return;
+  }
+
+  const size_t len = imv_navigator_length(gallery->nav);
+  const size_t visible_rows = (size_t)(gallery->height + gallery->cell - 1) / gallery->cell;
+  const size_t first = (size_t)gallery->top_row * gallery->cols;
+  const size_t last = first + visible_rows * gallery->cols < len
+    ? first + visible_rows * gallery->cols : len;
+
+  struct imv_canvas_thumbnail *batch = calloc(last > first ? last - first : 1,
+      sizeof *batch);
+  size_t count = 0;
+
+  /* The selection and placeholders go underneath the thumbnails */
+  imv_canvas_clear(canvas);
+  for (size_t i = first; i < last; ++i) {
+    const int x = gallery->margin + (int)((i - first) % gallery->cols) * gallery->cell;
+    const int y = (int)((i - first) / gallery->cols) * gallery->cell;
+
+    if (i == gallery->selection) {
+      imv_canvas_color(canvas, 1, 1, 1, 0.5);
+      imv_canvas_fill_rectangle(canvas, x, y, gallery->cell, gallery->cell);
+    }
+
+    const char *path = imv_navigator_at(gallery->nav, i);
+    struct thumbnail *thumbnail = path ? find_thumbnail(gallery, path) : NULL;
+    if (!thumbnail || !thumbnail->bitmap) {
+      const float shade = thumbnail && thumbnail->failed ? 0.05 : 0.15;
+      imv_canvas_color(canvas, 1, 1, 1, shade);
+      imv_canvas_fill_rectangle(canvas, x + gallery->padding, y + gallery->padding,
+          gallery->size, gallery->size);
+      continue;
+    }
+
+    struct imv_canvas_thumbnail *entry = &batch[count++];
+    entry->id = thumbnail->id;
+    entry->bitmap = thumbnail->bitmap;
+    entry->width = thumbnail->bitmap->width;
+    entry->height = thumbnail->bitmap->height;
+    entry->x = x + gallery->padding + (gallery->size - entry->width) / 2;
+    entry->y = y + gallery->padding + (gallery->size - entry->height) / 2;
+  }
+  imv_canvas_draw(canvas);
+
+  imv_canvas_draw_thumbnails(canvas, batch, count, gallery->size, upscaling_method);
+  free(batch);
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,75 @@
+#ifndef IMV_GALLERY_H
+#define IMV_GALLERY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "canvas.h"
+
+/* imv_gallery lays out the navigator's paths as a grid of thumbnails. Only
+ * the rows that are visible, or about to be, are decoded. Each is decoded at
+ * a reduced resolution where the backend allows it, and the decodes run in
+ * parallel in the background.
+ */
+struct imv_gallery;
+
+struct imv_image;
+struct imv_navigator;
+struct imv_source;
+
+/* Opens a source for path, which is to send its images to
+ * imv_gallery_store. Returns false if the path can't be opened. */
+typedef bool (*imv_gallery_open_func)(const char *path, struct imv_source **src,
+    void *data);
+
+/* Creates an imv_gallery instance showing the paths in nav, using open to
+ * open a source for each thumbnail */
+struct imv_gallery *imv_gallery_create(struct imv_navigator *nav,
+    imv_gallery_open_func open, void *data);
+
+/* Cleans up an imv_gallery instance */
+void imv_gallery_free(struct imv_gallery *gallery);
+
+/* Set the size of the thumbnails, in pixels */
+void imv_gallery_set_thumbnail_size(struct imv_gallery *gallery, int size);
+
+/* Select the path at index, scrolling it into view */
+void imv_gallery_select(struct imv_gallery *gallery, ssize_t index);
+
+/* Get the index of the selected path */
+size_t imv_gallery_selection(struct imv_gallery *gallery);
+
+/* Move the selection by the given number of paths, and rows of the grid,
+ * scrolling it into view */
+void imv_gallery_move(struct imv_gallery *gallery, ssize_t paths, ssize_t rows);
+
+/* Scroll the view by the given number of rows, moving the selection with it
+ * if it would go out of view */
+void imv_gallery_scroll(struct imv_gallery *gallery, ssize_t rows);
+
+/* Lay the grid out to fit a width x height buffer, and start decoding any
+ * thumbnails that are wanted. Thumbnails too far from view are dropped.
+ * Should be called regularly, as decoding is throttled. */
+void imv_gallery_update(struct imv_gallery *gallery, int width, int height);
+
+/* Stores the result of a thumbnail's load. A NULL image records that the load
+ * failed. Returns false if the source does not belong to the gallery, in
+ * which case the caller retains ownership of image.
+ */
+bool imv_gallery_store(struct imv_gallery *gallery, struct imv_source *src,
+    struct imv_image *image);
+
+/* Returns true if the gallery has changed since it was last drawn */
+bool imv_gallery_needs_redraw(struct imv_gallery *gallery);
+
+/* Draw the gallery, as laid out by the last imv_gallery_update */
+void imv_gallery_draw(struct imv_gallery *gallery, struct imv_canvas *canvas,
+    enum upscaling_method upscaling_method);
+
+/* Drop every thumbnail, and stop any decodes in progress */
+void imv_gallery_clear(struct imv_gallery *gallery);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
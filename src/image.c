@@ -2,39 +2,125 @@
 
 #include "bitmap.h"
 
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+/* Mipmaps stop once they're smaller than this in both dimensions */
+#define MIPMAP_MIN_SIZE 256
+
+/* Enough mipmaps for images up to 2^(MAX_MIPMAPS + 8) pixels wide */
+#define MAX_MIPMAPS 16
+
+/* Vector images are never rasterised larger than this many pixels. Beyond
+ * it, the largest raster is scaled up as it's drawn. */
+#define MAX_RASTER_PIXELS (16 * 1024 * 1024)
+
 struct imv_image {
+  int refcount;
+  /* unique to the image, so frames can say which one they follow on from */
+  unsigned long id;
   int width;
   int height;
   struct imv_bitmap *bitmap;
-  #ifdef IMV_BACKEND_LIBRSVG
-  RsvgHandle *svg;
-  #endif
+  /* the part of the full image the bitmap covers, all of it unless it's a
+   * region */
+  bool region;
+  int region_x, region_y, region_width, region_height;
+  /* successively halved copies of bitmap, for drawing at small scales */
+  struct imv_bitmap *mipmaps[MAX_MIPMAPS];
+  int num_mipmaps;
+  /* draws a vector image, given vector_data */
+  imv_image_render_func render;
+  void (*free_vector_data)(void *data);
+  void *vector_data;
+  /* the vector image rendered at raster_scale, drawn in its place */
+  struct imv_bitmap *raster;
+  double raster_scale;
+  /* the only part of the bitmap that differs from the image with id
+   * damage_base, or damage_base 0 if any of it may */
+  unsigned long damage_base;
+  int damage_x, damage_y, damage_width, damage_height;
 };
 
-struct imv_image *imv_image_create_from_bitmap(struct imv_bitmap *bmp)
+/* Images are shared between the main thread and background work, such as
+ * the disk cache, so references are counted under a lock */
+static pthread_mutex_t refcount_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The id the next image is given, also protected by refcount_lock */
+static unsigned long next_id = 1;
+
+static struct imv_image *alloc_image(void)
 {
   struct imv_image *image = calloc(1, sizeof *image);
+  image->refcount = 1;
+  pthread_mutex_lock(&refcount_lock);
+  image->id = next_id++;
+  pthread_mutex_unlock(&refcount_lock);
+  return image;
+}
+
+struct imv_image *imv_image_create_from_bitmap(struct imv_bitmap *bmp)
+{
+  struct imv_image *image = alloc_image();
   image->width = bmp->width;
   image->height = bmp->height;
+  image->region_width = bmp->width;
+  image->region_height = bmp->height;
   image->bitmap = bmp;
   return image;
 }
 
-#ifdef IMV_BACKEND_LIBRSVG
-struct imv_image *imv_image_create_from_svg(RsvgHandle *handle)
+struct imv_image *imv_image_create_from_reduced_bitmap(struct imv_bitmap *bmp,
+    int width, int height)
 {
-  struct imv_image *image = calloc(1, sizeof *image);
-  image->svg = handle;
+  struct imv_image *image = imv_image_create_from_bitmap(bmp);
+  image->width = width;
+  image->height = height;
+  image->region_width = width;
+  image->region_height = height;
+  return image;
+}
+
+struct imv_image *imv_image_create_from_region(struct imv_bitmap *bmp,
+    int width, int height, int x, int y, int region_width, int region_height)
+{
+  struct imv_image *image = imv_image_create_from_bitmap(bmp);
+  image->width = width;
+  image->height = height;
+  image->region = true;
+  image->region_x = x;
+  image->region_y = y;
+  image->region_width = region_width;
+  image->region_height = region_height;
+  return image;
+}
 
-  RsvgDimensionData dim;
-  rsvg_handle_get_dimensions(handle, &dim);
-  image->width = dim.width;
-  image->height = dim.height;
+struct imv_image *imv_image_create_from_vector(int width, int height,
+    imv_image_render_func render, void (*free_data)(void *data), void *data)
+{
+  struct imv_image *image = alloc_image();
+  image->width = width;
+  image->height = height;
+  image->region_width = width;
+  image->region_height = height;
+  image->render = render;
+  image->free_vector_data = free_data;
+  image->vector_data = data;
+  return image;
+}
+
+struct imv_image *imv_image_ref(struct imv_image *image)
+{
+  if (image) {
+    pthread_mutex_lock(&refcount_lock);
+    image->refcount++;
+    pthread_mutex_unlock(&refcount_lock);
+  }
   return image;
 }
-#endif
 
 void imv_image_free(struct imv_image *image)
 {
@@ -42,15 +128,26 @@ void imv_image_free(struct imv_image *image)
     return;
   }
 
+  pthread_mutex_lock(&refcount_lock);
+  const bool released = --image->refcount == 0;
+  pthread_mutex_unlock(&refcount_lock);
+  if (!released) {
+    return;
+  }
+
   if (image->bitmap) {
     imv_bitmap_free(image->bitmap);
   }
+  for (int i = 0; i < image->num_mipmaps; ++i) {
+    imv_bitmap_free(image->mipmaps[i]);
+  }
+  if (image->raster) {
+    imv_bitmap_free(image->raster);
+  }
 
-#ifdef IMV_BACKEND_LIBRSVG
-  if (image->svg) {
-    g_object_unref(image->svg);
+  if (image->free_vector_data) {
+    image->free_vector_data(image->vector_data);
   }
-#endif
 
   free(image);
 }
@@ -65,17 +162,186 @@ int imv_image_height(const struct imv_image *image)
   return image ? image->height : 0;
 }
 
+void imv_image_generate_mipmaps(struct imv_image *image)
+{
+  if (!image->bitmap || image->num_mipmaps > 0) {
+    return;
+  }
+
+  const struct imv_bitmap *prev = image->bitmap;
+  while (image->num_mipmaps < MAX_MIPMAPS
+      && (prev->width > MIPMAP_MIN_SIZE || prev->height > MIPMAP_MIN_SIZE)) {
+    struct imv_bitmap *next = imv_bitmap_downscale(prev);
+    image->mipmaps[image->num_mipmaps++] = next;
+    prev = next;
+  }
+}
+
+size_t imv_image_bytes(const struct imv_image *image)
+{
+  if (!image) {
+    return 0;
+  }
+  if (!image->bitmap) {
+    /* Vector images are rendered at whatever size they're drawn */
+    return 4 * (size_t)image->width * (size_t)image->height;
+  }
+
+  size_t bytes = imv_bitmap_bytes(image->bitmap);
+  for (int i = 0; i < image->num_mipmaps; ++i) {
+    bytes += imv_bitmap_bytes(image->mipmaps[i]);
+  }
+  return bytes;
+}
+
+double imv_image_bitmap_scale(const struct imv_image *image)
+{
+  if (!image || !image->bitmap || image->region_width <= 0) {
+    return 1.0;
+  }
+  return (double)image->bitmap->width / (double)image->region_width;
+}
+
+bool imv_image_get_region(const struct imv_image *image, int *x, int *y,
+    int *width, int *height)
+{
+  *x = image->region_x;
+  *y = image->region_y;
+  *width = image->region_width;
+  *height = image->region_height;
+  return image->region;
+}
+
+unsigned long imv_image_id(const struct imv_image *image)
+{
+  return image->id;
+}
+
+void imv_image_set_damage(struct imv_image *image, unsigned long base,
+    int x, int y, int width, int height)
+{
+  image->damage_base = base;
+  image->damage_x = x;
+  image->damage_y = y;
+  image->damage_width = width;
+  image->damage_height = height;
+}
+
+bool imv_image_is_vector(const struct imv_image *image)
+{
+  return image && image->render;
+}
+
+/* Cairo's pixels are premultiplied, the canvas blends straight alpha */
+static void unpremultiply(uint32_t *dst, const uint32_t *src, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    const uint32_t p = src[i];
+    const uint32_t a = p >> 24;
+    if (a == 0 || a == 255) {
+      dst[i] = a ? p : 0;
+      continue;
+    }
+    const uint32_t r = (((p >> 16) & 0xff) * 255 + a / 2) / a;
+    const uint32_t g = (((p >> 8) & 0xff) * 255 + a / 2) / a;
+    const uint32_t b = ((p & 0xff) * 255 + a / 2) / a;
+    dst[i] = a << 24 | r << 16 | g << 8 | b;
+  }
+}
+
+struct imv_bitmap *imv_image_rasterize(const struct imv_image *image,
+    double scale)
+{
+  if (!image->render || !(scale > 0.0) || image->width <= 0 || image->height <= 0) {
+    return NULL;
+  }
+
+  const double pixels = image->width * scale * image->height * scale;
+  if (pixels > MAX_RASTER_PIXELS) {
+    scale *= sqrt(MAX_RASTER_PIXELS / pixels);
+  }
+  int width = (int)ceil(image->width * scale);
+  int height = (int)ceil(image->height * scale);
+  width = width > 0 ? width : 1;
+  height = height > 0 ? height : 1;
+
+  cairo_surface_t *surface =
+    cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(surface);
+    return NULL;
+  }
+
+  cairo_t *cairo = cairo_create(surface);
+  cairo_scale(cairo, (double)width / image->width,
+      (double)height / image->height);
+  image->render(image->vector_data, cairo);
+  cairo_destroy(cairo);
+  cairo_surface_flush(surface);
+
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
+  bmp->width = width;
+  bmp->height = height;
+  bmp->format = IMV_ARGB;
+  bmp->data = malloc(4 * (size_t)width * (size_t)height);
+
+  const unsigned char *src = cairo_image_surface_get_data(surface);
+  const size_t stride = cairo_image_surface_get_stride(surface);
+  for (int y = 0; y < height; ++y) {
+    unpremultiply((uint32_t *)bmp->data + (size_t)y * width,
+        (const uint32_t *)(src + y * stride), width);
+  }
+  cairo_surface_destroy(surface);
+  return bmp;
+}
+
+void imv_image_set_raster(struct imv_image *image, struct imv_bitmap *bmp,
+    double scale)
+{
+  if (image->raster) {
+    imv_bitmap_free(image->raster);
+  }
+  image->raster = bmp;
+  image->raster_scale = bmp ? scale : 0.0;
+}
+
+double imv_image_raster_scale(const struct imv_image *image)
+{
+  return image && image->raster ? image->raster_scale : 0.0;
+}
+
 /* Non-public functions, only used by imv_canvas */
 struct imv_bitmap *imv_image_get_bitmap(const struct imv_image *image)
 {
   return image->bitmap;
 }
 
-#ifdef IMV_BACKEND_LIBRSVG
-RsvgHandle *imv_image_get_svg(const struct imv_image *image)
+/* Level 0 is the bitmap itself. Returns NULL beyond the smallest mipmap. */
+struct imv_bitmap *imv_image_get_mipmap(const struct imv_image *image, int level)
+{
+  if (level == 0) {
+    return image->bitmap;
+  }
+  return level <= image->num_mipmaps ? image->mipmaps[level - 1] : NULL;
+}
+
+/* Returns false if any of the bitmap may differ from the image with id base */
+bool imv_image_get_damage(const struct imv_image *image, unsigned long base,
+    int *x, int *y, int *width, int *height)
+{
+  if (!base || image->damage_base != base) {
+    return false;
+  }
+  *x = image->damage_x;
+  *y = image->damage_y;
+  *width = image->damage_width;
+  *height = image->damage_height;
+  return true;
+}
+
+struct imv_bitmap *imv_image_get_raster(const struct imv_image *image)
 {
-  return image->svg;
+  return image->raster;
 }
-#endif
 
 /* vim:set ts=2 sts=2 sw=2 et: */
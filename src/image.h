@@ -3,19 +3,42 @@
 
 #include "bitmap.h"
 
-#ifdef IMV_BACKEND_LIBRSVG
-#include <librsvg/rsvg.h>
-#endif
+#include <cairo/cairo.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 struct imv_image;
 
 struct imv_image *imv_image_create_from_bitmap(struct imv_bitmap *bmp);
 
-#ifdef IMV_BACKEND_LIBRSVG
-struct imv_image *imv_image_create_from_svg(RsvgHandle *handle);
-#endif
+/* Creates an image from a bitmap decoded at a reduced resolution. width and
+ * height give the size of the full image, which the bitmap stands in for */
+struct imv_image *imv_image_create_from_reduced_bitmap(struct imv_bitmap *bmp,
+    int width, int height);
+
+/* Creates an image of part of a larger one, such as the area around what's
+ * onscreen of an image too big to decode all of. width and height give the
+ * size of the full image, and the rectangle, in its pixels, the part the
+ * bitmap covers, which may be at a reduced resolution */
+struct imv_image *imv_image_create_from_region(struct imv_bitmap *bmp,
+    int width, int height, int x, int y, int region_width, int region_height);
+
+/* Draws a vector image into cairo at its own size, for imv_image_rasterize.
+ * Only called by one thread at a time for each image. */
+typedef void (*imv_image_render_func)(void *data, cairo_t *cairo);
 
-/* Cleans up an imv_image instance */
+/* Creates a vector image of the given size, drawn by render. free_data is
+ * called on data once the image is freed. */
+struct imv_image *imv_image_create_from_vector(int width, int height,
+    imv_image_render_func render, void (*free_data)(void *data), void *data);
+
+/* Takes an additional reference to an image. Each reference must be released
+ * with imv_image_free. References may be taken and released from any thread,
+ * but the image must not be modified once it's shared. */
+struct imv_image *imv_image_ref(struct imv_image *image);
+
+/* Releases a reference to an imv_image instance, cleaning it up once the last
+ * reference is released */
 void imv_image_free(struct imv_image *image);
 
 /* Get the image width */
@@ -24,6 +47,55 @@ int imv_image_width(const struct imv_image *image);
 /* Get the image height */
 int imv_image_height(const struct imv_image *image);
 
+/* Build successively halved copies of the image's bitmap, so that it can be
+ * drawn at small scales without aliasing, or reading every pixel. Slow, so
+ * should be done on the thread that loaded the image, before handing it on. */
+void imv_image_generate_mipmaps(struct imv_image *image);
+
+/* Get the number of bytes of memory used by the image's pixels */
+size_t imv_image_bytes(const struct imv_image *image);
+
+/* Get the resolution the image was decoded at, relative to its full size.
+ * 1.0 unless the image came from a reduced resolution bitmap, or a region
+ * decoded at one */
+double imv_image_bitmap_scale(const struct imv_image *image);
+
+/* Get the rectangle of the full image that the image's bitmap covers, in
+ * full resolution pixels. Returns false, with the rectangle being the whole
+ * image, unless the image was created with imv_image_create_from_region. */
+bool imv_image_get_region(const struct imv_image *image, int *x, int *y,
+    int *width, int *height);
+
+/* Get a number that identifies the image, unique among every image created */
+unsigned long imv_image_id(const struct imv_image *image);
+
+/* Record that the image's bitmap only differs from that of the image with
+ * id base within the given rectangle, such as when an animation frame only
+ * redraws part of the one before it. Lets whatever's drawing the image update
+ * just that part. Must be called before the image is shared. */
+void imv_image_set_damage(struct imv_image *image, unsigned long base,
+    int x, int y, int width, int height);
+
+/* Whether the image is drawn from vector data, through rasters made with
+ * imv_image_rasterize, rather than from a bitmap */
+bool imv_image_is_vector(const struct imv_image *image);
+
+/* Render a vector image at the given scale, relative to its size, capped
+ * at a sensible number of pixels. Slow, so best done on a worker thread, but
+ * only one at a time for each image. Returns NULL if the image isn't a vector
+ * image or can't be rendered. */
+struct imv_bitmap *imv_image_rasterize(const struct imv_image *image,
+    double scale);
+
+/* Replace the raster a vector image is drawn from, taking ownership of bmp.
+ * Rasters are only used by the thread drawing the image, so this is the one
+ * change that may be made to a shared image, from that thread. */
+void imv_image_set_raster(struct imv_image *image, struct imv_bitmap *bmp,
+    double scale);
+
+/* Get the scale of the image's current raster, or 0 if it has none */
+double imv_image_raster_scale(const struct imv_image *image);
+
 #endif
 
 
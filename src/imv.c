@@ -4,27 +4,41 @@
 #include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <wordexp.h>
 
 #include "backend.h"
 #include "binds.h"
+#include "cache.h"
 #include "canvas.h"
 #include "commands.h"
 #include "console.h"
+#include "disk_cache.h"
+#include "gallery.h"
 #include "image.h"
 #include "ini.h"
 #include "ipc.h"
+#include "latency.h"
 #include "list.h"
 #include "log.h"
 #include "navigator.h"
+#include "opener.h"
+#include "pool.h"
+#include "scanner.h"
 #include "source.h"
+#include "stream.h"
+#include "template.h"
 #include "viewport.h"
+#include "watcher.h"
 #include "window.h"
 
 /* Some systems like GNU/Hurd don't define PATH_MAX */
@@ -32,6 +46,48 @@
 #define PATH_MAX 4096
 #endif
 
+/* Bounds on the size of the gallery's thumbnails, and how much each step of
+ * zooming the gallery changes it by */
+#define MIN_THUMBNAIL_SIZE 64
+#define MAX_THUMBNAIL_SIZE 1024
+#define THUMBNAIL_SIZE_STEP 32
+
+/* If an animation falls further behind than this, in seconds, such as after
+ * being paused, it's restarted from its current frame rather than having
+ * frames skipped to catch up */
+#define MAX_ANIMATION_LAG 0.25
+
+/* Directories are scanned on this many threads. Reading them is mostly
+ * waiting on the filesystem, so it's more than there might be cores. */
+#define SCAN_THREADS 4
+
+/* Paths read from stdin are passed to the main loop up to this many at a
+ * time, rather than one event each */
+#define PATHS_PER_EVENT 4096
+
+/* While paths are arriving, the title and overlay are redrawn with the new
+ * count at most this often, in seconds */
+#define PATH_REDRAW_INTERVAL 0.1
+
+/* A vector image is rasterised again once it's drawn at a scale this many
+ * times larger or smaller than its raster was made for. Until then, the
+ * raster is scaled to fit. */
+#define RASTER_TOLERANCE 1.25
+
+/* Images with at least this many pixels, from a source that can load part of
+ * an image, have just the part that's in view loaded in more detail when
+ * zoomed in, rather than all of it at full resolution */
+#define REGION_MIN_PIXELS (32 * 1024 * 1024)
+
+/* While the view's moving, each frame may spend this much of the display's
+ * refresh interval uploading tiles, the rest being filled in roughly until
+ * it stops */
+#define MOTION_UPLOAD_SHARE 0.5
+
+/* The next slide's decode is started this many times as long before its
+ * slot as recent images have taken to open and decode */
+#define SLIDESHOW_LEAD_FACTOR 2.0
+
 static const char *scaling_label[] = {
   "actual size",
   "shrink to fit",
@@ -49,26 +105,92 @@ enum internal_event_type {
   NEW_IMAGE,
   BAD_IMAGE,
   NEW_PATH,
-  COMMAND
+  NEW_PATHS,
+  COMMAND,
+  NEW_RASTER,
+  NEW_REGION,
+  NEW_STDIN_SOURCE
+};
+
+struct frame {
+  struct imv_image *image;
+  /* how long it's to be shown for, in seconds */
+  double duration;
+  /* its position within the animation */
+  int index;
+};
+
+/* A vector image being rasterised in the background */
+struct raster_job {
+  struct imv *imv;
+  struct imv_image *image;
+  double scale;
+  /* the result, NULL until it's done or if it failed */
+  struct imv_bitmap *bitmap;
 };
 
 struct internal_event {
   enum internal_event_type type;
   union {
     struct {
+      struct imv_source *source;
       struct imv_image *image;
       int frametime;
-      bool is_new_image;
+      int frame_index;
+      int frame_count;
+      int page_index;
+      bool preview;
+      double decode_time;
+      double sent_time;
     } new_image;
     struct {
-      char *path;
+      struct imv_source *source;
+    } bad_image;
+    struct {
+      /* the paths, in the order they were read */
+      struct list *paths;
     } new_path;
+    struct {
+      struct imv_scanner_batch *batch;
+    } new_paths;
     struct {
       char *text;
+      /* where to send the reply, if it came over IPC */
+      struct imv_ipc_request *request;
     } command;
+    struct {
+      struct raster_job *job;
+    } new_raster;
+    struct {
+      struct imv_source *source;
+      /* NULL if it couldn't be loaded */
+      struct imv_image *image;
+      int page_index;
+    } new_region;
+    struct {
+      struct stdin_job *job;
+    } new_stdin_source;
   } data;
 };
 
+/* stdin being opened by the backends that can only read it once it's all
+ * arrived */
+struct stdin_job {
+  struct imv *imv;
+  /* the backends to try, freed once they have been */
+  struct list *pending;
+  /* the result, once they have */
+  enum backend_result result;
+  struct imv_source *source;
+};
+
+/* A directory to be scanned, and watched for new files once it has been */
+struct scan_request {
+  char *path;
+  bool recursive;
+  unsigned group;
+};
+
 struct imv {
   /* set to true to trigger clean exit */
   bool quit;
@@ -76,6 +198,35 @@ struct imv {
   /* indicates a new image is being loaded */
   bool loading;
 
+  /* indicates the current image is being reloaded at full resolution */
+  bool loading_full_res;
+
+  /* indicates the current image is a preview, and the real one is loading */
+  bool showing_preview;
+
+  /* the part of a very large current image that's in view, loaded in more
+   * detail than the whole of it is */
+  struct {
+    struct imv_image *image;
+    /* the source and page it's part of */
+    struct imv_source *source;
+    int page;
+    /* set while one is being loaded */
+    bool loading;
+    /* set once one has failed to load, after which the whole image is
+     * reloaded at full resolution instead */
+    bool failed;
+  } region;
+
+  /* show a grid of thumbnails, rather than the current image */
+  bool gallery_enabled;
+
+  /* size of the gallery's thumbnails, in pixels */
+  int thumbnail_size;
+
+  /* how long zooming and panning glide for, in seconds */
+  double transition_time;
+
   /* initial fullscreen state */
   bool start_fullscreen;
 
@@ -94,6 +245,11 @@ struct imv {
   bool need_rescale;
   bool cache_invalidated;
 
+  /* paths were added, so the image count needs redrawing, which happens at
+   * most every PATH_REDRAW_INTERVAL while paths keep arriving */
+  bool paths_changed;
+  double paths_redrawn;
+
   /* traverse sub-directories for more images */
   bool recursive_load;
 
@@ -120,29 +276,156 @@ struct imv {
     struct { unsigned char r, g, b; } color;
   } background;
 
+  /* decode neighbouring images ahead of time */
+  struct {
+    /* how many images to decode in the direction of travel, and behind it */
+    int ahead;
+    int behind;
+    /* how many bytes of decoded images may be held onto */
+    size_t max_bytes;
+  } prefetch;
+
+  /* keep screen sized copies of large images on disk, between sessions */
+  struct {
+    bool enabled;
+    /* how many bytes of disk space may be used */
+    size_t max_bytes;
+    struct imv_disk_cache *cache;
+  } disk_cache;
+
+  /* share decoded images with other instances, through memory */
+  struct {
+    bool enabled;
+    /* how many bytes of memory may be used, between every instance */
+    size_t max_bytes;
+    struct imv_disk_cache *cache;
+  } shared_cache;
+
   /* slideshow state tracking */
   struct {
     double duration;
     double elapsed;
+    /* the next slide has been asked to be decoded ahead of time */
+    bool prepared;
+    /* how long decoding each image has taken, prefetched ones included */
+    struct imv_latency *decodes;
   } slideshow;
 
+  /* pacing of presentation, driven by the display */
+  struct {
+    /* a frame has been presented, and the display isn't ready for another */
+    bool pending;
+    /* the cur_time() times the last frame was presented, and the display was
+     * last ready for another */
+    double presented;
+    double ready;
+    /* estimated time between the display's refreshes */
+    double interval;
+    /* animation frames skipped because their time had already passed */
+    unsigned long dropped;
+  } display;
+
+  /* playback of animated images */
   struct {
-    /* for animated images, the getTime() time to display the next frame */
+    /* the getTime() time to display the next frame, or 0 if not animated */
     double due;
-    /* how long the next frame to be put onscreen should be displayed for */
-    double duration;
-    /* the next frame of an animated image, pre-fetched */
-    struct imv_image *image;
-    /* force the next frame to load, even if early */
+    /* frames decoded ahead of the one onscreen, in the order they're shown */
+    struct list *queue;
+    size_t queue_bytes;
+    /* how many frames to decode ahead, and how many bytes of frames may be
+     * held onto by the queue, or by the loop */
+    int lookahead;
+    size_t max_bytes;
+    /* whether the source is decoding a frame for the queue */
+    bool loading;
+    /* every frame of the animation, indexed by position, if they all fit in
+     * max_bytes. Once it's complete, later loops are played from memory
+     * rather than decoded again. */
+    struct frame *loop;
+    int loop_len;
+    int loop_filled;
+    size_t loop_bytes;
+    /* position within the animation of the frame onscreen */
+    int current;
+    /* force the next frame to show, even if early */
     bool force_next_frame;
-  } next_frame;
+  } animation;
+
+  /* pages of a multi-page file, counting from 0 */
+  struct {
+    /* the page onscreen, and the one asked for */
+    int current;
+    int wanted;
+    /* the page the current source is loading, or -1 */
+    int loading;
+    /* which way the pages are being turned, 1 or -1 */
+    int direction;
+    /* the page after the current one in that direction, read ahead so that
+     * it can be shown straight away */
+    struct imv_image *ahead;
+    int ahead_index;
+  } page;
 
   struct imv_image *current_image;
 
+  /* timing of each stage of showing the image selected last */
+  struct {
+    struct imv_latency *stats;
+    /* the cur_time() it was selected, or 0 once it's been shown */
+    double selected;
+    /* its first full resolution image has arrived, and is still to be drawn,
+     * or it's been presented at the cur_time() in presented, and the display
+     * isn't ready yet */
+    bool drawing;
+    double presented;
+  } latency;
+
+  /* the output of the command being run for an IPC client, if it is one */
+  struct {
+    bool active;
+    char *output;
+    size_t len;
+    size_t cap;
+    /* set by a command that failed, in place of any output */
+    const char *error;
+  } reply;
+
+  /* vector images are rasterised on their own thread, one at a time */
+  struct {
+    struct imv_pool *pool;
+    /* the raster being made, if any */
+    struct raster_job *job;
+  } raster;
+
+  /* stdin's opened on a thread of its own when it can only be read once
+   * it's all arrived, so the window isn't left frozen meanwhile */
+  struct {
+    struct imv_pool *pool;
+    /* the job for stdin as currently selected, if it's still running */
+    struct stdin_job *job;
+  } stdin_open;
+
+  /* what was last drawn on the canvas for the overlay and command prompt, so
+   * that it's only drawn and uploaded again when it changes */
+  struct {
+    bool valid;
+    int width, height;
+    bool overlay_enabled;
+    char *text;
+    char *prompt;
+    size_t cursor;
+  } drawn_overlay;
+
+  /* path that current_source was opened from */
+  char *current_path;
+
   /* overlay font */
   struct {
     char *name;
     int size;
+    /* buffer pixels per window pixel the canvas's font was set for, or 0
+     * before there's a canvas */
+    double scale;
   } font;
 
   /* if specified by user, the path of the first image to display */
@@ -151,26 +434,39 @@ struct imv {
   /* list of startup commands to be run on launch, after loading the config */
   struct list *startup_commands;
 
+  /* directories being searched for images in the background */
+  struct {
+    struct imv_scanner *scanner;
+    /* scan_requests waiting for the window, and those started */
+    struct list *waiting;
+    struct list *active;
+    /* those finished, whose directories are watched for new files, by
+     * their canonical paths as the watcher reports them */
+    struct list *watched;
+  } scan;
+
   /* the user-specified format strings for the overlay and window title */
-  char *title_text;
-  char *overlay_text;
+  struct imv_template *title_text;
+  struct imv_template *overlay_text;
 
   /* imv subsystems */
   struct imv_binds *binds;
   struct imv_navigator *navigator;
-  struct list *backends;
+  struct imv_opener *opener;
   struct imv_source *current_source;
   struct imv_source *last_source;
+  struct imv_cache *cache;
+  struct imv_gallery *gallery;
   struct imv_commands *commands;
   struct imv_console *console;
   struct imv_ipc *ipc;
   struct imv_viewport *view;
   struct imv_canvas *canvas;
+  struct imv_watcher *watcher;
   struct imv_window *window;
 
-  /* if reading an image from stdin, this is the buffer for it */
-  void *stdin_image_data;
-  size_t stdin_image_data_len;
+  /* if reading an image from stdin, this is the data arriving on it */
+  struct imv_stream *stdin_stream;
 };
 
 static void command_quit(struct list *args, const char *argstr, void *data);
@@ -189,19 +485,34 @@ static void command_exec(struct list *args, const char *argstr, void *data);
 static void command_center(struct list *args, const char *argstr, void *data);
 static void command_reset(struct list *args, const char *argstr, void *data);
 static void command_next_frame(struct list *args, const char *argstr, void *data);
+static void command_page(struct list *args, const char *argstr, void *data);
 static void command_toggle_playing(struct list *args, const char *argstr, void *data);
 static void command_set_scaling_mode(struct list *args, const char *argstr, void *data);
 static void command_set_upscaling_method(struct list *args, const char *argstr, void *data);
 static void command_set_slideshow_duration(struct list *args, const char *argstr, void *data);
 static void command_set_background(struct list *args, const char *argstr, void *data);
 static void command_bind(struct list *args, const char *argstr, void *data);
+static void command_gallery(struct list *args, const char *argstr, void *data);
+static void command_latency(struct list *args, const char *argstr, void *data);
+static void command_get(struct list *args, const char *argstr, void *data);
 
 static bool setup_window(struct imv *imv);
+static void handle_new_image(struct imv *imv, struct imv_image *image, int frametime,
+    int frame_index, int frame_count);
+static void stop_animation(struct imv *imv);
+static void reset_pages(struct imv *imv);
+static void drop_region(struct imv *imv);
+static void update_pages(struct imv *imv);
+static bool frame_ready(struct imv *imv);
+static void take_frame(struct imv *imv, struct frame *out);
+static void request_frame(struct imv *imv);
 static void consume_internal_event(struct imv *imv, struct internal_event *event);
+static bool open_thumbnail(const char *path, struct imv_source **src, void *data);
 static void render_window(struct imv *imv);
 static void update_env_vars(struct imv *imv);
-static size_t generate_env_text(struct imv *imv, char *buf, size_t len, const char *format);
-static size_t read_from_stdin(void **buffer);
+static const char *expand_template(struct imv *imv, struct imv_template *tmpl,
+    bool *changed);
+static void update_title(struct imv *imv);
 
 /* Finds the next split between commands in a string (';'). Provides a pointer
  * to the next character after the delimiter as out, or a pointer to '\0' if
@@ -320,33 +631,59 @@ static double cur_time(void)
   return ts.tv_sec + (double)ts.tv_nsec * 0.000000001;
 }
 
-static void source_callback(struct imv_source_message *msg)
+/* Add to the output sent back to the IPC client whose command is running.
+ * Does nothing for commands from anywhere else. */
+static void reply(struct imv *imv, const char *fmt, ...)
 {
-  struct imv *imv = msg->user_data;
-  if (msg->source != imv->current_source) {
-    /* We received a message from an old source, tidy up contents
-     * as required, but ignore it.
-     */
-    if (msg->image) {
-      imv_image_free(msg->image);
-    }
+  if (!imv->reply.active) {
     return;
   }
 
+  va_list args;
+  va_start(args, fmt);
+  va_list measure;
+  va_copy(measure, args);
+  const int len = vsnprintf(NULL, 0, fmt, measure);
+  va_end(measure);
+
+  if (len >= 0) {
+    if (imv->reply.len + len + 1 > imv->reply.cap) {
+      imv->reply.cap = (imv->reply.len + len + 1) * 2;
+      imv->reply.output = realloc(imv->reply.output, imv->reply.cap);
+    }
+    vsnprintf(imv->reply.output + imv->reply.len, len + 1, fmt, args);
+    imv->reply.len += len;
+  }
+  va_end(args);
+}
+
+static void source_callback(struct imv_source_message *msg)
+{
+  struct imv *imv = msg->user_data;
+
+  /* The message may be from the current source, a prefetched one, or an old
+   * one. That's decided on the main thread, when the event is consumed.
+   */
   struct internal_event *event = calloc(1, sizeof *event);
-  if (msg->image) {
+  if (msg->region) {
+    event->type = NEW_REGION;
+    event->data.new_region.source = msg->source;
+    event->data.new_region.image = msg->image;
+    event->data.new_region.page_index = msg->page_index;
+  } else if (msg->image) {
     event->type = NEW_IMAGE;
+    event->data.new_image.source = msg->source;
     event->data.new_image.image = msg->image;
     event->data.new_image.frametime = msg->frametime;
-
-    /* Keep track of the last source to send us an image in order to detect
-     * when we're getting a new image, as opposed to a new frame from the
-     * same image.
-     */
-    event->data.new_image.is_new_image = msg->source != imv->last_source;
-    imv->last_source = msg->source;
+    event->data.new_image.frame_index = msg->frame_index;
+    event->data.new_image.frame_count = msg->frame_count;
+    event->data.new_image.page_index = msg->page_index;
+    event->data.new_image.preview = msg->preview;
+    event->data.new_image.decode_time = msg->decode_time;
+    event->data.new_image.sent_time = msg->sent_time;
   } else {
     event->type = BAD_IMAGE;
+    event->data.bad_image.source = msg->source;
   }
 
   struct imv_event e = {
@@ -359,13 +696,15 @@ static void source_callback(struct imv_source_message *msg)
   imv_window_push_event(imv->window, &e);
 }
 
-static void command_callback(const char *text, void *data)
+/* Queue a command up to be run on the main thread, with the IPC request
+ * that's to get its reply, if it came from a client */
+static void push_command(struct imv *imv, const char *text,
+    struct imv_ipc_request *request)
 {
-  struct imv *imv = data;
-
   struct internal_event *event = calloc(1, sizeof *event);
   event->type = COMMAND;
   event->data.command.text = strdup(text);
+  event->data.command.request = request;
 
   struct imv_event e = {
     .type = IMV_EVENT_CUSTOM,
@@ -376,6 +715,17 @@ static void command_callback(const char *text, void *data)
   imv_window_push_event(imv->window, &e);
 }
 
+static void command_callback(const char *text, void *data)
+{
+  push_command(data, text, NULL);
+}
+
+static void ipc_callback(const char *text, struct imv_ipc_request *request,
+    void *data)
+{
+  push_command(data, text, request);
+}
+
 static void key_handler(struct imv *imv, const struct imv_event *event)
 {
   if (imv_console_is_active(imv->console)) {
@@ -398,9 +748,9 @@ static void key_handler(struct imv *imv, const struct imv_event *event)
       return;
     }
 
-    struct list *cmds = imv_bind_handle_event(imv->binds, event->data.keyboard.description);
+    const struct list *cmds = imv_bind_handle_event(imv->binds, event->data.keyboard.description);
     if (cmds) {
-      imv_command_exec_list(imv->commands, cmds, imv);
+      imv_command_exec_list(cmds, imv);
     }
   }
 
@@ -408,6 +758,63 @@ static void key_handler(struct imv *imv, const struct imv_event *event)
 }
 
 
+/* The image selected last is on the display, so that's every stage timed */
+static void finish_latency(struct imv *imv, double now)
+{
+  struct imv_latency *stats = imv->latency.stats;
+  imv_latency_add(stats, IMV_LATENCY_PRESENT, now - imv->latency.presented);
+  imv_latency_add(stats, IMV_LATENCY_TOTAL, now - imv->latency.selected);
+  imv->latency.presented = 0.0;
+  imv->latency.selected = 0.0;
+
+  imv_log(IMV_DEBUG, "latency: open %.1fms, decode %.1fms, deliver %.1fms, "
+      "draw %.1fms, present %.1fms, total %.1fms (median %.1fms, 95th "
+      "percentile %.1fms)\n",
+      imv_latency_last(stats, IMV_LATENCY_OPEN) * 1e3,
+      imv_latency_last(stats, IMV_LATENCY_DECODE) * 1e3,
+      imv_latency_last(stats, IMV_LATENCY_DELIVER) * 1e3,
+      imv_latency_last(stats, IMV_LATENCY_DRAW) * 1e3,
+      imv_latency_last(stats, IMV_LATENCY_PRESENT) * 1e3,
+      imv_latency_last(stats, IMV_LATENCY_TOTAL) * 1e3,
+      imv_latency_percentile(stats, IMV_LATENCY_TOTAL, 50.0) * 1e3,
+      imv_latency_percentile(stats, IMV_LATENCY_TOTAL, 95.0) * 1e3);
+}
+
+static void handle_frame_done(struct imv *imv)
+{
+  const double now = cur_time();
+
+  /* If a frame went out straight after the display was last ready, this is
+   * the refresh following that one, which gives a measure of the refresh
+   * rate */
+  if (imv->display.presented >= imv->display.ready
+      && imv->display.presented - imv->display.ready < imv->display.interval * 0.5) {
+    const double sample = now - imv->display.ready;
+    if (sample > 0.0 && sample < imv->display.interval * 1.5) {
+      imv->display.interval += (sample - imv->display.interval) * 0.1;
+    }
+  }
+
+  imv->display.ready = now;
+  imv->display.pending = false;
+
+  if (imv->latency.presented != 0.0) {
+    finish_latency(imv, now);
+  }
+}
+
+/* Text is laid out in buffer pixels, so it's kept the same size on screen
+ * whatever scale the window's rendered at */
+static void update_font_scale(struct imv *imv, int window_width,
+    int buffer_width)
+{
+  const double scale = window_width > 0 ? (double)buffer_width / window_width : 1;
+  if (scale != imv->font.scale) {
+    imv->font.scale = scale;
+    imv_canvas_font(imv->canvas, imv->font.name, imv->font.size * scale + 0.5);
+  }
+}
+
 static void event_handler(void *data, const struct imv_event *e)
 {
   struct imv *imv = data;
@@ -423,19 +830,30 @@ static void event_handler(void *data, const struct imv_event *e)
         const int bh = e->data.resize.buffer_height;
         imv_viewport_update(imv->view, ww, wh, bw, bh, imv->current_image, imv->scaling_mode);
         imv_canvas_resize(imv->canvas, bw, bh);
+        update_font_scale(imv, ww, bw);
+        imv->drawn_overlay.valid = false;
         break;
       }
     case IMV_EVENT_KEYBOARD:
       key_handler(imv, e);
       break;
+    case IMV_EVENT_FRAME:
+      handle_frame_done(imv);
+      break;
     case IMV_EVENT_MOUSE_MOTION:
+      if (imv->gallery_enabled) {
+        break;
+      }
       if (imv_window_get_mouse_button(imv->window, 1)) {
         imv_viewport_move(imv->view, e->data.mouse_motion.dx,
             e->data.mouse_motion.dy, imv->current_image);
       }
       break;
     case IMV_EVENT_MOUSE_SCROLL:
-      {
+      if (imv->gallery_enabled) {
+        const double dy = e->data.mouse_scroll.dy;
+        imv_gallery_scroll(imv->gallery, dy > 0 ? 1 : dy < 0 ? -1 : 0);
+      } else {
         double x, y;
         imv_window_get_mouse_position(imv->window, &x, &y);
         imv_viewport_zoom(imv->view, imv->current_image, IMV_ZOOM_MOUSE,
@@ -471,27 +889,48 @@ struct imv *imv_create(void)
   imv->need_rescale = true;
   imv->scaling_mode = SCALING_FULL;
   imv->loop_input = true;
+  imv->prefetch.ahead = 1;
+  imv->prefetch.behind = 1;
+  imv->prefetch.max_bytes = 512 * 1024 * 1024;
+  imv->thumbnail_size = 256;
+  imv->transition_time = 0.15;
+  imv->disk_cache.max_bytes = (size_t)1024 * 1024 * 1024;
+  imv->shared_cache.max_bytes = (size_t)512 * 1024 * 1024;
+  imv->display.interval = 1.0 / 60.0;
+  imv->animation.queue = list_create();
+  imv->animation.lookahead = 4;
+  imv->animation.max_bytes = 256 * 1024 * 1024;
+  imv->page.loading = -1;
+  imv->page.direction = 1;
   imv->font.name = strdup("Monospace");
   imv->font.size = 24;
-  imv->binds = imv_binds_create();
   imv->navigator = imv_navigator_create();
-  imv->backends = list_create();
+  imv->opener = imv_opener_create();
+  imv->cache = imv_cache_create(imv->prefetch.max_bytes);
+  imv->latency.stats = imv_latency_create();
+  imv->slideshow.decodes = imv_latency_create();
+  imv->gallery = imv_gallery_create(imv->navigator, &open_thumbnail, imv);
   imv->commands = imv_commands_create();
+  imv->binds = imv_binds_create(imv->commands);
   imv->console = imv_console_create();
   imv_console_set_command_callback(imv->console, &command_callback, imv);
   imv->ipc = imv_ipc_create();
-  imv_ipc_set_command_callback(imv->ipc, &command_callback, imv);
-  imv->title_text = strdup(
+  imv_ipc_set_command_callback(imv->ipc, &ipc_callback, imv);
+  imv->title_text = imv_template_create(
       "imv - [${imv_current_index}/${imv_file_count}]"
       " [${imv_width}x${imv_height}] [${imv_scale}%]"
       " $imv_current_file [$imv_scaling_mode]"
   );
-  imv->overlay_text = strdup(
+  imv->overlay_text = imv_template_create(
       "[${imv_current_index}/${imv_file_count}]"
       " [${imv_width}x${imv_height}] [${imv_scale}%]"
       " $imv_current_file [$imv_scaling_mode]"
   );
   imv->startup_commands = list_create();
+  imv->scan.waiting = list_create();
+  imv->scan.active = list_create();
+  imv->scan.watched = list_create();
+  imv->watcher = imv_watcher_create();
 
   imv_command_register(imv->commands, "quit", &command_quit);
   imv_command_register(imv->commands, "pan", &command_pan);
@@ -510,11 +949,15 @@ struct imv *imv_create(void)
   imv_command_register(imv->commands, "reset", &command_reset);
   imv_command_register(imv->commands, "next_frame", &command_next_frame);
   imv_command_register(imv->commands, "toggle_playing", &command_toggle_playing);
+  imv_command_register(imv->commands, "page", &command_page);
   imv_command_register(imv->commands, "scaling", &command_set_scaling_mode);
   imv_command_register(imv->commands, "upscaling", &command_set_upscaling_method);
   imv_command_register(imv->commands, "slideshow", &command_set_slideshow_duration);
   imv_command_register(imv->commands, "background", &command_set_background);
   imv_command_register(imv->commands, "bind", &command_bind);
+  imv_command_register(imv->commands, "gallery", &command_gallery);
+  imv_command_register(imv->commands, "latency", &command_latency);
+  imv_command_register(imv->commands, "get", &command_get);
 
   imv_command_alias(imv->commands, "q", "quit");
   imv_command_alias(imv->commands, "n", "next");
@@ -558,41 +1001,89 @@ struct imv *imv_create(void)
   add_bind(imv, "r", "reset");
   add_bind(imv, "<period>", "next_frame");
   add_bind(imv, "<space>", "toggle_playing");
+  add_bind(imv, "<Next>", "page +1");
+  add_bind(imv, "<Prior>", "page -1");
   add_bind(imv, "t", "slideshow +1");
   add_bind(imv, "<Shift+T>", "slideshow -1");
+  add_bind(imv, "<Tab>", "gallery");
 
   return imv;
 }
 
+static void free_scan_requests(struct list *requests)
+{
+  for (size_t i = 0; i < requests->len; ++i) {
+    struct scan_request *request = requests->items[i];
+    free(request->path);
+    free(request);
+  }
+  list_free(requests);
+}
+
 void imv_free(struct imv *imv)
 {
+  /* Nothing should be left waiting on stdin while sources are freed */
+  if (imv->stdin_stream) {
+    imv_stream_abort(imv->stdin_stream);
+  }
+
+  /* Stop scanning first, while its results still have a window to go to */
+  imv_scanner_free(imv->scan.scanner);
+  free_scan_requests(imv->scan.waiting);
+  free_scan_requests(imv->scan.active);
+  free_scan_requests(imv->scan.watched);
+  imv_watcher_free(imv->watcher);
   free(imv->font.name);
-  free(imv->title_text);
-  free(imv->overlay_text);
+  imv_template_free(imv->title_text);
+  imv_template_free(imv->overlay_text);
   imv_binds_free(imv->binds);
   imv_navigator_free(imv->navigator);
   if (imv->current_source) {
     imv_source_free(imv->current_source);
   }
+  free(imv->current_path);
+  imv_cache_free(imv->cache);
+  imv_latency_free(imv->latency.stats);
+  imv_latency_free(imv->slideshow.decodes);
+  imv_gallery_free(imv->gallery);
+  imv_disk_cache_free(imv->disk_cache.cache);
+  imv_disk_cache_free(imv->shared_cache.cache);
+  /* A raster that's yet to start is never going to, one that's being made
+   * is passed back in an event nobody will read */
+  if (imv->raster.job
+      && imv_pool_cancel(imv->raster.pool, NULL, imv->raster.job) > 0) {
+    imv_image_free(imv->raster.job->image);
+    free(imv->raster.job);
+  }
+  imv_pool_free(imv->raster.pool);
+  /* The same goes for opening stdin */
+  if (imv->stdin_open.job
+      && imv_pool_cancel(imv->stdin_open.pool, NULL, imv->stdin_open.job) > 0) {
+    list_free(imv->stdin_open.job->pending);
+    free(imv->stdin_open.job);
+  }
+  imv_pool_free(imv->stdin_open.pool);
   imv_commands_free(imv->commands);
   imv_console_free(imv->console);
   imv_ipc_free(imv->ipc);
+  free(imv->reply.output);
   imv_viewport_free(imv->view);
   imv_canvas_free(imv->canvas);
   if (imv->current_image) {
     imv_image_free(imv->current_image);
   }
-  if (imv->next_frame.image) {
-    imv_image_free(imv->next_frame.image);
-  }
-  if (imv->stdin_image_data) {
-    free(imv->stdin_image_data);
-  }
+  drop_region(imv);
+  stop_animation(imv);
+  reset_pages(imv);
+  list_free(imv->animation.queue);
+  free(imv->drawn_overlay.text);
+  free(imv->drawn_overlay.prompt);
+  imv_stream_unref(imv->stdin_stream);
   if (imv->window) {
     imv_window_free(imv->window);
   }
 
-  list_free(imv->backends);
+  imv_opener_free(imv->opener);
 
   list_free(imv->startup_commands);
 
@@ -601,7 +1092,13 @@ void imv_free(struct imv *imv)
 
 void imv_install_backend(struct imv *imv, const struct imv_backend *backend)
 {
-  list_append(imv->backends, (void*)backend);
+  imv_opener_add_backend(imv->opener, backend);
+}
+
+void imv_install_module(struct imv *imv, const char *name,
+    bool (*sniff)(const unsigned char *header, size_t len))
+{
+  imv_opener_add_module(imv->opener, name, sniff);
 }
 
 static bool parse_bg(struct imv *imv, const char *bg)
@@ -672,6 +1169,13 @@ static bool parse_upscaling_method(struct imv *imv, const char *method)
   return false;
 }
 
+static void set_thumbnail_size(struct imv *imv, long size)
+{
+  imv->thumbnail_size = size < MIN_THUMBNAIL_SIZE ? MIN_THUMBNAIL_SIZE
+    : size > MAX_THUMBNAIL_SIZE ? MAX_THUMBNAIL_SIZE : (int)size;
+  imv_gallery_set_thumbnail_size(imv->gallery, imv->thumbnail_size);
+}
+
 static bool parse_initial_pan(struct imv *imv, const char *pan_params)
 {
   char *next_val;
@@ -684,32 +1188,82 @@ static bool parse_initial_pan(struct imv *imv, const char *pan_params)
   return true;
 }
 
+static void push_paths(struct imv *imv, struct list *paths)
+{
+  struct internal_event *event = calloc(1, sizeof *event);
+  event->type = NEW_PATH;
+  event->data.new_path.paths = paths;
+
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(imv->window, &e);
+}
+
 static void *load_paths_from_stdin(void *data)
 {
   struct imv *imv = data;
 
   imv_log(IMV_INFO, "Reading paths from stdin...");
 
-  char buf[PATH_MAX];
-  while (fgets(buf, sizeof(buf), stdin) != NULL) {
-    size_t len = strlen(buf);
-    if (buf[len-1] == '\n') {
-      buf[--len] = 0;
-    }
-    if (len > 0) {
-      struct internal_event *event = calloc(1, sizeof *event);
-      event->type = NEW_PATH;
-      event->data.new_path.path = strdup(buf);
-
-      struct imv_event e = {
-        .type = IMV_EVENT_CUSTOM,
-        .data = {
-          .custom = event
+  /* Everything read at once from a pipe goes in one event, so a writer that
+   * produces paths quickly doesn't cost an event per path, and one that's
+   * slow still has its paths seen as soon as they arrive */
+  char buf[PATH_MAX * 4];
+  size_t used = 0;
+  bool overlong = false;
+  struct list *paths = list_create();
+
+  while (true) {
+    ssize_t got = read(STDIN_FILENO, buf + used, sizeof buf - used);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    const bool eof = got <= 0;
+    if (!eof) {
+      used += got;
+    } else if (used > 0 && used < sizeof buf) {
+      /* The last line needn't end in a newline */
+      buf[used++] = '\n';
+    }
+
+    char *start = buf;
+    char *end = buf + used;
+    char *newline;
+    while ((newline = memchr(start, '\n', end - start))) {
+      *newline = 0;
+      /* Lines too long to be paths are skipped, along with their ends */
+      if (!overlong && newline > start) {
+        list_append(paths, strdup(start));
+        if (paths->len == PATHS_PER_EVENT) {
+          push_paths(imv, paths);
+          paths = list_create();
         }
-      };
-      imv_window_push_event(imv->window, &e);
+      }
+      overlong = false;
+      start = newline + 1;
+    }
+
+    used = end - start;
+    if (used == sizeof buf) {
+      overlong = true;
+      used = 0;
+    } else {
+      memmove(buf, start, used);
+    }
+
+    if (paths->len > 0) {
+      push_paths(imv, paths);
+      paths = list_create();
+    }
+    if (eof) {
+      break;
     }
   }
+  list_free(paths);
   return NULL;
 }
 
@@ -718,8 +1272,15 @@ static void print_help(struct imv *imv)
   printf("imv %s\nSee manual for usage information.\n", IMV_VERSION);
   puts("This version of imv has been compiled with the following backends:\n");
 
-  for (size_t i = 0; i < imv->backends->len; ++i) {
-    struct imv_backend *backend = imv->backends->items[i];
+  for (size_t i = 0; i < imv_opener_len(imv->opener); ++i) {
+    const char *name;
+    const struct imv_backend *backend = imv_opener_get(imv->opener, i, &name);
+    if (!backend) {
+      printf("Name: %s\n"
+             "Description: Module that couldn't be loaded\n\n",
+             name);
+      continue;
+    }
     printf("Name: %s\n"
            "Description: %s\n"
            "Website: %s\n"
@@ -815,7 +1376,9 @@ bool imv_parse_args(struct imv *imv, int argc, char **argv)
         }
         data_from_stdin = true;
 
-        imv->stdin_image_data_len = read_from_stdin(&imv->stdin_image_data);
+        /* Start reading it now, each backend can then decode what's arrived
+         * so far, and wait for the rest */
+        imv->stdin_stream = imv_stream_create(dup(STDIN_FILENO));
       }
 
       imv_add_path(imv, argv[i]);
@@ -825,135 +1388,874 @@ bool imv_parse_args(struct imv *imv, int argc, char **argv)
   return true;
 }
 
-void imv_add_path(struct imv *imv, const char *path)
+static void scan_callback(struct imv_scanner_batch *batch, void *data)
 {
-  imv_navigator_add(imv->navigator, path, imv->recursive_load);
+  struct imv *imv = data;
+
+  struct internal_event *event = calloc(1, sizeof *event);
+  event->type = NEW_PATHS;
+  event->data.new_paths.batch = batch;
+
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(imv->window, &e);
 }
 
-int imv_run(struct imv *imv)
+static void add_path(struct imv *imv, const char *path, bool recursive)
 {
-  if (imv->quit)
-    return 0;
+  struct stat info;
+  if (stat(path, &info) || !S_ISDIR(info.st_mode)) {
+    imv_navigator_add(imv->navigator, path, recursive);
+    return;
+  }
 
-  if (!setup_window(imv))
-    return 1;
+  /* Directories are scanned in the background, with their files merged into
+   * their place in the navigator as they're found, so the first can be shown
+   * long before a large directory has been read */
+  if (!imv->scan.scanner) {
+    imv->scan.scanner = imv_scanner_create(SCAN_THREADS, &scan_callback, imv);
+  }
+  struct scan_request *request = calloc(1, sizeof *request);
+  request->path = strdup(path);
+  request->recursive = recursive;
+  request->group = imv_navigator_reserve(imv->navigator);
 
-  /* if loading paths from stdin, kick off a thread to do that - we'll receive
-   * events back via internal events */
-  if (imv->paths_from_stdin) {
-    pthread_t thread;
-    pthread_create(&thread, NULL, load_paths_from_stdin, imv);
-    pthread_detach(thread);
+  if (imv->window) {
+    imv_scanner_add(imv->scan.scanner, path, recursive, request->group);
+    list_append(imv->scan.active, request);
+  } else {
+    list_append(imv->scan.waiting, request);
   }
+}
 
-  if (imv->starting_path) {
-    ssize_t index = imv_navigator_find_path(imv->navigator, imv->starting_path);
-    if (index == -1) {
-      index = (int) strtol(imv->starting_path, NULL, 10);
-      index -= 1; /* input is 1-indexed, internally we're 0 indexed */
-      if (errno == EINVAL) {
-        index = -1;
-      }
-    }
+static bool scans_running(struct imv *imv)
+{
+  return imv->scan.waiting->len > 0 || imv->scan.active->len > 0;
+}
 
-    if (index >= 0) {
-      imv_navigator_select_abs(imv->navigator, index);
-    } else {
-      imv_log(IMV_ERROR, "Invalid starting image: %s\n", imv->starting_path);
+void imv_add_path(struct imv *imv, const char *path)
+{
+  add_path(imv, path, imv->recursive_load);
+}
+
+static void select_starting_path(struct imv *imv)
+{
+  ssize_t index = imv_navigator_find_path(imv->navigator, imv->starting_path);
+  if (index == -1) {
+    index = (int) strtol(imv->starting_path, NULL, 10);
+    index -= 1; /* input is 1-indexed, internally we're 0 indexed */
+    if (errno == EINVAL) {
+      index = -1;
     }
   }
 
-  /* Push any startup commands into the event queue */
-  for (size_t i = 0; i < imv->startup_commands->len; ++i) {
-    command_callback(imv->startup_commands->items[i], imv);
+  if (index >= 0) {
+    imv_navigator_select_abs(imv->navigator, index);
+  } else {
+    imv_log(IMV_ERROR, "Invalid starting image: %s\n", imv->starting_path);
   }
-  list_free(imv->startup_commands);
-  imv->startup_commands = NULL;
+  imv->starting_path = NULL;
+}
 
-  /* time keeping */
-  double last_time = cur_time();
-  double current_time;
+static void stdin_job(void *data)
+{
+  struct stdin_job *job = data;
+  job->result = imv_opener_open_pending(job->pending, job->imv->stdin_stream,
+      &job->source);
+  job->pending = NULL;
 
+  struct internal_event *event = calloc(1, sizeof *event);
+  event->type = NEW_STDIN_SOURCE;
+  event->data.new_stdin_source.job = job;
 
-  while (!imv->quit) {
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(job->imv->window, &e);
+}
 
-    /* Check if navigator wrapped around paths lists */
-    if (!imv->loop_input && imv_navigator_wrapped(imv->navigator)) {
-      break;
+/* Backends that decode as the data arrives are given stdin straight away.
+ * Any others that might read it have to wait for all of it, which they do
+ * on a thread of their own, leaving src NULL until a NEW_STDIN_SOURCE event
+ * brings the result. */
+static enum backend_result open_stdin(struct imv *imv, struct imv_source **src)
+{
+  struct list *pending;
+  const enum backend_result result = imv_opener_open_stream(imv->opener,
+      imv->stdin_stream, src, &pending);
+  if (!pending) {
+    return result;
+  }
+
+  if (!imv->stdin_open.pool) {
+    imv->stdin_open.pool = imv_pool_create(1);
+    if (!imv->stdin_open.pool) {
+      list_free(pending);
+      return BACKEND_UNSUPPORTED;
     }
+  }
 
-    /* If the user has changed image, start loading the new one. It's possible
-     * that there are lots of unsupported files listed back to back, so we
-     * may immediate close one and navigate onto the next. So we attempt to
-     * load in a while loop until the navigation stops.
-     */
-    while (imv_navigator_poll_changed(imv->navigator)) {
-      const char *current_path = imv_navigator_selection(imv->navigator);
-      /* check we got a path back */
-      if (strcmp("", current_path)) {
+  struct stdin_job *job = calloc(1, sizeof *job);
+  job->imv = imv;
+  job->pending = pending;
+  imv->stdin_open.job = job;
+  imv_pool_push(imv->stdin_open.pool, IMV_POOL_PRIORITY_NORMAL, stdin_job, job);
+  return BACKEND_SUCCESS;
+}
 
-        const bool path_is_stdin = !strcmp("-", current_path);
-        struct imv_source *new_source;
+/* Find a backend able to open the path. If use_disk_cache is set, a copy
+ * that another instance has shared, or failing that one from the disk cache,
+ * is preferred. stdin may succeed with src left NULL, see open_stdin. */
+static enum backend_result open_source(struct imv *imv, const char *path,
+                                       struct imv_source **src,
+                                       bool use_disk_cache)
+{
+  const bool path_is_stdin = !strcmp("-", path);
 
-        enum backend_result result = BACKEND_UNSUPPORTED;
+  if (use_disk_cache && imv->shared_cache.cache && !path_is_stdin
+      && imv_disk_cache_open(imv->shared_cache.cache, path, src)) {
+    return BACKEND_SUCCESS;
+  }
 
-        if (!imv->backends) {
-          imv_log(IMV_ERROR, "No backends installed. Unable to load image.\n");
-        }
+  if (use_disk_cache && imv->disk_cache.cache && !path_is_stdin
+      && imv_disk_cache_open(imv->disk_cache.cache, path, src)) {
+    return BACKEND_SUCCESS;
+  }
 
-        for (size_t i = 0; i < imv->backends->len; ++i) {
-          const struct imv_backend *backend = imv->backends->items[i];
-          if (path_is_stdin) {
+  if (!imv_opener_len(imv->opener)) {
+    imv_log(IMV_ERROR, "No backends installed. Unable to load image.\n");
+    return BACKEND_UNSUPPORTED;
+  }
 
-            if (!backend->open_memory) {
-              /* memory loading unsupported by backend */
-              continue;
-            }
+  return path_is_stdin ? open_stdin(imv, src)
+    : imv_opener_open_path(imv->opener, path, src);
+}
 
-            result = backend->open_memory(imv->stdin_image_data,
-                imv->stdin_image_data_len, &new_source);
-          } else {
+/* Open a source for one of the gallery's thumbnails */
+static bool open_thumbnail(const char *path, struct imv_source **src, void *data)
+{
+  struct imv *imv = data;
+  if (!strcmp("-", path) || open_source(imv, path, src, true) != BACKEND_SUCCESS) {
+    return false;
+  }
+  imv_source_set_callback(*src, &source_callback, imv);
+  return true;
+}
 
-            if (!backend->open_path) {
-              /* path loading unsupported by backend */
-              continue;
-            }
+/* Forget the detailed part of the current image, if there is one. One that's
+ * still loading is ignored when it arrives. */
+static void drop_region(struct imv *imv)
+{
+  if (imv->region.image) {
+    imv_image_free(imv->region.image);
+  }
+  imv->region.image = NULL;
+  imv->region.source = NULL;
+  imv->region.loading = false;
+  imv->region.failed = false;
+}
 
-            result = backend->open_path(current_path, &new_source);
-          }
-          if (result == BACKEND_UNSUPPORTED) {
-            /* Try the next backend */
-            continue;
-          } else {
-            break;
-          }
-        }
+/* Stop using the current source. If it's a still image that has finished
+ * loading it's handed to the cache, so that coming back to it is instant.
+ */
+static void retire_current_source(struct imv *imv, bool keep)
+{
+  /* stdin still being opened is dropped when its source arrives */
+  imv->stdin_open.job = NULL;
+  if (!imv->current_source) {
+    free(imv->current_path);
+    imv->current_path = NULL;
+    return;
+  }
 
-        if (result == BACKEND_SUCCESS) {
-          if (imv->current_source) {
-            imv_source_async_free(imv->current_source);
-          }
-          imv->current_source = new_source;
-          imv_source_set_callback(imv->current_source, &source_callback, imv);
-          imv_source_async_load_first_frame(imv->current_source);
+  /* The cache holds a source's first page, so a source showing, or busy
+   * with, any other page can't go in it */
+  const bool cacheable = keep && imv->current_path && imv->current_image
+    && !imv->loading && imv->animation.due == 0.0
+    && imv->page.current == 0 && imv->page.loading == -1;
 
-          imv->loading = true;
-          imv_viewport_set_playing(imv->view, true);
+  if (cacheable) {
+    imv_source_set_page(imv->current_source, 0);
+    imv_source_set_priority(imv->current_source, IMV_SOURCE_PRIORITY_PREFETCH);
+    imv_cache_insert(imv->cache, imv->current_path, imv->current_source,
+        imv_image_ref(imv->current_image), 0);
+  } else {
+    imv_source_async_free(imv->current_source);
+  }
 
-          char title[1024];
-          generate_env_text(imv, title, sizeof title, imv->title_text);
-          imv_window_set_title(imv->window, title);
-        } else {
-          /* Error loading path so remove it from the navigator */
-          imv_navigator_remove(imv->navigator, current_path);
-        }
-      } else {
-        /* No image currently selected */
-        if (imv->current_image) {
-          imv_image_free(imv->current_image);
-          imv->current_image = NULL;
-        }
-      }
+  /* Its address may be reused by a new source, so forget it */
+  if (imv->last_source == imv->current_source) {
+    imv->last_source = NULL;
+  }
+  imv->current_source = NULL;
+  imv->loading_full_res = false;
+  imv->showing_preview = false;
+  drop_region(imv);
+  stop_animation(imv);
+  reset_pages(imv);
+  free(imv->current_path);
+  imv->current_path = NULL;
+}
+
+static void add_prefetch_path(struct imv *imv, struct list *paths, ssize_t index)
+{
+  const ssize_t len = (ssize_t)imv_navigator_length(imv->navigator);
+
+  if (index < 0 || index >= len) {
+    if (!imv->loop_input) {
+      return;
+    }
+    index = ((index % len) + len) % len;
+  }
+
+  if ((size_t)index == imv_navigator_index(imv->navigator)) {
+    return;
+  }
+
+  char *path = imv_navigator_at(imv->navigator, index);
+  if (!path || !strcmp("-", path)) {
+    return;
+  }
+
+  for (size_t i = 0; i < paths->len; ++i) {
+    if (!strcmp(paths->items[i], path)) {
+      return;
+    }
+  }
+
+  /* The navigator's copy only lasts until it's next asked for a path */
+  list_append(paths, strdup(path));
+}
+
+/* Tell a source the size its image will be shrunk to fit, if it's going to
+ * be, so that it can be decoded at a lower resolution */
+static void set_target_size(struct imv *imv, struct imv_source *src)
+{
+  int width = 0, height = 0;
+  if (imv->scaling_mode == SCALING_FULL || imv->scaling_mode == SCALING_DOWN) {
+    imv_viewport_get_buffer_size(imv->view, &width, &height);
+  }
+  imv_source_set_target_size(src, width, height);
+}
+
+/* Start on the newly chosen current source, decoding its first frame unless
+ * it's already been */
+static void start_current_source(struct imv *imv, bool load_first_frame)
+{
+  imv_source_set_callback(imv->current_source, &source_callback, imv);
+  /* If it was still being prefetched, it's now the most urgent */
+  imv_source_set_priority(imv->current_source, IMV_SOURCE_PRIORITY_CURRENT);
+  if (load_first_frame) {
+    set_target_size(imv, imv->current_source);
+    imv_source_async_load_first_frame(imv->current_source);
+  }
+}
+
+/* A copy from the disk cache can only stand in for the file's first page at
+ * a reduced resolution, so anything more means opening the file itself. The
+ * current image stays onscreen. */
+static bool replace_disk_cache_source(struct imv *imv)
+{
+  if (!imv_disk_cache_is_source(imv->current_source)) {
+    return true;
+  }
+
+  struct imv_source *src = NULL;
+  if (open_source(imv, imv->current_path, &src, false) != BACKEND_SUCCESS) {
+    return false;
+  }
+  imv_source_set_callback(src, &source_callback, imv);
+  imv_source_async_free(imv->current_source);
+  imv->current_source = src;
+  /* So that its images replace the current one, rather than being treated
+   * as a new image */
+  imv->last_source = src;
+  return true;
+}
+
+/* Find the part of the current image that's in view, in its own pixels, as
+ * the bounding box of the window's corners taken back through the view's
+ * rotation and mirroring */
+static void visible_rect(struct imv *imv, double scale,
+    int *x0, int *y0, int *x1, int *y1)
+{
+  int x, y, bw, bh;
+  double rotation;
+  bool mirrored;
+  imv_viewport_get_offset(imv->view, &x, &y);
+  imv_viewport_get_rotation(imv->view, &rotation);
+  imv_viewport_get_mirrored(imv->view, &mirrored);
+  imv_viewport_get_buffer_size(imv->view, &bw, &bh);
+
+  const int width = imv_image_width(imv->current_image);
+  const int height = imv_image_height(imv->current_image);
+  const double center_x = x + width * scale / 2;
+  const double center_y = y + height * scale / 2;
+  const double corners[4][2] = {{0, 0}, {bw, 0}, {bw, bh}, {0, bh}};
+  const double theta = -rotation * M_PI / 180.0;
+  const double c = cos(theta);
+  const double s = sin(theta);
+
+  double min_x = INFINITY, min_y = INFINITY;
+  double max_x = -INFINITY, max_y = -INFINITY;
+  for (int i = 0; i < 4; ++i) {
+    const double dx = (corners[i][0] - center_x) * (mirrored ? -1 : 1);
+    const double dy = corners[i][1] - center_y;
+    const double ix = (dx * c - dy * s + center_x - x) / scale;
+    const double iy = (dx * s + dy * c + center_y - y) / scale;
+    min_x = ix < min_x ? ix : min_x;
+    min_y = iy < min_y ? iy : min_y;
+    max_x = ix > max_x ? ix : max_x;
+    max_y = iy > max_y ? iy : max_y;
+  }
+
+  *x0 = min_x < 0 ? 0 : (int)floor(min_x);
+  *y0 = min_y < 0 ? 0 : (int)floor(min_y);
+  *x1 = max_x > width ? width : (int)ceil(max_x);
+  *y1 = max_y > height ? height : (int)ceil(max_y);
+}
+
+/* Make sure the part of the image in view is loaded in as much detail as
+ * it's drawn at, asking for it with a margin of half as much again on every
+ * side, so that panning a little doesn't need another load straight away */
+static void update_region(struct imv *imv, double scale)
+{
+  if (imv->region.loading) {
+    return;
+  }
+
+  int x0, y0, x1, y1;
+  visible_rect(imv, scale, &x0, &y0, &x1, &y1);
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+
+  const double wanted = scale < 1.0 ? scale : 1.0;
+  int rx, ry, rw, rh;
+  if (imv->region.image && imv->region.source == imv->current_source
+      && imv->region.page == imv->page.current
+      && imv_image_get_region(imv->region.image, &rx, &ry, &rw, &rh)
+      && rx <= x0 && ry <= y0 && rx + rw >= x1 && ry + rh >= y1
+      && imv_image_bitmap_scale(imv->region.image) >= wanted * 0.99) {
+    return;
+  }
+
+  /* A copy from the disk cache can't, but the file it stands in for may */
+  if (!replace_disk_cache_source(imv)
+      || !imv_source_can_load_region(imv->current_source)) {
+    imv->region.failed = true;
+    return;
+  }
+
+  const int width = imv_image_width(imv->current_image);
+  const int height = imv_image_height(imv->current_image);
+  const int margin_x = (x1 - x0) / 2;
+  const int margin_y = (y1 - y0) / 2;
+  x0 = x0 - margin_x < 0 ? 0 : x0 - margin_x;
+  y0 = y0 - margin_y < 0 ? 0 : y0 - margin_y;
+  x1 = x1 + margin_x > width ? width : x1 + margin_x;
+  y1 = y1 + margin_y > height ? height : y1 + margin_y;
+
+  imv->region.loading = true;
+  imv_source_set_page(imv->current_source, imv->page.current);
+  imv_source_async_load_region(imv->current_source, x0, y0, x1 - x0, y1 - y0,
+      wanted);
+}
+
+/* If the current image was decoded at a reduced resolution, and it's now
+ * being drawn larger than that, reload it at full resolution, or for a very
+ * large image, just the part of it that's in view */
+static void check_resolution(struct imv *imv)
+{
+  if (!imv->current_source || !imv->current_image
+      || imv->loading || imv->loading_full_res || imv->page.loading != -1) {
+    return;
+  }
+
+  const double bitmap_scale = imv_image_bitmap_scale(imv->current_image);
+  if (bitmap_scale >= 1.0) {
+    return;
+  }
+
+  double scale;
+  imv_viewport_get_scale(imv->view, &scale);
+  if (scale <= bitmap_scale) {
+    /* The detail's only worth its memory while it can be seen */
+    if (imv->region.image && !imv->region.loading) {
+      drop_region(imv);
+    }
+    return;
+  }
+
+  const size_t pixels = (size_t)imv_image_width(imv->current_image)
+    * imv_image_height(imv->current_image);
+  if (!imv->region.failed && pixels >= REGION_MIN_PIXELS
+      && (imv_source_can_load_region(imv->current_source)
+        || imv_disk_cache_is_source(imv->current_source))) {
+    update_region(imv, scale);
+    if (!imv->region.failed) {
+      return;
+    }
+  }
+
+  imv->loading_full_res = true;
+
+  if (!replace_disk_cache_source(imv)) {
+    imv_log(IMV_WARNING, "Failed to reload image at full resolution\n");
+    return;
+  }
+
+  imv_source_set_page(imv->current_source, imv->page.current);
+  imv_source_set_target_size(imv->current_source, 0, 0);
+  imv_source_async_load_first_frame(imv->current_source);
+}
+
+static void raster_job(void *data)
+{
+  struct raster_job *job = data;
+  job->bitmap = imv_image_rasterize(job->image, job->scale);
+
+  struct internal_event *event = calloc(1, sizeof *event);
+  event->type = NEW_RASTER;
+  event->data.new_raster.job = job;
+
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(job->imv->window, &e);
+}
+
+/* If the current image is a vector image, and it's now drawn at a scale far
+ * enough from its raster's that the raster looks blurred or wastes memory,
+ * make a new one to replace it */
+static void check_raster(struct imv *imv)
+{
+  if (!imv_image_is_vector(imv->current_image) || imv->raster.job) {
+    return;
+  }
+
+  double scale;
+  imv_viewport_get_scale(imv->view, &scale);
+  const double raster_scale = imv_image_raster_scale(imv->current_image);
+  if (raster_scale > 0.0 && scale < raster_scale * RASTER_TOLERANCE
+      && scale > raster_scale / RASTER_TOLERANCE) {
+    return;
+  }
+
+  if (!imv->raster.pool) {
+    imv->raster.pool = imv_pool_create(1);
+    if (!imv->raster.pool) {
+      return;
+    }
+  }
+
+  struct raster_job *job = calloc(1, sizeof *job);
+  job->imv = imv;
+  job->image = imv_image_ref(imv->current_image);
+  job->scale = scale;
+  imv->raster.job = job;
+  imv_pool_push(imv->raster.pool, IMV_POOL_PRIORITY_NORMAL, raster_job, job);
+}
+
+/* Save a copy of a newly displayed image to the disk cache, if it's large
+ * enough to be worth it. Only still images that are being shrunk to fit are
+ * stored, as that's all a screen sized copy is good for. */
+static void store_on_disk(struct imv *imv, struct imv_image *image, int frametime)
+{
+  if (frametime != 0 || !imv->current_path
+      || !strcmp("-", imv->current_path)
+      || imv_disk_cache_is_source(imv->current_source)) {
+    return;
+  }
+
+  /* Other instances can show the image just as it was decoded */
+  if (imv->shared_cache.cache) {
+    imv_disk_cache_store(imv->shared_cache.cache, imv->current_path, image,
+        0, 0);
+  }
+
+  if (!imv->disk_cache.cache) {
+    return;
+  }
+
+  if (imv->scaling_mode != SCALING_FULL && imv->scaling_mode != SCALING_DOWN) {
+    return;
+  }
+
+  int width, height;
+  imv_viewport_get_buffer_size(imv->view, &width, &height);
+  imv_disk_cache_store(imv->disk_cache.cache, imv->current_path, image,
+      width, height);
+}
+
+/* Decide which neighbours of the current image should be decoded ahead of
+ * time, drop any others from the cache, and start loading the missing ones.
+ * Prefetch loads are queued behind any work for the current image.
+ */
+static void update_prefetch(struct imv *imv)
+{
+  struct list *paths = list_create();
+
+  if (imv_navigator_length(imv->navigator) > 1) {
+    const ssize_t index = imv_navigator_index(imv->navigator);
+    const int dir = imv_navigator_direction(imv->navigator);
+    const int max = imv->prefetch.ahead > imv->prefetch.behind
+      ? imv->prefetch.ahead : imv->prefetch.behind;
+
+    /* The slideshow's next slide comes before anything else, whichever way
+     * the user was last going */
+    if (imv->slideshow.prepared) {
+      add_prefetch_path(imv, paths, index + 1);
+    }
+
+    for (int i = 1; i <= max; ++i) {
+      if (i <= imv->prefetch.ahead) {
+        add_prefetch_path(imv, paths, index + dir * i);
+      }
+      if (i <= imv->prefetch.behind) {
+        add_prefetch_path(imv, paths, index - dir * i);
+      }
+    }
+  }
+
+  imv_cache_retain(imv->cache, paths);
+
+  for (size_t i = 0; i < paths->len; ++i) {
+    const char *path = paths->items[i];
+    if (imv_cache_contains(imv->cache, path)) {
+      continue;
+    }
+    if (imv_cache_is_full(imv->cache)) {
+      break;
+    }
+
+    /* stdin's opened once it's selected, as it can mean waiting for all of
+     * it to arrive */
+    if (!strcmp("-", path)) {
+      continue;
+    }
+
+    struct imv_source *src = NULL;
+    if (open_source(imv, path, &src, true) == BACKEND_SUCCESS) {
+      imv_source_set_callback(src, &source_callback, imv);
+      imv_source_set_priority(src, IMV_SOURCE_PRIORITY_PREFETCH);
+      set_target_size(imv, src);
+      imv_cache_insert(imv->cache, path, src, NULL, 0);
+      imv_source_async_load_first_frame(src);
+    } else {
+      /* Remember the failure, it's handled when the user reaches it */
+      imv_cache_insert(imv->cache, path, NULL, NULL, 0);
+    }
+  }
+
+  list_deep_free(paths);
+}
+
+/* How long before its slot the next slide should start being decoded. Until
+ * anything's been timed, that's as soon as the current slide's up. */
+static double slideshow_lead(struct imv *imv)
+{
+  const double decode = imv_latency_percentile(imv->slideshow.decodes,
+      IMV_LATENCY_DECODE, 95.0);
+  if (decode == 0.0) {
+    return imv->slideshow.duration;
+  }
+  const double open = imv_latency_percentile(imv->latency.stats,
+      IMV_LATENCY_OPEN, 95.0);
+  return (open + decode) * SLIDESHOW_LEAD_FACTOR + imv->display.interval;
+}
+
+/* Whether the next slide can be shown, which it can't while it's still being
+ * decoded ahead of time. One that isn't being, such as a path the cache had
+ * no room for, is loaded once it's selected, as any other image would be. */
+static bool next_slide_ready(struct imv *imv)
+{
+  const ssize_t len = (ssize_t)imv_navigator_length(imv->navigator);
+  ssize_t index = (ssize_t)imv_navigator_index(imv->navigator) + 1;
+  if (len < 2 || (index >= len && !imv->loop_input)) {
+    return true;
+  }
+  const char *path = imv_navigator_at(imv->navigator, index % len);
+  return !path || !imv_cache_is_loading(imv->cache, path);
+}
+
+/* Move the slideshow on at the refresh nearest the current slide's deadline,
+ * having started decoding the next one far enough ahead for it to be ready.
+ * If it's late all the same, the current slide stays up until it arrives. */
+static void advance_slideshow(struct imv *imv, double dt)
+{
+  /* The slideshow waits while the gallery is open */
+  if (imv->slideshow.duration == 0.0 || imv->gallery_enabled) {
+    return;
+  }
+
+  imv->slideshow.elapsed += dt;
+  const double timeleft = imv->slideshow.duration - imv->slideshow.elapsed;
+
+  if (!imv->slideshow.prepared && imv->current_source
+      && timeleft <= slideshow_lead(imv)) {
+    imv->slideshow.prepared = true;
+    update_prefetch(imv);
+  }
+
+  if (timeleft > imv->display.interval * 0.5 || !next_slide_ready(imv)) {
+    return;
+  }
+
+  imv_navigator_select_rel(imv->navigator, 1);
+  imv->slideshow.prepared = false;
+  /* Slides keep to the slideshow's own clock, rather than drifting by however
+   * late each is shown, unless one was held up decoding, in which case it
+   * gets its full time */
+  imv->slideshow.elapsed = timeleft < -imv->display.interval ? 0.0 : -timeleft;
+  imv->need_redraw = true;
+}
+
+static void scan_finished(struct imv *imv, unsigned group)
+{
+  for (size_t i = 0; i < imv->scan.active->len; ++i) {
+    struct scan_request *request = imv->scan.active->items[i];
+    if (request->group == group) {
+      /* Anything written to it from now on is merged into its files */
+      list_remove(imv->scan.active, i);
+      char *real = realpath(request->path, NULL);
+      if (real) {
+        free(request->path);
+        request->path = real;
+      }
+      if (imv_watcher_watch_dir(imv->watcher, request->path)) {
+        list_append(imv->scan.watched, request);
+      } else {
+        free(request->path);
+        free(request);
+      }
+      break;
+    }
+  }
+
+  if (!scans_running(imv) && imv->starting_path) {
+    select_starting_path(imv);
+  }
+}
+
+/* Add a file that's appeared in a watched directory where the scan of the
+ * directory would have put it, as its key is its name within it. Anything
+ * else joins the end of the list. */
+static void add_watched_file(struct imv *imv, const char *path)
+{
+  const char *last_sep = strrchr(path, '/');
+  struct scan_request *scanned = NULL;
+  for (size_t i = 0; last_sep && i < imv->scan.watched->len; ++i) {
+    struct scan_request *request = imv->scan.watched->items[i];
+    const size_t len = strlen(request->path);
+    if ((size_t)(last_sep - path) == len && !strncmp(path, request->path, len)) {
+      scanned = request;
+      break;
+    }
+  }
+  /* A directory moved in is added as any other is */
+  struct stat info;
+  if (!scanned || stat(path, &info) || S_ISDIR(info.st_mode)) {
+    imv_navigator_add(imv->navigator, path, false);
+    return;
+  }
+
+  struct imv_navigator_entry *entry = calloc(1, sizeof *entry);
+  entry->path = strdup(path);
+  entry->key = strdup(last_sep + 1);
+  struct list *entries = list_create();
+  list_append(entries, entry);
+  imv_navigator_add_entries(imv->navigator, scanned->group, entries);
+  list_free(entries);
+}
+
+static void watch_callback(enum imv_watch_event event, const char *path,
+    void *data)
+{
+  struct imv *imv = data;
+
+  if (event == IMV_WATCH_CHANGED) {
+    imv_navigator_file_changed(imv->navigator, path);
+  } else if (imv_navigator_find_path(imv->navigator, path) == -1) {
+    add_watched_file(imv, path);
+    /* Need to update image count in title */
+    imv->need_redraw = true;
+    if (imv->current_source) {
+      update_prefetch(imv);
+    }
+  }
+}
+
+int imv_run(struct imv *imv)
+{
+  if (imv->quit)
+    return 0;
+
+  if (!setup_window(imv))
+    return 1;
+
+  if (imv->disk_cache.enabled && imv->disk_cache.max_bytes > 0) {
+    char *dir = imv_disk_cache_default_dir();
+    if (dir) {
+      imv->disk_cache.cache = imv_disk_cache_create(dir, imv->disk_cache.max_bytes);
+      free(dir);
+    }
+  }
+
+  if (imv->shared_cache.enabled && imv->shared_cache.max_bytes > 0) {
+    char *dir = imv_disk_cache_shared_dir();
+    if (dir) {
+      imv->shared_cache.cache = imv_disk_cache_create_shared(dir,
+          imv->shared_cache.max_bytes);
+      free(dir);
+    } else {
+      imv_log(IMV_WARNING, "shared cache: $XDG_RUNTIME_DIR isn't set\n");
+    }
+  }
+
+  /* if loading paths from stdin, kick off a thread to do that - we'll receive
+   * events back via internal events */
+  if (imv->paths_from_stdin) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, load_paths_from_stdin, imv);
+    pthread_detach(thread);
+  }
+
+  /* Start scanning the directories given on the command line */
+  for (size_t i = 0; i < imv->scan.waiting->len; ++i) {
+    struct scan_request *request = imv->scan.waiting->items[i];
+    imv_scanner_add(imv->scan.scanner, request->path, request->recursive,
+        request->group);
+    list_append(imv->scan.active, request);
+  }
+  list_clear(imv->scan.waiting);
+
+  /* Changes to watched files wake the main loop up along with everything
+   * else */
+  imv_window_watch_fd(imv->window, imv_watcher_fd(imv->watcher));
+
+  /* The starting image may be in a directory still being scanned, in which
+   * case it's selected once they all are */
+  if (imv->starting_path && !scans_running(imv)) {
+    select_starting_path(imv);
+  }
+
+  /* Push any startup commands into the event queue */
+  for (size_t i = 0; i < imv->startup_commands->len; ++i) {
+    command_callback(imv->startup_commands->items[i], imv);
+  }
+  list_free(imv->startup_commands);
+  imv->startup_commands = NULL;
+
+  /* time keeping */
+  double last_time = cur_time();
+  double current_time;
+
+
+  while (!imv->quit) {
+
+    /* The slideshow's moved on first, so that a slide that's due is swapped
+     * in on this pass, not after another redraw of the last one */
+    current_time = cur_time();
+    advance_slideshow(imv, current_time - last_time);
+    last_time = current_time;
+
+    /* Check if navigator wrapped around paths lists */
+    if (!imv->loop_input && imv_navigator_wrapped(imv->navigator)) {
+      break;
+    }
+
+    /* If the user has changed image, start loading the new one. It's possible
+     * that there are lots of unsupported files listed back to back, so we
+     * may immediate close one and navigate onto the next. So we attempt to
+     * load in a while loop until the navigation stops.
+     */
+    bool selection_changed = false;
+    while (imv_navigator_poll_changed(imv->navigator)) {
+      selection_changed = true;
+      const char *current_path = imv_navigator_selection(imv->navigator);
+      /* check we got a path back */
+      if (strcmp("", current_path)) {
+
+        /* The same path means the file changed on disk, so it must be reloaded
+         * rather than being served from the cache */
+        const bool path_changed = !imv->current_path
+          || strcmp(imv->current_path, current_path);
+        retire_current_source(imv, path_changed);
+
+        struct imv_source *new_source = NULL;
+        struct imv_image *cached_image = NULL;
+        int cached_frametime = 0;
+        bool from_cache = false;
+
+        /* Start timing it afresh, even if the last one never got shown */
+        imv->latency.selected = cur_time();
+        imv->latency.drawing = false;
+        imv->latency.presented = 0.0;
+
+        enum backend_result result = BACKEND_UNSUPPORTED;
+        if (path_changed && imv_cache_take(imv->cache, current_path,
+              &new_source, &cached_image, &cached_frametime)) {
+          from_cache = true;
+          result = new_source ? BACKEND_SUCCESS : BACKEND_UNSUPPORTED;
+        } else {
+          result = open_source(imv, current_path, &new_source, true);
+          imv_latency_add(imv->latency.stats, IMV_LATENCY_OPEN,
+              cur_time() - imv->latency.selected);
+        }
+
+        if (result == BACKEND_SUCCESS) {
+          imv->current_source = new_source;
+          imv->current_path = strdup(current_path);
+          /* Only fall back on polling if it can't be watched */
+          imv_navigator_set_polling(imv->navigator,
+              !imv_watcher_watch_file(imv->watcher, imv->current_path));
+          /* Without a source, it's stdin that's still being opened */
+          if (imv->current_source) {
+            start_current_source(imv, !from_cache);
+          }
+
+          imv->loading = true;
+          imv_viewport_set_playing(imv->view, true);
+
+          if (cached_image) {
+            /* Already decoded, so it can go straight onscreen */
+            imv->latency.drawing = true;
+            imv->last_source = imv->current_source;
+            handle_new_image(imv, cached_image, cached_frametime, 0, 0);
+            store_on_disk(imv, cached_image, cached_frametime);
+            update_pages(imv);
+          }
+
+          update_title(imv);
+        } else {
+          /* Error loading path so remove it from the navigator */
+          imv->latency.selected = 0.0;
+          imv_image_free(cached_image);
+          imv_navigator_remove(imv->navigator, current_path);
+        }
+      } else {
+        /* No image currently selected */
+        retire_current_source(imv, false);
+        if (imv->current_image) {
+          imv_image_free(imv->current_image);
+          imv->current_image = NULL;
+        }
+      }
+    }
+
+    if (selection_changed) {
+      update_prefetch(imv);
     }
 
     if (imv->need_rescale) {
@@ -963,74 +2265,145 @@ int imv_run(struct imv *imv)
 
     current_time = cur_time();
 
-    /* Check if a new frame is due */
+    /* Check if a new frame is due. Frames are only changed when the display
+     * is ready to show them, and a frame is shown at the refresh nearest to
+     * when it's due. */
+    const double next_refresh = current_time + imv->display.interval * 0.5;
     bool should_change_frame = false;
-    if (imv->next_frame.force_next_frame && imv->next_frame.image) {
+    if (imv->animation.force_next_frame && frame_ready(imv)) {
       should_change_frame = true;
     }
-    if (imv_viewport_is_playing(imv->view) && imv->next_frame.image
-        && imv->next_frame.due && imv->next_frame.due <= current_time) {
+    if (imv_viewport_is_playing(imv->view) && frame_ready(imv)
+        && imv->animation.due && imv->animation.due <= next_refresh) {
       should_change_frame = true;
     }
+    if (imv->display.pending) {
+      should_change_frame = false;
+    }
 
     if (should_change_frame) {
+      struct frame frame;
+      take_frame(imv, &frame);
+
+      /* Keep to the animation's own clock, rather than drifting by however
+       * late each frame is shown */
+      double start = imv->animation.due;
+      if (imv->animation.force_next_frame
+          || current_time - start > MAX_ANIMATION_LAG) {
+        start = current_time;
+      }
+
+      /* Any frames whose time has been and gone are dropped to catch up */
+      while (frame.duration > 0.0 && start + frame.duration <= next_refresh
+          && frame_ready(imv)) {
+        start += frame.duration;
+        imv_image_free(frame.image);
+        take_frame(imv, &frame);
+        imv->display.dropped++;
+        imv_log(IMV_DEBUG, "dropped an animation frame, %lu so far\n",
+            imv->display.dropped);
+      }
+
       if (imv->current_image) {
         imv_image_free(imv->current_image);
       }
-      imv->current_image = imv->next_frame.image;
-      imv->next_frame.image = NULL;
-      imv->next_frame.due = current_time + imv->next_frame.duration;
-      imv->next_frame.duration = 0;
-      imv->next_frame.force_next_frame = false;
+      imv->current_image = frame.image;
+      imv->animation.current = frame.index;
+      imv->animation.due = start + frame.duration;
+      imv->animation.force_next_frame = false;
 
       imv->need_redraw = true;
+      /* Frame buffers are recycled, so the new frame may well have the same
+       * address as an old one, but it always needs uploading */
+      imv->cache_invalidated = true;
 
-      /* Trigger loading of a new frame, now this one's being displayed */
-      if (imv->current_source) {
-        imv_source_async_load_next_frame(imv->current_source);
-      }
+      /* There's room in the queue for another frame */
+      request_frame(imv);
     }
 
-    /* handle slideshow */
-    if (imv->slideshow.duration != 0.0) {
-      double dt = current_time - last_time;
+    /* A view that's gliding or being dragged is drawn every refresh, in less
+     * detail until it stops */
+    const bool moving = imv_viewport_animate(imv->view);
+
+    /* Zooming in may have gone past the resolution the image was decoded at */
+    check_resolution(imv);
+    check_raster(imv);
 
-      imv->slideshow.elapsed += dt;
-      if (imv->slideshow.elapsed >= imv->slideshow.duration) {
-        imv_navigator_select_rel(imv->navigator, 1);
-        imv->slideshow.elapsed = 0;
+    if (imv->gallery_enabled) {
+      int bw, bh;
+      imv_viewport_get_buffer_size(imv->view, &bw, &bh);
+      imv_gallery_update(imv->gallery, bw, bh);
+      if (imv_gallery_needs_redraw(imv->gallery)) {
         imv->need_redraw = true;
       }
     }
 
-    last_time = current_time;
-
     /* check if the viewport needs a redraw */
     if (imv_viewport_needs_redraw(imv->view)) {
       imv->need_redraw = true;
     }
 
-    if (imv->need_redraw) {
-      imv_window_clear(imv->window, 0, 0, 0);
+    /* However many batches of paths arrived, the count's only redrawn once,
+     * and while they keep arriving, only every so often */
+    if (imv->paths_changed
+        && current_time - imv->paths_redrawn >= PATH_REDRAW_INTERVAL) {
+      imv->need_redraw = true;
+    }
+    /* Anything presented before the display is ready would never be seen, so
+     * the redraw waits for it */
+    if (imv->need_redraw && !imv->display.pending) {
+      const double draw_start = cur_time();
+      imv_canvas_set_budget(imv->canvas,
+          moving ? imv->display.interval * MOTION_UPLOAD_SHARE : 0.0);
       render_window(imv);
       imv_window_present(imv->window);
+      imv->display.pending = true;
+      imv->display.presented = cur_time();
+
+      if (imv->latency.drawing) {
+        /* Presenting may block for a buffer, which is the display's doing */
+        imv_latency_add(imv->latency.stats, IMV_LATENCY_DRAW,
+            imv->display.presented - draw_start);
+        imv->latency.drawing = false;
+        imv->latency.presented = imv->display.presented;
+      }
     }
 
     /* sleep until we have something to do */
     double timeout = 1.0; /* seconds */
 
     /* If we need to display the next frame of an animation soon we should
-     * limit our sleep until the next frame is due.
+     * limit our sleep until the next frame is due. If it's still decoding,
+     * its arrival will wake us, as will the display becoming ready.
      */
-    if (imv_viewport_is_playing(imv->view) && imv->next_frame.due != 0.0) {
-      timeout = imv->next_frame.due - current_time;
+    if (imv_viewport_is_playing(imv->view) && imv->animation.due != 0.0
+        && frame_ready(imv) && !imv->display.pending) {
+      timeout = imv->animation.due - current_time;
       if (timeout < 0.001) {
         timeout = 0.001;
       }
     }
 
-    if (imv->slideshow.duration > 0) {
-      double timeleft = imv->slideshow.duration - imv->slideshow.elapsed;
+    /* The display becoming ready wakes us for the next step of a glide, but
+     * a drag coming to rest has nothing to wake us */
+    if (moving && imv->display.interval < timeout) {
+      timeout = imv->display.interval;
+    }
+
+    if (imv->paths_changed) {
+      double timeleft = imv->paths_redrawn + PATH_REDRAW_INTERVAL - current_time;
+      if (timeleft < timeout) {
+        timeout = timeleft > 0.001 ? timeleft : 0.001;
+      }
+    }
+
+    /* Wake to start decoding the next slide, and then in time for its slot.
+     * If it's late, its arrival wakes us instead. */
+    if (imv->slideshow.duration > 0 && !imv->gallery_enabled) {
+      double timeleft = imv->slideshow.duration - imv->slideshow.elapsed
+        - (current_time - last_time);
+      timeleft -= imv->slideshow.prepared
+        ? imv->display.interval * 0.5 : slideshow_lead(imv);
       if (timeleft > 0.0 && timeleft < timeout) {
         timeout = timeleft + 0.001;
       }
@@ -1041,6 +2414,7 @@ int imv_run(struct imv *imv)
 
     /* Handle the new events that have arrived */
     imv_window_pump_events(imv->window, event_handler, imv);
+    imv_watcher_dispatch(imv->watcher, &watch_callback, imv);
   }
 
   if (imv->list_files_at_exit) {
@@ -1048,110 +2422,520 @@ int imv_run(struct imv *imv)
       puts(imv_navigator_at(imv->navigator, i));
   }
 
-  return 0;
+  return 0;
+}
+
+static bool setup_window(struct imv *imv)
+{
+  imv->window = imv_window_create(imv->initial_width, imv->initial_height, "imv");
+
+  if (!imv->window) {
+    imv_log(IMV_ERROR, "Failed to create window\n");
+    return false;
+  }
+
+  {
+    int ww, wh, bw, bh;
+    imv_window_get_size(imv->window, &ww, &wh);
+    imv_window_get_framebuffer_size(imv->window, &bw, &bh);
+    imv->view = imv_viewport_create(ww, wh, bw, bh);
+    imv_viewport_set_transition_time(imv->view, imv->transition_time);
+  }
+
+  if (imv->custom_start_pan) {
+    imv_viewport_set_default_pan_factor(imv->view, imv->initial_pan_x, imv->initial_pan_y);
+  }
+
+  /* put us in fullscren mode to begin with if requested */
+  imv_window_set_fullscreen(imv->window, imv->start_fullscreen);
+
+  {
+    int ww, bw, bh;
+    imv_window_get_size(imv->window, &ww, NULL);
+    imv_window_get_framebuffer_size(imv->window, &bw, &bh);
+    imv->canvas = imv_canvas_create(bw, bh);
+    update_font_scale(imv, ww, bw);
+  }
+
+  return true;
+}
+
+
+static void drop_loop(struct imv *imv)
+{
+  for (int i = 0; i < imv->animation.loop_len; ++i) {
+    imv_image_free(imv->animation.loop[i].image);
+  }
+  free(imv->animation.loop);
+  imv->animation.loop = NULL;
+  imv->animation.loop_len = 0;
+  imv->animation.loop_filled = 0;
+  imv->animation.loop_bytes = 0;
+}
+
+static void stop_animation(struct imv *imv)
+{
+  struct list *queue = imv->animation.queue;
+  while (queue->len > 0) {
+    struct frame *frame = queue->items[queue->len - 1];
+    list_remove(queue, queue->len - 1);
+    imv_image_free(frame->image);
+    free(frame);
+  }
+  imv->animation.queue_bytes = 0;
+  drop_loop(imv);
+  imv->animation.due = 0.0;
+  imv->animation.loading = false;
+  imv->animation.current = 0;
+  imv->animation.force_next_frame = false;
+}
+
+static bool loop_complete(struct imv *imv)
+{
+  return imv->animation.loop
+    && imv->animation.loop_filled == imv->animation.loop_len;
+}
+
+/* Returns true if there's a frame to show after the current one */
+static bool frame_ready(struct imv *imv)
+{
+  return imv->animation.queue->len > 0 || loop_complete(imv);
+}
+
+/* Take the frame to show after the current one, which must be ready. The
+ * caller is given a reference to its image. */
+static void take_frame(struct imv *imv, struct frame *out)
+{
+  struct list *queue = imv->animation.queue;
+  if (queue->len > 0) {
+    struct frame *frame = queue->items[0];
+    list_remove(queue, 0);
+    imv->animation.queue_bytes -= imv_image_bytes(frame->image);
+    *out = *frame;
+    free(frame);
+    return;
+  }
+
+  const int next = (imv->animation.current + 1) % imv->animation.loop_len;
+  *out = imv->animation.loop[next];
+  out->image = imv_image_ref(out->image);
+}
+
+/* Start decoding another frame, if the queue has room for it */
+static void request_frame(struct imv *imv)
+{
+  if (!imv->current_source || imv->animation.due == 0.0
+      || imv->animation.loading || loop_complete(imv)) {
+    return;
+  }
+
+  struct list *queue = imv->animation.queue;
+  if (queue->len > 0 && ((int)queue->len >= imv->animation.lookahead
+        || imv->animation.queue_bytes >= imv->animation.max_bytes)) {
+    return;
+  }
+
+  imv->animation.loading = true;
+  imv_source_async_load_next_frame(imv->current_source);
 }
 
-static bool setup_window(struct imv *imv)
+/* Keep a reference to a frame in the loop, if there's one being built */
+static void add_to_loop(struct imv *imv, const struct frame *frame)
 {
-  imv->window = imv_window_create(imv->initial_width, imv->initial_height, "imv");
+  if (!imv->animation.loop || frame->index < 0
+      || frame->index >= imv->animation.loop_len
+      || imv->animation.loop[frame->index].image) {
+    return;
+  }
 
-  if (!imv->window) {
-    imv_log(IMV_ERROR, "Failed to create window\n");
-    return false;
+  imv->animation.loop[frame->index] = *frame;
+  imv->animation.loop[frame->index].image = imv_image_ref(frame->image);
+  imv->animation.loop_filled++;
+  imv->animation.loop_bytes += imv_image_bytes(frame->image);
+
+  if (imv->animation.loop_bytes > imv->animation.max_bytes) {
+    /* Too long to keep, so every loop will have to be decoded */
+    drop_loop(imv);
   }
+}
 
-  {
-    int ww, wh, bw, bh;
-    imv_window_get_size(imv->window, &ww, &wh);
-    imv_window_get_framebuffer_size(imv->window, &bw, &bh);
-    imv->view = imv_viewport_create(ww, wh, bw, bh);
+static void handle_new_image(struct imv *imv, struct imv_image *image, int frametime,
+    int frame_index, int frame_count)
+{
+  if (imv->current_image) {
+    imv_image_free(imv->current_image);
   }
+  imv->current_image = image;
+  imv->need_redraw = true;
+  imv->need_rescale = true;
+  imv->loading = false;
+  imv->loading_full_res = false;
+  imv->showing_preview = false;
+
+  stop_animation(imv);
+  if (frametime) {
+    imv->animation.due = cur_time() + frametime * 0.001;
+    imv->animation.current = frame_index;
+
+    /* Short animations are kept whole, if they look like they'll fit */
+    const size_t bytes = imv_image_bytes(image);
+    if (frame_count > 1
+        && bytes * (size_t)frame_count <= imv->animation.max_bytes) {
+      imv->animation.loop = calloc(frame_count, sizeof *imv->animation.loop);
+      imv->animation.loop_len = frame_count;
+      struct frame frame = {
+        .image = image,
+        .duration = frametime * 0.001,
+        .index = frame_index,
+      };
+      add_to_loop(imv, &frame);
+    }
 
-  if (imv->custom_start_pan) {
-    imv_viewport_set_default_pan_factor(imv->view, imv->initial_pan_x, imv->initial_pan_y);
+    /* Start filling the queue with the frames that follow */
+    request_frame(imv);
   }
 
-  /* put us in fullscren mode to begin with if requested */
-  imv_window_set_fullscreen(imv->window, imv->start_fullscreen);
+  /* Now the current image is up, start on its neighbours */
+  update_prefetch(imv);
+}
 
-  {
-    int ww, wh;
-    imv_window_get_size(imv->window, &ww, &wh);
-    imv->canvas = imv_canvas_create(ww, wh);
-    imv_canvas_font(imv->canvas, imv->font.name, imv->font.size);
+static void handle_new_frame(struct imv *imv, struct imv_image *image, int frametime,
+    int frame_index)
+{
+  imv->animation.loading = false;
+  if (imv->animation.due == 0.0) {
+    /* Not animating any more */
+    imv_image_free(image);
+    return;
   }
 
-  return true;
+  struct frame *frame = calloc(1, sizeof *frame);
+  frame->image = image;
+  frame->duration = frametime * 0.001;
+  frame->index = frame_index;
+  list_append(imv->animation.queue, frame);
+  imv->animation.queue_bytes += imv_image_bytes(image);
+  add_to_loop(imv, frame);
+
+  request_frame(imv);
 }
 
+static void reset_pages(struct imv *imv)
+{
+  imv_image_free(imv->page.ahead);
+  imv->page.ahead = NULL;
+  imv->page.current = 0;
+  imv->page.wanted = 0;
+  imv->page.loading = -1;
+  imv->page.direction = 1;
+}
 
-static void handle_new_image(struct imv *imv, struct imv_image *image, int frametime)
+/* Start loading the page that's been asked for, or failing that the one
+ * after it. A source only loads one thing at a time, so nothing's started
+ * while it's busy, and this is called again once it's done. */
+static void update_pages(struct imv *imv)
 {
-  if (imv->current_image) {
-    imv_image_free(imv->current_image);
+  struct imv_source *src = imv->current_source;
+  if (!src || imv->page.loading != -1 || imv->loading
+      || imv->loading_full_res || imv->region.loading || imv->animation.loading
+      || imv_source_page_count(src) < 2) {
+    return;
   }
-  imv->current_image = image;
-  imv->need_redraw = true;
-  imv->need_rescale = true;
-  imv->loading = false;
-  imv->next_frame.due = frametime ? cur_time() + frametime * 0.001 : 0.0;
-  imv->next_frame.duration = 0.0;
 
-  /* If this is an animated image, we should kick off loading the next frame */
-  if (imv->current_source && frametime) {
-    imv_source_async_load_next_frame(imv->current_source);
+  int page = imv->page.wanted;
+  if (page == imv->page.current) {
+    page += imv->page.direction;
+    if (page < 0 || page >= imv_source_page_count(src)
+        || (imv->page.ahead && imv->page.ahead_index == page)) {
+      return;
+    }
+  } else {
+    imv->loading = true;
   }
+
+  imv->page.loading = page;
+  imv_source_set_page(src, page);
+  set_target_size(imv, src);
+  imv_source_async_load_first_frame(src);
+}
+
+static void show_page(struct imv *imv, struct imv_image *image, int page)
+{
+  drop_region(imv);
+  imv->page.current = page;
+  handle_new_image(imv, image, 0, 0, 0);
 }
 
-static void handle_new_frame(struct imv *imv, struct imv_image *image, int frametime)
+static void handle_new_page(struct imv *imv, struct imv_image *image, int page)
 {
-  if (imv->next_frame.image) {
-    imv_image_free(imv->next_frame.image);
+  imv->page.loading = -1;
+  if (page == imv->page.wanted && page != imv->page.current) {
+    show_page(imv, image, page);
+  } else {
+    /* Either read ahead, or asked for and then turned away from */
+    imv->loading = false;
+    if (page != imv->page.current) {
+      imv_image_free(imv->page.ahead);
+      imv->page.ahead = image;
+      imv->page.ahead_index = page;
+    } else {
+      imv_image_free(image);
+    }
   }
-  imv->next_frame.image = image;
+  update_pages(imv);
+}
 
-  imv->next_frame.duration = frametime * 0.001;
+static void go_to_page(struct imv *imv, int page)
+{
+  imv->page.direction = page < imv->page.wanted ? -1 : 1;
+  imv->page.wanted = page;
+  if (page != imv->page.current && imv->page.ahead
+      && imv->page.ahead_index == page) {
+    struct imv_image *image = imv->page.ahead;
+    imv->page.ahead = NULL;
+    show_page(imv, image, page);
+  }
+  update_pages(imv);
 }
 
 static void consume_internal_event(struct imv *imv, struct internal_event *event)
 {
   if (event->type == NEW_IMAGE) {
-    /* New image vs just a new frame of the same image */
-    if (event->data.new_image.is_new_image) {
-      handle_new_image(imv, event->data.new_image.image, event->data.new_image.frametime);
+    struct imv_source *source = event->data.new_image.source;
+    struct imv_image *image = event->data.new_image.image;
+    const int frametime = event->data.new_image.frametime;
+    const int frame_index = event->data.new_image.frame_index;
+    const int frame_count = event->data.new_image.frame_count;
+    const int page_index = event->data.new_image.page_index;
+    const bool preview = event->data.new_image.preview;
+
+    /* The first full resolution image of a newly selected file */
+    if (!preview && source == imv->current_source && imv->latency.selected != 0.0
+        && !imv->latency.drawing && imv->latency.presented == 0.0) {
+      imv_latency_add(imv->latency.stats, IMV_LATENCY_DECODE,
+          event->data.new_image.decode_time);
+      imv_latency_add(imv->latency.stats, IMV_LATENCY_DELIVER,
+          cur_time() - event->data.new_image.sent_time);
+      imv_latency_add(imv->slideshow.decodes, IMV_LATENCY_DECODE,
+          event->data.new_image.decode_time);
+      imv->latency.drawing = true;
+    }
+
+    if (preview && source == imv->current_source
+        && source == imv->last_source && imv->showing_preview) {
+      /* More of an image that's being decoded progressively. It's the same
+       * size as the preview already shown, so the view is left alone. */
+      imv_image_free(imv->current_image);
+      imv->current_image = image;
+      imv->need_redraw = true;
+    } else if (preview && (source != imv->current_source
+          || source == imv->last_source)) {
+      /* A preview is only any use while there's nothing better to show */
+      imv_image_free(image);
+    } else if (preview) {
+      imv->last_source = source;
+      handle_new_image(imv, image, 0, 0, 0);
+      /* The real image is still on its way */
+      imv->loading = true;
+      imv->showing_preview = true;
+    } else if (source == imv->current_source && imv->page.loading != -1) {
+      handle_new_page(imv, image, page_index);
+    } else if (source == imv->current_source && source == imv->last_source
+        && (imv->loading_full_res || imv->showing_preview)) {
+      /* A higher resolution version of the current image. It's the same size
+       * as the one being shown, so the view is left alone. */
+      const bool after_preview = imv->showing_preview && !imv->loading_full_res;
+      imv->loading = false;
+      imv->loading_full_res = false;
+      imv->showing_preview = false;
+      imv_image_free(imv->current_image);
+      imv->current_image = image;
+      imv->need_redraw = true;
+      /* The first full image of a source that started with a preview, which
+       * the caches haven't seen yet */
+      if (after_preview) {
+        store_on_disk(imv, image, 0);
+      }
+      /* A page may have been asked for in the meantime */
+      update_pages(imv);
+    } else if (source == imv->current_source) {
+      /* Keep track of the last source to send us an image in order to detect
+       * when we're getting a new image, as opposed to a new frame from the
+       * same image.
+       */
+      if (source != imv->last_source) {
+        imv->last_source = source;
+        handle_new_image(imv, image, frametime, frame_index, frame_count);
+        store_on_disk(imv, image, frametime);
+        update_pages(imv);
+      } else {
+        handle_new_frame(imv, image, frametime, frame_index);
+      }
+    } else if (imv_gallery_store(imv->gallery, source, image)) {
+      /* A thumbnail, which the gallery's taken */
+    } else if (imv_cache_store(imv->cache, source, image, frametime)) {
+      /* A prefetched image, timed for deciding how far ahead of a slide's slot
+       * to start on it */
+      if (!preview) {
+        imv_latency_add(imv->slideshow.decodes, IMV_LATENCY_DECODE,
+            event->data.new_image.decode_time);
+      }
     } else {
-      handle_new_frame(imv, event->data.new_image.image, event->data.new_image.frametime);
+      /* We received a message from an old source, ignore it */
+      imv_image_free(image);
     }
 
   } else if (event->type == BAD_IMAGE) {
+    if (event->data.bad_image.source != imv->current_source) {
+      /* A prefetch or thumbnail failed, or an old source we don't care about
+       * any more */
+      if (!imv_gallery_store(imv->gallery, event->data.bad_image.source, NULL)) {
+        imv_cache_store(imv->cache, event->data.bad_image.source, NULL, 0);
+      }
+      free(event);
+      return;
+    }
+
+    if (imv->page.loading != -1) {
+      /* Stay on the page that's onscreen */
+      if (imv->page.loading == imv->page.wanted) {
+        imv_log(IMV_WARNING, "Failed to load page %d\n", imv->page.loading + 1);
+        imv->page.wanted = imv->page.current;
+        imv->loading = false;
+      }
+      imv->page.loading = -1;
+      update_pages(imv);
+      free(event);
+      return;
+    }
+
+    if (imv->loading_full_res) {
+      /* Keep showing the reduced resolution version */
+      imv_log(IMV_WARNING, "Failed to reload image at full resolution\n");
+      imv->loading_full_res = false;
+      update_pages(imv);
+      free(event);
+      return;
+    }
+
     /* An image failed to load, remove it from our image list */
     const char *err_path = imv_navigator_selection(imv->navigator);
 
     /* Special case: the image came from stdin */
     if (strcmp(err_path, "-") == 0) {
-      if (imv->stdin_image_data) {
-        free(imv->stdin_image_data);
-        imv->stdin_image_data = NULL;
-        imv->stdin_image_data_len = 0;
-      }
       imv_log(IMV_ERROR, "Failed to load image from stdin.\n");
     }
 
     imv_navigator_remove(imv->navigator, err_path);
 
   } else if (event->type == NEW_PATH) {
-    /* Received a new path from the stdin reading thread */
-    imv_add_path(imv, event->data.new_path.path);
-    free(event->data.new_path.path);
+    /* Received some paths from the stdin reading thread */
+    struct list *paths = event->data.new_path.paths;
+    for (size_t i = 0; i < paths->len; ++i) {
+      imv_add_path(imv, paths->items[i]);
+    }
+    list_deep_free(paths);
     /* Need to update image count in title */
-    imv->need_redraw = true;
+    imv->paths_changed = true;
+
+  } else if (event->type == NEW_PATHS) {
+    /* Received some of a directory's files from the scanner */
+    struct imv_scanner_batch *batch = event->data.new_paths.batch;
+    imv_navigator_add_entries(imv->navigator, batch->group, batch->entries);
+    if (batch->done) {
+      scan_finished(imv, batch->group);
+    }
+    imv_scanner_batch_free(batch);
+    /* The images either side of the current one may have changed */
+    if (imv->current_source) {
+      update_prefetch(imv);
+    }
+    imv->paths_changed = true;
 
   } else if (event->type == COMMAND) {
-    struct list *commands = list_create();
-    list_append(commands, event->data.command.text);
-    imv_command_exec_list(imv->commands, commands, imv);
-    list_deep_free(commands);
+    struct imv_ipc_request *request = event->data.command.request;
+    if (request) {
+      imv->reply.active = true;
+      imv->reply.len = 0;
+      imv->reply.error = NULL;
+      if (imv->reply.output) {
+        imv->reply.output[0] = 0;
+      }
+    }
+    const int failed = imv_command_exec(imv->commands,
+        event->data.command.text, imv);
+    if (request) {
+      if (failed && !imv->reply.error) {
+        imv->reply.error = "unknown command";
+      }
+      imv_ipc_reply(imv->ipc, request, !imv->reply.error,
+          imv->reply.error ? imv->reply.error : imv->reply.output);
+      imv->reply.active = false;
+    }
+    free(event->data.command.text);
     imv->need_redraw = true;
+
+  } else if (event->type == NEW_RASTER) {
+    /* A vector image has been rasterised at a new scale. It's only any use
+     * if the image is still being shown, and the job hasn't failed. */
+    struct raster_job *job = event->data.new_raster.job;
+    if (job->bitmap && job->image == imv->current_image) {
+      imv_image_set_raster(job->image, job->bitmap, job->scale);
+      imv->need_redraw = true;
+    } else if (job->bitmap) {
+      imv_bitmap_free(job->bitmap);
+    }
+    imv_image_free(job->image);
+    if (imv->raster.job == job) {
+      imv->raster.job = NULL;
+    }
+    free(job);
+
+  } else if (event->type == NEW_STDIN_SOURCE) {
+    /* stdin's been opened by a backend that needed all of it, which is only
+     * any use if it's still selected */
+    struct stdin_job *job = event->data.new_stdin_source.job;
+    if (job != imv->stdin_open.job) {
+      if (job->source) {
+        imv_source_async_free(job->source);
+      }
+    } else if (job->result == BACKEND_SUCCESS) {
+      imv->stdin_open.job = NULL;
+      imv->current_source = job->source;
+      start_current_source(imv, true);
+    } else {
+      imv->stdin_open.job = NULL;
+      imv->loading = false;
+      imv->latency.selected = 0.0;
+      imv_navigator_remove(imv->navigator, "-");
+    }
+    free(job);
+
+  } else if (event->type == NEW_REGION) {
+    /* A more detailed part of the current image, unless the image has
+     * changed since it was asked for */
+    struct imv_image *image = event->data.new_region.image;
+    if (event->data.new_region.source != imv->current_source
+        || !imv->region.loading) {
+      if (image) {
+        imv_image_free(image);
+      }
+    } else {
+      imv->region.loading = false;
+      if (!image) {
+        imv_log(IMV_WARNING, "Failed to load part of image in detail\n");
+        imv->region.failed = true;
+      } else {
+        if (imv->region.image) {
+          imv_image_free(imv->region.image);
+        }
+        imv->region.image = image;
+        imv->region.source = imv->current_source;
+        imv->region.page = event->data.new_region.page_index;
+        imv->need_redraw = true;
+      }
+      update_pages(imv);
+    }
   }
 
   free(event);
@@ -1160,32 +2944,28 @@ static void consume_internal_event(struct imv *imv, struct internal_event *event
 
 static void render_window(struct imv *imv)
 {
+  /* The canvas is the size of the buffer, so the overlay's drawn in buffer
+   * pixels too */
   int ww, wh;
-  imv_window_get_size(imv->window, &ww, &wh);
+  imv_window_get_framebuffer_size(imv->window, &ww, &wh);
+  const double ui_scale = imv->font.scale;
 
-  /* update window title */
-  char title_text[1024];
-  generate_env_text(imv, title_text, sizeof title_text, imv->title_text);
-  imv_window_set_title(imv->window, title_text);
+  update_title(imv);
 
-  /* first we draw the background */
+  /* first we draw the background. A solid colour is just a clear. */
   if (imv->background.type == BACKGROUND_SOLID) {
-    imv_canvas_clear(imv->canvas);
-    imv_canvas_color(imv->canvas,
-        imv->background.color.r / 255.f,
-        imv->background.color.g / 255.f,
-        imv->background.color.b / 255.f,
-        1.0);
-    imv_canvas_fill(imv->canvas);
-    imv_canvas_draw(imv->canvas);
+    imv_window_clear(imv->window, imv->background.color.r,
+        imv->background.color.g, imv->background.color.b);
   } else {
     /* chequered background */
-    imv_canvas_fill_checkers(imv->canvas, 16);
-    imv_canvas_draw(imv->canvas);
+    imv_canvas_draw_checkers(imv->canvas, 16 * ui_scale + 0.5);
   }
 
-  /* draw our actual image */
-  if (imv->current_image) {
+  /* draw our actual image, or the gallery in its place */
+  if (imv->gallery_enabled) {
+    imv_gallery_draw(imv->gallery, imv->canvas, imv->upscaling_method);
+    imv->drawn_overlay.valid = false;
+  } else if (imv->current_image) {
     int x, y;
     double scale, rotation;
     bool mirrored;
@@ -1196,49 +2976,83 @@ static void render_window(struct imv *imv)
     imv_canvas_draw_image(imv->canvas, imv->current_image,
                           x, y, scale, rotation, mirrored,
                           imv->upscaling_method, imv->cache_invalidated);
+    /* with the part that's in view in more detail on top */
+    if (imv->region.image && imv->region.source == imv->current_source
+        && imv->region.page == imv->page.current) {
+      imv_canvas_draw_image(imv->canvas, imv->region.image,
+                            x, y, scale, rotation, mirrored,
+                            imv->upscaling_method, imv->cache_invalidated);
+    }
   }
 
-  imv_canvas_clear(imv->canvas);
-
-  /* if the overlay needs to be drawn, draw that too */
+  /* The overlay and command prompt only need drawing again if they've
+   * changed, otherwise what's already on the canvas is reused */
+  const char *overlay_text = "";
   if (imv->overlay_enabled) {
-    const int height = imv->font.size * 1.2;
-    imv_canvas_color(imv->canvas, 0, 0, 0, 0.75);
-    imv_canvas_fill_rectangle(imv->canvas, 0, 0, ww, height);
-    imv_canvas_color(imv->canvas, 1, 1, 1, 1);
-    char overlay_text[1024];
-    generate_env_text(imv, overlay_text, sizeof overlay_text, imv->overlay_text);
-    imv_canvas_printf(imv->canvas, 0, 0, "%s", overlay_text);
-  }
-
-  /* draw command entry bar if needed */
-  if (imv_console_prompt(imv->console)) {
-    const int bottom_offset = 5;
-    const int height = imv->font.size * 1.2;
-    imv_canvas_color(imv->canvas, 0, 0, 0, 0.75);
-    imv_canvas_fill_rectangle(imv->canvas, 0, wh - height - bottom_offset,
-        ww, height + bottom_offset);
-    imv_canvas_color(imv->canvas, 1, 1, 1, 1);
-
-    int x = 0;
-    /* draw pre-cursor text */
-    x += imv_canvas_printf(imv->canvas, x, wh - height - bottom_offset,
-        ":%.*s",
-        imv_console_prompt_cursor(imv->console),
-        imv_console_prompt(imv->console));
-    /* draw the cursor */
-    imv_canvas_color(imv->canvas, 1, 1, 1, 0.5);
-    imv_canvas_printf(imv->canvas, x, wh - height - bottom_offset, "\u2588");
-    /* any any remaining text on top of the cursor */
-    imv_canvas_color(imv->canvas, 1, 1, 1, 1);
-    imv_canvas_printf(imv->canvas, x, wh - height - bottom_offset, "%s",
-        imv_console_prompt(imv->console) + imv_console_prompt_cursor(imv->console));
+    overlay_text = expand_template(imv, imv->overlay_text, NULL);
+  }
+  const char *prompt = imv_console_prompt(imv->console);
+  const size_t cursor = prompt ? imv_console_prompt_cursor(imv->console) : 0;
+
+  const bool overlay_changed = !imv->drawn_overlay.valid
+    || imv->drawn_overlay.width != ww || imv->drawn_overlay.height != wh
+    || imv->drawn_overlay.overlay_enabled != imv->overlay_enabled
+    || strcmp(imv->drawn_overlay.text, overlay_text)
+    || !prompt != !imv->drawn_overlay.prompt
+    || (prompt && strcmp(prompt, imv->drawn_overlay.prompt))
+    || imv->drawn_overlay.cursor != cursor;
+
+  if (overlay_changed) {
+    imv_canvas_clear(imv->canvas);
+
+    /* if the overlay needs to be drawn, draw that too */
+    if (imv->overlay_enabled) {
+      const int height = imv->font.size * ui_scale * 1.2;
+      imv_canvas_color(imv->canvas, 0, 0, 0, 0.75);
+      imv_canvas_fill_rectangle(imv->canvas, 0, 0, ww, height);
+      imv_canvas_color(imv->canvas, 1, 1, 1, 1);
+      imv_canvas_printf(imv->canvas, 0, 0, "%s", overlay_text);
+    }
+
+    /* draw command entry bar if needed */
+    if (prompt) {
+      const int bottom_offset = 5 * ui_scale + 0.5;
+      const int height = imv->font.size * ui_scale * 1.2;
+      imv_canvas_color(imv->canvas, 0, 0, 0, 0.75);
+      imv_canvas_fill_rectangle(imv->canvas, 0, wh - height - bottom_offset,
+          ww, height + bottom_offset);
+      imv_canvas_color(imv->canvas, 1, 1, 1, 1);
+
+      int x = 0;
+      /* draw pre-cursor text */
+      x += imv_canvas_printf(imv->canvas, x, wh - height - bottom_offset,
+          ":%.*s", (int)cursor, prompt);
+      /* draw the cursor */
+      imv_canvas_color(imv->canvas, 1, 1, 1, 0.5);
+      imv_canvas_printf(imv->canvas, x, wh - height - bottom_offset, "\u2588");
+      /* any any remaining text on top of the cursor */
+      imv_canvas_color(imv->canvas, 1, 1, 1, 1);
+      imv_canvas_printf(imv->canvas, x, wh - height - bottom_offset, "%s",
+          prompt + cursor);
+    }
+
+    imv->drawn_overlay.valid = true;
+    imv->drawn_overlay.width = ww;
+    imv->drawn_overlay.height = wh;
+    imv->drawn_overlay.overlay_enabled = imv->overlay_enabled;
+    free(imv->drawn_overlay.text);
+    imv->drawn_overlay.text = strdup(overlay_text);
+    free(imv->drawn_overlay.prompt);
+    imv->drawn_overlay.prompt = prompt ? strdup(prompt) : NULL;
+    imv->drawn_overlay.cursor = cursor;
   }
 
   imv_canvas_draw(imv->canvas);
 
   /* redraw complete, unset the flag */
   imv->need_redraw = false;
+  imv->paths_changed = false;
+  imv->paths_redrawn = cur_time();
   imv->cache_invalidated = false;
 }
 
@@ -1344,10 +3158,80 @@ static int handle_ini_value(void *user, const char *section, const char *name,
       return parse_scaling_mode(imv, value);
     }
 
+    if (!strcmp(name, "prefetch_ahead")) {
+      imv->prefetch.ahead = strtol(value, NULL, 10);
+      if (imv->prefetch.ahead < 0) {
+        imv->prefetch.ahead = 0;
+      }
+      return 1;
+    }
+
+    if (!strcmp(name, "prefetch_behind")) {
+      imv->prefetch.behind = strtol(value, NULL, 10);
+      if (imv->prefetch.behind < 0) {
+        imv->prefetch.behind = 0;
+      }
+      return 1;
+    }
+
+    if (!strcmp(name, "prefetch_memory")) {
+      const long megabytes = strtol(value, NULL, 10);
+      imv->prefetch.max_bytes = megabytes > 0 ? (size_t)megabytes * 1024 * 1024 : 0;
+      imv_cache_set_max_bytes(imv->cache, imv->prefetch.max_bytes);
+      return 1;
+    }
+
+    if (!strcmp(name, "animation_lookahead")) {
+      imv->animation.lookahead = strtol(value, NULL, 10);
+      if (imv->animation.lookahead < 1) {
+        imv->animation.lookahead = 1;
+      }
+      return 1;
+    }
+
+    if (!strcmp(name, "animation_memory")) {
+      const long megabytes = strtol(value, NULL, 10);
+      imv->animation.max_bytes = megabytes > 0 ? (size_t)megabytes * 1024 * 1024 : 0;
+      return 1;
+    }
+
+    if (!strcmp(name, "disk_cache")) {
+      imv->disk_cache.enabled = parse_bool(value);
+      return 1;
+    }
+
+    if (!strcmp(name, "disk_cache_size")) {
+      const long megabytes = strtol(value, NULL, 10);
+      imv->disk_cache.max_bytes = megabytes > 0 ? (size_t)megabytes * 1024 * 1024 : 0;
+      return 1;
+    }
+
+    if (!strcmp(name, "shared_cache")) {
+      imv->shared_cache.enabled = parse_bool(value);
+      return 1;
+    }
+
+    if (!strcmp(name, "shared_cache_size")) {
+      const long megabytes = strtol(value, NULL, 10);
+      imv->shared_cache.max_bytes = megabytes > 0 ? (size_t)megabytes * 1024 * 1024 : 0;
+      return 1;
+    }
+
+    if (!strcmp(name, "thumbnail_size")) {
+      set_thumbnail_size(imv, strtol(value, NULL, 10));
+      return 1;
+    }
+
     if (!strcmp(name, "initial_pan")) {
       return parse_initial_pan(imv, value);
     }
 
+    if (!strcmp(name, "transition_time")) {
+      const long ms = strtol(value, NULL, 10);
+      imv->transition_time = ms > 0 ? ms * 0.001 : 0.0;
+      return 1;
+    }
+
     if (!strcmp(name, "background")) {
       if (!parse_bg(imv, value)) {
         return false;
@@ -1376,14 +3260,14 @@ static int handle_ini_value(void *user, const char *section, const char *name,
     }
 
     if (!strcmp(name, "overlay_text")) {
-      free(imv->overlay_text);
-      imv->overlay_text = strdup(value);
+      imv_template_free(imv->overlay_text);
+      imv->overlay_text = imv_template_create(value);
       return 1;
     }
 
     if (!strcmp(name, "title_text")) {
-      free(imv->title_text);
-      imv->title_text = strdup(value);
+      imv_template_free(imv->title_text);
+      imv->title_text = imv_template_create(value);
       return 1;
     }
 
@@ -1444,7 +3328,14 @@ static void command_pan(struct list *args, const char *argstr, void *data)
   long int x = strtol(args->items[1], NULL, 10);
   long int y = strtol(args->items[2], NULL, 10);
 
-  imv_viewport_move(imv->view, x, y, imv->current_image);
+  if (imv->gallery_enabled) {
+    /* Panning the view one way is moving the selection the other */
+    imv_gallery_move(imv->gallery, x > 0 ? -1 : x < 0 ? 1 : 0,
+        y > 0 ? -1 : y < 0 ? 1 : 0);
+    return;
+  }
+
+  imv_viewport_pan(imv->view, x, y, imv->current_image);
 }
 
 static void command_next(struct list *args, const char *argstr, void *data)
@@ -1457,6 +3348,11 @@ static void command_next(struct list *args, const char *argstr, void *data)
     index = strtol(args->items[1], NULL, 10);
   }
 
+  if (imv->gallery_enabled) {
+    imv_gallery_move(imv->gallery, index, 0);
+    return;
+  }
+
   imv_navigator_select_rel(imv->navigator, index);
   imv_viewport_reset_transform(imv->view);
 
@@ -1473,6 +3369,11 @@ static void command_prev(struct list *args, const char *argstr, void *data)
     index = strtol(args->items[1], NULL, 10);
   }
 
+  if (imv->gallery_enabled) {
+    imv_gallery_move(imv->gallery, -index, 0);
+    return;
+  }
+
   imv_navigator_select_rel(imv->navigator, -index);
   imv_viewport_reset_transform(imv->view);
 
@@ -1488,6 +3389,14 @@ static void command_goto(struct list *args, const char *argstr, void *data)
   }
 
   long int index = strtol(args->items[1], NULL, 10);
+
+  if (imv->gallery_enabled) {
+    /* As with the navigator, -1 is the last path */
+    const ssize_t len = (ssize_t)imv_navigator_length(imv->navigator);
+    imv_gallery_select(imv->gallery, index > 0 ? index - 1 : len + index - 1);
+    return;
+  }
+
   imv_navigator_select_abs(imv->navigator, index - 1);
   imv_viewport_reset_transform(imv->view);
 
@@ -1498,7 +3407,11 @@ static void command_zoom(struct list *args, const char *argstr, void *data)
 {
   (void)argstr;
   struct imv *imv = data;
-  if (args->len == 2) {
+  if (args->len == 2 && imv->gallery_enabled) {
+    /* Zooming the gallery changes the size of its thumbnails */
+    const long amount = strtol(args->items[1], NULL, 10);
+    set_thumbnail_size(imv, imv->thumbnail_size + amount * THUMBNAIL_SIZE_STEP);
+  } else if (args->len == 2) {
     const char *str = args->items[1];
     if (!strcmp(str, "actual")) {
       imv_viewport_scale_to_actual(imv->view, imv->current_image);
@@ -1555,7 +3468,7 @@ static void command_open(struct list *args, const char *argstr, void *data)
     wordexp_t word;
     if (wordexp(args->items[i], &word, 0) == 0) {
       for (size_t j = 0; j < word.we_wordc; ++j) {
-        imv_navigator_add(imv->navigator, word.we_wordv[j], recursive);
+        add_path(imv, word.we_wordv[j], recursive);
       }
       wordfree(&word);
     }
@@ -1634,9 +3547,49 @@ static void command_next_frame(struct list *args, const char *argstr, void *data
   (void)args;
   (void)argstr;
   struct imv *imv = data;
-  if (imv->current_source) {
-    imv_source_async_load_next_frame(imv->current_source);
-    imv->next_frame.force_next_frame = true;
+  if (imv->animation.due != 0.0) {
+    imv->animation.force_next_frame = true;
+    request_frame(imv);
+  }
+}
+
+static void command_page(struct list *args, const char *argstr, void *data)
+{
+  (void)argstr;
+  struct imv *imv = data;
+
+  if (args->len != 2 || !imv->current_source) {
+    return;
+  }
+
+  /* Only the file itself knows how many pages it has */
+  if (!replace_disk_cache_source(imv)) {
+    imv_log(IMV_WARNING, "Failed to open %s for its pages\n", imv->current_path);
+    return;
+  }
+
+  const int count = imv_source_page_count(imv->current_source);
+  if (count < 2) {
+    return;
+  }
+
+  /* Relative moves are from the page last asked for, so that they add up
+   * while it's still loading */
+  const char *arg = args->items[1];
+  long page = strtol(arg, NULL, 10);
+  if (arg[0] == '+' || arg[0] == '-') {
+    page += imv->page.wanted;
+  } else {
+    page -= 1;
+  }
+  if (page < 0) {
+    page = 0;
+  } else if (page >= count) {
+    page = count - 1;
+  }
+
+  if (page != imv->page.wanted) {
+    go_to_page(imv, (int)page);
   }
 }
 
@@ -1732,6 +3685,50 @@ static void command_set_background(struct list *args, const char *argstr, void *
   }
 }
 
+static void command_gallery(struct list *args, const char *argstr, void *data)
+{
+  (void)args;
+  (void)argstr;
+  struct imv *imv = data;
+
+  if (imv->gallery_enabled) {
+    /* Leave the gallery at whichever image was selected */
+    const size_t index = imv_gallery_selection(imv->gallery);
+    if (index != imv_navigator_index(imv->navigator)) {
+      imv_navigator_select_abs(imv->navigator, (ssize_t)index);
+      imv_viewport_reset_transform(imv->view);
+      imv->slideshow.elapsed = 0;
+    }
+    imv_gallery_clear(imv->gallery);
+  } else {
+    imv_gallery_select(imv->gallery, (ssize_t)imv_navigator_index(imv->navigator));
+  }
+
+  imv->gallery_enabled = !imv->gallery_enabled;
+  imv->need_redraw = true;
+}
+
+static void command_latency(struct list *args, const char *argstr, void *data)
+{
+  (void)args;
+  (void)argstr;
+  struct imv *imv = data;
+
+  for (int i = 0; i < IMV_LATENCY_STAGE_COUNT; ++i) {
+    const double last = imv_latency_last(imv->latency.stats, i) * 1e3;
+    const double p50 = imv_latency_percentile(imv->latency.stats, i, 50.0) * 1e3;
+    const double p95 = imv_latency_percentile(imv->latency.stats, i, 95.0) * 1e3;
+    if (imv->reply.active) {
+      reply(imv, "%s %.1f %.1f %.1f\n", imv_latency_stage_name(i),
+          last, p50, p95);
+    } else {
+      imv_log(IMV_INFO, "latency: %-8s last %7.1fms, median %7.1fms, "
+          "95th percentile %7.1fms\n", imv_latency_stage_name(i),
+          last, p50, p95);
+    }
+  }
+}
+
 static void command_bind(struct list *args, const char *argstr, void *data)
 {
   (void)argstr;
@@ -1744,93 +3741,209 @@ static void command_bind(struct list *args, const char *argstr, void *data)
   }
 }
 
-static void update_env_vars(struct imv *imv)
+static const char *env_var_names[] = {
+  "imv_pid",
+  "imv_current_file",
+  "imv_scaling_mode",
+  "imv_loading",
+  "imv_current_index",
+  "imv_file_count",
+  "imv_current_page",
+  "imv_page_count",
+  "imv_width",
+  "imv_height",
+  "imv_scale",
+  "imv_slideshow_duration",
+  "imv_slideshow_elapsed",
+  "imv_dropped_frames",
+  "imv_cache_bytes",
+  "imv_cache_images",
+  "imv_cache_hit_rate",
+  "imv_resident_bytes",
+  "imv_latency_open",
+  "imv_latency_open_p50",
+  "imv_latency_open_p95",
+  "imv_latency_decode",
+  "imv_latency_decode_p50",
+  "imv_latency_decode_p95",
+  "imv_latency_deliver",
+  "imv_latency_deliver_p50",
+  "imv_latency_deliver_p95",
+  "imv_latency_draw",
+  "imv_latency_draw_p50",
+  "imv_latency_draw_p95",
+  "imv_latency_present",
+  "imv_latency_present_p50",
+  "imv_latency_present_p95",
+  "imv_latency_total",
+  "imv_latency_total_p50",
+  "imv_latency_total_p95",
+};
+
+/* The process's resident set size, or 0 if it can't be found */
+static size_t resident_bytes(void)
 {
-  char str[64];
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f) {
+    return 0;
+  }
+  unsigned long size = 0, resident = 0;
+  const int matched = fscanf(f, "%lu %lu", &size, &resident);
+  fclose(f);
+  return matched == 2 ? (size_t)resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+}
 
-  snprintf(str, sizeof str, "%d", getpid());
-  setenv("imv_pid", str, 1);
+/* Get an $imv_latency_ variable, given the rest of its name: a stage, for
+ * its latest timing, or a stage and a percentile, in milliseconds */
+static bool get_latency_var(struct imv *imv, const char *name, char *buf,
+    size_t len)
+{
+  char stage_name[16];
+  const char *suffix = strchr(name, '_');
+  const size_t stage_len = suffix ? (size_t)(suffix - name) : strlen(name);
+  if (stage_len >= sizeof stage_name) {
+    return false;
+  }
+  memcpy(stage_name, name, stage_len);
+  stage_name[stage_len] = 0;
 
-  setenv("imv_current_file", imv_navigator_selection(imv->navigator), 1);
-  setenv("imv_scaling_mode", scaling_label[imv->scaling_mode], 1);
-  setenv("imv_loading", imv->loading ? "1" : "0", 1);
+  enum imv_latency_stage stage;
+  if (!imv_latency_find_stage(stage_name, &stage)) {
+    return false;
+  }
 
-  if (imv_navigator_length(imv->navigator)) {
-    snprintf(str, sizeof str, "%zu", imv_navigator_index(imv->navigator) + 1);
-    setenv("imv_current_index", str, 1);
+  double seconds;
+  if (!suffix) {
+    seconds = imv_latency_last(imv->latency.stats, stage);
+  } else if (!strcmp(suffix, "_p50")) {
+    seconds = imv_latency_percentile(imv->latency.stats, stage, 50.0);
+  } else if (!strcmp(suffix, "_p95")) {
+    seconds = imv_latency_percentile(imv->latency.stats, stage, 95.0);
   } else {
-    setenv("imv_current_index", "0", 1);
+    return false;
   }
+  snprintf(buf, len, "%.1f", seconds * 1e3);
+  return true;
+}
 
-  snprintf(str, sizeof str, "%zu", imv_navigator_length(imv->navigator));
-  setenv("imv_file_count", str, 1);
-
-  snprintf(str, sizeof str, "%d", imv_image_width(imv->current_image));
-  setenv("imv_width", str, 1);
-
-  snprintf(str, sizeof str, "%d", imv_image_height(imv->current_image));
-  setenv("imv_height", str, 1);
+/* Get the value of one of imv's environment variables, as it would be
+ * exported. Returns false if name isn't one of them. */
+static bool get_env_var(const char *name, char *buf, size_t len, void *data)
+{
+  struct imv *imv = data;
 
-  {
+  if (!strcmp(name, "imv_pid")) {
+    snprintf(buf, len, "%d", getpid());
+  } else if (!strcmp(name, "imv_current_file")) {
+    snprintf(buf, len, "%s", imv_navigator_selection(imv->navigator));
+  } else if (!strcmp(name, "imv_scaling_mode")) {
+    snprintf(buf, len, "%s", scaling_label[imv->scaling_mode]);
+  } else if (!strcmp(name, "imv_loading")) {
+    snprintf(buf, len, "%s", imv->loading ? "1" : "0");
+  } else if (!strcmp(name, "imv_current_index")) {
+    if (imv_navigator_length(imv->navigator)) {
+      snprintf(buf, len, "%zu", imv_navigator_index(imv->navigator) + 1);
+    } else {
+      snprintf(buf, len, "0");
+    }
+  } else if (!strcmp(name, "imv_file_count")) {
+    snprintf(buf, len, "%zu", imv_navigator_length(imv->navigator));
+  } else if (!strcmp(name, "imv_current_page")) {
+    snprintf(buf, len, "%d", imv->page.current + 1);
+  } else if (!strcmp(name, "imv_page_count")) {
+    snprintf(buf, len, "%d", imv->current_source
+        ? imv_source_page_count(imv->current_source) : 1);
+  } else if (!strcmp(name, "imv_width")) {
+    snprintf(buf, len, "%d", imv_image_width(imv->current_image));
+  } else if (!strcmp(name, "imv_height")) {
+    snprintf(buf, len, "%d", imv_image_height(imv->current_image));
+  } else if (!strcmp(name, "imv_scale")) {
     double scale;
     imv_viewport_get_scale(imv->view, &scale);
-    snprintf(str, sizeof str, "%d", (int)(scale * 100.0));
-    setenv("imv_scale", str, 1);
+    snprintf(buf, len, "%d", (int)(scale * 100.0));
+  } else if (!strcmp(name, "imv_slideshow_duration")) {
+    snprintf(buf, len, "%f", imv->slideshow.duration);
+  } else if (!strcmp(name, "imv_slideshow_elapsed")) {
+    snprintf(buf, len, "%f", imv->slideshow.elapsed);
+  } else if (!strcmp(name, "imv_dropped_frames")) {
+    snprintf(buf, len, "%lu", imv->display.dropped);
+  } else if (!strncmp(name, "imv_cache_", strlen("imv_cache_"))) {
+    struct imv_cache_stats stats;
+    imv_cache_get_stats(imv->cache, &stats);
+    const unsigned long lookups = stats.hits + stats.misses;
+    if (!strcmp(name, "imv_cache_bytes")) {
+      snprintf(buf, len, "%zu", stats.bytes);
+    } else if (!strcmp(name, "imv_cache_images")) {
+      snprintf(buf, len, "%zu", stats.images);
+    } else if (!strcmp(name, "imv_cache_hit_rate")) {
+      snprintf(buf, len, "%lu", lookups ? 100 * stats.hits / lookups : 0);
+    } else {
+      return false;
+    }
+  } else if (!strcmp(name, "imv_resident_bytes")) {
+    snprintf(buf, len, "%zu", resident_bytes());
+  } else if (!strncmp(name, "imv_latency_", strlen("imv_latency_"))) {
+    return get_latency_var(imv, name + strlen("imv_latency_"), buf, len);
+  } else {
+    return false;
   }
-
-  snprintf(str, sizeof str, "%f", imv->slideshow.duration);
-  setenv("imv_slideshow_duration", str, 1);
-
-  snprintf(str, sizeof str, "%f", imv->slideshow.elapsed);
-  setenv("imv_slideshow_elapsed", str, 1);
+  return true;
 }
 
-static size_t generate_env_text(struct imv *imv, char *buf, size_t buf_len, const char *format)
+static void command_get(struct list *args, const char *argstr, void *data)
 {
-  update_env_vars(imv);
+  (void)argstr;
+  struct imv *imv = data;
+  char value[PATH_MAX];
 
-  size_t len = 0;
-  wordexp_t word;
-  if (wordexp(format, &word, 0) == 0) {
-    for (size_t i = 0; i < word.we_wordc; ++i) {
-      len += snprintf(buf + len, buf_len - len, "%s ", word.we_wordv[i]);
+  if (args->len < 2) {
+    for (size_t i = 0; i < sizeof env_var_names / sizeof *env_var_names; ++i) {
+      get_env_var(env_var_names[i], value, sizeof value, imv);
+      reply(imv, "%s=%s\n", env_var_names[i], value);
     }
-    wordfree(&word);
-  } else {
-    len += snprintf(buf, buf_len, "error expanding text");
+    return;
   }
 
-  return len;
+  /* Names can be given with or without their imv_ prefix */
+  for (size_t i = 1; i < args->len; ++i) {
+    char name[128];
+    const char *arg = args->items[i];
+    snprintf(name, sizeof name, "%s%s",
+        strncmp(arg, "imv_", strlen("imv_")) ? "imv_" : "", arg);
+    if (!get_env_var(name, value, sizeof value, imv)) {
+      imv->reply.error = "unknown variable";
+      return;
+    }
+    reply(imv, "%s\n", value);
+  }
 }
 
-static size_t read_from_stdin(void **buffer)
+static void update_env_vars(struct imv *imv)
 {
-  size_t len = 0;
-  ssize_t r;
-  size_t step = 4096; /* Arbitrary value of 4 KiB */
-  void *p;
-
-  errno = 0; /* clear errno */
-
-  for (*buffer = NULL; (*buffer = realloc((p = *buffer), len + step));
-      len += (size_t)r) {
-    if ((r = read(STDIN_FILENO, (uint8_t *)*buffer + len, step)) == -1) {
-      perror(NULL);
-      break;
-    } else if (r == 0) {
-      break;
-    }
+  char str[PATH_MAX];
+  for (size_t i = 0; i < sizeof env_var_names / sizeof *env_var_names; ++i) {
+    get_env_var(env_var_names[i], str, sizeof str, imv);
+    setenv(env_var_names[i], str, 1);
   }
+}
 
-  /* realloc(3) leaves old buffer allocated in case of error */
-  if (*buffer == NULL && p != NULL) {
-    int save = errno;
-    free(p);
-    errno = save;
-    len = 0;
+static const char *expand_template(struct imv *imv, struct imv_template *tmpl,
+    bool *changed)
+{
+  /* The environment only needs to be kept up to date for wordexp's sake */
+  if (imv_template_uses_shell(tmpl)) {
+    update_env_vars(imv);
   }
-  return len;
+  return imv_template_expand(tmpl, &get_env_var, imv, changed);
 }
 
+static void update_title(struct imv *imv)
+{
+  bool changed;
+  const char *title = expand_template(imv, imv->title_text, &changed);
+  if (changed) {
+    imv_window_set_title(imv->window, title);
+  }
+}
 
 /* vim:set ts=2 sts=2 sw=2 et: */
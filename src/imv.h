@@ -2,6 +2,7 @@
 #define IMV_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct imv;
 struct imv_backend;
@@ -11,6 +12,12 @@ void imv_free(struct imv *imv);
 
 void imv_install_backend(struct imv *imv, const struct imv_backend *backend);
 
+/* Install the named backend as a module, only loaded once sniff claims a
+ * file, or a file can't be sniffed by any backend. sniff mustn't need the
+ * module, and may be NULL if the format can't be told from the header. */
+void imv_install_module(struct imv *imv, const char *name,
+    bool (*sniff)(const unsigned char *header, size_t len));
+
 bool imv_load_config(struct imv *imv);
 bool imv_parse_args(struct imv *imv, int argc, char **argv);
 
@@ -1,16 +1,120 @@
 #include <assert.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <unistd.h>
 
 #include "ipc.h"
 
+/* Buffered reading of the replies imv sends back */
+struct reader {
+  int fd;
+  char buf[4096];
+  size_t start;
+  size_t len;
+};
+
+/* Returns false once imv's hung up */
+static bool fill(struct reader *reader)
+{
+  if (reader->start > 0) {
+    memmove(reader->buf, reader->buf + reader->start, reader->len);
+    reader->start = 0;
+  }
+  const ssize_t len = read(reader->fd, reader->buf + reader->len,
+      sizeof reader->buf - reader->len);
+  if (len <= 0) {
+    return false;
+  }
+  reader->len += len;
+  return true;
+}
+
+/* Read up to and including a newline, which is replaced with a terminator */
+static bool read_line(struct reader *reader, char *line, size_t max)
+{
+  while (true) {
+    char *start = reader->buf + reader->start;
+    char *end = memchr(start, '\n', reader->len);
+    if (end) {
+      const size_t len = end - start;
+      if (len >= max) {
+        return false;
+      }
+      memcpy(line, start, len);
+      line[len] = 0;
+      reader->start += len + 1;
+      reader->len -= len + 1;
+      return true;
+    }
+    if (reader->len == sizeof reader->buf || !fill(reader)) {
+      return false;
+    }
+  }
+}
+
+/* Copy len bytes of output to stdout */
+static bool copy_output(struct reader *reader, size_t len)
+{
+  while (len > 0) {
+    if (reader->len == 0 && !fill(reader)) {
+      return false;
+    }
+    const size_t chunk = reader->len < len ? reader->len : len;
+    fwrite(reader->buf + reader->start, 1, chunk, stdout);
+    reader->start += chunk;
+    reader->len -= chunk;
+    len -= chunk;
+  }
+  return true;
+}
+
+static bool send_all(int fd, const char *data, size_t len)
+{
+  while (len > 0) {
+    const ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+    if (sent < 0) {
+      return false;
+    }
+    data += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+/* Send each line of stdin as a command, returning how many were sent */
+static size_t send_stdin(int fd)
+{
+  size_t count = 0;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, stdin)) > 0) {
+    if (strspn(line, " \t\r\n\v\f") == (size_t)len) {
+      /* imv skips blank lines without replying */
+      continue;
+    }
+    if (line[len - 1] != '\n') {
+      /* getline leaves room for the terminator this replaces */
+      line[len++] = '\n';
+    }
+    if (!send_all(fd, line, len)) {
+      break;
+    }
+    ++count;
+  }
+  free(line);
+  return count;
+}
+
 int main(int argc, char **argv)
 {
   if (argc < 3) {
-    fprintf(stderr, "Usage: %s <pid> <command>\n", argv[0]);
+    fprintf(stderr, "Usage: %s <pid> <command>\n"
+        "       %s <pid> -\n", argv[0], argv[0]);
     return 0;
   }
 
@@ -27,16 +131,53 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  char buf[4096] = {0};
-  for (int i = 2; i < argc; ++i) {
-    strncat(buf, argv[i], sizeof buf - 1);
-    if (i + 1 < argc) {
-      strncat(buf, " ", sizeof buf - 1);
+  size_t commands = 0;
+  if (argc == 3 && !strcmp(argv[2], "-")) {
+    commands = send_stdin(sockfd);
+  } else {
+    char buf[4096] = {0};
+    for (int i = 2; i < argc; ++i) {
+      strncat(buf, argv[i], sizeof buf - strlen(buf) - 1);
+      if (i + 1 < argc) {
+        strncat(buf, " ", sizeof buf - strlen(buf) - 1);
+      }
+    }
+    strncat(buf, "\n", sizeof buf - strlen(buf) - 1);
+    if (send_all(sockfd, buf, strlen(buf))) {
+      commands = 1;
+    }
+  }
+
+  /* Let imv know there's nothing more to come, so it hangs up once it's
+   * replied to everything */
+  shutdown(sockfd, SHUT_WR);
+
+  int status = 0;
+  struct reader reader = {
+    .fd = sockfd,
+  };
+  for (size_t i = 0; i < commands; ++i) {
+    char line[4096];
+    if (!read_line(&reader, line, sizeof line)) {
+      /* An imv that doesn't reply has still run the commands */
+      break;
+    }
+
+    size_t len;
+    if (sscanf(line, "ok %zu", &len) == 1) {
+      if (!copy_output(&reader, len)) {
+        break;
+      }
+    } else if (!strncmp(line, "error ", strlen("error "))) {
+      fprintf(stderr, "%s\n", line + strlen("error "));
+      status = 1;
+    } else {
+      fprintf(stderr, "Unexpected reply: %s\n", line);
+      status = 1;
+      break;
     }
   }
-  strncat(buf, "\n", sizeof buf - 1);
 
-  write(sockfd, buf, strlen(buf));
   close(sockfd);
-  return 0;
+  return status;
 }
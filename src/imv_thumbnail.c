@@ -0,0 +1,488 @@
+/* imv-thumbnail writes shrunk copies of images, decoded by the same backends
+ * imv uses and scaled the same way the canvas draws them, without opening a
+ * window. Files are decoded in parallel, one per worker thread. */
+#include "backend.h"
+#include "backends.h"
+#include "bitmap.h"
+#include "image.h"
+#include "module.h"
+#include "pool.h"
+#include "source.h"
+
+#include <cairo/cairo.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef IMV_HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+#define DEFAULT_SIZE 256
+#define DEFAULT_QUALITY 85
+
+enum format {
+  FORMAT_PNG,
+  FORMAT_JPEG,
+};
+
+/* The backends imv tries, and those among them that are modules */
+static const struct imv_backend_entry *backends;
+static size_t backends_len;
+static struct imv_module **modules;
+
+/* Non-public function from imv_image */
+struct imv_bitmap *imv_image_get_mipmap(const struct imv_image *image, int level);
+
+/* Options, and the count of files still being worked on */
+static struct {
+  int size;
+  const char *out_dir;
+  enum format format;
+  int quality;
+  bool recursive;
+
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  size_t pending;
+  size_t failed;
+} thumb = {
+  .size = DEFAULT_SIZE,
+  .out_dir = ".",
+  .format = FORMAT_PNG,
+  .quality = DEFAULT_QUALITY,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void store_image(struct imv_source_message *message)
+{
+  struct imv_image **image = message->user_data;
+  if (message->preview) {
+    imv_image_free(message->image);
+    return;
+  }
+  imv_image_free(*image);
+  *image = message->image;
+}
+
+/* Decode the first frame of the file at path with the first backend that
+ * can, at no more than the resolution needed to fill a width x height box */
+static struct imv_image *decode(const char *path, int width, int height)
+{
+  unsigned char header[4096];
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+  const size_t len = fread(header, 1, sizeof header, f);
+  fclose(f);
+
+  for (size_t i = 0; i < backends_len; ++i) {
+    if (backends[i].sniff && !backends[i].sniff(header, len)) {
+      continue;
+    }
+    const struct imv_backend *backend = modules[i]
+      ? imv_module_backend(modules[i]) : backends[i].backend;
+    struct imv_source *src = NULL;
+    if (!backend || !backend->open_path
+        || backend->open_path(path, &src) != BACKEND_SUCCESS) {
+      continue;
+    }
+
+    /* This thread waits for the load anyway, so there's no point in a
+     * preview of it first */
+    struct imv_image *image = NULL;
+    imv_source_set_priority(src, IMV_SOURCE_PRIORITY_PREFETCH);
+    imv_source_set_target_size(src, width, height);
+    imv_source_set_callback(src, store_image, &image);
+    imv_source_load_first_frame(src);
+    imv_source_free(src);
+    if (image) {
+      return image;
+    }
+  }
+  return NULL;
+}
+
+/* Shrink an image to width x height the way the canvas would draw it: from
+ * the smallest mipmap that's still at least that size, interpolated */
+static struct imv_bitmap *scale_image(struct imv_image *image,
+    int width, int height)
+{
+  struct imv_bitmap *bmp;
+  if (imv_image_is_vector(image)) {
+    bmp = imv_image_rasterize(image,
+        (double)width / imv_image_width(image));
+    if (!bmp) {
+      return NULL;
+    }
+  } else {
+    int level = 0;
+    struct imv_bitmap *next;
+    while ((next = imv_image_get_mipmap(image, level + 1))
+        && next->width >= width && next->height >= height) {
+      ++level;
+    }
+    bmp = imv_image_get_mipmap(image, level);
+    if (!bmp) {
+      return NULL;
+    }
+    bmp = imv_bitmap_clone(bmp);
+  }
+
+  if (bmp->width != width || bmp->height != height) {
+    struct imv_bitmap *resized = imv_bitmap_resize(bmp, width, height);
+    imv_bitmap_free(bmp);
+    bmp = resized;
+  }
+
+  if (bmp->format != IMV_ARGB) {
+    struct imv_bitmap *argb = imv_bitmap_to_argb(bmp);
+    imv_bitmap_free(bmp);
+    bmp = argb;
+  }
+  return bmp;
+}
+
+/* Cairo's pixels are premultiplied, imv's have straight alpha */
+static bool write_png(struct imv_bitmap *bmp, const char *path)
+{
+  cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+      bmp->width, bmp->height);
+  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(surface);
+    return false;
+  }
+
+  cairo_surface_flush(surface);
+  unsigned char *data = cairo_image_surface_get_data(surface);
+  const int stride = cairo_image_surface_get_stride(surface);
+  for (int y = 0; y < bmp->height; ++y) {
+    const uint32_t *src = (const uint32_t *)bmp->data + (size_t)y * bmp->width;
+    uint32_t *dst = (uint32_t *)(data + (size_t)y * stride);
+    for (int x = 0; x < bmp->width; ++x) {
+      const uint32_t a = src[x] >> 24;
+      const uint32_t r = ((src[x] >> 16) & 0xff) * a / 255;
+      const uint32_t g = ((src[x] >> 8) & 0xff) * a / 255;
+      const uint32_t b = (src[x] & 0xff) * a / 255;
+      dst[x] = a << 24 | r << 16 | g << 8 | b;
+    }
+  }
+  cairo_surface_mark_dirty(surface);
+
+  const bool ok = cairo_surface_write_to_png(surface, path) == CAIRO_STATUS_SUCCESS;
+  cairo_surface_destroy(surface);
+  return ok;
+}
+
+#ifdef IMV_HAVE_TURBOJPEG
+/* JPEGs have no alpha, so transparent areas are made white, in place */
+static bool write_jpeg(struct imv_bitmap *bmp, const char *path)
+{
+  uint32_t *pixels = (uint32_t *)bmp->data;
+  const size_t num_pixels = (size_t)bmp->width * bmp->height;
+  for (size_t i = 0; i < num_pixels; ++i) {
+    const uint32_t a = pixels[i] >> 24;
+    const uint32_t white = 255 * (255 - a);
+    const uint32_t r = (((pixels[i] >> 16) & 0xff) * a + white) / 255;
+    const uint32_t g = (((pixels[i] >> 8) & 0xff) * a + white) / 255;
+    const uint32_t b = ((pixels[i] & 0xff) * a + white) / 255;
+    pixels[i] = 0xffu << 24 | r << 16 | g << 8 | b;
+  }
+
+  tjhandle handle = tjInitCompress();
+  if (!handle) {
+    return false;
+  }
+  unsigned char *jpeg = NULL;
+  unsigned long len = 0;
+  const int rcode = tjCompress2(handle, bmp->data, bmp->width, 0, bmp->height,
+      TJPF_BGRX, &jpeg, &len, TJSAMP_420, thumb.quality, TJFLAG_FASTDCT);
+  tjDestroy(handle);
+  if (rcode) {
+    tjFree(jpeg);
+    return false;
+  }
+
+  FILE *f = fopen(path, "wb");
+  bool ok = f && fwrite(jpeg, 1, len, f) == len;
+  if (f) {
+    ok = !fclose(f) && ok;
+  }
+  tjFree(jpeg);
+  return ok;
+}
+#endif
+
+/* The output is named after the input, in the output directory, with the
+ * extension swapped for that of the format */
+static char *output_path(const char *path)
+{
+  const char *name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  const char *ext = strrchr(name, '.');
+  const int name_len = ext && ext != name ? (int)(ext - name) : (int)strlen(name);
+
+  const char *out_ext = thumb.format == FORMAT_JPEG ? "jpg" : "png";
+  const size_t len = strlen(thumb.out_dir) + 1 + name_len + 1 + strlen(out_ext) + 1;
+  char *out = malloc(len);
+  snprintf(out, len, "%s/%.*s.%s", thumb.out_dir, name_len, name, out_ext);
+  return out;
+}
+
+static bool make_thumbnail(const char *path)
+{
+  /* Backends that can may decode at a reduced resolution, as long as it's
+   * enough to fill the box the thumbnail's shrunk to fit */
+  struct imv_image *image = decode(path, thumb.size, thumb.size);
+  if (!image) {
+    fprintf(stderr, "%s: can't be decoded\n", path);
+    return false;
+  }
+
+  const int image_width = imv_image_width(image);
+  const int image_height = imv_image_height(image);
+  int width = image_width, height = image_height;
+  if (width > thumb.size || height > thumb.size) {
+    if (width >= height) {
+      width = thumb.size;
+      height = (int)((double)image_height * thumb.size / image_width + 0.5);
+    } else {
+      height = thumb.size;
+      width = (int)((double)image_width * thumb.size / image_height + 0.5);
+    }
+    width = width > 0 ? width : 1;
+    height = height > 0 ? height : 1;
+  }
+
+  struct imv_bitmap *bmp = scale_image(image, width, height);
+  imv_image_free(image);
+  if (!bmp) {
+    fprintf(stderr, "%s: can't be scaled\n", path);
+    return false;
+  }
+
+  /* Written alongside, then moved into place, so nothing ever sees half a
+   * thumbnail */
+  char *out = output_path(path);
+  const size_t tmp_len = strlen(out) + 5;
+  char *tmp = malloc(tmp_len);
+  snprintf(tmp, tmp_len, "%s.tmp", out);
+
+  bool ok;
+#ifdef IMV_HAVE_TURBOJPEG
+  if (thumb.format == FORMAT_JPEG) {
+    ok = write_jpeg(bmp, tmp);
+  } else
+#endif
+  {
+    ok = write_png(bmp, tmp);
+  }
+  imv_bitmap_free(bmp);
+
+  if (ok && rename(tmp, out)) {
+    ok = false;
+  }
+  if (!ok) {
+    fprintf(stderr, "%s: can't write %s\n", path, out);
+    unlink(tmp);
+  }
+  free(tmp);
+  free(out);
+  return ok;
+}
+
+static void thumbnail_job(void *data)
+{
+  char *path = data;
+  const bool ok = make_thumbnail(path);
+  free(path);
+
+  pthread_mutex_lock(&thumb.lock);
+  if (!ok) {
+    ++thumb.failed;
+  }
+  if (--thumb.pending == 0) {
+    pthread_cond_signal(&thumb.done);
+  }
+  pthread_mutex_unlock(&thumb.lock);
+}
+
+static void add_path(struct imv_pool *pool, const char *path, bool top_level);
+
+static void add_dir(struct imv_pool *pool, const char *path)
+{
+  DIR *dir = opendir(path);
+  if (!dir) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    const size_t len = strlen(path) + 1 + strlen(entry->d_name) + 1;
+    char *child = malloc(len);
+    snprintf(child, len, "%s/%s", path, entry->d_name);
+    add_path(pool, child, false);
+    free(child);
+  }
+  closedir(dir);
+}
+
+/* Queue up a file, or the files in a directory. Directories within those
+ * are only descended into with -r. */
+static void add_path(struct imv_pool *pool, const char *path, bool top_level)
+{
+  struct stat st;
+  if (stat(path, &st)) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    if (top_level || thumb.recursive) {
+      add_dir(pool, path);
+    }
+    return;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    return;
+  }
+
+  pthread_mutex_lock(&thumb.lock);
+  ++thumb.pending;
+  pthread_mutex_unlock(&thumb.lock);
+  imv_pool_push(pool, IMV_POOL_PRIORITY_NORMAL, thumbnail_job, strdup(path));
+}
+
+/* Queue up each line of stdin as a path */
+static void add_stdin(struct imv_pool *pool)
+{
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, stdin)) > 0) {
+    if (line[len - 1] == '\n') {
+      line[--len] = 0;
+    }
+    if (len > 0) {
+      add_path(pool, line, true);
+    }
+  }
+  free(line);
+}
+
+static void print_usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-r] [-s size] [-o dir] [-f png|jpeg] "
+      "[-q quality] [-j threads] [path...]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int o;
+  while ((o = getopt(argc, argv, "rs:o:f:q:j:h")) != -1) {
+    switch (o) {
+      case 'r':
+        thumb.recursive = true;
+        break;
+      case 's':
+        thumb.size = atoi(optarg);
+        break;
+      case 'o':
+        thumb.out_dir = optarg;
+        break;
+      case 'f':
+        if (!strcmp(optarg, "png")) {
+          thumb.format = FORMAT_PNG;
+        } else if (!strcmp(optarg, "jpeg") || !strcmp(optarg, "jpg")) {
+#ifdef IMV_HAVE_TURBOJPEG
+          thumb.format = FORMAT_JPEG;
+#else
+          fprintf(stderr, "JPEG output needs imv built with libturbojpeg\n");
+          return 1;
+#endif
+        } else {
+          fprintf(stderr, "Unknown format: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'q':
+        thumb.quality = atoi(optarg);
+        break;
+      case 'j':
+        threads = atol(optarg);
+        break;
+      case 'h':
+        print_usage(argv[0]);
+        return 0;
+      default:
+        print_usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (thumb.size < 1 || thumb.quality < 1 || thumb.quality > 100) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  struct stat st;
+  if (stat(thumb.out_dir, &st) || !S_ISDIR(st.st_mode)) {
+    fprintf(stderr, "%s: not a directory\n", thumb.out_dir);
+    return 1;
+  }
+
+  /* Modules are set up before any loads start, and loaded by whichever
+   * thread first needs them */
+  backends = imv_backends_list(&backends_len);
+  modules = calloc(backends_len, sizeof *modules);
+  for (size_t i = 0; i < backends_len; ++i) {
+    if (!backends[i].backend) {
+      modules[i] = imv_module_create(backends[i].name);
+    }
+  }
+
+  struct imv_pool *pool = imv_pool_create((int)threads);
+
+  if (optind == argc) {
+    add_stdin(pool);
+  }
+  for (int i = optind; i < argc; ++i) {
+    if (!strcmp(argv[i], "-")) {
+      add_stdin(pool);
+    } else {
+      add_path(pool, argv[i], true);
+    }
+  }
+
+  pthread_mutex_lock(&thumb.lock);
+  while (thumb.pending > 0) {
+    pthread_cond_wait(&thumb.done, &thumb.lock);
+  }
+  const size_t failed = thumb.failed;
+  pthread_mutex_unlock(&thumb.lock);
+
+  imv_pool_free(pool);
+  for (size_t i = 0; i < backends_len; ++i) {
+    imv_module_free(modules[i]);
+  }
+  free(modules);
+  return failed ? 1 : 0;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
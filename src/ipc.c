@@ -1,68 +1,315 @@
 #include "ipc.h"
 
+#include "list.h"
+#include "log.h"
+
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 
+/* The longest command accepted. Clients that send longer lines are cut off. */
+#define MAX_LINE 4096
+
+/* How many events are handled for each epoll_wait */
+#define MAX_EVENTS 16
+
+struct connection {
+  int fd;
+  unsigned long id;
+  /* what's arrived since the last full line */
+  char in[MAX_LINE];
+  size_t in_len;
+  /* replies still to be sent */
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  /* commands passed on that haven't been replied to yet */
+  size_t pending;
+  /* the client has stopped sending, and is only waiting for replies */
+  bool hung_up;
+  /* the client's gone altogether, so replies are thrown away */
+  bool gone;
+  /* the events it's registered with epoll for */
+  unsigned int events;
+};
+
+struct imv_ipc_request {
+  unsigned long connection;
+};
+
 struct imv_ipc {
   int fd;
+  int epoll_fd;
+  /* written to wake the thread up, to send replies or to quit */
+  int wake[2];
+  pthread_t thread;
+  bool started;
   imv_ipc_callback callback;
   void *data;
-};
 
-struct connection {
-  struct imv_ipc *ipc;
-  int fd;
+  /* guards everything below, which replies from other threads touch */
+  pthread_mutex_t lock;
+  struct list *connections;
+  unsigned long next_id;
+  bool quit;
 };
 
-static void *wait_for_commands(void* void_conn)
+/* The epoll data of the listening socket and the wake pipe. Connections
+ * have their struct connection. */
+static int listen_tag;
+static int wake_tag;
+
+static void set_nonblocking(int fd)
 {
-  struct connection *conn = void_conn;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static void wake(struct imv_ipc *ipc)
+{
+  const char byte = 0;
+  (void)!write(ipc->wake[1], &byte, 1);
+}
+
+static struct connection *find_connection(struct imv_ipc *ipc, unsigned long id)
+{
+  for (size_t i = 0; i < ipc->connections->len; ++i) {
+    struct connection *conn = ipc->connections->items[i];
+    if (conn->id == id) {
+      return conn;
+    }
+  }
+  return NULL;
+}
+
+static void free_connection(struct connection *conn)
+{
+  close(conn->fd);
+  free(conn->out);
+  free(conn);
+}
 
-  while (1) {
-    char buf[1024];
-    ssize_t len = recv(conn->fd, buf, sizeof buf - 1, 0);
-    if (len <= 0) {
+/* Called with the lock held */
+static void close_connection(struct imv_ipc *ipc, struct connection *conn)
+{
+  for (size_t i = 0; i < ipc->connections->len; ++i) {
+    if (ipc->connections->items[i] == conn) {
+      list_remove(ipc->connections, i);
       break;
     }
+  }
+  epoll_ctl(ipc->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  free_connection(conn);
+}
+
+static void append_output(struct connection *conn, const char *data, size_t len)
+{
+  if (conn->out_len + len > conn->out_cap) {
+    conn->out_cap = (conn->out_len + len) * 2;
+    conn->out = realloc(conn->out, conn->out_cap);
+  }
+  memcpy(conn->out + conn->out_len, data, len);
+  conn->out_len += len;
+}
+
+static void accept_connections(struct imv_ipc *ipc)
+{
+  int client;
+  while ((client = accept(ipc->fd, NULL, NULL)) != -1) {
+    set_nonblocking(client);
+
+    struct connection *conn = calloc(1, sizeof *conn);
+    conn->fd = client;
+    conn->events = EPOLLIN;
+
+    pthread_mutex_lock(&ipc->lock);
+    conn->id = ++ipc->next_id;
+    list_append(ipc->connections, conn);
+    pthread_mutex_unlock(&ipc->lock);
+
+    struct epoll_event event = {
+      .events = conn->events,
+      .data.ptr = conn,
+    };
+    epoll_ctl(ipc->epoll_fd, EPOLL_CTL_ADD, client, &event);
+  }
+}
+
+/* Pass on a command to the callback, or reply straight away if there's
+ * nothing to pass it to. Called with the lock held. */
+static void run_command(struct imv_ipc *ipc, struct connection *conn, char *line)
+{
+  size_t len = strlen(line);
+  while (len > 0 && isspace((unsigned char)line[len - 1])) {
+    line[--len] = 0;
+  }
+  while (isspace((unsigned char)*line)) {
+    ++line;
+  }
+  if (!*line) {
+    return;
+  }
+
+  if (!ipc->callback) {
+    const char *reply = "error not ready\n";
+    append_output(conn, reply, strlen(reply));
+    return;
+  }
 
-    buf[len] = 0;
-    while (len > 0 && isspace(buf[len-1])) {
-      buf[len-1] = 0;
-      --len;
+  struct imv_ipc_request *request = malloc(sizeof *request);
+  request->connection = conn->id;
+  conn->pending++;
+  /* The callback only queues the command up for the main thread, so it's
+   * fine to call with the lock held */
+  ipc->callback(line, request, ipc->data);
+}
+
+/* Read whatever's arrived, and run each full line as a command. Called with
+ * the lock held. */
+static void read_commands(struct imv_ipc *ipc, struct connection *conn)
+{
+  while (!conn->hung_up) {
+    const ssize_t len = read(conn->fd, conn->in + conn->in_len,
+        sizeof conn->in - 1 - conn->in_len);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else if (len < 0 && errno == EINTR) {
+      continue;
+    } else if (len <= 0) {
+      /* The last line needn't have ended with a newline */
+      conn->in[conn->in_len] = 0;
+      run_command(ipc, conn, conn->in);
+      conn->in_len = 0;
+      conn->hung_up = true;
+      break;
+    }
+    conn->in_len += len;
+
+    char *start = conn->in;
+    char *end;
+    while ((end = memchr(start, '\n', conn->in + conn->in_len - start))) {
+      *end = 0;
+      run_command(ipc, conn, start);
+      start = end + 1;
     }
+    conn->in_len -= start - conn->in;
+    memmove(conn->in, start, conn->in_len);
 
-    if (conn->ipc->callback) {
-      conn->ipc->callback(buf, conn->ipc->data);
+    if (conn->in_len == sizeof conn->in - 1) {
+      imv_log(IMV_WARNING, "IPC command too long, dropping the client\n");
+      const char *reply = "error command too long\n";
+      append_output(conn, reply, strlen(reply));
+      conn->in_len = 0;
+      conn->hung_up = true;
     }
   }
+}
 
-  close(conn->fd);
-  free(conn);
-  return NULL;
+/* Send whatever replies are waiting, and close the connection once there's
+ * nothing more to come. Called with the lock held. Returns false if the
+ * connection's been closed. */
+static bool flush_connection(struct imv_ipc *ipc, struct connection *conn)
+{
+  if (conn->gone) {
+    conn->out_len = 0;
+    if (conn->pending == 0) {
+      close_connection(ipc, conn);
+      return false;
+    }
+    return true;
+  }
+
+  while (conn->out_len > 0) {
+    const ssize_t len = send(conn->fd, conn->out, conn->out_len, MSG_NOSIGNAL);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else if (len < 0 && errno == EINTR) {
+      continue;
+    } else if (len < 0) {
+      /* Nobody's listening any more */
+      close_connection(ipc, conn);
+      return false;
+    }
+    conn->out_len -= len;
+    memmove(conn->out, conn->out + len, conn->out_len);
+  }
+
+  if (conn->hung_up && conn->pending == 0 && conn->out_len == 0) {
+    close_connection(ipc, conn);
+    return false;
+  }
+
+  /* Only wait to write when there's something to, and stop waiting to read
+   * once it's hung up, to keep level triggered events from spinning */
+  const unsigned int events = (conn->hung_up ? 0 : EPOLLIN)
+    | (conn->out_len ? EPOLLOUT : 0);
+  if (events != conn->events) {
+    conn->events = events;
+    struct epoll_event event = {
+      .events = events,
+      .data.ptr = conn,
+    };
+    epoll_ctl(ipc->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+  }
+  return true;
 }
 
-static void *wait_for_connections(void* void_ipc)
+static void *wait_for_commands(void *void_ipc)
 {
   struct imv_ipc *ipc = void_ipc;
-  (void)ipc;
+  struct epoll_event events[MAX_EVENTS];
 
-  while (1) {
-    int client = accept(ipc->fd, NULL, NULL);
-    if (client == -1) {
+  while (true) {
+    const int count = epoll_wait(ipc->epoll_fd, events, MAX_EVENTS, -1);
+    if (count < 0 && errno != EINTR) {
       break;
     }
-    struct connection *conn = calloc(1, sizeof *conn);
-    conn->ipc = ipc;
-    conn->fd = client;
 
-    pthread_t thread;
-    pthread_create(&thread, NULL, wait_for_commands, conn);
-    pthread_detach(thread);
+    for (int i = 0; i < count; ++i) {
+      if (events[i].data.ptr == &listen_tag) {
+        accept_connections(ipc);
+      } else if (events[i].data.ptr == &wake_tag) {
+        char buf[64];
+        while (read(ipc->wake[0], buf, sizeof buf) > 0);
+      } else {
+        struct connection *conn = events[i].data.ptr;
+        pthread_mutex_lock(&ipc->lock);
+        if (events[i].events & EPOLLIN) {
+          read_commands(ipc, conn);
+        }
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+          /* There's no one to reply to, but the commands it sent before
+           * hanging up still run, and the connection's only closed once
+           * they're done, as their replies are still to come */
+          conn->hung_up = true;
+          conn->gone = true;
+          epoll_ctl(ipc->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        }
+        pthread_mutex_unlock(&ipc->lock);
+      }
+    }
+
+    /* Replies may have been added for any connection. Connections are only
+     * closed here, so none of this round's events refer to a closed one. */
+    pthread_mutex_lock(&ipc->lock);
+    const bool quit = ipc->quit;
+    for (size_t i = 0; i < ipc->connections->len;) {
+      if (flush_connection(ipc, ipc->connections->items[i])) {
+        ++i;
+      }
+    }
+    pthread_mutex_unlock(&ipc->lock);
+    if (quit) {
+      break;
+    }
   }
   return NULL;
 }
@@ -90,13 +337,34 @@ struct imv_ipc *imv_ipc_create(void)
     close(sockfd);
     return NULL;
   }
+  set_nonblocking(sockfd);
 
   struct imv_ipc *ipc = calloc(1, sizeof *ipc);
   ipc->fd = sockfd;
+  ipc->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  ipc->wake[0] = ipc->wake[1] = -1;
+  pthread_mutex_init(&ipc->lock, NULL);
+  ipc->connections = list_create();
 
-  pthread_t thread;
-  pthread_create(&thread, NULL, wait_for_connections, ipc);
-  pthread_detach(thread);
+  if (ipc->epoll_fd == -1 || pipe(ipc->wake)) {
+    imv_ipc_free(ipc);
+    return NULL;
+  }
+  set_nonblocking(ipc->wake[0]);
+  set_nonblocking(ipc->wake[1]);
+
+  struct epoll_event listen_event = {
+    .events = EPOLLIN,
+    .data.ptr = &listen_tag,
+  };
+  struct epoll_event wake_event = {
+    .events = EPOLLIN,
+    .data.ptr = &wake_tag,
+  };
+  epoll_ctl(ipc->epoll_fd, EPOLL_CTL_ADD, ipc->fd, &listen_event);
+  epoll_ctl(ipc->epoll_fd, EPOLL_CTL_ADD, ipc->wake[0], &wake_event);
+
+  ipc->started = !pthread_create(&ipc->thread, NULL, wait_for_commands, ipc);
   return ipc;
 }
 
@@ -106,18 +374,75 @@ void imv_ipc_free(struct imv_ipc *ipc)
     return;
   }
 
+  if (ipc->started) {
+    pthread_mutex_lock(&ipc->lock);
+    ipc->quit = true;
+    pthread_mutex_unlock(&ipc->lock);
+    wake(ipc);
+    pthread_join(ipc->thread, NULL);
+  }
+
   char ipc_filename[1024];
   imv_ipc_path(ipc_filename, sizeof ipc_filename, getpid());
   unlink(ipc_filename);
   close(ipc->fd);
 
+  for (size_t i = 0; i < ipc->connections->len; ++i) {
+    free_connection(ipc->connections->items[i]);
+  }
+  list_free(ipc->connections);
+  if (ipc->epoll_fd != -1) {
+    close(ipc->epoll_fd);
+  }
+  if (ipc->wake[0] != -1) {
+    close(ipc->wake[0]);
+    close(ipc->wake[1]);
+  }
+  pthread_mutex_destroy(&ipc->lock);
+
   free(ipc);
 }
 
 void imv_ipc_set_command_callback(struct imv_ipc *ipc,
     imv_ipc_callback callback, void *data)
 {
+  if (!ipc) {
+    return;
+  }
+  pthread_mutex_lock(&ipc->lock);
   ipc->callback = callback;
   ipc->data = data;
+  pthread_mutex_unlock(&ipc->lock);
 }
 
+void imv_ipc_reply(struct imv_ipc *ipc, struct imv_ipc_request *request,
+    bool ok, const char *output)
+{
+  if (!output) {
+    output = "";
+  }
+
+  pthread_mutex_lock(&ipc->lock);
+  struct connection *conn = find_connection(ipc, request->connection);
+  if (conn) {
+    char header[64];
+    const size_t len = strlen(output);
+    if (ok) {
+      snprintf(header, sizeof header, "ok %zu\n", len);
+      append_output(conn, header, strlen(header));
+      append_output(conn, output, len);
+    } else {
+      snprintf(header, sizeof header, "error ");
+      append_output(conn, header, strlen(header));
+      append_output(conn, output, len);
+      append_output(conn, "\n", 1);
+    }
+    conn->pending--;
+  }
+  pthread_mutex_unlock(&ipc->lock);
+  free(request);
+
+  if (conn) {
+    wake(ipc);
+  }
+}
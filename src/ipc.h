@@ -1,28 +1,47 @@
 #ifndef IMV_IPC_H
 #define IMV_IPC_H
 
+#include <stdbool.h>
 #include <unistd.h>
 
 /* imv_ipc provides a listener on a unix socket that listens for commands.
- * When a command is received, a callback function is called.
+ * When a command is received, a callback function is called. Every client is
+ * served by a single thread.
+ *
+ * Each line a client sends is a command, and any number may be sent at once.
+ * Every command gets a reply, in the order they were sent, of either
+ * "ok <length>\n" followed by length bytes of output, or "error <reason>\n".
+ * Clients that don't want the replies can just hang up.
  */
 struct imv_ipc;
 
+/* A command waiting to be replied to */
+struct imv_ipc_request;
+
 /* Creates an imv_ipc instance */
 struct imv_ipc *imv_ipc_create(void);
 
 /* Cleans up an imv_ipc instance */
 void imv_ipc_free(struct imv_ipc *ipc);
 
-typedef void (*imv_ipc_callback)(const char *command, void *data);
+typedef void (*imv_ipc_callback)(const char *command,
+    struct imv_ipc_request *request, void *data);
 
 /* When a command is received, imv_ipc will call the callback function passed
- * in. Only one callback function at a time can be connected. The data argument
- * is passed back to the callback to allow for context passing
+ * in, on its own thread. Only one callback function at a time can be
+ * connected. The data argument is passed back to the callback to allow for
+ * context passing. Every request must be given to imv_ipc_reply.
  */
 void imv_ipc_set_command_callback(struct imv_ipc *ipc,
     imv_ipc_callback callback, void *data);
 
+/* Send the reply to a request, which may be from any thread, and frees it.
+ * output is sent if ok is set, otherwise it's the reason the command failed,
+ * and mustn't hold any newlines. Replies for clients that have gone are
+ * dropped. */
+void imv_ipc_reply(struct imv_ipc *ipc, struct imv_ipc_request *request,
+    bool ok, const char *output);
+
 /* Given a pid, emits the path of the unix socket that would connect to an imv
  * instance with that pid
  */
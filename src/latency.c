@@ -0,0 +1,105 @@
+#include "latency.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Enough timings for the percentiles to be steady, and still follow changes
+ * from one directory of images to the next */
+#define MAX_SAMPLES 128
+
+static const char *stage_names[IMV_LATENCY_STAGE_COUNT] = {
+  [IMV_LATENCY_OPEN] = "open",
+  [IMV_LATENCY_DECODE] = "decode",
+  [IMV_LATENCY_DELIVER] = "deliver",
+  [IMV_LATENCY_DRAW] = "draw",
+  [IMV_LATENCY_PRESENT] = "present",
+  [IMV_LATENCY_TOTAL] = "total",
+};
+
+/* A ring of a stage's most recent timings */
+struct samples {
+  double values[MAX_SAMPLES];
+  /* the number of values held, and where the next goes */
+  int count;
+  int next;
+};
+
+struct imv_latency {
+  struct samples stages[IMV_LATENCY_STAGE_COUNT];
+};
+
+struct imv_latency *imv_latency_create(void)
+{
+  return calloc(1, sizeof(struct imv_latency));
+}
+
+void imv_latency_free(struct imv_latency *latency)
+{
+  free(latency);
+}
+
+const char *imv_latency_stage_name(enum imv_latency_stage stage)
+{
+  return stage_names[stage];
+}
+
+bool imv_latency_find_stage(const char *name, enum imv_latency_stage *stage)
+{
+  for (int i = 0; i < IMV_LATENCY_STAGE_COUNT; ++i) {
+    if (!strcmp(name, stage_names[i])) {
+      *stage = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void imv_latency_add(struct imv_latency *latency,
+    enum imv_latency_stage stage, double seconds)
+{
+  struct samples *samples = &latency->stages[stage];
+  samples->values[samples->next] = seconds;
+  samples->next = (samples->next + 1) % MAX_SAMPLES;
+  if (samples->count < MAX_SAMPLES) {
+    samples->count++;
+  }
+}
+
+double imv_latency_last(const struct imv_latency *latency,
+    enum imv_latency_stage stage)
+{
+  const struct samples *samples = &latency->stages[stage];
+  if (!samples->count) {
+    return 0.0;
+  }
+  return samples->values[(samples->next + MAX_SAMPLES - 1) % MAX_SAMPLES];
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  const double x = *(const double *)a;
+  const double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+double imv_latency_percentile(const struct imv_latency *latency,
+    enum imv_latency_stage stage, double percentile)
+{
+  const struct samples *samples = &latency->stages[stage];
+  if (!samples->count) {
+    return 0.0;
+  }
+
+  /* Cheap enough at this size to sort a copy each time it's asked for */
+  double sorted[MAX_SAMPLES];
+  memcpy(sorted, samples->values, samples->count * sizeof *sorted);
+  qsort(sorted, samples->count, sizeof *sorted, compare_doubles);
+
+  /* Nearest rank */
+  int rank = (int)ceil(percentile / 100.0 * samples->count);
+  rank = rank < 1 ? 1 : rank > samples->count ? samples->count : rank;
+  return sorted[rank - 1];
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
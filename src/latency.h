@@ -0,0 +1,56 @@
+#ifndef IMV_LATENCY_H
+#define IMV_LATENCY_H
+
+#include <stdbool.h>
+
+/* imv_latency keeps the most recent timings of each stage of showing an
+ * image, so that a slow image can be put down to the file, the codec, the
+ * GPU or the compositor, and summarises them as percentiles.
+ */
+struct imv_latency;
+
+enum imv_latency_stage {
+  /* finding a backend for the file, and reading its header */
+  IMV_LATENCY_OPEN,
+  /* the backend decoding the image, on a worker thread */
+  IMV_LATENCY_DECODE,
+  /* the decoded image waiting for the main thread to pick it up */
+  IMV_LATENCY_DELIVER,
+  /* drawing the window with the new image, uploading it as textures */
+  IMV_LATENCY_DRAW,
+  /* from presenting the window until the display's ready for another */
+  IMV_LATENCY_PRESENT,
+  /* from selecting the image to it being on the display */
+  IMV_LATENCY_TOTAL,
+  IMV_LATENCY_STAGE_COUNT
+};
+
+/* Creates an imv_latency instance, with no timings */
+struct imv_latency *imv_latency_create(void);
+
+/* Cleans up an imv_latency instance */
+void imv_latency_free(struct imv_latency *latency);
+
+/* Get a stage's name, as used in environment variables */
+const char *imv_latency_stage_name(enum imv_latency_stage stage);
+
+/* Look up a stage by name. Returns false if there's no such stage. */
+bool imv_latency_find_stage(const char *name, enum imv_latency_stage *stage);
+
+/* Record how long a stage took, in seconds. Only the most recent timings of
+ * each stage are kept. */
+void imv_latency_add(struct imv_latency *latency,
+    enum imv_latency_stage stage, double seconds);
+
+/* Get the last timing recorded for a stage, or 0 if there's none */
+double imv_latency_last(const struct imv_latency *latency,
+    enum imv_latency_stage stage);
+
+/* Get the given percentile, from 0 to 100, of the recent timings of a stage,
+ * or 0 if there are none */
+double imv_latency_percentile(const struct imv_latency *latency,
+    enum imv_latency_stage stage, double percentile);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
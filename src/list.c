@@ -52,7 +52,7 @@ void list_remove(struct list *list, size_t index)
     return;
   }
 
-  memmove(&list->items[index], &list->items[index + 1], sizeof(void*) * (list->len - index));
+  memmove(&list->items[index], &list->items[index + 1], sizeof(void*) * (list->len - index - 1));
 
   list->len -= 1;
 }
@@ -1,15 +1,6 @@
+#include "backends.h"
 #include "imv.h"
 
-struct imv_backend;
-
-extern const struct imv_backend imv_backend_freeimage;
-extern const struct imv_backend imv_backend_libpng;
-extern const struct imv_backend imv_backend_librsvg;
-extern const struct imv_backend imv_backend_libtiff;
-extern const struct imv_backend imv_backend_libjpeg;
-extern const struct imv_backend imv_backend_libnsgif;
-extern const struct imv_backend imv_backend_libheif;
-
 int main(int argc, char **argv)
 {
   struct imv *imv = imv_create();
@@ -18,33 +9,15 @@ int main(int argc, char **argv)
     return 1;
   }
 
-#ifdef IMV_BACKEND_LIBTIFF
-  imv_install_backend(imv, &imv_backend_libtiff);
-#endif
-
-#ifdef IMV_BACKEND_LIBPNG
-  imv_install_backend(imv, &imv_backend_libpng);
-#endif
-
-#ifdef IMV_BACKEND_LIBJPEG
-  imv_install_backend(imv, &imv_backend_libjpeg);
-#endif
-
-#ifdef IMV_BACKEND_LIBRSVG
-  imv_install_backend(imv, &imv_backend_librsvg);
-#endif
-
-#ifdef IMV_BACKEND_LIBNSGIF
-  imv_install_backend(imv, &imv_backend_libnsgif);
-#endif
-
-#ifdef IMV_BACKEND_FREEIMAGE
-  imv_install_backend(imv, &imv_backend_freeimage);
-#endif
-
-#ifdef IMV_BACKEND_LIBHEIF
-  imv_install_backend(imv, &imv_backend_libheif);
-#endif
+  size_t len;
+  const struct imv_backend_entry *backends = imv_backends_list(&len);
+  for (size_t i = 0; i < len; ++i) {
+    if (backends[i].backend) {
+      imv_install_backend(imv, backends[i].backend);
+    } else {
+      imv_install_module(imv, backends[i].name, backends[i].sniff);
+    }
+  }
 
   if (!imv_load_config(imv)) {
     imv_free(imv);
@@ -0,0 +1,91 @@
+#include "module.h"
+
+#include "log.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef IMV_MODULE_DIR
+#define IMV_MODULE_DIR "/usr/lib/imv"
+#endif
+
+struct imv_module {
+  char *name;
+  /* guards everything below, as modules are loaded by whichever thread
+   * opens the first file that needs them */
+  pthread_mutex_t lock;
+  bool tried;
+  void *handle;
+  const struct imv_backend *backend;
+};
+
+struct imv_module *imv_module_create(const char *name)
+{
+  struct imv_module *module = calloc(1, sizeof *module);
+  module->name = strdup(name);
+  pthread_mutex_init(&module->lock, NULL);
+  return module;
+}
+
+void imv_module_free(struct imv_module *module)
+{
+  if (!module) {
+    return;
+  }
+  pthread_mutex_destroy(&module->lock);
+  free(module->name);
+  free(module);
+}
+
+const char *imv_module_name(const struct imv_module *module)
+{
+  return module->name;
+}
+
+static void load(struct imv_module *module)
+{
+  /* Modules can be run from the build tree by pointing this at it */
+  const char *dir = getenv("IMV_MODULE_DIR");
+  if (!dir || !*dir) {
+    dir = IMV_MODULE_DIR;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof path, "%s/backend_%s.so", dir, module->name);
+
+  module->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!module->handle) {
+    imv_log(IMV_WARNING, "Failed to load %s backend: %s\n", module->name, dlerror());
+    return;
+  }
+
+  char symbol[256];
+  snprintf(symbol, sizeof symbol, "imv_backend_%s", module->name);
+  module->backend = dlsym(module->handle, symbol);
+  if (!module->backend) {
+    imv_log(IMV_WARNING, "%s doesn't provide %s\n", path, symbol);
+    dlclose(module->handle);
+    module->handle = NULL;
+    return;
+  }
+
+  imv_log(IMV_DEBUG, "Loaded %s backend from %s\n", module->name, path);
+}
+
+const struct imv_backend *imv_module_backend(struct imv_module *module)
+{
+  pthread_mutex_lock(&module->lock);
+  if (!module->tried) {
+    module->tried = true;
+    load(module);
+  }
+  const struct imv_backend *backend = module->backend;
+  pthread_mutex_unlock(&module->lock);
+  return backend;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,33 @@
+#ifndef IMV_MODULE_H
+#define IMV_MODULE_H
+
+struct imv_backend;
+
+/* imv_module is a backend built as a shared object, rather than linked into
+ * imv, so neither it nor the codec libraries it links are loaded until a
+ * file needs it. The module for backend foo is installed as backend_foo.so
+ * in IMV_MODULE_DIR, or the directory the environment variable of the same
+ * name gives, and exports its struct imv_backend as imv_backend_foo,
+ * just as it would be named if linked in. Modules are linked against the
+ * symbols imv itself exports, so must come from the same build.
+ */
+struct imv_module;
+
+/* Creates an imv_module instance for the named backend, without loading it */
+struct imv_module *imv_module_create(const char *name);
+
+/* Cleans up an imv_module instance. A loaded module stays loaded, as images
+ * and sources it created may still be using its code. */
+void imv_module_free(struct imv_module *module);
+
+/* Get the name of the module's backend */
+const char *imv_module_name(const struct imv_module *module);
+
+/* Get the module's backend, loading it the first time it's asked for. May be
+ * called from any thread. Returns NULL if the module can't be loaded, and
+ * doesn't try again. */
+const struct imv_backend *imv_module_backend(struct imv_module *module);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -4,6 +4,7 @@
 #include <dirent.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,50 +18,548 @@
 #define PATH_MAX 4096
 #endif
 
+/* Marks the absence of an item, directory or string */
+#define NONE UINT32_MAX
+
+/* Strings live in chunks of an arena that never move, so each can be
+ * referred to by a 32 bit reference: the chunk in the high bits, and the
+ * offset within it in the low ones. A string too long for a chunk gets one
+ * to itself. */
+#define CHUNK_BITS 16
+#define CHUNK_SIZE ((size_t)1 << CHUNK_BITS)
+
+struct arena {
+  struct list *chunks;
+  /* how much of the last chunk is in use */
+  size_t used;
+};
+
+/* A directory, interned so that it's stored once however many of the
+ * navigator's paths are within it */
+struct nav_dir {
+  uint32_t path;
+  uint32_t len;
+  /* the FNV-1a state after hashing the directory and a separator, where the
+   * hashes of the paths within it carry on from */
+  uint64_t hash;
+  uint32_t next;
+};
+
+/* Paths are split at their last separator, into their directory and name */
 struct nav_item {
-  char *path;
+  /* NONE if the path has no separator, in which case name is all of it */
+  uint32_t dir;
+  uint32_t name;
+  /* the whole path, only put together the first time it's asked for, so
+   * that it can be handed out for as long as the item's there. NONE until
+   * then, or if the path has no directory, as name is all of it. */
+  uint32_t path;
+  /* items are ordered by group, then by key within a scan's group. Items not
+   * from a scan have no key. */
+  uint32_t group;
+  uint32_t key;
+  /* its slot in the order */
+  uint32_t slot;
+  /* hashes of the path and its name, and the next items in the same buckets
+   * of the indexes. Removed items are chained through next_path. */
+  uint32_t path_hash;
+  uint32_t name_hash;
+  uint32_t next_path;
+  uint32_t next_name;
+};
+
+enum index_kind {
+  INDEX_PATH,
+  INDEX_NAME,
+  INDEX_DIR,
+};
+
+/* A hash table of items or directories, chained through them */
+struct index {
+  enum index_kind kind;
+  uint32_t *buckets;
+  size_t num_buckets;
+  size_t count;
 };
 
 struct imv_navigator {
-  struct list *paths;
+  struct arena strings;
+
+  struct nav_dir *dirs;
+  size_t num_dirs;
+  size_t dirs_cap;
+
+  /* items are never moved, so their ids stay the same. Removed ones are
+   * reused. */
+  struct nav_item *items;
+  size_t num_items;
+  size_t items_cap;
+  uint32_t free_items;
+
+  /* the ids of the items in order, with removed items leaving a NONE behind
+   * until there are enough of them to be worth closing up */
+  uint32_t *slots;
+  size_t len;
+  size_t slots_cap;
+  size_t removed;
+
+  /* while there are removed slots, a Fenwick tree of which are occupied,
+   * mapping indexes to slots and back. tree[i] covers the slots
+   * [i - lowbit(i), i). */
+  size_t *tree;
+  size_t tree_size;
+
+  struct index by_path;
+  struct index by_name;
+  struct index dir_index;
+
+  /* where imv_navigator_at puts together a path before storing it */
+  char *path_buf;
+  size_t path_buf_len;
+
   size_t cur_path;
   time_t last_change;
   time_t last_check;
   int last_move_direction;
   int changed;
   int wrapped;
+  bool no_polling;
+  unsigned next_group;
 };
 
+static void *grow(void *array, size_t *cap, size_t min_size, size_t item_size)
+{
+  if (*cap >= min_size) {
+    return array;
+  }
+  size_t new_cap = *cap ? *cap : 64;
+  while (new_cap < min_size) {
+    new_cap *= 2;
+  }
+  *cap = new_cap;
+  return realloc(array, new_cap * item_size);
+}
+
+static uint32_t arena_add(struct arena *arena, const char *str, size_t len)
+{
+  if (arena->chunks->len == 0 || arena->used + len + 1 > CHUNK_SIZE) {
+    const size_t size = len + 1 > CHUNK_SIZE ? len + 1 : CHUNK_SIZE;
+    list_append(arena->chunks, malloc(size));
+    arena->used = 0;
+  }
+
+  char *chunk = arena->chunks->items[arena->chunks->len - 1];
+  memcpy(chunk + arena->used, str, len);
+  chunk[arena->used + len] = '\0';
+
+  const uint32_t ref = ((uint32_t)(arena->chunks->len - 1) << CHUNK_BITS)
+    | (uint32_t)arena->used;
+  arena->used += len + 1;
+  return ref;
+}
+
+static const char *arena_get(const struct arena *arena, uint32_t ref)
+{
+  const char *chunk = arena->chunks->items[ref >> CHUNK_BITS];
+  return chunk + (ref & (CHUNK_SIZE - 1));
+}
+
+static void arena_clear(struct arena *arena)
+{
+  for (size_t i = 0; i < arena->chunks->len; ++i) {
+    free(arena->chunks->items[i]);
+  }
+  list_clear(arena->chunks);
+  arena->used = 0;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325
+#define FNV_PRIME 0x100000001b3
+
+static uint64_t hash_bytes(uint64_t hash, const char *str, size_t len)
+{
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)str[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+static const char *name_of(struct imv_navigator *nav, const struct nav_item *item)
+{
+  return arena_get(&nav->strings, item->name);
+}
+
+static uint32_t *next_link(struct imv_navigator *nav, enum index_kind kind,
+    uint32_t id)
+{
+  switch (kind) {
+    case INDEX_PATH: return &nav->items[id].next_path;
+    case INDEX_NAME: return &nav->items[id].next_name;
+    case INDEX_DIR: return &nav->dirs[id].next;
+  }
+  return NULL;
+}
+
+static uint32_t stored_hash(struct imv_navigator *nav, enum index_kind kind,
+    uint32_t id)
+{
+  switch (kind) {
+    case INDEX_PATH: return nav->items[id].path_hash;
+    case INDEX_NAME: return nav->items[id].name_hash;
+    case INDEX_DIR: return (uint32_t)nav->dirs[id].hash;
+  }
+  return 0;
+}
+
+static uint32_t *bucket(struct index *index, uint32_t hash)
+{
+  return &index->buckets[hash & (index->num_buckets - 1)];
+}
+
+static void index_insert(struct imv_navigator *nav, struct index *index,
+    uint32_t id)
+{
+  if (index->count >= index->num_buckets) {
+    /* Keep to about one entry per bucket */
+    const size_t old_num_buckets = index->num_buckets;
+    uint32_t *old_buckets = index->buckets;
+    index->num_buckets = old_num_buckets ? old_num_buckets * 2 : 64;
+    index->buckets = malloc(index->num_buckets * sizeof *index->buckets);
+    for (size_t i = 0; i < index->num_buckets; ++i) {
+      index->buckets[i] = NONE;
+    }
+    for (size_t i = 0; i < old_num_buckets; ++i) {
+      uint32_t next;
+      for (uint32_t it = old_buckets[i]; it != NONE; it = next) {
+        next = *next_link(nav, index->kind, it);
+        uint32_t *head = bucket(index, stored_hash(nav, index->kind, it));
+        *next_link(nav, index->kind, it) = *head;
+        *head = it;
+      }
+    }
+    free(old_buckets);
+  }
+
+  uint32_t *head = bucket(index, stored_hash(nav, index->kind, id));
+  *next_link(nav, index->kind, id) = *head;
+  *head = id;
+  ++index->count;
+}
+
+static void index_remove(struct imv_navigator *nav, struct index *index,
+    uint32_t id)
+{
+  uint32_t *link = bucket(index, stored_hash(nav, index->kind, id));
+  while (*link != NONE && *link != id) {
+    link = next_link(nav, index->kind, *link);
+  }
+  if (*link != NONE) {
+    *link = *next_link(nav, index->kind, id);
+    --index->count;
+  }
+}
+
+static void index_clear(struct index *index)
+{
+  free(index->buckets);
+  index->buckets = NULL;
+  index->num_buckets = 0;
+  index->count = 0;
+}
+
+static bool path_equals(struct imv_navigator *nav, const struct nav_item *item,
+    const char *path)
+{
+  if (item->dir != NONE) {
+    const struct nav_dir *dir = &nav->dirs[item->dir];
+    if (strncmp(path, arena_get(&nav->strings, dir->path), dir->len)
+        || path[dir->len] != '/') {
+      return false;
+    }
+    path += dir->len + 1;
+  }
+  return !strcmp(path, name_of(nav, item));
+}
+
+/* Returns the earliest item matching str, either by path or name */
+static uint32_t index_find(struct imv_navigator *nav, struct index *index,
+    const char *str)
+{
+  if (!index->count) {
+    return NONE;
+  }
+
+  uint32_t found = NONE;
+  const uint32_t hash = (uint32_t)hash_bytes(FNV_OFFSET, str, strlen(str));
+  for (uint32_t id = *bucket(index, hash); id != NONE;
+      id = *next_link(nav, index->kind, id)) {
+    const struct nav_item *item = &nav->items[id];
+    if (stored_hash(nav, index->kind, id) != hash) {
+      continue;
+    }
+    const bool matches = index->kind == INDEX_NAME
+      ? !strcmp(name_of(nav, item), str) : path_equals(nav, item, str);
+    if (matches && (found == NONE || item->slot < nav->items[found].slot)) {
+      found = id;
+    }
+  }
+  return found;
+}
+
+static uint32_t intern_dir(struct imv_navigator *nav, const char *path,
+    size_t len)
+{
+  const uint64_t hash = hash_bytes(hash_bytes(FNV_OFFSET, path, len), "/", 1);
+
+  if (nav->dir_index.count) {
+    for (uint32_t id = *bucket(&nav->dir_index, (uint32_t)hash); id != NONE;
+        id = nav->dirs[id].next) {
+      const struct nav_dir *dir = &nav->dirs[id];
+      if (dir->hash == hash && dir->len == len
+          && !memcmp(arena_get(&nav->strings, dir->path), path, len)) {
+        return id;
+      }
+    }
+  }
+
+  nav->dirs = grow(nav->dirs, &nav->dirs_cap, nav->num_dirs + 1, sizeof *nav->dirs);
+  const uint32_t id = (uint32_t)nav->num_dirs++;
+  struct nav_dir *dir = &nav->dirs[id];
+  dir->path = arena_add(&nav->strings, path, len);
+  dir->len = (uint32_t)len;
+  dir->hash = hash;
+  index_insert(nav, &nav->dir_index, id);
+  return id;
+}
+
+/* Store a path, returning its item */
+static uint32_t new_item(struct imv_navigator *nav, const char *path,
+    unsigned group, const char *key)
+{
+  uint32_t id = nav->free_items;
+  if (id != NONE) {
+    nav->free_items = nav->items[id].next_path;
+  } else {
+    nav->items = grow(nav->items, &nav->items_cap, nav->num_items + 1,
+        sizeof *nav->items);
+    id = (uint32_t)nav->num_items++;
+  }
+
+  struct nav_item *item = &nav->items[id];
+  item->path = NONE;
+  item->group = group;
+  item->key = key ? arena_add(&nav->strings, key, strlen(key)) : NONE;
+
+  const char *last_sep = strrchr(path, '/');
+  if (last_sep) {
+    item->dir = intern_dir(nav, path, last_sep - path);
+    const char *name = last_sep + 1;
+    const size_t name_len = strlen(name);
+    item->name = arena_add(&nav->strings, name, name_len);
+    item->path_hash = (uint32_t)hash_bytes(nav->dirs[item->dir].hash, name, name_len);
+    item->name_hash = (uint32_t)hash_bytes(FNV_OFFSET, name, name_len);
+    index_insert(nav, &nav->by_path, id);
+    index_insert(nav, &nav->by_name, id);
+  } else {
+    /* Nothing to match by name, only the whole path */
+    const size_t len = strlen(path);
+    item->dir = NONE;
+    item->name = arena_add(&nav->strings, path, len);
+    item->path_hash = (uint32_t)hash_bytes(FNV_OFFSET, path, len);
+    index_insert(nav, &nav->by_path, id);
+  }
+  return id;
+}
+
+static size_t lowbit(size_t i)
+{
+  return i & (~i + 1);
+}
+
+/* Number of occupied slots before slot */
+static size_t tree_prefix(struct imv_navigator *nav, size_t slot)
+{
+  size_t sum = 0;
+  for (size_t i = slot; i > 0; i -= lowbit(i)) {
+    sum += nav->tree[i];
+  }
+  return sum;
+}
+
+static void tree_build(struct imv_navigator *nav)
+{
+  free(nav->tree);
+  nav->tree_size = 64;
+  while (nav->tree_size < nav->len * 2) {
+    nav->tree_size *= 2;
+  }
+  nav->tree = calloc(nav->tree_size + 1, sizeof *nav->tree);
+  for (size_t i = 1; i <= nav->len; ++i) {
+    nav->tree[i] += nav->slots[i - 1] != NONE;
+    const size_t parent = i + lowbit(i);
+    if (parent <= nav->len) {
+      nav->tree[parent] += nav->tree[i];
+    }
+  }
+}
+
+/* Account for an item appended to the last slot */
+static void tree_append(struct imv_navigator *nav)
+{
+  const size_t i = nav->len;
+  if (i > nav->tree_size) {
+    tree_build(nav);
+    return;
+  }
+  nav->tree[i] = 1 + tree_prefix(nav, i - 1) - tree_prefix(nav, i - lowbit(i));
+}
+
+static void tree_vacate(struct imv_navigator *nav, size_t slot)
+{
+  for (size_t i = slot + 1; i <= nav->tree_size; i += lowbit(i)) {
+    --nav->tree[i];
+  }
+}
+
+static size_t length(struct imv_navigator *nav)
+{
+  return nav->len - nav->removed;
+}
+
+static size_t slot_of(struct imv_navigator *nav, size_t index)
+{
+  if (!nav->removed) {
+    return index;
+  }
+
+  /* Find the slot with index occupied slots before it */
+  size_t slot = 0;
+  size_t remaining = index + 1;
+  size_t step = nav->tree_size;
+  for (; step > 0; step /= 2) {
+    const size_t next = slot + step;
+    if (next <= nav->len && nav->tree[next] < remaining) {
+      slot = next;
+      remaining -= nav->tree[next];
+    }
+  }
+  return slot;
+}
+
+static size_t index_of(struct imv_navigator *nav, size_t slot)
+{
+  return nav->removed ? tree_prefix(nav, slot) : slot;
+}
+
+static struct nav_item *item_at(struct imv_navigator *nav, size_t index)
+{
+  return &nav->items[nav->slots[slot_of(nav, index)]];
+}
+
+/* Close up the slots of removed items */
+static void compact(struct imv_navigator *nav)
+{
+  if (!nav->removed) {
+    return;
+  }
+  size_t len = 0;
+  for (size_t i = 0; i < nav->len; ++i) {
+    const uint32_t id = nav->slots[i];
+    if (id != NONE) {
+      nav->items[id].slot = len;
+      nav->slots[len++] = id;
+    }
+  }
+  nav->len = len;
+  nav->removed = 0;
+  free(nav->tree);
+  nav->tree = NULL;
+  nav->tree_size = 0;
+}
+
+/* Remove the item at index, without doing anything about the selection.
+ * Its strings stay in the arena until everything is removed. */
+static void remove_item(struct imv_navigator *nav, size_t index)
+{
+  const size_t slot = slot_of(nav, index);
+  const uint32_t id = nav->slots[slot];
+  struct nav_item *item = &nav->items[id];
+
+  index_remove(nav, &nav->by_path, id);
+  if (item->dir != NONE) {
+    index_remove(nav, &nav->by_name, id);
+  }
+  item->next_path = nav->free_items;
+  nav->free_items = id;
+
+  /* Leave a gap rather than moving everything after it */
+  nav->slots[slot] = NONE;
+  if (!nav->removed) {
+    tree_build(nav);
+  } else {
+    tree_vacate(nav, slot);
+  }
+  ++nav->removed;
+
+  if (nav->removed * 4 > nav->len) {
+    compact(nav);
+  }
+}
+
+static void clear(struct imv_navigator *nav)
+{
+  arena_clear(&nav->strings);
+  nav->num_dirs = 0;
+  nav->num_items = 0;
+  nav->free_items = NONE;
+  nav->len = 0;
+  nav->removed = 0;
+  free(nav->tree);
+  nav->tree = NULL;
+  nav->tree_size = 0;
+  index_clear(&nav->by_path);
+  index_clear(&nav->by_name);
+  index_clear(&nav->dir_index);
+}
+
 struct imv_navigator *imv_navigator_create(void)
 {
   struct imv_navigator *nav = calloc(1, sizeof *nav);
   nav->last_move_direction = 1;
-  nav->paths = list_create();
+  nav->strings.chunks = list_create();
+  nav->free_items = NONE;
+  nav->by_path.kind = INDEX_PATH;
+  nav->by_name.kind = INDEX_NAME;
+  nav->dir_index.kind = INDEX_DIR;
   return nav;
 }
 
 void imv_navigator_free(struct imv_navigator *nav)
 {
-  for (size_t i = 0; i < nav->paths->len; ++i) {
-    struct nav_item *nav_item = nav->paths->items[i];
-    free(nav_item->path);
-  }
-  list_deep_free(nav->paths);
+  clear(nav);
+  list_free(nav->strings.chunks);
+  free(nav->dirs);
+  free(nav->items);
+  free(nav->slots);
+  free(nav->path_buf);
   free(nav);
 }
 
-static int add_item(struct imv_navigator *nav, const char *path)
+static int add_item(struct imv_navigator *nav, const char *path, unsigned group)
 {
-  struct nav_item *nav_item = calloc(1, sizeof *nav_item);
-
-  nav_item->path = realpath(path, NULL);
-  if (!nav_item->path) {
-    nav_item->path = strdup(path);
+  char *real = realpath(path, NULL);
+  const uint32_t id = new_item(nav, real ? real : path, group, NULL);
+  free(real);
+
+  nav->slots = grow(nav->slots, &nav->slots_cap, nav->len + 1, sizeof *nav->slots);
+  nav->items[id].slot = nav->len;
+  nav->slots[nav->len++] = id;
+  if (nav->removed) {
+    tree_append(nav);
   }
 
-  list_append(nav->paths, nav_item);
-
-  if (nav->paths->len == 1) {
+  if (length(nav) == 1) {
     nav->cur_path = 0;
     nav->changed = 1;
   }
@@ -68,8 +567,8 @@ static int add_item(struct imv_navigator *nav, const char *path)
   return 0;
 }
 
-int imv_navigator_add(struct imv_navigator *nav, const char *path,
-                       int recursive)
+static int add_path(struct imv_navigator *nav, const char *path,
+                    int recursive, unsigned group)
 {
   char path_buf[PATH_MAX+1];
   struct stat path_info;
@@ -81,39 +580,173 @@ int imv_navigator_add(struct imv_navigator *nav, const char *path,
     if (total_dirs >= 0) {
       for (int i = 0; i < total_dirs; ++i) {
         struct dirent *dir = dir_list[i];
-        if (strcmp(dir->d_name, "..") == 0 || strcmp(dir->d_name, ".") == 0) {
+        if (result || strcmp(dir->d_name, "..") == 0
+            || strcmp(dir->d_name, ".") == 0) {
+          free(dir);
           continue;
         }
         snprintf(path_buf, sizeof path_buf, "%s/%s", path, dir->d_name);
+        free(dir);
         struct stat new_path_info;
         if (stat(path_buf, &new_path_info)) {
           result = 1;
-          break;
+          continue;
         }
         int is_dir = S_ISDIR(new_path_info.st_mode);
         if (is_dir && recursive) {
-          if (imv_navigator_add(nav, path_buf, recursive) != 0) {
-            result = 1;
-            break;
-          }
+          result = add_path(nav, path_buf, recursive, group);
         } else if (!is_dir) {
-          if (add_item(nav, path_buf) != 0) {
-            result = 1;
-            break;
-          }
+          result = add_item(nav, path_buf, group);
         }
-        free(dir_list[i]);
       }
       free(dir_list);
     }
     return result;
   } else {
-    return add_item(nav, path);
+    return add_item(nav, path, group);
   }
 
   return 0;
 }
 
+int imv_navigator_add(struct imv_navigator *nav, const char *path,
+                       int recursive)
+{
+  return add_path(nav, path, recursive, nav->next_group++);
+}
+
+unsigned imv_navigator_reserve(struct imv_navigator *nav)
+{
+  return nav->next_group++;
+}
+
+/* Orders keys as a depth first walk would find them, with the entries of
+ * each directory sorted as alphasort sorts them */
+static int compare_keys(const char *a, const char *b)
+{
+  char name_a[PATH_MAX];
+  char name_b[PATH_MAX];
+
+  while (true) {
+    const size_t len_a = strcspn(a, "/");
+    const size_t len_b = strcspn(b, "/");
+    if (len_a != len_b || memcmp(a, b, len_a)) {
+      snprintf(name_a, sizeof name_a, "%.*s", (int)len_a, a);
+      snprintf(name_b, sizeof name_b, "%.*s", (int)len_b, b);
+      const int result = strcoll(name_a, name_b);
+      if (result) {
+        return result;
+      }
+    }
+    a += len_a;
+    b += len_b;
+    if (!*a || !*b) {
+      return (unsigned char)*a - (unsigned char)*b;
+    }
+    ++a;
+    ++b;
+  }
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+  const struct imv_navigator_entry *entry_a = *(void *const *)a;
+  const struct imv_navigator_entry *entry_b = *(void *const *)b;
+  return compare_keys(entry_a->key, entry_b->key);
+}
+
+void imv_navigator_sort_entries(struct list *entries)
+{
+  qsort(entries->items, entries->len, sizeof *entries->items, compare_entries);
+}
+
+void imv_navigator_add_entries(struct imv_navigator *nav, unsigned group,
+                               struct list *entries)
+{
+  if (entries->len == 0) {
+    return;
+  }
+
+  /* Every item moves anyway, so any gaps may as well be closed */
+  compact(nav);
+
+  const size_t old_len = nav->len;
+  const size_t count = entries->len;
+
+  /* The group's items lie together in [start, end), with every item of a
+   * later group after them */
+  size_t start = 0, end = old_len;
+  while (start < end) {
+    const size_t mid = start + (end - start) / 2;
+    if (nav->items[nav->slots[mid]].group < group) {
+      start = mid + 1;
+    } else {
+      end = mid;
+    }
+  }
+  end = start;
+  while (end < old_len && nav->items[nav->slots[end]].group == group) {
+    ++end;
+  }
+
+  /* Store the new items first, as doing so may move the items array */
+  uint32_t *ids = malloc(count * sizeof *ids);
+  for (size_t j = 0; j < count; ++j) {
+    struct imv_navigator_entry *entry = entries->items[j];
+    ids[j] = new_item(nav, entry->path, group, entry->key);
+    free(entry->path);
+    free(entry->key);
+    free(entry);
+  }
+  list_clear(entries);
+
+  /* Make room for the new items by moving the later groups up, then merge
+   * from the back, so each existing item only moves once */
+  nav->slots = grow(nav->slots, &nav->slots_cap, old_len + count, sizeof *nav->slots);
+  uint32_t *slots = nav->slots;
+  memmove(&slots[end + count], &slots[end], (old_len - end) * sizeof *slots);
+  nav->len = old_len + count;
+
+  size_t cur_path = nav->cur_path;
+  if (cur_path >= end) {
+    cur_path += count;
+  }
+
+  ssize_t i = (ssize_t)end - 1;
+  ssize_t j = (ssize_t)count - 1;
+  size_t k = end + count;
+  while (j >= 0) {
+    struct nav_item *item = &nav->items[ids[j]];
+    struct nav_item *old = i >= (ssize_t)start ? &nav->items[slots[i]] : NULL;
+    --k;
+    if (old && compare_keys(arena_get(&nav->strings, old->key),
+          arena_get(&nav->strings, item->key)) > 0) {
+      if ((size_t)i == nav->cur_path) {
+        cur_path = k;
+      }
+      old->slot = k;
+      slots[k] = slots[i];
+      --i;
+    } else {
+      item->slot = k;
+      slots[k] = ids[j];
+      --j;
+    }
+  }
+  free(ids);
+
+  for (size_t slot = end + count; slot < nav->len; ++slot) {
+    nav->items[slots[slot]].slot = slot;
+  }
+
+  if (old_len == 0) {
+    nav->cur_path = 0;
+    nav->changed = 1;
+  } else {
+    nav->cur_path = cur_path;
+  }
+}
+
 const char *imv_navigator_selection(struct imv_navigator *nav)
 {
   const char *path = imv_navigator_at(nav, nav->cur_path);
@@ -125,29 +758,34 @@ size_t imv_navigator_index(struct imv_navigator *nav)
   return nav->cur_path;
 }
 
+int imv_navigator_direction(struct imv_navigator *nav)
+{
+  return nav->last_move_direction < 0 ? -1 : 1;
+}
+
 void imv_navigator_select_rel(struct imv_navigator *nav, ssize_t direction)
 {
   const ssize_t prev_path = nav->cur_path;
-  if (nav->paths->len == 0) {
+  if (length(nav) == 0) {
     return;
   }
 
   if (direction > 1) {
-    direction = div(direction, nav->paths->len).rem;
+    direction = div(direction, length(nav)).rem;
   } else if (direction < -1) {
-    direction = div(direction, nav->paths->len).rem;
+    direction = div(direction, length(nav)).rem;
   } else if (direction == 0) {
     return;
   }
 
   ssize_t new_path = nav->cur_path + direction;
-  if (new_path >= (ssize_t)nav->paths->len) {
+  if (new_path >= (ssize_t)length(nav)) {
     /* Wrap after the end of the list */
-    new_path -= (ssize_t)nav->paths->len;
+    new_path -= (ssize_t)length(nav);
     nav->wrapped = 1;
   } else if (new_path < 0) {
     /* Wrap before the start of the list */
-    new_path += (ssize_t)nav->paths->len;
+    new_path += (ssize_t)length(nav);
     nav->wrapped = 1;
   }
   nav->cur_path = (size_t)new_path;
@@ -160,7 +798,7 @@ void imv_navigator_select_abs(struct imv_navigator *nav, ssize_t index)
 {
   /* allow -1 to indicate the last image */
   if (index < 0) {
-    index += (ssize_t)nav->paths->len;
+    index += (ssize_t)length(nav);
 
     /* but if they go farther back than the first image, stick to first image */
     if (index < 0) {
@@ -169,8 +807,8 @@ void imv_navigator_select_abs(struct imv_navigator *nav, ssize_t index)
   }
 
   /* stick to last image if we go beyond it */
-  if (index >= (ssize_t)nav->paths->len) {
-    index = (ssize_t)nav->paths->len - 1;
+  if (index >= (ssize_t)length(nav)) {
+    index = (ssize_t)length(nav) - 1;
   }
 
   const size_t prev_path = nav->cur_path;
@@ -181,49 +819,18 @@ void imv_navigator_select_abs(struct imv_navigator *nav, ssize_t index)
 
 void imv_navigator_remove(struct imv_navigator *nav, const char *path)
 {
-  bool found = false;
-  size_t removed = 0;
-  for (size_t i = 0; i < nav->paths->len; ++i) {
-    struct nav_item *item = nav->paths->items[i];
-    if (!strcmp(item->path, path)) {
-      free(item->path);
-      free(item);
-      list_remove(nav->paths, i);
-      removed = i;
-      found = true;
-      break;
-    }
+  const uint32_t id = index_find(nav, &nav->by_path, path);
+  if (id != NONE) {
+    imv_navigator_remove_at(nav, index_of(nav, nav->items[id].slot));
   }
-
-  if (!found) {
-    return;
-  }
-
-  if (nav->cur_path == removed) {
-    /* We just removed the current path */
-    if (nav->last_move_direction < 0) {
-      /* Move left */
-      imv_navigator_select_rel(nav, -1);
-    } else {
-      /* Try to stay where we are, unless we ran out of room */
-      if (nav->cur_path == nav->paths->len) {
-        nav->cur_path = 0;
-        nav->wrapped = 1;
-      }
-    }
-  }
-  nav->changed = 1;
 }
 
 void imv_navigator_remove_at(struct imv_navigator *nav, size_t index)
 {
-  if (index >= nav->paths->len) {
+  if (index >= length(nav)) {
     return;
   }
-  struct nav_item *item = nav->paths->items[index];
-  free(item->path);
-  free(item);
-  list_remove(nav->paths, index);
+  remove_item(nav, index);
 
   if (nav->cur_path == index) {
     /* We just removed the current path */
@@ -232,7 +839,7 @@ void imv_navigator_remove_at(struct imv_navigator *nav, size_t index)
       imv_navigator_select_rel(nav, -1);
     } else {
       /* Try to stay where we are, unless we ran out of room */
-      if (nav->cur_path == nav->paths->len) {
+      if (nav->cur_path == length(nav)) {
         nav->cur_path = 0;
         nav->wrapped = 1;
       }
@@ -243,12 +850,7 @@ void imv_navigator_remove_at(struct imv_navigator *nav, size_t index)
 
 void imv_navigator_remove_all(struct imv_navigator *nav)
 {
-  for (size_t i = 0; i < nav->paths->len; ++i) {
-    struct nav_item *item = nav->paths->items[i];
-    free(item->path);
-    free(item);
-  }
-  list_clear(nav->paths);
+  clear(nav);
   nav->cur_path = 0;
   nav->changed = 1;
 }
@@ -256,24 +858,15 @@ void imv_navigator_remove_all(struct imv_navigator *nav)
 ssize_t imv_navigator_find_path(struct imv_navigator *nav, const char *path)
 {
   /* first try to match the exact path */
-  for (size_t i = 0; i < nav->paths->len; ++i) {
-    struct nav_item *item = nav->paths->items[i];
-    if (!strcmp(item->path, path)) {
-      return (ssize_t)i;
-    }
-  }
+  uint32_t id = index_find(nav, &nav->by_path, path);
 
   /* no exact matches, try the final portion of the path */
-  for (size_t i = 0; i < nav->paths->len; ++i) {
-    struct nav_item *item = nav->paths->items[i];
-    char *last_sep = strrchr(item->path, '/');
-    if (last_sep && !strcmp(last_sep+1, path)) {
-      return (ssize_t)i;
-    }
+  if (id == NONE) {
+    id = index_find(nav, &nav->by_name, path);
   }
 
   /* no matches at all, give up */
-  return -1;
+  return id != NONE ? (ssize_t)index_of(nav, nav->items[id].slot) : -1;
 }
 
 int imv_navigator_poll_changed(struct imv_navigator *nav)
@@ -284,7 +877,7 @@ int imv_navigator_poll_changed(struct imv_navigator *nav)
     return 1;
   }
 
-  if (nav->paths->len == 0) {
+  if (length(nav) == 0 || nav->no_polling) {
     return 0;
   };
 
@@ -294,8 +887,7 @@ int imv_navigator_poll_changed(struct imv_navigator *nav)
     nav->last_check = cur_time;
 
     struct stat file_info;
-    struct nav_item *cur_item = nav->paths->items[nav->cur_path];
-    if (stat(cur_item->path, &file_info) == -1) {
+    if (stat(imv_navigator_at(nav, nav->cur_path), &file_info) == -1) {
       return 0;
     }
 
@@ -308,6 +900,19 @@ int imv_navigator_poll_changed(struct imv_navigator *nav)
   return 0;
 }
 
+void imv_navigator_set_polling(struct imv_navigator *nav, bool enabled)
+{
+  nav->no_polling = !enabled;
+}
+
+void imv_navigator_file_changed(struct imv_navigator *nav, const char *path)
+{
+  if (nav->cur_path < length(nav)
+      && path_equals(nav, item_at(nav, nav->cur_path), path)) {
+    nav->changed = 1;
+  }
+}
+
 int imv_navigator_wrapped(struct imv_navigator *nav)
 {
   return nav->wrapped;
@@ -315,16 +920,36 @@ int imv_navigator_wrapped(struct imv_navigator *nav)
 
 size_t imv_navigator_length(struct imv_navigator *nav)
 {
-  return nav->paths->len;
+  return length(nav);
 }
 
 char *imv_navigator_at(struct imv_navigator *nav, size_t index)
 {
-  if (index < nav->paths->len) {
-    struct nav_item *item = nav->paths->items[index];
-    return item->path;
+  if (index >= length(nav)) {
+    return NULL;
   }
-  return NULL;
+
+  struct nav_item *item = item_at(nav, index);
+  const char *name = name_of(nav, item);
+  if (item->dir == NONE) {
+    return (char *)name;
+  }
+  if (item->path != NONE) {
+    return (char *)arena_get(&nav->strings, item->path);
+  }
+
+  const struct nav_dir *dir = &nav->dirs[item->dir];
+  const size_t name_len = strlen(name);
+  const size_t len = dir->len + 1 + name_len;
+  if (len + 1 > nav->path_buf_len) {
+    nav->path_buf_len = len + 1;
+    nav->path_buf = realloc(nav->path_buf, nav->path_buf_len);
+  }
+  memcpy(nav->path_buf, arena_get(&nav->strings, dir->path), dir->len);
+  nav->path_buf[dir->len] = '/';
+  memcpy(nav->path_buf + dir->len + 1, name, name_len + 1);
+  item->path = arena_add(&nav->strings, nav->path_buf, len);
+  return (char *)arena_get(&nav->strings, item->path);
 }
 
 /* vim:set ts=2 sts=2 sw=2 et: */
@@ -1,8 +1,19 @@
 #ifndef IMV_NAVIGATOR_H
 #define IMV_NAVIGATOR_H
 
+#include <stdbool.h>
 #include <unistd.h>
 
+struct list;
+
+/* A file found by scanning a directory. key is its path relative to the
+ * directory scanned, and decides where it's placed among the scan's other
+ * files. */
+struct imv_navigator_entry {
+  char *path;
+  char *key;
+};
+
 /* Creates an instance of imv_navigator */
 struct imv_navigator *imv_navigator_create(void);
 
@@ -17,13 +28,31 @@ void imv_navigator_free(struct imv_navigator *nav);
 int imv_navigator_add(struct imv_navigator *nav, const char *path,
                        int recursive);
 
-/* Returns a read-only reference to the current path. The pointer is only
- * guaranteed to be valid until the next call to an imv_navigator method. */
+/* Reserves a place for the files of a directory scan, after every path
+ * added so far, returning the group to add them with */
+unsigned imv_navigator_reserve(struct imv_navigator *nav);
+
+/* Sorts a list of imv_navigator_entry by key, into the order a recursive
+ * imv_navigator_add of the directory would have given them */
+void imv_navigator_sort_entries(struct list *entries);
+
+/* Merges a sorted list of imv_navigator_entry into the group's place in the
+ * list, keeping the current selection. Takes ownership of the entries, but
+ * not the list itself. */
+void imv_navigator_add_entries(struct imv_navigator *nav, unsigned group,
+                               struct list *entries);
+
+/* Returns a read-only reference to the current path, which stays valid until
+ * the path is removed from the navigator. */
 const char *imv_navigator_selection(struct imv_navigator *nav);
 
 /* Returns the index of the currently selected path */
 size_t imv_navigator_index(struct imv_navigator *nav);
 
+/* Returns the direction the selection last moved in. 1 for forwards, -1 for
+ * backwards. */
+int imv_navigator_direction(struct imv_navigator *nav);
+
 /* Change the currently selected path. dir = -1 for previous, 1 for next. */
 void imv_navigator_select_rel(struct imv_navigator *nav, ssize_t dir);
 
@@ -48,13 +77,24 @@ ssize_t imv_navigator_find_path(struct imv_navigator *nav, const char *path);
  * changed since last called */
 int imv_navigator_poll_changed(struct imv_navigator *nav);
 
+/* Set whether poll_changed checks the current file's modification time,
+ * which it does at most once a second. It's on by default, and may be turned
+ * off while something else is watching the file. */
+void imv_navigator_set_polling(struct imv_navigator *nav, bool enabled);
+
+/* Tell the navigator the file at path has changed. If it's the current file,
+ * the next poll_changed returns 1. */
+void imv_navigator_file_changed(struct imv_navigator *nav, const char *path);
+
 /* Check whether navigator wrapped around paths list */
 int imv_navigator_wrapped(struct imv_navigator *nav);
 
 /* Return how many paths in navigator */
 size_t imv_navigator_length(struct imv_navigator *nav);
 
-/* Return a path for a given index */
+/* Return a path for a given index. As with imv_navigator_selection, the
+ * pointer stays valid until the path is removed from the navigator, however
+ * many others are asked for meanwhile. */
 char *imv_navigator_at(struct imv_navigator *nav, size_t index);
 
 
@@ -0,0 +1,264 @@
+#include "opener.h"
+
+#include "list.h"
+#include "module.h"
+#include "stream.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* How much of a file is read to work out which backends might open it. An
+ * SVG can have a long prologue before its <svg> tag. */
+#define SNIFF_LEN 4096
+
+/* The longest file extension remembered for choosing a backend */
+#define MAX_HINT_EXT 15
+
+/* An installed backend, either linked in, or a module that's loaded the
+ * first time a file it sniffs as its own is opened */
+struct backend_slot {
+  const struct imv_backend *backend;
+  struct imv_module *module;
+  /* the backend's sniff, or for a module, one that doesn't need it loaded */
+  bool (*sniff)(const unsigned char *header, size_t len);
+};
+
+/* The backend that last opened a file with the given extension */
+struct backend_hint {
+  char ext[MAX_HINT_EXT + 1];
+  const struct backend_slot *slot;
+};
+
+struct imv_opener {
+  struct list *backends;
+  /* backend_hints, tried ahead of the other backends that claim a file */
+  struct list *hints;
+};
+
+struct imv_opener *imv_opener_create(void)
+{
+  struct imv_opener *opener = calloc(1, sizeof *opener);
+  opener->backends = list_create();
+  opener->hints = list_create();
+  return opener;
+}
+
+void imv_opener_free(struct imv_opener *opener)
+{
+  if (!opener) {
+    return;
+  }
+  for (size_t i = 0; i < opener->backends->len; ++i) {
+    struct backend_slot *slot = opener->backends->items[i];
+    imv_module_free(slot->module);
+    free(slot);
+  }
+  list_free(opener->backends);
+  list_deep_free(opener->hints);
+  free(opener);
+}
+
+void imv_opener_add_backend(struct imv_opener *opener,
+    const struct imv_backend *backend)
+{
+  struct backend_slot *slot = calloc(1, sizeof *slot);
+  slot->backend = backend;
+  slot->sniff = backend->sniff;
+  list_append(opener->backends, slot);
+}
+
+void imv_opener_add_module(struct imv_opener *opener, const char *name,
+    bool (*sniff)(const unsigned char *header, size_t len))
+{
+  struct backend_slot *slot = calloc(1, sizeof *slot);
+  slot->module = imv_module_create(name);
+  slot->sniff = sniff;
+  list_append(opener->backends, slot);
+}
+
+size_t imv_opener_len(struct imv_opener *opener)
+{
+  return opener->backends->len;
+}
+
+/* Get the slot's backend, loading it if it's a module. NULL if it can't be
+ * loaded. */
+static const struct imv_backend *slot_backend(const struct backend_slot *slot)
+{
+  return slot->module ? imv_module_backend(slot->module) : slot->backend;
+}
+
+const struct imv_backend *imv_opener_get(struct imv_opener *opener,
+    size_t index, const char **name)
+{
+  const struct backend_slot *slot = opener->backends->items[index];
+  const struct imv_backend *backend = slot_backend(slot);
+  if (!backend) {
+    *name = imv_module_name(slot->module);
+  }
+  return backend;
+}
+
+/* Lowercase the extension of path into ext, returning false if it has none,
+ * or one too long to be worth remembering */
+static bool get_extension(const char *path, char ext[MAX_HINT_EXT + 1])
+{
+  const char *base = strrchr(path, '/');
+  const char *dot = strrchr(base ? base : path, '.');
+  if (!dot || strlen(dot + 1) > MAX_HINT_EXT) {
+    return false;
+  }
+  size_t i = 0;
+  for (const char *c = dot + 1; *c; ++c) {
+    ext[i++] = tolower((unsigned char)*c);
+  }
+  ext[i] = 0;
+  return true;
+}
+
+static struct backend_hint *find_hint(struct imv_opener *opener,
+    const char *ext)
+{
+  for (size_t i = 0; i < opener->hints->len; ++i) {
+    struct backend_hint *hint = opener->hints->items[i];
+    if (!strcmp(hint->ext, ext)) {
+      return hint;
+    }
+  }
+  return NULL;
+}
+
+/* Whether a slot's backend is worth trying on a file starting with header.
+ * Those that can't tell from the header always are. */
+static bool backend_claims(const struct backend_slot *slot,
+    const unsigned char *header, size_t len)
+{
+  return !slot->sniff || slot->sniff(header, len);
+}
+
+enum backend_result imv_opener_open_path(struct imv_opener *opener,
+    const char *path, struct imv_source **src)
+{
+  unsigned char header[SNIFF_LEN];
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return BACKEND_BAD_PATH;
+  }
+  const ssize_t got = read(fd, header, sizeof header);
+  close(fd);
+  if (got < 0) {
+    return BACKEND_BAD_PATH;
+  }
+  const size_t len = got;
+
+  char ext[MAX_HINT_EXT + 1];
+  const bool has_ext = get_extension(path, ext);
+  struct backend_hint *hint = has_ext ? find_hint(opener, ext) : NULL;
+  const struct backend_slot *hinted = hint ? hint->slot : NULL;
+
+  const struct backend_slot *chosen = NULL;
+  enum backend_result result = BACKEND_UNSUPPORTED;
+  for (int pass = 0; pass < 2 && !chosen; ++pass) {
+    const bool sniffers = pass == 0;
+    /* i == -1 stands for the hinted backend */
+    for (ssize_t i = -1; i < (ssize_t)opener->backends->len; ++i) {
+      const struct backend_slot *slot = i == -1 ? hinted
+        : opener->backends->items[i];
+      if (!slot || (i != -1 && slot == hinted)
+          || (slot->sniff != NULL) != sniffers
+          || !backend_claims(slot, header, len)) {
+        continue;
+      }
+
+      const struct imv_backend *backend = slot_backend(slot);
+      if (!backend || !backend->open_path) {
+        continue;
+      }
+
+      result = backend->open_path(path, src);
+      if (result != BACKEND_UNSUPPORTED) {
+        chosen = slot;
+        break;
+      }
+    }
+  }
+
+  if (result == BACKEND_SUCCESS && has_ext && chosen != hinted) {
+    if (!hint) {
+      hint = calloc(1, sizeof *hint);
+      strcpy(hint->ext, ext);
+      list_append(opener->hints, hint);
+    }
+    hint->slot = chosen;
+  }
+  return result;
+}
+
+enum backend_result imv_opener_open_stream(struct imv_opener *opener,
+    struct imv_stream *stream, struct imv_source **src, struct list **pending)
+{
+  *pending = NULL;
+
+  unsigned char header[SNIFF_LEN];
+  const size_t len = imv_stream_read(stream, 0, header, sizeof header, NULL);
+
+  /* Those that decode as the data arrives are tried straight away, the rest
+   * are kept, in the same order, for once it's all there */
+  struct list *waiting = list_create();
+  enum backend_result result = BACKEND_UNSUPPORTED;
+  for (int pass = 0; pass < 2 && result == BACKEND_UNSUPPORTED; ++pass) {
+    const bool sniffers = pass == 0;
+    for (size_t i = 0; i < opener->backends->len; ++i) {
+      const struct backend_slot *slot = opener->backends->items[i];
+      if ((slot->sniff != NULL) != sniffers
+          || !backend_claims(slot, header, len)) {
+        continue;
+      }
+
+      const struct imv_backend *backend = slot_backend(slot);
+      if (!backend) {
+        continue;
+      } else if (backend->open_stream) {
+        result = backend->open_stream(stream, src);
+        if (result != BACKEND_UNSUPPORTED) {
+          break;
+        }
+      } else if (backend->open_memory) {
+        list_append(waiting, (void *)backend);
+      }
+    }
+  }
+
+  if (result == BACKEND_UNSUPPORTED && waiting->len > 0) {
+    *src = NULL;
+    *pending = waiting;
+    return BACKEND_SUCCESS;
+  }
+  list_free(waiting);
+  return result;
+}
+
+enum backend_result imv_opener_open_pending(struct list *pending,
+    struct imv_stream *stream, struct imv_source **src)
+{
+  enum backend_result result = BACKEND_BAD_PATH;
+  const void *data;
+  size_t len;
+  if (imv_stream_wait(stream, &data, &len)) {
+    result = BACKEND_UNSUPPORTED;
+    for (size_t i = 0; i < pending->len; ++i) {
+      const struct imv_backend *backend = pending->items[i];
+      result = backend->open_memory((void *)data, len, src);
+      if (result != BACKEND_UNSUPPORTED) {
+        break;
+      }
+    }
+  }
+  list_free(pending);
+  return result;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
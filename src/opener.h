@@ -0,0 +1,68 @@
+#ifndef IMV_OPENER_H
+#define IMV_OPENER_H
+
+#include "backend.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* imv_opener holds the installed backends, and picks which of them to open
+ * each file with. The start of a file is sniffed once, and only the backends
+ * that might read it are tried: first those that recognise its header, then
+ * those that can't tell from it. Anything that recognises a different format
+ * isn't tried at all. Modules are only loaded once they claim a file.
+ */
+struct imv_opener;
+
+struct imv_source;
+struct imv_stream;
+struct list;
+
+/* Creates an imv_opener instance with no backends */
+struct imv_opener *imv_opener_create(void);
+
+/* Cleans up an imv_opener instance, unloading any modules */
+void imv_opener_free(struct imv_opener *opener);
+
+/* Add a linked in backend, tried after those added before it */
+void imv_opener_add_backend(struct imv_opener *opener,
+    const struct imv_backend *backend);
+
+/* Add the named backend as a module, only loaded once sniff claims a file,
+ * or a file can't be sniffed by any backend. sniff mustn't need the module,
+ * and may be NULL if the format can't be told from the header. */
+void imv_opener_add_module(struct imv_opener *opener, const char *name,
+    bool (*sniff)(const unsigned char *header, size_t len));
+
+/* The number of backends added */
+size_t imv_opener_len(struct imv_opener *opener);
+
+/* Get a backend, loading it if it's a module. If it can't be loaded, returns
+ * NULL, and sets name to the module's name. */
+const struct imv_backend *imv_opener_get(struct imv_opener *opener,
+    size_t index, const char **name);
+
+/* Open a file. The backend that last opened a file with the same extension
+ * is tried first among those that claim it. */
+enum backend_result imv_opener_open_path(struct imv_opener *opener,
+    const char *path, struct imv_source **src);
+
+/* Open the data arriving on stream, such as stdin. Backends that claim it and
+ * can decode it as it arrives are tried first. If none of them read it, but
+ * others that claim it can only be given the data once it's all arrived,
+ * BACKEND_SUCCESS is returned with src left NULL, and pending set to a list
+ * of those, to be given to imv_opener_open_pending. Only the start of the
+ * stream is waited for here.
+ */
+enum backend_result imv_opener_open_stream(struct imv_opener *opener,
+    struct imv_stream *stream, struct imv_source **src, struct list **pending);
+
+/* Wait for the end of stream, then try each of the backends that opener
+ * left pending on it in turn, freeing the list. Needs nothing from the
+ * opener, so may be called on any thread. */
+enum backend_result imv_opener_open_pending(struct list *pending,
+    struct imv_stream *stream, struct imv_source **src);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,111 @@
+#include "pixels.h"
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* NEON's interleaving loads and stores work on bytes, so the channel layout
+ * they see depends on the byte order */
+#if defined(__ARM_NEON) && defined(__BYTE_ORDER__) \
+  && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define USE_NEON
+#include <arm_neon.h>
+#endif
+
+static inline uint32_t swap_rb(uint32_t p)
+{
+  return (p & 0xff00ff00) | (p & 0xff) << 16 | (p >> 16 & 0xff);
+}
+
+void imv_pixels_swap_rb(uint32_t *dst, const uint32_t *src, size_t n)
+{
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  const __m256i keep = _mm256_set1_epi32((int)0xff00ff00);
+  const __m256i low = _mm256_set1_epi32(0xff);
+  for (; i + 8 <= n; i += 8) {
+    const __m256i p = _mm256_loadu_si256((const __m256i *)(src + i));
+    const __m256i r = _mm256_or_si256(_mm256_and_si256(p, keep),
+        _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p, low), 16),
+                        _mm256_and_si256(_mm256_srli_epi32(p, 16), low)));
+    _mm256_storeu_si256((__m256i *)(dst + i), r);
+  }
+#elif defined(__SSE2__)
+  const __m128i keep = _mm_set1_epi32((int)0xff00ff00);
+  const __m128i low = _mm_set1_epi32(0xff);
+  for (; i + 4 <= n; i += 4) {
+    const __m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+    const __m128i r = _mm_or_si128(_mm_and_si128(p, keep),
+        _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, low), 16),
+                     _mm_and_si128(_mm_srli_epi32(p, 16), low)));
+    _mm_storeu_si128((__m128i *)(dst + i), r);
+  }
+#elif defined(USE_NEON)
+  for (; i + 16 <= n; i += 16) {
+    uint8x16x4_t p = vld4q_u8((const uint8_t *)(src + i));
+    const uint8x16_t t = p.val[0];
+    p.val[0] = p.val[2];
+    p.val[2] = t;
+    vst4q_u8((uint8_t *)(dst + i), p);
+  }
+#endif
+
+  for (; i < n; ++i) {
+    dst[i] = swap_rb(src[i]);
+  }
+}
+
+void imv_pixels_grey_to_argb(uint32_t *dst, const unsigned char *src, size_t n)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  /* Pairing each byte with itself, and then with an opaque alpha, gives the
+   * bytes of four ARGB words at a time */
+  const __m128i alpha = _mm_set1_epi8((char)0xff);
+  for (; i + 16 <= n; i += 16) {
+    const __m128i l = _mm_loadu_si128((const __m128i *)(src + i));
+    const __m128i ll_lo = _mm_unpacklo_epi8(l, l);
+    const __m128i ll_hi = _mm_unpackhi_epi8(l, l);
+    const __m128i la_lo = _mm_unpacklo_epi8(l, alpha);
+    const __m128i la_hi = _mm_unpackhi_epi8(l, alpha);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(ll_lo, la_lo));
+    _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(ll_lo, la_lo));
+    _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpacklo_epi16(ll_hi, la_hi));
+    _mm_storeu_si128((__m128i *)(dst + i + 12), _mm_unpackhi_epi16(ll_hi, la_hi));
+  }
+#elif defined(USE_NEON)
+  for (; i + 16 <= n; i += 16) {
+    const uint8x16_t l = vld1q_u8(src + i);
+    const uint8x16x4_t p = {{l, l, l, vdupq_n_u8(0xff)}};
+    vst4q_u8((uint8_t *)(dst + i), p);
+  }
+#endif
+
+  for (; i < n; ++i) {
+    const uint32_t l = src[i];
+    dst[i] = 0xff000000 | l << 16 | l << 8 | l;
+  }
+}
+
+void imv_pixels_copy_rows(void *dst, size_t dst_stride, const void *src,
+    size_t src_stride, size_t row_bytes, size_t rows)
+{
+  if (dst_stride == row_bytes && src_stride == row_bytes) {
+    memcpy(dst, src, row_bytes * rows);
+    return;
+  }
+
+  unsigned char *out = dst;
+  const unsigned char *in = src;
+  for (size_t y = 0; y < rows; ++y) {
+    memcpy(out + y * dst_stride, in + y * src_stride, row_bytes);
+  }
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
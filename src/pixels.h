@@ -0,0 +1,27 @@
+#ifndef IMV_PIXELS_H
+#define IMV_PIXELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Pixel conversion kernels shared by the backends and the canvas. Each has
+ * a vectorised implementation for whichever of SSE2, AVX2 or NEON the build
+ * targets, and a portable fallback. Pixels are packed 32 bit words, as in
+ * imv_bitmap.
+ */
+
+/* Swap the red and blue channels of n pixels, converting between IMV_ARGB
+ * and IMV_ABGR. dst may equal src. */
+void imv_pixels_swap_rb(uint32_t *dst, const uint32_t *src, size_t n);
+
+/* Expand n bytes of luminance to opaque IMV_ARGB pixels */
+void imv_pixels_grey_to_argb(uint32_t *dst, const unsigned char *src, size_t n);
+
+/* Copy rows of row_bytes each between buffers with different strides, such
+ * as packing a decoder's padded rows into a tightly packed bitmap */
+void imv_pixels_copy_rows(void *dst, size_t dst_stride, const void *src,
+    size_t src_stride, size_t row_bytes, size_t rows);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,184 @@
+#include "pool.h"
+
+#include "list.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+struct pool_job {
+  imv_pool_func func;
+  void *data;
+};
+
+struct imv_pool {
+  /* protects everything below */
+  pthread_mutex_t lock;
+
+  /* signalled when a job is queued, or the pool is shutting down */
+  pthread_cond_t wake;
+
+  /* one FIFO queue of pool_jobs per priority */
+  struct list *queues[IMV_POOL_PRIORITY_COUNT];
+
+  bool stopping;
+
+  int num_threads;
+  pthread_t *threads;
+};
+
+/* Must be called with the pool locked */
+static struct pool_job *pop_job(struct imv_pool *pool)
+{
+  for (int i = 0; i < IMV_POOL_PRIORITY_COUNT; ++i) {
+    struct list *queue = pool->queues[i];
+    if (queue->len > 0) {
+      struct pool_job *job = queue->items[0];
+      list_remove(queue, 0);
+      return job;
+    }
+  }
+  return NULL;
+}
+
+static void *worker_thread(void *data)
+{
+  struct imv_pool *pool = data;
+
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->stopping) {
+    struct pool_job *job = pop_job(pool);
+    if (!job) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+      continue;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    job->func(job->data);
+    free(job);
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+struct imv_pool *imv_pool_create(int num_threads)
+{
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+
+  struct imv_pool *pool = calloc(1, sizeof *pool);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  for (int i = 0; i < IMV_POOL_PRIORITY_COUNT; ++i) {
+    pool->queues[i] = list_create();
+  }
+
+  pool->threads = calloc(num_threads, sizeof *pool->threads);
+  for (int i = 0; i < num_threads; ++i) {
+    if (pthread_create(&pool->threads[i], NULL, worker_thread, pool)) {
+      break;
+    }
+    pool->num_threads++;
+  }
+
+  if (pool->num_threads == 0) {
+    imv_pool_free(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+void imv_pool_free(struct imv_pool *pool)
+{
+  if (!pool) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->num_threads; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  free(pool->threads);
+
+  for (int i = 0; i < IMV_POOL_PRIORITY_COUNT; ++i) {
+    list_deep_free(pool->queues[i]);
+  }
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+int imv_pool_num_threads(struct imv_pool *pool)
+{
+  return pool->num_threads;
+}
+
+void imv_pool_push(struct imv_pool *pool, enum imv_pool_priority priority,
+    imv_pool_func func, void *data)
+{
+  struct pool_job *job = malloc(sizeof *job);
+  job->func = func;
+  job->data = data;
+
+  pthread_mutex_lock(&pool->lock);
+  list_append(pool->queues[priority], job);
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+size_t imv_pool_cancel(struct imv_pool *pool, imv_pool_func func, void *data)
+{
+  size_t removed = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (int i = 0; i < IMV_POOL_PRIORITY_COUNT; ++i) {
+    struct list *queue = pool->queues[i];
+    for (size_t j = queue->len; j > 0; --j) {
+      struct pool_job *job = queue->items[j - 1];
+      if (job->data == data && (!func || job->func == func)) {
+        list_remove(queue, j - 1);
+        free(job);
+        ++removed;
+      }
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return removed;
+}
+
+void imv_pool_set_priority(struct imv_pool *pool, void *data,
+    enum imv_pool_priority priority)
+{
+  pthread_mutex_lock(&pool->lock);
+  struct list *moved = list_create();
+  for (int i = 0; i < IMV_POOL_PRIORITY_COUNT; ++i) {
+    if (i == (int)priority) {
+      continue;
+    }
+    struct list *queue = pool->queues[i];
+    for (size_t j = 0; j < queue->len;) {
+      struct pool_job *job = queue->items[j];
+      if (job->data == data) {
+        list_append(moved, job);
+        list_remove(queue, j);
+      } else {
+        ++j;
+      }
+    }
+  }
+  for (size_t i = 0; i < moved->len; ++i) {
+    list_append(pool->queues[priority], moved->items[i]);
+  }
+  list_free(moved);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,48 @@
+#ifndef IMV_POOL_H
+#define IMV_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* imv_pool is a fixed number of worker threads, fed from a queue of jobs.
+ * Jobs are run in order of priority, and in the order they were pushed within
+ * the same priority. Jobs that haven't started yet can be cancelled.
+ */
+struct imv_pool;
+
+enum imv_pool_priority {
+  IMV_POOL_PRIORITY_HIGH,
+  IMV_POOL_PRIORITY_NORMAL,
+  IMV_POOL_PRIORITY_LOW,
+  IMV_POOL_PRIORITY_COUNT
+};
+
+typedef void (*imv_pool_func)(void *data);
+
+/* Creates an imv_pool instance with the given number of threads */
+struct imv_pool *imv_pool_create(int num_threads);
+
+/* Cleans up an imv_pool instance. Waits for running jobs to complete, any jobs
+ * still queued are discarded without being run. */
+void imv_pool_free(struct imv_pool *pool);
+
+/* Returns the number of worker threads in the pool */
+int imv_pool_num_threads(struct imv_pool *pool);
+
+/* Queue func to be called with data on a worker thread */
+void imv_pool_push(struct imv_pool *pool, enum imv_pool_priority priority,
+    imv_pool_func func, void *data);
+
+/* Remove any queued jobs for data that haven't started yet. If func is NULL
+ * all jobs for data are removed, otherwise only the ones that would call func.
+ * Returns the number of jobs removed.
+ */
+size_t imv_pool_cancel(struct imv_pool *pool, imv_pool_func func, void *data);
+
+/* Move any queued jobs for data to the given priority */
+void imv_pool_set_priority(struct imv_pool *pool, void *data,
+    enum imv_pool_priority priority);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,399 @@
+/* for d_type, and the DT_ constants */
+#define _DEFAULT_SOURCE
+
+#include "scanner.h"
+
+#include "list.h"
+#include "navigator.h"
+#include "pool.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* How many entries a worker collects before handing them over */
+#define ENTRIES_PER_HANDOVER 256
+
+/* A scan's files are reported once there are this many of them, or a
+ * quarter of what's been reported so far if that's more, so that merging
+ * them into a long list doesn't come to dominate */
+#define MIN_BATCH_SIZE 1024
+
+/* Or once this many seconds have passed since the last batch */
+#define BATCH_INTERVAL 0.2
+
+/* One call to imv_scanner_add */
+struct scan {
+  unsigned group;
+  bool recursive;
+
+  /* directories queued or being read */
+  size_t pending;
+
+  /* batches taken, but not yet passed to the callback */
+  size_t reporting;
+
+  /* entries found since the last batch */
+  struct list *found;
+  size_t reported;
+  double last_report;
+};
+
+struct dir_job {
+  struct scan *scan;
+  /* where to find the directory. Only the root's may not be canonical. */
+  char *path;
+  /* the directory's path relative to the root, empty for the root */
+  char *key;
+  bool resolved;
+};
+
+struct imv_scanner {
+  struct imv_pool *pool;
+  imv_scanner_callback callback;
+  void *data;
+
+  /* protects everything below */
+  pthread_mutex_t lock;
+
+  /* dir_jobs waiting to be read, there's one pool job for each */
+  struct list *queue;
+
+  /* scans in progress */
+  struct list *scans;
+
+  bool stopping;
+};
+
+static double cur_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (double)ts.tv_nsec * 0.000000001;
+}
+
+static char *join(const char *dir, const char *name)
+{
+  if (!*dir) {
+    return strdup(name);
+  }
+  const size_t dir_len = strlen(dir);
+  const size_t name_len = strlen(name);
+  const bool sep = dir[dir_len - 1] != '/';
+  char *path = malloc(dir_len + sep + name_len + 1);
+  memcpy(path, dir, dir_len);
+  path[dir_len] = '/';
+  memcpy(path + dir_len + sep, name, name_len + 1);
+  return path;
+}
+
+static void free_entries(struct list *entries)
+{
+  for (size_t i = 0; i < entries->len; ++i) {
+    struct imv_navigator_entry *entry = entries->items[i];
+    free(entry->path);
+    free(entry->key);
+    free(entry);
+  }
+  list_free(entries);
+}
+
+static void free_job(struct dir_job *job)
+{
+  free(job->path);
+  free(job->key);
+  free(job);
+}
+
+static void scan_next(void *data);
+
+/* Must be called with the scanner locked */
+static void queue_dir(struct imv_scanner *scanner, struct scan *scan,
+    char *path, char *key, bool resolved)
+{
+  struct dir_job *job = calloc(1, sizeof *job);
+  job->scan = scan;
+  job->path = path;
+  job->key = key;
+  job->resolved = resolved;
+  ++scan->pending;
+  list_append(scanner->queue, job);
+  imv_pool_push(scanner->pool, IMV_POOL_PRIORITY_NORMAL, scan_next, scanner);
+}
+
+static void report(struct imv_scanner *scanner, struct scan *scan,
+    struct list *entries, bool done)
+{
+  struct imv_scanner_batch *batch = calloc(1, sizeof *batch);
+  batch->group = scan->group;
+  batch->entries = entries ? entries : list_create();
+  batch->done = done;
+  imv_navigator_sort_entries(batch->entries);
+  scanner->callback(batch, scanner->data);
+}
+
+/* Hand the entries a worker has collected to their scan, reporting a batch
+ * if it's time to. finished is set once the worker's done with a directory.
+ */
+static void hand_over(struct imv_scanner *scanner, struct scan *scan,
+    struct list *local, bool finished)
+{
+  pthread_mutex_lock(&scanner->lock);
+  for (size_t i = 0; i < local->len; ++i) {
+    list_append(scan->found, local->items[i]);
+  }
+  list_clear(local);
+
+  /* The last directory of the scan takes whatever's left */
+  const bool last = finished && scan->pending == 1;
+
+  struct list *batch = NULL;
+  const double now = cur_time();
+  size_t batch_size = scan->reported / 4;
+  if (batch_size < MIN_BATCH_SIZE) {
+    batch_size = MIN_BATCH_SIZE;
+  }
+  /* The first file found is reported straight away so it can be shown */
+  if (scan->found->len > 0 && (last || scan->reported == 0
+        || scan->found->len >= batch_size
+        || now - scan->last_report >= BATCH_INTERVAL)) {
+    batch = scan->found;
+    scan->found = list_create();
+    scan->reported += batch->len;
+    scan->last_report = now;
+    ++scan->reporting;
+  }
+  pthread_mutex_unlock(&scanner->lock);
+
+  if (batch) {
+    report(scanner, scan, batch, false);
+  }
+
+  /* The last batch must follow every other, whichever worker sends them.
+   * Only the worker that leaves nothing pending or being reported sees the
+   * scan as done, and nothing else can touch it after that. */
+  pthread_mutex_lock(&scanner->lock);
+  if (batch) {
+    --scan->reporting;
+  }
+  if (finished) {
+    --scan->pending;
+  }
+  const bool done = scan->pending == 0 && scan->reporting == 0;
+  if (done) {
+    for (size_t i = 0; i < scanner->scans->len; ++i) {
+      if (scanner->scans->items[i] == scan) {
+        list_remove(scanner->scans, i);
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&scanner->lock);
+
+  if (done) {
+    report(scanner, scan, scan->found, true);
+    free(scan);
+  }
+}
+
+static void add_entry(struct list *local, char *path, const char *key,
+    const char *name)
+{
+  struct imv_navigator_entry *entry = calloc(1, sizeof *entry);
+  entry->path = path;
+  entry->key = join(key, name);
+  list_append(local, entry);
+}
+
+static void read_dir(struct imv_scanner *scanner, struct dir_job *job)
+{
+  struct scan *scan = job->scan;
+
+  if (!job->resolved) {
+    char *real = realpath(job->path, NULL);
+    if (real) {
+      free(job->path);
+      job->path = real;
+    }
+  }
+
+  const int fd = open(job->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+  if (!dir) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return;
+  }
+
+  struct list *local = list_create();
+  struct dirent *dirent;
+  while ((dirent = readdir(dir))) {
+    const char *name = dirent->d_name;
+    if (!strcmp(name, ".") || !strcmp(name, "..")) {
+      continue;
+    }
+
+    /* Most filesystems say what each entry is, only links and the rest
+     * need to be looked at, following links as stat would */
+    bool is_dir = false;
+    bool is_link = true;
+#ifdef DT_DIR
+    if (dirent->d_type == DT_DIR) {
+      is_dir = true;
+      is_link = false;
+    } else if (dirent->d_type == DT_REG) {
+      is_link = false;
+    } else
+#endif
+    {
+      struct stat info;
+      if (fstatat(dirfd(dir), name, &info, AT_SYMLINK_NOFOLLOW)) {
+        continue;
+      }
+      is_link = S_ISLNK(info.st_mode);
+      if (is_link && fstatat(dirfd(dir), name, &info, 0)) {
+        continue;
+      }
+      is_dir = S_ISDIR(info.st_mode);
+    }
+
+    /* Entries are found within a canonical path, so only links have to be
+     * resolved */
+    char *path = join(job->path, name);
+    if (is_link) {
+      char *real = realpath(path, NULL);
+      if (real) {
+        free(path);
+        path = real;
+      }
+    }
+
+    if (is_dir) {
+      if (scan->recursive) {
+        pthread_mutex_lock(&scanner->lock);
+        queue_dir(scanner, scan, path, join(job->key, name), true);
+        pthread_mutex_unlock(&scanner->lock);
+      } else {
+        free(path);
+      }
+      continue;
+    }
+
+    add_entry(local, path, job->key, name);
+    if (local->len >= ENTRIES_PER_HANDOVER) {
+      hand_over(scanner, scan, local, false);
+      pthread_mutex_lock(&scanner->lock);
+      const bool stopping = scanner->stopping;
+      pthread_mutex_unlock(&scanner->lock);
+      if (stopping) {
+        break;
+      }
+    }
+  }
+  closedir(dir);
+
+  /* Whatever's left is handed over with the directory */
+  pthread_mutex_lock(&scanner->lock);
+  for (size_t i = 0; i < local->len; ++i) {
+    list_append(scan->found, local->items[i]);
+  }
+  pthread_mutex_unlock(&scanner->lock);
+  list_free(local);
+}
+
+static void scan_next(void *data)
+{
+  struct imv_scanner *scanner = data;
+
+  pthread_mutex_lock(&scanner->lock);
+  struct dir_job *job = NULL;
+  if (!scanner->stopping && scanner->queue->len > 0) {
+    job = scanner->queue->items[0];
+    list_remove(scanner->queue, 0);
+  }
+  pthread_mutex_unlock(&scanner->lock);
+
+  if (!job) {
+    return;
+  }
+
+  read_dir(scanner, job);
+
+  struct list *none = list_create();
+  hand_over(scanner, job->scan, none, true);
+  list_free(none);
+  free_job(job);
+}
+
+struct imv_scanner *imv_scanner_create(int num_threads,
+    imv_scanner_callback callback, void *data)
+{
+  struct imv_scanner *scanner = calloc(1, sizeof *scanner);
+  scanner->pool = imv_pool_create(num_threads);
+  scanner->callback = callback;
+  scanner->data = data;
+  pthread_mutex_init(&scanner->lock, NULL);
+  scanner->queue = list_create();
+  scanner->scans = list_create();
+  return scanner;
+}
+
+void imv_scanner_free(struct imv_scanner *scanner)
+{
+  if (!scanner) {
+    return;
+  }
+
+  pthread_mutex_lock(&scanner->lock);
+  scanner->stopping = true;
+  pthread_mutex_unlock(&scanner->lock);
+
+  imv_pool_free(scanner->pool);
+
+  for (size_t i = 0; i < scanner->queue->len; ++i) {
+    free_job(scanner->queue->items[i]);
+  }
+  list_free(scanner->queue);
+
+  for (size_t i = 0; i < scanner->scans->len; ++i) {
+    struct scan *scan = scanner->scans->items[i];
+    free_entries(scan->found);
+    free(scan);
+  }
+  list_free(scanner->scans);
+
+  pthread_mutex_destroy(&scanner->lock);
+  free(scanner);
+}
+
+void imv_scanner_add(struct imv_scanner *scanner, const char *path,
+    bool recursive, unsigned group)
+{
+  struct scan *scan = calloc(1, sizeof *scan);
+  scan->group = group;
+  scan->recursive = recursive;
+  scan->found = list_create();
+  scan->last_report = cur_time();
+
+  pthread_mutex_lock(&scanner->lock);
+  list_append(scanner->scans, scan);
+  queue_dir(scanner, scan, strdup(path), strdup(""), false);
+  pthread_mutex_unlock(&scanner->lock);
+}
+
+void imv_scanner_batch_free(struct imv_scanner_batch *batch)
+{
+  if (!batch) {
+    return;
+  }
+  free_entries(batch->entries);
+  free(batch);
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,47 @@
+#ifndef IMV_SCANNER_H
+#define IMV_SCANNER_H
+
+#include <stdbool.h>
+
+struct list;
+
+/* imv_scanner walks directories on a pool of worker threads, so that the
+ * files of a large or slow directory tree can be shown as they're found,
+ * rather than once all of them are. The files of each scan are reported in
+ * batches, as sorted lists of imv_navigator_entry, ready to be merged into a
+ * navigator.
+ */
+struct imv_scanner;
+
+struct imv_scanner_batch {
+  /* the group given to imv_scanner_add */
+  unsigned group;
+  /* imv_navigator_entry, sorted by key */
+  struct list *entries;
+  /* set on the last batch of a scan, which may be empty */
+  bool done;
+};
+
+/* Called on a worker thread with each batch, which the callback then owns */
+typedef void (*imv_scanner_callback)(struct imv_scanner_batch *batch,
+    void *data);
+
+/* Creates an imv_scanner instance with the given number of threads */
+struct imv_scanner *imv_scanner_create(int num_threads,
+    imv_scanner_callback callback, void *data);
+
+/* Cleans up an imv_scanner instance, abandoning any scans in progress. Waits
+ * for directories being read to finish. */
+void imv_scanner_free(struct imv_scanner *scanner);
+
+/* Start scanning the directory at path, recursing into subdirectories if
+ * recursive is set. Its batches are reported with the given group. */
+void imv_scanner_add(struct imv_scanner *scanner, const char *path,
+    bool recursive, unsigned group);
+
+/* Cleans up a batch, along with any entries left in it */
+void imv_scanner_batch_free(struct imv_scanner_batch *batch);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
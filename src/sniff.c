@@ -0,0 +1,85 @@
+#include "sniff.h"
+
+#include <stdint.h>
+#include <string.h>
+
+bool imv_sniff_png(const unsigned char *header, size_t len)
+{
+  return len >= 8 && !memcmp(header, "\x89PNG\r\n\x1a\n", 8);
+}
+
+/* Every JPEG starts with a start of image marker, then another marker */
+bool imv_sniff_jpeg(const unsigned char *header, size_t len)
+{
+  return len >= 3 && header[0] == 0xff && header[1] == 0xd8 && header[2] == 0xff;
+}
+
+bool imv_sniff_gif(const unsigned char *header, size_t len)
+{
+  return len >= 6 && (!memcmp(header, "GIF87a", 6) || !memcmp(header, "GIF89a", 6));
+}
+
+/* Classic and BigTIFF, in either byte order */
+bool imv_sniff_tiff(const unsigned char *header, size_t len)
+{
+  return len >= 4 && (!memcmp(header, "II*\0", 4) || !memcmp(header, "MM\0*", 4)
+      || !memcmp(header, "II+\0", 4) || !memcmp(header, "MM\0+", 4));
+}
+
+bool imv_sniff_webp(const unsigned char *header, size_t len)
+{
+  return len >= 12 && !memcmp(header, "RIFF", 4)
+    && !memcmp(header + 8, "WEBP", 4);
+}
+
+bool imv_sniff_svg(const unsigned char *header, size_t len)
+{
+  char text[4096];
+  if (len > sizeof text - 1) {
+    len = sizeof text - 1;
+  }
+  memcpy(text, header, len);
+  text[len] = 0;
+  return strstr(text, "<SVG") || strstr(text, "<svg");
+}
+
+static bool is_heif_brand(const unsigned char *brand)
+{
+  static const char *brands[] = {
+    "heic", "heix", "heim", "heis", "hevc", "hevx", "hevm", "hevs",
+    "mif1", "msf1", "avif", "avis",
+  };
+  for (size_t i = 0; i < sizeof brands / sizeof *brands; ++i) {
+    if (!memcmp(brand, brands[i], 4)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* The file type box comes first, holding the major brand, a version, then
+ * the compatible brands */
+bool imv_sniff_heif(const unsigned char *header, size_t len)
+{
+  if (len < 16 || memcmp(header + 4, "ftyp", 4)) {
+    return false;
+  }
+
+  const size_t box_len = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16
+    | (uint32_t)header[2] << 8 | header[3];
+  if (is_heif_brand(header + 8)) {
+    return true;
+  }
+  for (size_t pos = 16; pos + 4 <= box_len; pos += 4) {
+    if (pos + 4 > len) {
+      /* The brand that matters may be past what was read */
+      return true;
+    }
+    if (is_heif_brand(header + pos)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,32 @@
+#ifndef IMV_SNIFF_H
+#define IMV_SNIFF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Recognise image formats from the start of a file, without any of the
+ * libraries that decode them, for backends' sniff functions, and for
+ * modules that haven't been loaded yet. Each returns false only if the file
+ * certainly isn't in its format.
+ */
+
+bool imv_sniff_png(const unsigned char *header, size_t len);
+
+bool imv_sniff_jpeg(const unsigned char *header, size_t len);
+
+bool imv_sniff_gif(const unsigned char *header, size_t len);
+
+bool imv_sniff_tiff(const unsigned char *header, size_t len);
+
+bool imv_sniff_webp(const unsigned char *header, size_t len);
+
+/* Looks for an <svg> tag near the start of the file */
+bool imv_sniff_svg(const unsigned char *header, size_t len);
+
+/* Looks for an ISO base media file whose brands include a HEIF one. Looser
+ * than libheif's own check. */
+bool imv_sniff_heif(const unsigned char *header, size_t len);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
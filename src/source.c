@@ -1,8 +1,35 @@
 #include "source.h"
 #include "source_private.h"
 
+#include "image.h"
+#include "pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Upper bound on the number of threads used for loading, regardless of how
+ * many cores are available */
+#define MAX_POOL_THREADS 8
+
+/* The same for threads decoding parts of a single image */
+#define MAX_PARALLEL_THREADS 32
+
+struct imv_source_token {
+  /* the source the token belongs to, for delivering partial images */
+  struct imv_source *source;
+  pthread_mutex_t lock;
+  bool cancelled;
+  bool want_preview;
+  int target_width;
+  int target_height;
+  int page;
+};
 
 struct imv_source {
   /* pointers to implementation's functions */
@@ -18,6 +45,23 @@ struct imv_source {
    */
   pthread_mutex_t busy;
 
+  /* Set once the source is being freed, so that any load in progress can stop
+   * early, and any queued loads don't start at all */
+  struct imv_source_token token;
+
+  /* how urgently background loads should be performed */
+  enum imv_source_priority priority;
+
+  /* whether a preview has already been attempted. Protected by busy */
+  bool previewed;
+
+  /* the latest region asked for by imv_source_async_load_region, which the
+   * queued job loads. Protected by token.lock. */
+  struct {
+    int x, y, width, height;
+    double scale;
+  } region;
+
   /* callback function */
   imv_source_callback callback;
   /* callback data */
@@ -30,56 +74,471 @@ struct imv_source *imv_source_create(const struct imv_source_vtable *vtable, voi
   source->vtable = vtable;
   source->private = private;
   pthread_mutex_init(&source->busy, NULL);
+  pthread_mutex_init(&source->token.lock, NULL);
+  source->token.source = source;
+  source->token.want_preview = true;
   return source;
 }
 
-static void *free_thread(void *src)
+const struct imv_source_vtable *imv_source_get_vtable(const struct imv_source *src)
+{
+  return src->vtable;
+}
+
+bool imv_source_map_file(const char *path, bool sequential, void **data,
+    size_t *len)
+{
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) || !S_ISREG(info.st_mode) || info.st_size == 0) {
+    close(fd);
+    errno = EINVAL;
+    return false;
+  }
+
+  void *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  const int map_errno = errno;
+  /* The mapping keeps the file open by itself */
+  close(fd);
+  if (map == MAP_FAILED) {
+    errno = map_errno;
+    return false;
+  }
+
+  /* It's going to be wanted soon, so reading it in can start now, rather
+   * than a page at a time as the decoder faults */
+  if (sequential) {
+    posix_madvise(map, info.st_size, POSIX_MADV_SEQUENTIAL);
+  }
+  posix_madvise(map, info.st_size, POSIX_MADV_WILLNEED);
+
+  *data = map;
+  *len = info.st_size;
+  return true;
+}
+
+void imv_source_unmap_file(void *data, size_t len)
+{
+  if (data) {
+    munmap(data, len);
+  }
+}
+
+bool imv_source_token_cancelled(struct imv_source_token *token)
+{
+  pthread_mutex_lock(&token->lock);
+  bool cancelled = token->cancelled;
+  pthread_mutex_unlock(&token->lock);
+  return cancelled;
+}
+
+int imv_source_token_page(struct imv_source_token *token)
+{
+  pthread_mutex_lock(&token->lock);
+  const int page = token->page;
+  pthread_mutex_unlock(&token->lock);
+  return page;
+}
+
+bool imv_source_token_target_size(struct imv_source_token *token,
+    int *width, int *height)
+{
+  pthread_mutex_lock(&token->lock);
+  *width = token->target_width;
+  *height = token->target_height;
+  pthread_mutex_unlock(&token->lock);
+  return *width > 0 && *height > 0;
+}
+
+bool imv_source_token_want_partial(struct imv_source_token *token)
+{
+  pthread_mutex_lock(&token->lock);
+  const bool wanted = token->want_preview && !token->cancelled;
+  pthread_mutex_unlock(&token->lock);
+  return wanted;
+}
+
+void imv_source_token_send_partial(struct imv_source_token *token,
+    struct imv_image *image)
+{
+  if (!imv_source_token_want_partial(token)) {
+    imv_image_free(image);
+    return;
+  }
+
+  struct imv_source *src = token->source;
+  struct imv_source_message msg = {
+    .source = src,
+    .image = image,
+    .user_data = src->callback_data,
+    .preview = true,
+    .page_index = imv_source_token_page(token),
+  };
+  src->callback(&msg);
+}
+
+static void cancel(struct imv_source *src)
+{
+  pthread_mutex_lock(&src->token.lock);
+  src->token.cancelled = true;
+  pthread_mutex_unlock(&src->token.lock);
+}
+
+static struct imv_pool *g_pool;
+static pthread_once_t g_pool_once = PTHREAD_ONCE_INIT;
+
+static void create_pool(void)
+{
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads < 1) {
+    num_threads = 1;
+  } else if (num_threads > MAX_POOL_THREADS) {
+    num_threads = MAX_POOL_THREADS;
+  }
+  g_pool = imv_pool_create((int)num_threads);
+}
+
+/* All background work for sources shares a single pool of threads, created
+ * the first time it's needed */
+static struct imv_pool *get_pool(void)
+{
+  pthread_once(&g_pool_once, create_pool);
+  return g_pool;
+}
+
+/* Backends splitting up a decode get a pool of their own, as they're already
+ * running on one of the loading pool's threads, and waiting on jobs queued
+ * behind it could deadlock */
+static struct imv_pool *g_parallel_pool;
+static pthread_once_t g_parallel_pool_once = PTHREAD_ONCE_INIT;
+
+static void create_parallel_pool(void)
+{
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads < 1) {
+    num_threads = 1;
+  } else if (num_threads > MAX_PARALLEL_THREADS) {
+    num_threads = MAX_PARALLEL_THREADS;
+  }
+  g_parallel_pool = imv_pool_create((int)num_threads);
+}
+
+static struct imv_pool *get_parallel_pool(void)
+{
+  pthread_once(&g_parallel_pool_once, create_parallel_pool);
+  return g_parallel_pool;
+}
+
+int imv_source_parallel_threads(void)
+{
+  struct imv_pool *pool = get_parallel_pool();
+  return pool ? imv_pool_num_threads(pool) : 1;
+}
+
+struct parallel_run {
+  imv_source_parallel_func func;
+  void *data;
+
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  size_t left;
+};
+
+struct parallel_task {
+  struct parallel_run *run;
+  size_t index;
+};
+
+static void parallel_job(void *raw)
+{
+  struct parallel_task *task = raw;
+  struct parallel_run *run = task->run;
+  run->func(task->index, run->data);
+  free(task);
+
+  pthread_mutex_lock(&run->lock);
+  --run->left;
+  pthread_cond_signal(&run->finished);
+  pthread_mutex_unlock(&run->lock);
+}
+
+void imv_source_run_parallel(size_t count, imv_source_parallel_func func,
+    void *data)
+{
+  struct imv_pool *pool = get_parallel_pool();
+  if (!pool || count == 1) {
+    for (size_t i = 0; i < count; ++i) {
+      func(i, data);
+    }
+    return;
+  }
+
+  struct parallel_run run = {
+    .func = func,
+    .data = data,
+    .left = count,
+  };
+  pthread_mutex_init(&run.lock, NULL);
+  pthread_cond_init(&run.finished, NULL);
+
+  for (size_t i = 0; i < count; ++i) {
+    struct parallel_task *task = calloc(1, sizeof *task);
+    task->run = &run;
+    task->index = i;
+    imv_pool_push(pool, IMV_POOL_PRIORITY_NORMAL, parallel_job, task);
+  }
+
+  pthread_mutex_lock(&run.lock);
+  while (run.left > 0) {
+    pthread_cond_wait(&run.finished, &run.lock);
+  }
+  pthread_mutex_unlock(&run.lock);
+
+  pthread_cond_destroy(&run.finished);
+  pthread_mutex_destroy(&run.lock);
+}
+
+/* Guards the creation of thread context keys */
+static pthread_mutex_t context_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *imv_source_thread_context(struct imv_source_thread_context *context)
+{
+  pthread_mutex_lock(&context_lock);
+  if (!context->ready) {
+    context->ready = !pthread_key_create(&context->key, context->destroy);
+  }
+  const bool ready = context->ready;
+  pthread_mutex_unlock(&context_lock);
+  if (!ready) {
+    return NULL;
+  }
+
+  void *value = pthread_getspecific(context->key);
+  if (!value) {
+    value = context->create();
+    if (value && pthread_setspecific(context->key, value)) {
+      context->destroy(value);
+      value = NULL;
+    }
+  }
+  return value;
+}
+
+static enum imv_pool_priority load_priority(struct imv_source *src)
+{
+  return src->priority == IMV_SOURCE_PRIORITY_CURRENT
+    ? IMV_POOL_PRIORITY_HIGH
+    : IMV_POOL_PRIORITY_NORMAL;
+}
+
+static void free_job(void *src)
 {
   imv_source_free(src);
-  return NULL;
 }
 
 void imv_source_async_free(struct imv_source *src)
 {
-  pthread_t thread;
-  pthread_create(&thread, NULL, free_thread, src);
-  pthread_detach(thread);
+  struct imv_pool *pool = get_pool();
+  if (!pool) {
+    imv_source_free(src);
+    return;
+  }
+
+  /* Nothing the source is doing is wanted any more, so stop any load in
+   * progress as soon as possible, and drop any that haven't started yet */
+  cancel(src);
+  imv_pool_cancel(pool, NULL, src);
+  imv_pool_push(pool, IMV_POOL_PRIORITY_LOW, free_job, src);
 }
 
-static void *first_frame_thread(void *src)
+static void first_frame_job(void *src)
 {
   imv_source_load_first_frame(src);
-  return NULL;
 }
 
 void imv_source_async_load_first_frame(struct imv_source *src)
 {
-  pthread_t thread;
-  pthread_create(&thread, NULL, first_frame_thread, src);
-  pthread_detach(thread);
+  struct imv_pool *pool = get_pool();
+  if (!pool) {
+    imv_source_load_first_frame(src);
+    return;
+  }
+  imv_pool_push(pool, load_priority(src), first_frame_job, src);
 }
 
-static void *next_frame_thread(void *src)
+static void next_frame_job(void *src)
 {
   imv_source_load_next_frame(src);
-  return NULL;
 }
+
 void imv_source_async_load_next_frame(struct imv_source *src)
 {
-  pthread_t thread;
-  pthread_create(&thread, NULL, next_frame_thread, src);
-  pthread_detach(thread);
+  struct imv_pool *pool = get_pool();
+  if (!pool) {
+    imv_source_load_next_frame(src);
+    return;
+  }
+  imv_pool_push(pool, load_priority(src), next_frame_job, src);
+}
+
+static void region_job(void *raw_src)
+{
+  struct imv_source *src = raw_src;
+  pthread_mutex_lock(&src->token.lock);
+  const int x = src->region.x;
+  const int y = src->region.y;
+  const int width = src->region.width;
+  const int height = src->region.height;
+  const double scale = src->region.scale;
+  pthread_mutex_unlock(&src->token.lock);
+  imv_source_load_region(src, x, y, width, height, scale);
+}
+
+void imv_source_async_load_region(struct imv_source *src, int x, int y,
+    int width, int height, double scale)
+{
+  pthread_mutex_lock(&src->token.lock);
+  src->region.x = x;
+  src->region.y = y;
+  src->region.width = width;
+  src->region.height = height;
+  src->region.scale = scale;
+  pthread_mutex_unlock(&src->token.lock);
+
+  struct imv_pool *pool = get_pool();
+  if (!pool) {
+    imv_source_load_region(src, x, y, width, height, scale);
+    return;
+  }
+  /* A job that's yet to start would load the latest region too */
+  imv_pool_cancel(pool, region_job, src);
+  imv_pool_push(pool, load_priority(src), region_job, src);
+}
+
+void imv_source_set_priority(struct imv_source *src,
+    enum imv_source_priority priority)
+{
+  if (src->priority == priority) {
+    return;
+  }
+  src->priority = priority;
+
+  /* Previews are only worth producing for an image that's being looked at */
+  pthread_mutex_lock(&src->token.lock);
+  src->token.want_preview = priority == IMV_SOURCE_PRIORITY_CURRENT;
+  pthread_mutex_unlock(&src->token.lock);
+
+  struct imv_pool *pool = get_pool();
+  if (pool) {
+    imv_pool_set_priority(pool, src, load_priority(src));
+  }
+}
+
+void imv_source_set_target_size(struct imv_source *src, int width, int height)
+{
+  pthread_mutex_lock(&src->token.lock);
+  src->token.target_width = width;
+  src->token.target_height = height;
+  pthread_mutex_unlock(&src->token.lock);
+}
+
+int imv_source_page_count(struct imv_source *src)
+{
+  return src->vtable->page_count ? src->vtable->page_count(src->private) : 1;
+}
+
+void imv_source_set_page(struct imv_source *src, int page)
+{
+  pthread_mutex_lock(&src->token.lock);
+  src->token.page = page;
+  pthread_mutex_unlock(&src->token.lock);
 }
 
 void imv_source_free(struct imv_source *src)
 {
+  cancel(src);
   pthread_mutex_lock(&src->busy);
   src->vtable->free(src->private);
   pthread_mutex_unlock(&src->busy);
   pthread_mutex_destroy(&src->busy);
+  pthread_mutex_destroy(&src->token.lock);
   free(src);
 }
 
+static double cur_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Deliver the result of a load, unless nobody wants it any more. Called with
+ * busy held, as the source may be freed as soon as it's released. */
+static void finish_load(struct imv_source *src, struct imv_source_message *msg,
+    double started)
+{
+  const bool wanted = !imv_source_token_cancelled(&src->token);
+  imv_source_callback callback = src->callback;
+
+  pthread_mutex_unlock(&src->busy);
+
+  msg->sent_time = cur_time();
+  msg->decode_time = msg->sent_time - started;
+  if (wanted) {
+    callback(msg);
+  } else {
+    imv_image_free(msg->image);
+  }
+}
+
+/* Deliver a preview ahead of the first frame, if one is wanted and the
+ * backend can produce one. Called with busy held. */
+static void load_preview(struct imv_source *src)
+{
+  if (!src->vtable->load_preview || src->previewed) {
+    return;
+  }
+  src->previewed = true;
+
+  pthread_mutex_lock(&src->token.lock);
+  const bool wanted = src->token.want_preview;
+  pthread_mutex_unlock(&src->token.lock);
+  if (!wanted) {
+    return;
+  }
+
+  struct imv_source_message msg = {
+    .source = src,
+    .user_data = src->callback_data,
+    .preview = true,
+    .page_index = imv_source_token_page(&src->token),
+  };
+
+  src->vtable->load_preview(src->private, &msg.image, &src->token);
+
+  if (!msg.image) {
+    return;
+  }
+
+  if (imv_source_token_cancelled(&src->token)) {
+    imv_image_free(msg.image);
+    return;
+  }
+
+  src->callback(&msg);
+}
+
+static void get_frame_info(struct imv_source *src, struct imv_source_message *msg)
+{
+  if (msg->image && msg->frametime && src->vtable->frame_info) {
+    src->vtable->frame_info(src->private, &msg->frame_index, &msg->frame_count);
+  }
+}
+
 void imv_source_load_first_frame(struct imv_source *src)
 {
   if (!src->vtable->load_first_frame) {
@@ -90,16 +549,32 @@ void imv_source_load_first_frame(struct imv_source *src)
     return;
   }
 
+  if (imv_source_token_cancelled(&src->token)) {
+    pthread_mutex_unlock(&src->busy);
+    return;
+  }
+
+  load_preview(src);
+
   struct imv_source_message msg = {
     .source = src,
-    .user_data = src->callback_data
+    .user_data = src->callback_data,
+    .page_index = imv_source_token_page(&src->token),
   };
 
-  src->vtable->load_first_frame(src->private, &msg.image, &msg.frametime);
+  const double started = cur_time();
+  src->vtable->load_first_frame(src->private, &msg.image, &msg.frametime, &src->token);
 
-  pthread_mutex_unlock(&src->busy);
+  /* Still images may well be shown zoomed out, so it's worth having them
+   * ready to draw at small scales. Animation frames aren't around for long
+   * enough to pay for it. */
+  if (msg.image && msg.frametime == 0
+      && !imv_source_token_cancelled(&src->token)) {
+    imv_image_generate_mipmaps(msg.image);
+  }
 
-  src->callback(&msg);
+  get_frame_info(src, &msg);
+  finish_load(src, &msg, started);
 }
 
 void imv_source_load_next_frame(struct imv_source *src)
@@ -112,16 +587,60 @@ void imv_source_load_next_frame(struct imv_source *src)
     return;
   }
 
+  if (imv_source_token_cancelled(&src->token)) {
+    pthread_mutex_unlock(&src->busy);
+    return;
+  }
+
   struct imv_source_message msg = {
     .source = src,
-    .user_data = src->callback_data
+    .user_data = src->callback_data,
+    .page_index = imv_source_token_page(&src->token),
   };
 
-  src->vtable->load_next_frame(src->private, &msg.image, &msg.frametime);
+  const double started = cur_time();
+  src->vtable->load_next_frame(src->private, &msg.image, &msg.frametime, &src->token);
 
-  pthread_mutex_unlock(&src->busy);
+  get_frame_info(src, &msg);
+  finish_load(src, &msg, started);
+}
 
-  src->callback(&msg);
+bool imv_source_can_load_region(struct imv_source *src)
+{
+  return src->vtable->load_region != NULL;
+}
+
+void imv_source_load_region(struct imv_source *src, int x, int y,
+    int width, int height, double scale)
+{
+  if (!src->vtable->load_region) {
+    return;
+  }
+
+  struct imv_source_message msg = {
+    .source = src,
+    .user_data = src->callback_data,
+    .region = true,
+    .page_index = imv_source_token_page(&src->token),
+  };
+
+  /* Whoever asked still hears back if the source is busy, so they aren't
+   * left waiting */
+  imv_source_callback callback = src->callback;
+  if (pthread_mutex_trylock(&src->busy)) {
+    callback(&msg);
+    return;
+  }
+
+  if (imv_source_token_cancelled(&src->token)) {
+    pthread_mutex_unlock(&src->busy);
+    return;
+  }
+
+  const double started = cur_time();
+  src->vtable->load_region(src->private, x, y, width, height,
+      scale < 1.0 ? scale : 1.0, &msg.image, &src->token);
+  finish_load(src, &msg, started);
 }
 
 void imv_source_set_callback(struct imv_source *src, imv_source_callback callback,
@@ -1,6 +1,8 @@
 #ifndef IMV_SOURCE_H
 #define IMV_SOURCE_H
 
+#include <stdbool.h>
+
 /* While imv_image represents a single frame of an image, be it a bitmap or
  * vector image, imv_source represents an open handle to an image file, which
  * can emit one or more imv_images.
@@ -10,13 +12,45 @@ struct imv_source;
 struct imv_source_message;
 struct imv_image;
 
+/* Background work for all sources is shared between a fixed number of worker
+ * threads. Loads for the current source are performed ahead of any prefetch
+ * loads, and cleanup is performed last of all. */
+enum imv_source_priority {
+  IMV_SOURCE_PRIORITY_CURRENT,
+  IMV_SOURCE_PRIORITY_PREFETCH,
+};
+
+/* Set how urgently the source's background loads should be performed. Any
+ * loads already queued are moved to the new priority. Sources default to
+ * IMV_SOURCE_PRIORITY_CURRENT. */
+void imv_source_set_priority(struct imv_source *src, enum imv_source_priority priority);
+
+/* Set the size of the box the image will be shrunk to fit within. Backends
+ * that can decode at a reduced resolution cheaply may do so, as long as the
+ * result still reaches the edges of the box. A width or height of 0 asks for
+ * the full resolution. Takes effect from the next load to start. */
+void imv_source_set_target_size(struct imv_source *src, int width, int height);
+
+/* Get the number of pages in a file holding several separate images, such
+ * as a multi-page TIFF. It's 1 for everything else. */
+int imv_source_page_count(struct imv_source *src);
+
+/* Choose the page of a multi-page file that loads produce, counting from 0.
+ * Sources with a single page ignore it. Takes effect from the next load to
+ * start. */
+void imv_source_set_page(struct imv_source *src, int page);
+
 /* Clean up a source. Blocks if the source is active in the background. Async
- * version does not block, performing cleanup in another thread */
+ * version does not block, performing cleanup in another thread. Any async
+ * loads that have not started yet are dropped */
 void imv_source_async_free(struct imv_source *src);
 void imv_source_free(struct imv_source *src);
 
 /* Load the first frame. Silently aborts if source is already loading. Async
- * version performs loading in background. */
+ * version performs loading in background. The first time a source with
+ * IMV_SOURCE_PRIORITY_CURRENT loads, the callback may first be given a low
+ * resolution preview, if the backend can produce one quickly, and then
+ * partially decoded images as the load goes on, all marked as previews. */
 void imv_source_async_load_first_frame(struct imv_source *src);
 void imv_source_load_first_frame(struct imv_source *src);
 
@@ -25,6 +59,20 @@ void imv_source_load_first_frame(struct imv_source *src);
 void imv_source_async_load_next_frame(struct imv_source *src);
 void imv_source_load_next_frame(struct imv_source *src);
 
+/* Whether the source can load part of its image with imv_source_load_region */
+bool imv_source_can_load_region(struct imv_source *src);
+
+/* Load the part of the current page within a rectangle, given in full
+ * resolution pixels, at scale times the full resolution or finer. The
+ * callback is given the result marked as a region, with a NULL image if it
+ * failed, or if the source was busy with another load.
+ * Async version performs loading in background, and replaces any region load
+ * still queued, so only the latest of a quick succession is made. */
+void imv_source_async_load_region(struct imv_source *src, int x, int y,
+    int width, int height, double scale);
+void imv_source_load_region(struct imv_source *src, int x, int y,
+    int width, int height, double scale);
+
 typedef void (*imv_source_callback)(struct imv_source_message *message);
 
 /* Sets the callback function to be called when frame loading completes */
@@ -42,6 +90,28 @@ struct imv_source_message {
 
   /* If an animated gif, the frame's duration in milliseconds, else 0 */
   int frametime;
+
+  /* If an animated gif, the frame's position within the animation, counting
+   * from 0, and the number of frames in it. A frame_count of 0 means the
+   * number of frames isn't known. */
+  int frame_index;
+  int frame_count;
+
+  /* If true, image is a low resolution or partially decoded preview, and the
+   * first frame is still to follow. There may be several. */
+  bool preview;
+
+  /* If true, this is the result of imv_source_load_region, and image is
+   * part of the full image, or NULL if it couldn't be loaded */
+  bool region;
+
+  /* The page of a multi-page file the image is of, counting from 0 */
+  int page_index;
+
+  /* How long the backend took to produce the image, in seconds, and the
+   * CLOCK_MONOTONIC time the message was sent at */
+  double decode_time;
+  double sent_time;
 };
 
 #endif
@@ -1,9 +1,50 @@
 #ifndef IMV_SOURCE_PRIVATE_H
 #define IMV_SOURCE_PRIVATE_H
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
 struct imv_image;
 struct imv_source;
 
+/* A token is handed to a source's load functions. It carries hints about how
+ * the result is going to be used, and is cancelled when the result is no
+ * longer wanted, such as when the source is freed mid-load. Long running
+ * decodes should poll it between rows, strips, tiles or frames, and stop
+ * early, leaving image NULL, once it's cancelled.
+ */
+struct imv_source_token;
+
+/* Returns true if the load in progress should be abandoned */
+bool imv_source_token_cancelled(struct imv_source_token *token);
+
+/* Fetch the box the image will be shrunk to fit within, as set by
+ * imv_source_set_target_size. Returns false if the full resolution image is
+ * wanted. Backends that decode at a reduced resolution must still reach the
+ * edges of the box in at least one dimension, and create their image with
+ * imv_image_create_from_reduced_bitmap.
+ */
+bool imv_source_token_target_size(struct imv_source_token *token,
+    int *width, int *height);
+
+/* Fetch the page a multi-page source should load, counting from 0, as set by
+ * imv_source_set_page. A page past the end fails to load. */
+int imv_source_token_page(struct imv_source_token *token);
+
+/* Returns true if partial images sent with imv_source_token_send_partial
+ * would be shown, so that a backend needn't make them otherwise */
+bool imv_source_token_want_partial(struct imv_source_token *token);
+
+/* Deliver an image of what's been decoded so far, such as the rows read
+ * so far, or the coarse passes of an interlaced image, to be shown while the
+ * load goes on. The image must have the full image's dimensions, and isn't
+ * touched by the backend again, the rest of the load working on its own
+ * copy. Takes ownership of image. Only to be called from a load function.
+ */
+void imv_source_token_send_partial(struct imv_source_token *token,
+    struct imv_image *image);
+
 /* This is the interface a source needs to implement to function correctly.
  * Backends act as a "factory" for sources by calling imv_source_create
  * with a pointer to a static vtable, and a pointer to that implementation's
@@ -14,14 +55,52 @@ struct imv_source_vtable {
 
   /* Loads the first frame, if successful puts output in image and duration
    * (in milliseconds) in frametime. If unsuccessful, image shall be NULL. A
-   * still image should use a frametime of 0.
+   * still image should use a frametime of 0. If token is cancelled the load may
+   * be abandoned, as if unsuccessful.
+   */
+  void (*load_first_frame)(void *private, struct imv_image **image, int *frametime,
+      struct imv_source_token *token);
+
+  /* Optional. Loads a quick, low resolution stand-in for the first frame, such
+   * as an embedded thumbnail, to be shown while the first frame loads. The
+   * image should have the dimensions of the full image. If unsuccessful, or
+   * a preview wouldn't be much quicker than the real thing, image shall be
+   * NULL.
    */
-  void (*load_first_frame)(void *private, struct imv_image **image, int *frametime);
+  void (*load_preview)(void *private, struct imv_image **image,
+      struct imv_source_token *token);
 
   /* Loads the next frame, if successful puts output in image and duration
-   * (in milliseconds) in frametime. If unsuccessful, image shall be NULL.
+   * (in milliseconds) in frametime. If unsuccessful, image shall be NULL. If
+   * token is cancelled the load may be abandoned, as if unsuccessful.
+   */
+  void (*load_next_frame)(void *private, struct imv_image **image, int *frametime,
+      struct imv_source_token *token);
+
+  /* Optional. Loads part of the page chosen with imv_source_token_page: the
+   * rectangle given, in full resolution pixels, at scale times the full
+   * resolution or finer, up to the full resolution. The result may cover a
+   * little more than was asked, to line up with how the file is stored, and
+   * is created with imv_image_create_from_region. Lets images too large to
+   * decode all of at full resolution be looked at closely. If unsuccessful,
+   * image shall be NULL.
+   */
+  void (*load_region)(void *private, int x, int y, int width, int height,
+      double scale, struct imv_image **image, struct imv_source_token *token);
+
+  /* Optional. Gives the position of the frame last loaded within the
+   * animation, counting from 0, and the number of frames in it, or 0 if that
+   * isn't known. Called after each load.
+   */
+  void (*frame_info)(void *private, int *index, int *count);
+
+  /* Optional. Gives the number of pages in a file holding several separate
+   * images, such as a multi-page TIFF, each of which is loaded by
+   * load_first_frame once chosen with imv_source_token_page. The count
+   * mustn't change once the source is created, as it may be asked for from
+   * any thread, at any time.
    */
-  void (*load_next_frame)(void *private, struct imv_image **image, int *frametime);
+  int (*page_count)(void *private);
 
   /* Cleans up the private data of a source */
   void (*free)(void *private);
@@ -30,4 +109,51 @@ struct imv_source_vtable {
 /* Build a source given its vtable and a pointer to the private data */
 struct imv_source *imv_source_create(const struct imv_source_vtable *vt, void *private);
 
+/* Get the vtable a source was built with, to identify what kind it is */
+const struct imv_source_vtable *imv_source_get_vtable(const struct imv_source *src);
+
+/* Map the file at path into memory, read only, for a backend to decode from.
+ * The kernel is told it will be needed soon, so it starts reading it in
+ * straight away. Opening a prefetched neighbour then gets its data on the
+ * way well before it's decoded. Formats decoded from start to end should set
+ * sequential, so it can read further ahead. Returns false, with errno set, if
+ * it can't be opened or mapped.
+ */
+bool imv_source_map_file(const char *path, bool sequential, void **data,
+    size_t *len);
+
+/* Unmap a file mapped by imv_source_map_file */
+void imv_source_unmap_file(void *data, size_t len);
+
+typedef void (*imv_source_parallel_func)(size_t index, void *data);
+
+/* The number of threads imv_source_run_parallel spreads its calls over, which
+ * is how many pieces a decode is worth splitting into */
+int imv_source_parallel_threads(void);
+
+/* Call func with every index from 0 to count - 1, spread over a pool of
+ * threads shared by all backends, and wait for the calls to return. The calls
+ * may run in any order, and all at once. func mustn't call this itself.
+ */
+void imv_source_run_parallel(size_t count, imv_source_parallel_func func,
+    void *data);
+
+/* Something a backend keeps one of for each thread it decodes on, such as a
+ * decoder handle and scratch buffers, which would be costly to set up for
+ * every image. Declared statically by the backend, with only create and
+ * destroy filled in. The rest is set up the first time it's used.
+ */
+struct imv_source_thread_context {
+  void *(*create)(void);
+  /* called as the thread exits */
+  void (*destroy)(void *value);
+  bool ready;
+  pthread_key_t key;
+};
+
+/* Get the calling thread's value for a context, created on first use. The
+ * value's only ever used by that thread, so needs no locking. Returns NULL
+ * if it can't be created. */
+void *imv_source_thread_context(struct imv_source_thread_context *context);
+
 #endif
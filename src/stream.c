@@ -0,0 +1,216 @@
+#include "stream.h"
+
+#include "log.h"
+#include "source_private.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The buffer starts this big, and doubles each time it fills, so reading n
+ * bytes costs O(n) copying however they arrive */
+#define INITIAL_CAPACITY (64 * 1024)
+
+/* How often, in seconds, a waiting reader checks whether it's been
+ * cancelled */
+#define CANCEL_CHECK_INTERVAL 0.1
+
+struct imv_stream {
+  /* protects everything below */
+  pthread_mutex_t lock;
+
+  /* signalled when more data arrives, or the end is reached */
+  pthread_cond_t grown;
+
+  int refs;
+  int fd;
+
+  unsigned char *data;
+  size_t len;
+  size_t cap;
+
+  /* data is mapped from a regular file, rather than read into a buffer */
+  bool mapped;
+
+  /* nothing more is coming */
+  bool ended;
+};
+
+static void *read_thread(void *raw)
+{
+  struct imv_stream *stream = raw;
+
+  pthread_mutex_lock(&stream->lock);
+  while (!stream->ended) {
+    if (stream->len == stream->cap) {
+      const size_t cap = stream->cap ? stream->cap * 2 : INITIAL_CAPACITY;
+      unsigned char *data = realloc(stream->data, cap);
+      if (!data) {
+        imv_log(IMV_ERROR, "Out of memory reading from stdin\n");
+        break;
+      }
+      stream->data = data;
+      stream->cap = cap;
+    }
+
+    /* Everything else only touches what's already been read, so the lock
+     * needn't be held while waiting for more. Nothing can move or free the
+     * buffer meanwhile, as only this thread grows it, and it holds a
+     * reference. */
+    unsigned char *dest = stream->data + stream->len;
+    const size_t room = stream->cap - stream->len;
+    pthread_mutex_unlock(&stream->lock);
+    const ssize_t got = read(stream->fd, dest, room);
+    pthread_mutex_lock(&stream->lock);
+
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0) {
+      imv_log(IMV_ERROR, "Failed to read from stdin: %s\n", strerror(errno));
+    }
+    if (got <= 0) {
+      break;
+    }
+    stream->len += got;
+    pthread_cond_broadcast(&stream->grown);
+  }
+  stream->ended = true;
+  pthread_cond_broadcast(&stream->grown);
+  pthread_mutex_unlock(&stream->lock);
+
+  imv_stream_unref(stream);
+  return NULL;
+}
+
+struct imv_stream *imv_stream_create(int fd)
+{
+  struct imv_stream *stream = calloc(1, sizeof *stream);
+  pthread_mutex_init(&stream->lock, NULL);
+  pthread_cond_init(&stream->grown, NULL);
+  stream->refs = 1;
+  stream->fd = fd;
+
+  /* A regular file is all there already */
+  struct stat info;
+  if (!fstat(fd, &info) && S_ISREG(info.st_mode) && info.st_size > 0) {
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      stream->data = data;
+      stream->len = stream->cap = info.st_size;
+      stream->mapped = true;
+      stream->ended = true;
+      return stream;
+    }
+  }
+
+  /* The reader thread has a reference of its own, so the stream can be
+   * dropped while it's still blocked reading */
+  ++stream->refs;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, read_thread, stream)) {
+    --stream->refs;
+    stream->ended = true;
+  } else {
+    pthread_detach(thread);
+  }
+  return stream;
+}
+
+struct imv_stream *imv_stream_ref(struct imv_stream *stream)
+{
+  pthread_mutex_lock(&stream->lock);
+  ++stream->refs;
+  pthread_mutex_unlock(&stream->lock);
+  return stream;
+}
+
+void imv_stream_unref(struct imv_stream *stream)
+{
+  if (!stream) {
+    return;
+  }
+
+  pthread_mutex_lock(&stream->lock);
+  const bool last = --stream->refs == 0;
+  pthread_mutex_unlock(&stream->lock);
+  if (!last) {
+    return;
+  }
+
+  if (stream->mapped) {
+    munmap(stream->data, stream->cap);
+  } else {
+    free(stream->data);
+  }
+  close(stream->fd);
+  pthread_cond_destroy(&stream->grown);
+  pthread_mutex_destroy(&stream->lock);
+  free(stream);
+}
+
+void imv_stream_abort(struct imv_stream *stream)
+{
+  pthread_mutex_lock(&stream->lock);
+  stream->ended = true;
+  pthread_cond_broadcast(&stream->grown);
+  pthread_mutex_unlock(&stream->lock);
+}
+
+/* Must be called with the stream locked */
+static size_t available(struct imv_stream *stream, size_t offset)
+{
+  return offset < stream->len ? stream->len - offset : 0;
+}
+
+size_t imv_stream_read(struct imv_stream *stream, size_t offset, void *buf,
+    size_t len, struct imv_source_token *token)
+{
+  pthread_mutex_lock(&stream->lock);
+  while (!stream->ended && available(stream, offset) < len) {
+    if (!token) {
+      pthread_cond_wait(&stream->grown, &stream->lock);
+      continue;
+    }
+    if (imv_source_token_cancelled(token)) {
+      break;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += CANCEL_CHECK_INTERVAL * 1000000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&stream->grown, &stream->lock, &deadline);
+  }
+
+  size_t copied = available(stream, offset);
+  if (copied > len) {
+    copied = len;
+  }
+  if (copied > 0) {
+    memcpy(buf, stream->data + offset, copied);
+  }
+  pthread_mutex_unlock(&stream->lock);
+  return copied;
+}
+
+bool imv_stream_wait(struct imv_stream *stream, const void **data, size_t *len)
+{
+  pthread_mutex_lock(&stream->lock);
+  while (!stream->ended) {
+    pthread_cond_wait(&stream->grown, &stream->lock);
+  }
+  *data = stream->data;
+  *len = stream->len;
+  pthread_mutex_unlock(&stream->lock);
+  return *len > 0;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,47 @@
+#ifndef IMV_STREAM_H
+#define IMV_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct imv_source_token;
+
+/* imv_stream holds the data read from a file descriptor, such as stdin, that
+ * may still be arriving. A regular file is mapped into memory, anything else
+ * is read on a thread of its own, so that backends can start decoding before
+ * the end has been reached. Everything read is kept, so each reader can start
+ * from the beginning.
+ *
+ * Streams are reference counted, as sources decoding from one can outlive
+ * the code that opened them.
+ */
+struct imv_stream;
+
+/* Creates an imv_stream instance reading from fd, which it takes ownership
+ * of, with a single reference */
+struct imv_stream *imv_stream_create(int fd);
+
+/* Take another reference to the stream */
+struct imv_stream *imv_stream_ref(struct imv_stream *stream);
+
+/* Drop a reference, cleaning up the stream with the last one */
+void imv_stream_unref(struct imv_stream *stream);
+
+/* Stop waiting for more data, treating what's arrived so far as all there
+ * is. Wakes up any reader that's waiting. */
+void imv_stream_abort(struct imv_stream *stream);
+
+/* Copy up to len bytes from offset into buf, waiting for them to arrive.
+ * Returns fewer than len if the end comes first, or token is cancelled while
+ * waiting. token may be NULL. */
+size_t imv_stream_read(struct imv_stream *stream, size_t offset, void *buf,
+    size_t len, struct imv_source_token *token);
+
+/* Wait for the end of the stream, then return all of its data, which stays
+ * where it is for as long as the stream does. Returns false if nothing
+ * could be read. */
+bool imv_stream_wait(struct imv_stream *stream, const void **data, size_t *len);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
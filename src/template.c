@@ -0,0 +1,400 @@
+#include "template.h"
+
+#include "list.h"
+
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wordexp.h>
+
+/* Long enough for any path */
+#define MAX_VALUE_LEN 4096
+
+enum part_type {
+  PART_TEXT,
+  PART_VARIABLE,
+  /* unquoted whitespace, ending the word before it */
+  PART_BREAK,
+};
+
+struct part {
+  enum part_type type;
+  /* quoted text is taken literally, and never split or globbed */
+  bool quoted;
+  /* the text itself, or the variable's name */
+  char *text;
+  /* for variables, the value used by the last expansion */
+  char *value;
+};
+
+struct buffer {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+struct imv_template {
+  char *format;
+  /* the compiled format, or NULL if it has to go to wordexp */
+  struct list *parts;
+  struct buffer output;
+  bool expanded;
+};
+
+static void append(struct buffer *buf, const char *str, size_t len)
+{
+  if (buf->len + len + 1 > buf->cap) {
+    size_t cap = buf->cap ? buf->cap : 64;
+    while (buf->len + len + 1 > cap) {
+      cap *= 2;
+    }
+    buf->data = realloc(buf->data, cap);
+    buf->cap = cap;
+  }
+  memcpy(buf->data + buf->len, str, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+}
+
+static void reset(struct buffer *buf)
+{
+  buf->len = 0;
+  append(buf, "", 0);
+}
+
+static void add_part(struct list *parts, enum part_type type, bool quoted,
+    const char *text, size_t len)
+{
+  /* Runs of text with the same quoting are kept together */
+  if (type == PART_TEXT && parts->len > 0) {
+    struct part *last = parts->items[parts->len - 1];
+    if (last->type == PART_TEXT && last->quoted == quoted) {
+      const size_t old_len = strlen(last->text);
+      last->text = realloc(last->text, old_len + len + 1);
+      memcpy(last->text + old_len, text, len);
+      last->text[old_len + len] = '\0';
+      return;
+    }
+  }
+
+  struct part *part = calloc(1, sizeof *part);
+  part->type = type;
+  part->quoted = quoted;
+  part->text = strndup(text, len);
+  list_append(parts, part);
+}
+
+static bool is_name_start(char c)
+{
+  return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static bool is_name_char(char c)
+{
+  return is_name_start(c) || (c >= '0' && c <= '9');
+}
+
+/* Parse a $name or ${name} reference at str, returning the position after
+ * it, or NULL if it's anything more complicated */
+static const char *parse_variable(struct list *parts, const char *str, bool quoted)
+{
+  const bool braced = str[1] == '{';
+  const char *name = str + (braced ? 2 : 1);
+  const char *end = name;
+
+  if (!is_name_start(*end)) {
+    return NULL;
+  }
+  while (is_name_char(*end)) {
+    ++end;
+  }
+  if (braced && *end != '}') {
+    return NULL;
+  }
+
+  add_part(parts, PART_VARIABLE, quoted, name, end - name);
+  return braced ? end + 1 : end;
+}
+
+/* Parse the inside of a double quoted string, returning the position after
+ * its closing quote, or NULL if it can't be compiled */
+static const char *parse_double_quoted(struct list *parts, const char *str)
+{
+  /* Even an empty string makes a word */
+  add_part(parts, PART_TEXT, true, "", 0);
+
+  while (*str != '"') {
+    if (*str == '\0' || *str == '`') {
+      return NULL;
+    } else if (*str == '\\') {
+      if (str[1] == '\n') {
+        return NULL;
+      } else if (str[1] && strchr("$`\"\\", str[1])) {
+        add_part(parts, PART_TEXT, true, str + 1, 1);
+        str += 2;
+      } else {
+        add_part(parts, PART_TEXT, true, str, 1);
+        ++str;
+      }
+    } else if (*str == '$') {
+      str = parse_variable(parts, str, true);
+      if (!str) {
+        return NULL;
+      }
+    } else {
+      add_part(parts, PART_TEXT, true, str, 1);
+      ++str;
+    }
+  }
+  return str + 1;
+}
+
+static void free_parts(struct list *parts)
+{
+  if (!parts) {
+    return;
+  }
+  for (size_t i = 0; i < parts->len; ++i) {
+    struct part *part = parts->items[i];
+    free(part->text);
+    free(part->value);
+    free(part);
+  }
+  list_free(parts);
+}
+
+/* Returns the compiled format, or NULL if it's beyond us */
+static struct list *parse(const char *format)
+{
+  struct list *parts = list_create();
+  bool word_start = true;
+
+  const char *str = format;
+  while (*str) {
+    const char c = *str;
+    if (c == ' ' || c == '\t') {
+      add_part(parts, PART_BREAK, false, "", 0);
+      word_start = true;
+      ++str;
+      continue;
+    }
+
+    /* Tilde expansion and comments only happen at the start of a word */
+    if (word_start && (c == '~' || c == '#')) {
+      goto unsupported;
+    }
+    word_start = false;
+
+    if (c == '\\') {
+      if (str[1] == '\0' || str[1] == '\n') {
+        goto unsupported;
+      }
+      add_part(parts, PART_TEXT, true, str + 1, 1);
+      str += 2;
+    } else if (c == '\'') {
+      const char *end = strchr(str + 1, '\'');
+      if (!end) {
+        goto unsupported;
+      }
+      add_part(parts, PART_TEXT, true, str + 1, end - str - 1);
+      str = end + 1;
+    } else if (c == '"') {
+      str = parse_double_quoted(parts, str + 1);
+    } else if (c == '$') {
+      str = parse_variable(parts, str, false);
+    } else if (strchr("\n|&;<>(){}`", c)) {
+      /* Errors, or needing a shell */
+      goto unsupported;
+    } else {
+      add_part(parts, PART_TEXT, false, str, 1);
+      ++str;
+    }
+
+    if (!str) {
+      goto unsupported;
+    }
+  }
+
+  return parts;
+
+unsupported:
+  free_parts(parts);
+  return NULL;
+}
+
+struct imv_template *imv_template_create(const char *format)
+{
+  struct imv_template *tmpl = calloc(1, sizeof *tmpl);
+  tmpl->format = strdup(format);
+  tmpl->parts = parse(format);
+  reset(&tmpl->output);
+  return tmpl;
+}
+
+void imv_template_free(struct imv_template *tmpl)
+{
+  if (!tmpl) {
+    return;
+  }
+  free_parts(tmpl->parts);
+  free(tmpl->format);
+  free(tmpl->output.data);
+  free(tmpl);
+}
+
+bool imv_template_uses_shell(struct imv_template *tmpl)
+{
+  return !tmpl->parts;
+}
+
+/* The word being built during an expansion */
+struct word {
+  struct buffer text;
+  /* the same word as a glob pattern, with quoted characters escaped */
+  struct buffer pattern;
+  bool started;
+  bool glob;
+};
+
+static void add_to_word(struct word *word, const char *str, size_t len, bool quoted)
+{
+  append(&word->text, str, len);
+  for (size_t i = 0; i < len; ++i) {
+    const bool special = strchr("*?[]\\", str[i]) != NULL;
+    if (quoted && special) {
+      append(&word->pattern, "\\", 1);
+    } else if (!quoted && special && str[i] != ']' && str[i] != '\\') {
+      word->glob = true;
+    }
+    append(&word->pattern, str + i, 1);
+  }
+  word->started = true;
+}
+
+/* Finish the word, writing it to out followed by a space, as wordexp's
+ * words are joined */
+static void end_word(struct word *word, struct buffer *out)
+{
+  if (!word->started) {
+    return;
+  }
+
+  glob_t matches;
+  if (word->glob && glob(word->pattern.data, 0, NULL, &matches) == 0) {
+    for (size_t i = 0; i < matches.gl_pathc; ++i) {
+      append(out, matches.gl_pathv[i], strlen(matches.gl_pathv[i]));
+      append(out, " ", 1);
+    }
+    globfree(&matches);
+  } else {
+    append(out, word->text.data, word->text.len);
+    append(out, " ", 1);
+  }
+
+  reset(&word->text);
+  reset(&word->pattern);
+  word->started = false;
+  word->glob = false;
+}
+
+static void build(struct imv_template *tmpl, struct buffer *out)
+{
+  struct word word = {0};
+  reset(&word.text);
+  reset(&word.pattern);
+
+  for (size_t i = 0; i < tmpl->parts->len; ++i) {
+    const struct part *part = tmpl->parts->items[i];
+    if (part->type == PART_BREAK) {
+      end_word(&word, out);
+    } else if (part->type == PART_TEXT || part->quoted) {
+      const char *text = part->type == PART_TEXT ? part->text : part->value;
+      add_to_word(&word, text, strlen(text), part->quoted);
+    } else {
+      /* Unquoted values are split into words on whitespace */
+      for (const char *c = part->value; *c; ++c) {
+        if (*c == ' ' || *c == '\t' || *c == '\n') {
+          end_word(&word, out);
+        } else {
+          add_to_word(&word, c, 1, false);
+        }
+      }
+    }
+  }
+  end_word(&word, out);
+
+  free(word.text.data);
+  free(word.pattern.data);
+}
+
+static void expand_with_shell(struct imv_template *tmpl, struct buffer *out)
+{
+  wordexp_t word;
+  if (wordexp(tmpl->format, &word, 0) == 0) {
+    for (size_t i = 0; i < word.we_wordc; ++i) {
+      append(out, word.we_wordv[i], strlen(word.we_wordv[i]));
+      append(out, " ", 1);
+    }
+    wordfree(&word);
+  } else {
+    const char *error = "error expanding text";
+    append(out, error, strlen(error));
+  }
+}
+
+const char *imv_template_expand(struct imv_template *tmpl,
+    imv_template_lookup lookup, void *data, bool *changed)
+{
+  if (!tmpl->parts) {
+    struct buffer out = {0};
+    reset(&out);
+    expand_with_shell(tmpl, &out);
+    const bool differs = !tmpl->expanded || strcmp(out.data, tmpl->output.data);
+    free(tmpl->output.data);
+    tmpl->output = out;
+    tmpl->expanded = true;
+    if (changed) {
+      *changed = differs;
+    }
+    return tmpl->output.data;
+  }
+
+  /* Only rebuild if a variable's value has changed */
+  bool differs = !tmpl->expanded;
+  char value[MAX_VALUE_LEN];
+  for (size_t i = 0; i < tmpl->parts->len; ++i) {
+    struct part *part = tmpl->parts->items[i];
+    if (part->type != PART_VARIABLE) {
+      continue;
+    }
+
+    if (!lookup || !lookup(part->text, value, sizeof value, data)) {
+      const char *env = getenv(part->text);
+      snprintf(value, sizeof value, "%s", env ? env : "");
+    }
+
+    if (!part->value || strcmp(part->value, value)) {
+      free(part->value);
+      part->value = strdup(value);
+      differs = true;
+    }
+  }
+
+  if (differs) {
+    struct buffer out = {0};
+    reset(&out);
+    build(tmpl, &out);
+    differs = !tmpl->expanded || strcmp(out.data, tmpl->output.data);
+    free(tmpl->output.data);
+    tmpl->output = out;
+    tmpl->expanded = true;
+  }
+
+  if (changed) {
+    *changed = differs;
+  }
+  return tmpl->output.data;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
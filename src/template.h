@@ -0,0 +1,41 @@
+#ifndef IMV_TEMPLATE_H
+#define IMV_TEMPLATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* imv_template is a format string, such as the window title or overlay text,
+ * compiled for repeated expansion. Formats are expanded as a shell would a
+ * list of words, with the words joined by spaces. Those made up of plain
+ * text, quoting and $variable or ${variable} references are expanded
+ * directly, and only rebuilt when the value of a variable they use has
+ * changed. Anything else, such as command substitution, is handed to
+ * wordexp every time.
+ */
+struct imv_template;
+
+/* Looks up the value of a variable, writing it to buf. Returns false if the
+ * variable isn't one of the caller's, in which case it's taken from the
+ * environment. */
+typedef bool (*imv_template_lookup)(const char *name, char *buf, size_t len,
+    void *data);
+
+/* Compile a format string */
+struct imv_template *imv_template_create(const char *format);
+
+/* Clean up a template */
+void imv_template_free(struct imv_template *tmpl);
+
+/* Returns true if the template is expanded by wordexp, which only sees the
+ * environment. The caller must export its variables before expanding it. */
+bool imv_template_uses_shell(struct imv_template *tmpl);
+
+/* Expand the template, looking up variables with lookup. The result remains
+ * valid until the next expansion. If changed is given, it's set to whether
+ * the result differs from the last expansion. */
+const char *imv_template_expand(struct imv_template *tmpl,
+    imv_template_lookup lookup, void *data, bool *changed);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
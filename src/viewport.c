@@ -2,6 +2,11 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <time.h>
+
+/* A view that's been dragged counts as moving for this long after, in
+ * seconds, as the next drag is likely to follow soon */
+#define DRAG_SETTLE_TIME 0.1
 
 struct imv_viewport {
   double scale;
@@ -18,12 +23,76 @@ struct imv_viewport {
   int redraw;
   int playing;
   int locked;
+  /* how long a zoom or pan glides for, 0 to make them instant */
+  double transition_time;
+  /* x, y and scale are on their way from one place to another */
+  struct {
+    bool active;
+    double start;
+    double from_x, from_y, from_scale;
+    double to_x, to_y, to_scale;
+  } transition;
+  /* when the view was last dragged, and whether it was moving when last
+   * animated */
+  double dragged;
+  bool moving;
 };
 
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Make the view's current position where it's headed, gliding there from
+ * where it was drawn last */
+static void begin_transition(struct imv_viewport *view,
+    double from_x, double from_y, double from_scale)
+{
+  if (view->transition_time <= 0.0) {
+    return;
+  }
+  view->transition.active = true;
+  view->transition.start = now();
+  view->transition.from_x = from_x;
+  view->transition.from_y = from_y;
+  view->transition.from_scale = from_scale;
+  view->transition.to_x = view->x;
+  view->transition.to_y = view->y;
+  view->transition.to_scale = view->scale;
+  view->x = from_x;
+  view->y = from_y;
+  view->scale = from_scale;
+}
+
+/* Jump to where any transition was headed, so a change can start from
+ * there. Its starting point is kept in from, for the change to glide from. */
+static void finish_transition(struct imv_viewport *view,
+    double *from_x, double *from_y, double *from_scale)
+{
+  *from_x = view->x;
+  *from_y = view->y;
+  *from_scale = view->scale;
+  if (view->transition.active) {
+    view->x = view->transition.to_x;
+    view->y = view->transition.to_y;
+    view->scale = view->transition.to_scale;
+    view->transition.active = false;
+  }
+}
+
+/* Anything that puts the view somewhere directly stops it gliding */
+static void stop_transition(struct imv_viewport *view)
+{
+  view->transition.active = false;
+}
+
 static void input_xy_to_render_xy(struct imv_viewport *view, int *x, int *y)
 {
-  *x *= view->buffer.width / view->window.width;
-  *y *= view->buffer.height / view->window.height;
+  /* Buffers can be a fractional multiple of the window's size */
+  *x = *x * (double)view->buffer.width / view->window.width;
+  *y = *y * (double)view->buffer.height / view->window.height;
 }
 
 struct imv_viewport *imv_viewport_create(int window_width, int window_height,
@@ -41,6 +110,10 @@ struct imv_viewport *imv_viewport_create(int window_width, int window_height,
   view->pan_factor_x = view->pan_factor_y = 0.5;
   view->playing = 1;
   view->locked = 0;
+  view->transition_time = 0.0;
+  view->transition.active = false;
+  view->dragged = 0.0;
+  view->moving = false;
   return view;
 }
 
@@ -64,8 +137,50 @@ void imv_viewport_toggle_playing(struct imv_viewport *view)
   view->playing = !view->playing;
 }
 
+void imv_viewport_set_transition_time(struct imv_viewport *view, double seconds)
+{
+  view->transition_time = seconds > 0.0 ? seconds : 0.0;
+}
+
+bool imv_viewport_animate(struct imv_viewport *view)
+{
+  const double time = now();
+  if (view->transition.active) {
+    const double t = (time - view->transition.start) / view->transition_time;
+    if (t >= 1.0) {
+      view->x = view->transition.to_x;
+      view->y = view->transition.to_y;
+      view->scale = view->transition.to_scale;
+      view->transition.active = false;
+    } else {
+      /* Easing out, so it starts straight away, and settles gently. Offset
+       * and scale move together, which keeps the point zoomed about in
+       * place, as the offset is linear in the scale. */
+      const double u = 1.0 - t;
+      const double e = 1.0 - u * u * u;
+      const double from_x = view->transition.from_x;
+      const double from_y = view->transition.from_y;
+      const double from_scale = view->transition.from_scale;
+      view->x = from_x + (view->transition.to_x - from_x) * e;
+      view->y = from_y + (view->transition.to_y - from_y) * e;
+      view->scale = from_scale + (view->transition.to_scale - from_scale) * e;
+    }
+    view->redraw = 1;
+  }
+
+  const bool moving = view->transition.active
+    || time - view->dragged < DRAG_SETTLE_TIME;
+  if (view->moving && !moving) {
+    /* Once more now it's still, at full quality */
+    view->redraw = 1;
+  }
+  view->moving = moving;
+  return moving;
+}
+
 void imv_viewport_scale_to_actual(struct imv_viewport *view, const struct imv_image *image)
 {
+  stop_transition(view);
   view->scale = 1;
   view->redraw = 1;
   view->locked = 1;
@@ -82,6 +197,16 @@ void imv_viewport_get_offset(struct imv_viewport *view, int *x, int *y)
   }
 }
 
+void imv_viewport_get_buffer_size(struct imv_viewport *view, int *width, int *height)
+{
+  if(width) {
+    *width = view->buffer.width;
+  }
+  if(height) {
+    *height = view->buffer.height;
+  }
+}
+
 void imv_viewport_get_scale(struct imv_viewport *view, double *scale)
 {
   if(scale) {
@@ -109,10 +234,10 @@ void imv_viewport_set_default_pan_factor(struct imv_viewport *view, double pan_f
   view->pan_factor_y = pan_factor_y;
 }
 
-void imv_viewport_move(struct imv_viewport *view, int x, int y,
+/* Offset the view, without letting the image get too far off-screen */
+static void offset_view(struct imv_viewport *view, int x, int y,
     const struct imv_image *image)
 {
-  input_xy_to_render_xy(view, &x, &y);
   view->x += x;
   view->y += y;
   view->redraw = 1;
@@ -133,9 +258,53 @@ void imv_viewport_move(struct imv_viewport *view, int x, int y,
   }
 }
 
+void imv_viewport_move(struct imv_viewport *view, int x, int y,
+    const struct imv_image *image)
+{
+  input_xy_to_render_xy(view, &x, &y);
+  view->dragged = now();
+
+  /* The image follows the pointer exactly, so a transition under way is
+   * moved along with it, as far as where it's headed can go */
+  if (view->transition.active) {
+    const int shown_x = view->x;
+    const int shown_y = view->y;
+    const double shown_scale = view->scale;
+    view->x = view->transition.to_x;
+    view->y = view->transition.to_y;
+    view->scale = view->transition.to_scale;
+    offset_view(view, x, y, image);
+    const int dx = view->x - view->transition.to_x;
+    const int dy = view->y - view->transition.to_y;
+    view->transition.to_x += dx;
+    view->transition.to_y += dy;
+    view->transition.from_x += dx;
+    view->transition.from_y += dy;
+    view->x = shown_x + dx;
+    view->y = shown_y + dy;
+    view->scale = shown_scale;
+    return;
+  }
+  offset_view(view, x, y, image);
+}
+
+void imv_viewport_pan(struct imv_viewport *view, int x, int y,
+    const struct imv_image *image)
+{
+  input_xy_to_render_xy(view, &x, &y);
+  double from_x, from_y, from_scale;
+  finish_transition(view, &from_x, &from_y, &from_scale);
+  offset_view(view, x, y, image);
+  begin_transition(view, from_x, from_y, from_scale);
+}
+
 void imv_viewport_zoom(struct imv_viewport *view, const struct imv_image *image,
                        enum imv_zoom_source src, int mouse_x, int mouse_y, int amount)
 {
+  /* Successive steps add up, each starting from where the last was headed */
+  double from_x, from_y, from_scale;
+  finish_transition(view, &from_x, &from_y, &from_scale);
+
   double prev_scale = view->scale;
   int x, y;
 
@@ -194,6 +363,8 @@ void imv_viewport_zoom(struct imv_viewport *view, const struct imv_image *image,
 
   view->redraw = 1;
   view->locked = 1;
+
+  begin_transition(view, from_x, from_y, from_scale);
 }
 
 void imv_viewport_rotate_by(struct imv_viewport *view, double degrees) {
@@ -223,6 +394,7 @@ void imv_viewport_center(struct imv_viewport *view, const struct imv_image *imag
   const int image_width = imv_image_width(image);
   const int image_height = imv_image_height(image);
 
+  stop_transition(view);
   view->x = view->buffer.width - image_width * view->scale;
   view->y = view->buffer.height - image_height * view->scale;
 
@@ -39,6 +39,9 @@ void imv_viewport_toggle_playing(struct imv_viewport *view);
 /* Fetch viewport offset/position */
 void imv_viewport_get_offset(struct imv_viewport *view, int *x, int *y);
 
+/* Fetch the size of the buffer being rendered to */
+void imv_viewport_get_buffer_size(struct imv_viewport *view, int *width, int *height);
+
 /* Fetch viewport scale */
 void imv_viewport_get_scale(struct imv_viewport *view, double *scale);
 
@@ -51,13 +54,28 @@ void imv_viewport_get_mirrored(struct imv_viewport *view, bool *mirrored);
 /* Set the default pan_factor factor for the x and y position */
 void imv_viewport_set_default_pan_factor(struct imv_viewport *view, double pan_factor_x, double pan_factor_y);
 
+/* Set how long zooming and panning take to glide to where they're headed,
+ * in seconds. 0, the default, makes them instant. */
+void imv_viewport_set_transition_time(struct imv_viewport *view, double seconds);
+
+/* Move the view along any transition under way, to where it should be drawn
+ * now. Returns whether it's in motion, either gliding or being dragged, when
+ * it can be drawn in less detail, as it'll soon be drawn again. The frame
+ * after it comes to rest is always redrawn. */
+bool imv_viewport_animate(struct imv_viewport *view);
+
 /* Pan the view by the given amounts without letting the image get too far
- * off-screen */
+ * off-screen, straight away, as for dragging */
 void imv_viewport_move(struct imv_viewport *view, int x, int y,
     const struct imv_image *image);
 
-/* Zoom the view by the given amount. imv_image* is used to get the image
- * dimensions */
+/* Pan the view by the given amounts like imv_viewport_move, but gliding
+ * there, as for a key press */
+void imv_viewport_pan(struct imv_viewport *view, int x, int y,
+    const struct imv_image *image);
+
+/* Zoom the view by the given amount, gliding there. imv_image* is used to get
+ * the image dimensions */
 void imv_viewport_zoom(struct imv_viewport *view, const struct imv_image *image,
                        enum imv_zoom_source, int mouse_x, int mouse_y, int amount);
 
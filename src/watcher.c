@@ -0,0 +1,254 @@
+#include "watcher.h"
+
+#include "list.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef IMV_HAVE_INOTIFY
+#include <limits.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+/* A rename into place is a new file as much as one written in place is, and
+ * attribute changes cover touch(1), which used to trigger a reload when the
+ * file was polled */
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB)
+#endif
+
+struct watch {
+  int wd;
+  /* the directory's canonical path */
+  char *dir;
+  /* new files in the directory are wanted, not just the current one */
+  bool new_files;
+};
+
+struct imv_watcher {
+  int fd;
+  struct list *watches;
+  /* the name of the file being watched, and the watch on its directory */
+  char *file;
+  struct watch *file_watch;
+};
+
+struct imv_watcher *imv_watcher_create(void)
+{
+  struct imv_watcher *watcher = calloc(1, sizeof *watcher);
+  watcher->watches = list_create();
+#ifdef IMV_HAVE_INOTIFY
+  watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+  watcher->fd = -1;
+#endif
+  return watcher;
+}
+
+static void free_watch(struct watch *watch)
+{
+  free(watch->dir);
+  free(watch);
+}
+
+void imv_watcher_free(struct imv_watcher *watcher)
+{
+  if (!watcher) {
+    return;
+  }
+#ifdef IMV_HAVE_INOTIFY
+  if (watcher->fd != -1) {
+    close(watcher->fd);
+  }
+#endif
+  for (size_t i = 0; i < watcher->watches->len; ++i) {
+    free_watch(watcher->watches->items[i]);
+  }
+  list_free(watcher->watches);
+  free(watcher->file);
+  free(watcher);
+}
+
+int imv_watcher_fd(struct imv_watcher *watcher)
+{
+  return watcher->fd;
+}
+
+#ifdef IMV_HAVE_INOTIFY
+
+static struct watch *find_watch(struct imv_watcher *watcher, int wd)
+{
+  for (size_t i = 0; i < watcher->watches->len; ++i) {
+    struct watch *watch = watcher->watches->items[i];
+    if (watch->wd == wd) {
+      return watch;
+    }
+  }
+  return NULL;
+}
+
+static void forget_watch(struct imv_watcher *watcher, struct watch *watch)
+{
+  for (size_t i = 0; i < watcher->watches->len; ++i) {
+    if (watcher->watches->items[i] == watch) {
+      list_remove(watcher->watches, i);
+      break;
+    }
+  }
+  if (watcher->file_watch == watch) {
+    watcher->file_watch = NULL;
+  }
+  free_watch(watch);
+}
+
+/* Watch a directory, or find the existing watch on it. The same directory
+ * always gets the same wd, however it's named. */
+static struct watch *add_watch(struct imv_watcher *watcher, const char *dir)
+{
+  if (watcher->fd == -1) {
+    return NULL;
+  }
+
+  const int wd = inotify_add_watch(watcher->fd, dir, WATCH_MASK | IN_ONLYDIR);
+  if (wd == -1) {
+    return NULL;
+  }
+
+  struct watch *watch = find_watch(watcher, wd);
+  if (!watch) {
+    watch = calloc(1, sizeof *watch);
+    watch->wd = wd;
+    watch->dir = realpath(dir, NULL);
+    if (!watch->dir) {
+      watch->dir = strdup(dir);
+    }
+    list_append(watcher->watches, watch);
+  }
+  return watch;
+}
+
+static void stop_watching_file(struct imv_watcher *watcher)
+{
+  struct watch *watch = watcher->file_watch;
+  if (watch && !watch->new_files) {
+    inotify_rm_watch(watcher->fd, watch->wd);
+    forget_watch(watcher, watch);
+  }
+  watcher->file_watch = NULL;
+  free(watcher->file);
+  watcher->file = NULL;
+}
+
+bool imv_watcher_watch_file(struct imv_watcher *watcher, const char *path)
+{
+  const char *last_sep = strrchr(path, '/');
+  if (!last_sep) {
+    stop_watching_file(watcher);
+    return false;
+  }
+
+  char *dir = last_sep == path ? strdup("/") : strndup(path, last_sep - path);
+  struct watch *watch = add_watch(watcher, dir);
+  free(dir);
+
+  if (watch != watcher->file_watch) {
+    stop_watching_file(watcher);
+  }
+  free(watcher->file);
+  watcher->file = NULL;
+  watcher->file_watch = watch;
+  if (!watch) {
+    return false;
+  }
+  watcher->file = strdup(last_sep + 1);
+  return true;
+}
+
+bool imv_watcher_watch_dir(struct imv_watcher *watcher, const char *path)
+{
+  struct watch *watch = add_watch(watcher, path);
+  if (watch) {
+    watch->new_files = true;
+  }
+  return watch != NULL;
+}
+
+void imv_watcher_dispatch(struct imv_watcher *watcher,
+    imv_watcher_callback callback, void *data)
+{
+  if (watcher->fd == -1) {
+    return;
+  }
+
+  /* Big enough for at least one event with the longest name */
+  union {
+    struct inotify_event event;
+    char bytes[sizeof(struct inotify_event) + NAME_MAX + 1];
+  } buf[8];
+
+  ssize_t len;
+  while ((len = read(watcher->fd, buf, sizeof buf)) > 0) {
+    const char *pos = (const char *)buf;
+    const char *end = pos + len;
+    while (pos < end) {
+      const struct inotify_event *event = (const struct inotify_event *)pos;
+      pos += sizeof *event + event->len;
+
+      struct watch *watch = find_watch(watcher, event->wd);
+      if (!watch) {
+        continue;
+      }
+      if (event->mask & IN_IGNORED) {
+        /* The directory's gone */
+        forget_watch(watcher, watch);
+        continue;
+      }
+      if (!event->len) {
+        continue;
+      }
+
+      const size_t dir_len = strlen(watch->dir);
+      const bool sep = dir_len == 0 || watch->dir[dir_len - 1] != '/';
+      char *path = malloc(dir_len + sep + strlen(event->name) + 1);
+      strcpy(path, watch->dir);
+      if (sep) {
+        strcat(path, "/");
+      }
+      strcat(path, event->name);
+
+      if (watch == watcher->file_watch && !strcmp(event->name, watcher->file)) {
+        callback(IMV_WATCH_CHANGED, path, data);
+      } else if (watch->new_files && !(event->mask & IN_ATTRIB)) {
+        callback(IMV_WATCH_ADDED, path, data);
+      }
+      free(path);
+    }
+  }
+}
+
+#else
+
+bool imv_watcher_watch_file(struct imv_watcher *watcher, const char *path)
+{
+  (void)watcher;
+  (void)path;
+  return false;
+}
+
+bool imv_watcher_watch_dir(struct imv_watcher *watcher, const char *path)
+{
+  (void)watcher;
+  (void)path;
+  return false;
+}
+
+void imv_watcher_dispatch(struct imv_watcher *watcher,
+    imv_watcher_callback callback, void *data)
+{
+  (void)watcher;
+  (void)callback;
+  (void)data;
+}
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,49 @@
+#ifndef IMV_WATCHER_H
+#define IMV_WATCHER_H
+
+#include <stdbool.h>
+
+/* imv_watcher uses inotify to be told when the current file changes, or new
+ * files are written to a directory, rather than checking for them. Where
+ * inotify isn't available, nothing can be watched, and the caller has to
+ * fall back on polling.
+ */
+struct imv_watcher;
+
+enum imv_watch_event {
+  /* the file given to imv_watcher_watch_file changed */
+  IMV_WATCH_CHANGED,
+  /* a file was written to, or moved into, a directory given to
+   * imv_watcher_watch_dir */
+  IMV_WATCH_ADDED,
+};
+
+typedef void (*imv_watcher_callback)(enum imv_watch_event event,
+    const char *path, void *data);
+
+/* Creates an imv_watcher instance */
+struct imv_watcher *imv_watcher_create(void);
+
+/* Cleans up an imv_watcher instance */
+void imv_watcher_free(struct imv_watcher *watcher);
+
+/* Returns a file descriptor that's readable when there are events to
+ * dispatch, or -1 if nothing can be watched */
+int imv_watcher_fd(struct imv_watcher *watcher);
+
+/* Watch path for changes, instead of whichever file was watched before.
+ * Returns false if it can't be watched. */
+bool imv_watcher_watch_file(struct imv_watcher *watcher, const char *path);
+
+/* Watch the directory at path for new files, for as long as it exists.
+ * Returns false if it can't be watched. */
+bool imv_watcher_watch_dir(struct imv_watcher *watcher, const char *path);
+
+/* Call callback for each event that has arrived, without blocking. The
+ * callback mustn't change what's being watched. */
+void imv_watcher_dispatch(struct imv_watcher *watcher,
+    imv_watcher_callback callback, void *data);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
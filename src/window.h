@@ -13,6 +13,7 @@ enum imv_event_type {
   IMV_EVENT_MOUSE_MOTION,
   IMV_EVENT_MOUSE_BUTTON,
   IMV_EVENT_MOUSE_SCROLL,
+  IMV_EVENT_FRAME,
   IMV_EVENT_CUSTOM
 };
 
@@ -76,12 +77,19 @@ bool imv_window_get_mouse_button(struct imv_window *window, int button);
 /* Gets the mouse's position */
 void imv_window_get_mouse_position(struct imv_window *window, double *x, double *y);
 
-/* Swap the framebuffers. Present anything rendered since the last call. */
+/* Swap the framebuffers. Present anything rendered since the last call. Once
+ * the display is ready for another frame, an IMV_EVENT_FRAME is pushed. Frames
+ * presented before then may be dropped, or block until the display catches up.
+ */
 void imv_window_present(struct imv_window *window);
 
 /* Blocks until an event is received, or the timeout (in seconds) expires */
 void imv_window_wait_for_event(struct imv_window *window, double timeout);
 
+/* Also wake imv_window_wait_for_event when fd becomes readable, replacing
+ * any fd given before. -1 stops it. */
+void imv_window_watch_fd(struct imv_window *window, int fd);
+
 /* Push an event to the event queue. An internal copy of the event is made.
  * Wakes up imv_window_wait_for_event */
 void imv_window_push_event(struct imv_window *window, struct imv_event *e);
@@ -1,11 +1,10 @@
 #include "window.h"
 
+#include "event_queue.h"
 #include "keyboard.h"
 #include "list.h"
 
 #include <assert.h>
-#include <fcntl.h>
-#include <limits.h>
 #include <poll.h>
 #include <signal.h>
 #include <string.h>
@@ -16,6 +15,8 @@
 #include <wayland-egl.h>
 #include <EGL/egl.h>
 #include <GL/gl.h>
+#include "fractional-scale-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
 #include "xdg-shell-client-protocol.h"
 
 struct imv_window {
@@ -29,10 +30,15 @@ struct imv_window {
   struct wl_seat       *wl_seat;
   struct wl_keyboard   *wl_keyboard;
   struct wl_pointer    *wl_pointer;
+  struct wp_viewporter *wp_viewporter;
+  struct wp_viewport   *wp_viewport;
+  struct wp_fractional_scale_manager_v1 *wp_fractional_scale_manager;
+  struct wp_fractional_scale_v1 *wp_fractional_scale;
   EGLDisplay           egl_display;
   EGLContext           egl_context;
   EGLSurface           egl_surface;
   struct wl_egl_window *egl_window;
+  struct wl_callback   *frame_callback;
 
   bool xdg_configured;
 
@@ -40,7 +46,8 @@ struct imv_window {
   struct list *wl_outputs;
 
   int display_fd;
-  int pipe_fds[2];
+  struct imv_event_queue *events;
+  int watch_fd;
 
   timer_t timer_id;
   int repeat_scancode; /* scancode of key to repeat */
@@ -50,7 +57,9 @@ struct imv_window {
   int width;
   int height;
   bool fullscreen;
-  int scale;
+  double scale;
+  uint32_t preferred_scale; /* 120ths, or 0 until the compositor says */
+  bool opaque; /* the EGL config has no alpha, so nothing shows through */
 
   struct {
     struct {
@@ -79,15 +88,6 @@ struct output_data {
   bool contains_window;
 };
 
-static void set_nonblocking(int fd)
-{
-  int flags = fcntl(fd, F_GETFL);
-  assert(flags != -1);
-  flags |= O_NONBLOCK;
-  int rc = fcntl(fd, F_SETFL, flags);
-  assert(rc != -1);
-}
-
 static void handle_ping_xdg_wm_base(void *data, struct xdg_wm_base *xdg,
     uint32_t serial)
 {
@@ -516,6 +516,12 @@ static void on_global(void *data, struct wl_registry *registry, uint32_t id,
     wl_output_set_user_data(output_data->wl_output, output_data);
     wl_output_add_listener(output_data->wl_output, &output_listener, output_data);
     list_append(window->wl_outputs, output_data);
+  } else if (!strcmp(interface, "wp_viewporter")) {
+    window->wp_viewporter =
+      wl_registry_bind(registry, id, &wp_viewporter_interface, 1);
+  } else if (!strcmp(interface, "wp_fractional_scale_manager_v1")) {
+    window->wp_fractional_scale_manager =
+      wl_registry_bind(registry, id, &wp_fractional_scale_manager_v1_interface, 1);
   }
 }
 
@@ -526,40 +532,79 @@ static void on_remove_global(void *data, struct wl_registry *registry, uint32_t
   (void)id;
 }
 
+/* The buffer is the surface size at the window's scale, which is rounded
+ * the same way the compositor rounds fractionally scaled surfaces */
+static void get_buffer_size(struct imv_window *window, int *w, int *h)
+{
+  *w = window->width * window->scale + 0.5;
+  *h = window->height * window->scale + 0.5;
+}
+
+static void resize_buffer(struct imv_window *window)
+{
+  int buffer_width, buffer_height;
+  get_buffer_size(window, &buffer_width, &buffer_height);
+  wl_egl_window_resize(window->egl_window, buffer_width, buffer_height, 0, 0);
+  glViewport(0, 0, buffer_width, buffer_height);
+  if (window->wp_viewport && window->width > 0 && window->height > 0) {
+    /* Fractionally scaled buffers are mapped back onto the surface by the
+     * viewport, rather than by the buffer scale, which stays at 1 */
+    wp_viewport_set_destination(window->wp_viewport,
+        window->width, window->height);
+  }
+
+  /* With an XRGB buffer every pixel is opaque, and saying so lets the
+   * compositor skip what's beneath, or scan a fullscreen window out
+   * directly. A buffer with alpha may really be translucent. */
+  if (window->opaque) {
+    struct wl_region *opaque = wl_compositor_create_region(window->wl_compositor);
+    wl_region_add(opaque, 0, 0, window->width, window->height);
+    wl_surface_set_opaque_region(window->wl_surface, opaque);
+    wl_region_destroy(opaque);
+  } else {
+    wl_surface_set_opaque_region(window->wl_surface, NULL);
+  }
+
+  struct imv_event e = {
+    .type = IMV_EVENT_RESIZE,
+    .data = {
+      .resize = {
+        .width = window->width,
+        .height = window->height,
+        .buffer_width = buffer_width,
+        .buffer_height = buffer_height
+      }
+    }
+  };
+  imv_window_push_event(window, &e);
+}
+
 static void update_scale(struct imv_window *window)
 {
   if (!window->xdg_configured) {
     return;
   }
-  int new_scale = 1;
-  for (size_t i = 0; i < window->wl_outputs->len; ++i) {
-    struct output_data *data = window->wl_outputs->items[i];
-    if (data->contains_window && data->scale > new_scale) {
-      new_scale = data->scale;
+  double new_scale = 1;
+  if (window->wp_fractional_scale) {
+    if (window->preferred_scale) {
+      new_scale = window->preferred_scale / 120.0;
+    }
+  } else {
+    for (size_t i = 0; i < window->wl_outputs->len; ++i) {
+      struct output_data *data = window->wl_outputs->items[i];
+      if (data->contains_window && data->scale > new_scale) {
+        new_scale = data->scale;
+      }
     }
   }
 
   if (new_scale != window->scale) {
     window->scale = new_scale;
-    wl_surface_set_buffer_scale(window->wl_surface, window->scale);
+    if (!window->wp_fractional_scale) {
+      wl_surface_set_buffer_scale(window->wl_surface, (int)window->scale);
+    }
+    resize_buffer(window);
     wl_surface_commit(window->wl_surface);
-    size_t buffer_width = window->width * window->scale;
-    size_t buffer_height = window->height * window->scale;
-    wl_egl_window_resize(window->egl_window, buffer_width, buffer_height, 0, 0);
-    glViewport(0, 0, buffer_width, buffer_height);
-
-    struct imv_event e = {
-      .type = IMV_EVENT_RESIZE,
-      .data = {
-        .resize = {
-          .width = window->width,
-          .height = window->height,
-          .buffer_width = buffer_width,
-          .buffer_height = buffer_height
-        }
-      }
-    };
-    imv_window_push_event(window, &e);
   }
 }
 
@@ -604,6 +649,19 @@ static const struct xdg_surface_listener shell_surface_listener = {
   .configure = surface_configure
 };
 
+static void fractional_scale_preferred(void *data,
+    struct wp_fractional_scale_v1 *fractional_scale, uint32_t scale)
+{
+  (void)fractional_scale;
+  struct imv_window *window = data;
+  window->preferred_scale = scale;
+  update_scale(window);
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+  .preferred_scale = fractional_scale_preferred
+};
+
 static void toplevel_configure(void *data, struct xdg_toplevel *toplevel,
     int width, int height, struct wl_array *states)
 {
@@ -620,23 +678,7 @@ static void toplevel_configure(void *data, struct xdg_toplevel *toplevel,
       window->fullscreen = true;
     }
   }
-  size_t buffer_width = window->width * window->scale;
-  size_t buffer_height = window->height * window->scale;
-  wl_egl_window_resize(window->egl_window, buffer_width, buffer_height, 0, 0);
-  glViewport(0, 0, buffer_width, buffer_height);
-
-  struct imv_event e = {
-    .type = IMV_EVENT_RESIZE,
-    .data = {
-      .resize = {
-        .width = width,
-        .height = height,
-        .buffer_width = width * window->scale,
-        .buffer_height = height * window->scale
-      }
-    }
-  };
-  imv_window_push_event(window, &e);
+  resize_buffer(window);
 }
 
 static void toplevel_close(void *data, struct xdg_toplevel *toplevel)
@@ -660,9 +702,8 @@ static void connect_to_wayland(struct imv_window *window)
   window->wl_display = wl_display_connect(NULL);
   assert(window->wl_display);
   window->display_fd = wl_display_get_fd(window->wl_display);
-  pipe(window->pipe_fds);
-  set_nonblocking(window->pipe_fds[0]);
-  set_nonblocking(window->pipe_fds[1]);
+  window->events = imv_event_queue_create();
+  window->watch_fd = -1;
 
   window->wl_registry = wl_display_get_registry(window->wl_display);
   assert(window->wl_registry);
@@ -677,26 +718,96 @@ static void connect_to_wayland(struct imv_window *window)
   eglInitialize(window->egl_display, NULL, NULL);
 }
 
-static void create_window(struct imv_window *window, int width, int height,
-    const char *title)
+/* Configs with an alpha channel get ARGB buffers, which the compositor has
+ * to blend with whatever's underneath, and which blending onto leaves
+ * translucent wherever a translucent image is drawn. Everything imv draws is
+ * over an opaque background, so an XRGB buffer that can go straight to the
+ * screen is chosen where there is one. */
+static EGLBoolean choose_config(EGLDisplay display, const EGLint *attributes,
+    EGLConfig *config)
+{
+  EGLConfig configs[64];
+  EGLint num_config = 0;
+  if (!eglChooseConfig(display, attributes, configs, 64, &num_config)
+      || num_config <= 0) {
+    return EGL_FALSE;
+  }
+  *config = configs[0];
+  for (EGLint i = 0; i < num_config; ++i) {
+    EGLint alpha = 0;
+    if (eglGetConfigAttrib(display, configs[i], EGL_ALPHA_SIZE, &alpha)
+        && alpha == 0) {
+      *config = configs[i];
+      break;
+    }
+  }
+  return EGL_TRUE;
+}
+
+/* Desktop OpenGL is preferred, but where the driver only offers OpenGL ES
+ * a GLES 3 context is used instead, which the canvas can also draw with */
+static EGLContext create_context(EGLDisplay display, EGLConfig *config)
 {
-  eglBindAPI(EGL_OPENGL_API);
-  EGLint attributes[] = {
+  EGLint gl_attributes[] = {
     EGL_RED_SIZE,   8,
     EGL_GREEN_SIZE, 8,
     EGL_BLUE_SIZE,  8,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
     EGL_NONE
   };
+  if (eglBindAPI(EGL_OPENGL_API)
+      && choose_config(display, gl_attributes, config)) {
+    EGLContext context = eglCreateContext(display, *config, EGL_NO_CONTEXT, NULL);
+    if (context != EGL_NO_CONTEXT) {
+      return context;
+    }
+  }
+
+  EGLint gles_attributes[] = {
+    EGL_RED_SIZE,   8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE,  8,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+    EGL_NONE
+  };
+  EGLint context_attributes[] = {
+    EGL_CONTEXT_CLIENT_VERSION, 3,
+    EGL_NONE
+  };
+  if (eglBindAPI(EGL_OPENGL_ES_API)
+      && choose_config(display, gles_attributes, config)) {
+    return eglCreateContext(display, *config, EGL_NO_CONTEXT, context_attributes);
+  }
+  return EGL_NO_CONTEXT;
+}
+
+static void create_window(struct imv_window *window, int width, int height,
+    const char *title)
+{
   EGLConfig config;
-  EGLint num_config;
-  eglChooseConfig(window->egl_display, attributes, &config, 1, &num_config);
-  window->egl_context = eglCreateContext(window->egl_display, config, EGL_NO_CONTEXT, NULL);
-  assert(window->egl_context);
+  window->egl_context = create_context(window->egl_display, &config);
+  assert(window->egl_context != EGL_NO_CONTEXT);
+  EGLint alpha = 0;
+  window->opaque = eglGetConfigAttrib(window->egl_display, config,
+      EGL_ALPHA_SIZE, &alpha) && alpha == 0;
 
   window->wl_surface = wl_compositor_create_surface(window->wl_compositor);
   assert(window->wl_surface);
   wl_surface_add_listener(window->wl_surface, &surface_listener, window);
 
+  /* Rendering at fractional scales needs both the scale and a viewport to
+   * map the buffer onto the surface, otherwise integer buffer scales are
+   * used */
+  if (window->wp_viewporter && window->wp_fractional_scale_manager) {
+    window->wp_viewport =
+      wp_viewporter_get_viewport(window->wp_viewporter, window->wl_surface);
+    window->wp_fractional_scale =
+      wp_fractional_scale_manager_v1_get_fractional_scale(
+          window->wp_fractional_scale_manager, window->wl_surface);
+    wp_fractional_scale_v1_add_listener(window->wp_fractional_scale,
+        &fractional_scale_listener, window);
+  }
+
   window->wl_xdg_surface = xdg_wm_base_get_xdg_surface(window->wl_xdg, window->wl_surface);
   assert(window->wl_xdg_surface);
 
@@ -712,6 +823,9 @@ static void create_window(struct imv_window *window, int width, int height,
   window->egl_window = wl_egl_window_create(window->wl_surface, width, height);
   window->egl_surface = eglCreateWindowSurface(window->egl_display, config, window->egl_window, NULL);
   eglMakeCurrent(window->egl_display, window->egl_surface, window->egl_surface, window->egl_context);
+  /* Presentation is paced by frame callbacks, so swapping mustn't also block
+   * on them */
+  eglSwapInterval(window->egl_display, 0);
 
   wl_surface_commit(window->wl_surface);
   wl_display_roundtrip(window->wl_display);
@@ -719,8 +833,7 @@ static void create_window(struct imv_window *window, int width, int height,
 
 static void shutdown_wayland(struct imv_window *window)
 {
-  close(window->pipe_fds[0]);
-  close(window->pipe_fds[1]);
+  imv_event_queue_free(window->events);
   if (window->wl_pointer) {
     wl_pointer_destroy(window->wl_pointer);
   }
@@ -739,10 +852,25 @@ static void shutdown_wayland(struct imv_window *window)
   if (window->wl_xdg) {
     xdg_wm_base_destroy(window->wl_xdg);
   }
+  if (window->wp_fractional_scale) {
+    wp_fractional_scale_v1_destroy(window->wp_fractional_scale);
+  }
+  if (window->wp_fractional_scale_manager) {
+    wp_fractional_scale_manager_v1_destroy(window->wp_fractional_scale_manager);
+  }
+  if (window->wp_viewport) {
+    wp_viewport_destroy(window->wp_viewport);
+  }
+  if (window->wp_viewporter) {
+    wp_viewporter_destroy(window->wp_viewporter);
+  }
   if (window->egl_window) {
     wl_egl_window_destroy(window->egl_window);
   }
   eglTerminate(window->egl_display);
+  if (window->frame_callback) {
+    wl_callback_destroy(window->frame_callback);
+  }
   if (window->wl_surface) {
     wl_surface_destroy(window->wl_surface);
   }
@@ -765,9 +893,6 @@ static void on_timer(union sigval sigval)
 
 struct imv_window *imv_window_create(int width, int height, const char *title)
 {
-  /* Ensure event writes will always be atomic */
-  assert(sizeof(struct imv_event) <= PIPE_BUF);
-
   struct imv_window *window = calloc(1, sizeof *window);
   window->scale = 1;
 
@@ -816,11 +941,13 @@ void imv_window_get_size(struct imv_window *window, int *w, int *h)
 
 void imv_window_get_framebuffer_size(struct imv_window *window, int *w, int *h)
 {
+  int buffer_width, buffer_height;
+  get_buffer_size(window, &buffer_width, &buffer_height);
   if (w) {
-    *w = window->width * window->scale;
+    *w = buffer_width;
   }
   if (h) {
-    *h = window->height * window->scale;
+    *h = buffer_height;
   }
 }
 
@@ -861,18 +988,50 @@ void imv_window_get_mouse_position(struct imv_window *window, double *x, double
   }
 }
 
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+  (void)time;
+  struct imv_window *window = data;
+  wl_callback_destroy(callback);
+  window->frame_callback = NULL;
+
+  struct imv_event e = {
+    .type = IMV_EVENT_FRAME,
+  };
+  imv_window_push_event(window, &e);
+}
+
+static const struct wl_callback_listener frame_listener = {
+  .done = frame_done
+};
+
 void imv_window_present(struct imv_window *window)
 {
-  if (window->xdg_configured) {
-    eglSwapBuffers(window->egl_display, window->egl_surface);
+  if (!window->xdg_configured) {
+    /* Nothing will be shown, so there's no sense waiting on the display */
+    struct imv_event e = {
+      .type = IMV_EVENT_FRAME,
+    };
+    imv_window_push_event(window, &e);
+    return;
+  }
+
+  /* Ask to be told when it's a good time to draw the next frame. The request
+   * goes out with the commit made by eglSwapBuffers. */
+  if (!window->frame_callback) {
+    window->frame_callback = wl_surface_frame(window->wl_surface);
+    wl_callback_add_listener(window->frame_callback, &frame_listener, window);
   }
+  eglSwapBuffers(window->egl_display, window->egl_surface);
 }
 
 void imv_window_wait_for_event(struct imv_window *window, double timeout)
 {
   struct pollfd fds[] = {
     {.fd = window->display_fd,  .events = POLLIN},
-    {.fd = window->pipe_fds[0], .events = POLLIN}
+    {.fd = imv_event_queue_fd(window->events), .events = POLLIN},
+    /* poll ignores it while it's -1 */
+    {.fd = window->watch_fd, .events = POLLIN}
   };
   nfds_t nfds = sizeof fds / sizeof *fds;
 
@@ -895,10 +1054,14 @@ void imv_window_wait_for_event(struct imv_window *window, double timeout)
   }
 }
 
+void imv_window_watch_fd(struct imv_window *window, int fd)
+{
+  window->watch_fd = fd;
+}
+
 void imv_window_push_event(struct imv_window *window, struct imv_event *e)
 {
-  /* Push it down the pipe */
-  write(window->pipe_fds[1], e, sizeof *e);
+  imv_event_queue_push(window->events, e);
 }
 
 void imv_window_pump_events(struct imv_window *window, imv_event_handler handler, void *data)
@@ -907,11 +1070,9 @@ void imv_window_pump_events(struct imv_window *window, imv_event_handler handler
 
   while (1) {
     struct imv_event e;
-    ssize_t len = read(window->pipe_fds[0], &e, sizeof e);
-    if (len <= 0) {
+    if (!imv_event_queue_pop(window->events, &e)) {
       break;
     }
-    assert(len == sizeof e);
     if (handler) {
       handler(data, &e);
     }
@@ -1,8 +1,6 @@
 #include "window.h"
 
 #include <assert.h>
-#include <fcntl.h>
-#include <limits.h>
 #include <poll.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,6 +14,7 @@
 #include <xcb/xcb.h>
 #include <xkbcommon/xkbcommon-x11.h>
 
+#include "event_queue.h"
 #include "keyboard.h"
 #include "log.h"
 
@@ -38,18 +37,10 @@ struct imv_window {
   } pointer;
 
   struct imv_keyboard *keyboard;
-  int pipe_fds[2];
+  struct imv_event_queue *events;
+  int watch_fd;
 };
 
-static void set_nonblocking(int fd)
-{
-  int flags = fcntl(fd, F_GETFL);
-  assert(flags != -1);
-  flags |= O_NONBLOCK;
-  int rc = fcntl(fd, F_SETFL, flags);
-  assert(rc != -1);
-}
-
 static void setup_keymap(struct imv_window *window)
 {
   xcb_connection_t *conn = xcb_connect(NULL, NULL);
@@ -91,17 +82,37 @@ static void setup_keymap(struct imv_window *window)
   xcb_disconnect(conn);
 }
 
-struct imv_window *imv_window_create(int w, int h, const char *title)
+/* Sync swaps to the display's refresh, through whichever extension the
+ * driver provides */
+static void set_swap_interval(struct imv_window *window, int interval)
 {
-  /* Ensure event writes will always be atomic */
-  assert(sizeof(struct imv_event) <= PIPE_BUF);
+  typedef void (*swap_interval_ext)(Display*, GLXDrawable, int);
+  typedef int (*swap_interval_mesa)(unsigned int);
+
+  swap_interval_ext ext = (swap_interval_ext)
+    glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalEXT");
+  if (ext) {
+    ext(window->x_display, window->x_window, interval);
+    return;
+  }
+
+  swap_interval_mesa mesa = (swap_interval_mesa)
+    glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalMESA");
+  if (mesa) {
+    mesa(interval);
+    return;
+  }
 
+  imv_log(IMV_DEBUG, "x11_window: no way to set the swap interval\n");
+}
+
+struct imv_window *imv_window_create(int w, int h, const char *title)
+{
   struct imv_window *window = calloc(1, sizeof *window);
   window->pointer.last.x = -1;
   window->pointer.last.y = -1;
-  pipe(window->pipe_fds);
-  set_nonblocking(window->pipe_fds[0]);
-  set_nonblocking(window->pipe_fds[1]);
+  window->events = imv_event_queue_create();
+  window->watch_fd = -1;
 
   window->x_display = XOpenDisplay(NULL);
   assert(window->x_display);
@@ -145,6 +156,7 @@ struct imv_window *imv_window_create(int w, int h, const char *title)
   window->x_glc = glXCreateContext(window->x_display, vi, NULL, GL_TRUE);
   assert(window->x_glc);
   glXMakeCurrent(window->x_display, window->x_window, window->x_glc);
+  set_swap_interval(window, 1);
 
   window->keyboard = imv_keyboard_create();
   assert(window->keyboard);
@@ -159,8 +171,7 @@ struct imv_window *imv_window_create(int w, int h, const char *title)
 void imv_window_free(struct imv_window *window)
 {
   imv_keyboard_free(window->keyboard);
-  close(window->pipe_fds[0]);
-  close(window->pipe_fds[1]);
+  imv_event_queue_free(window->events);
   glXMakeCurrent(window->x_display, None, NULL);
   glXDestroyContext(window->x_display, window->x_glc);
   XDestroyWindow(window->x_display, window->x_window);
@@ -265,24 +276,38 @@ void imv_window_get_mouse_position(struct imv_window *window, double *x, double
 
 void imv_window_present(struct imv_window *window)
 {
+  /* With a swap interval of 1 this returns once the swap has been scheduled
+   * for the next refresh, which is as good a time as any to start the next
+   * frame */
   glXSwapBuffers(window->x_display, window->x_window);
+
+  struct imv_event e = {
+    .type = IMV_EVENT_FRAME,
+  };
+  imv_window_push_event(window, &e);
 }
 
 void imv_window_wait_for_event(struct imv_window *window, double timeout)
 {
   struct pollfd fds[] = {
     {.fd = ConnectionNumber(window->x_display), .events = POLLIN},
-    {.fd = window->pipe_fds[0], .events = POLLIN}
+    {.fd = imv_event_queue_fd(window->events), .events = POLLIN},
+    /* poll ignores it while it's -1 */
+    {.fd = window->watch_fd, .events = POLLIN}
   };
   nfds_t nfds = sizeof fds / sizeof *fds;
 
   poll(fds, nfds, timeout * 1000);
 }
 
+void imv_window_watch_fd(struct imv_window *window, int fd)
+{
+  window->watch_fd = fd;
+}
+
 void imv_window_push_event(struct imv_window *window, struct imv_event *e)
 {
-  /* Push it down the pipe */
-  write(window->pipe_fds[1], e, sizeof *e);
+  imv_event_queue_push(window->events, e);
 }
 
 static void handle_keyboard(struct imv_window *window, imv_event_handler handler, void *data, const XEvent *xev)
@@ -415,14 +440,12 @@ void imv_window_pump_events(struct imv_window *window, imv_event_handler handler
     }
   }
 
-  /* Handle any events in the pipe */
+  /* Handle any queued events */
   while (1) {
     struct imv_event e;
-    ssize_t len = read(window->pipe_fds[0], &e, sizeof e);
-    if (len <= 0) {
+    if (!imv_event_queue_pop(window->events, &e)) {
       break;
     }
-    assert(len == sizeof e);
     if (handler) {
       handler(data, &e);
     }
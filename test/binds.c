@@ -0,0 +1,172 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <unistd.h>
+#include "binds.h"
+#include "commands.h"
+#include "list.h"
+
+struct calls {
+  int count;
+  char argstr[64];
+  size_t args;
+};
+
+static void record(struct list *args, const char *argstr, void *data)
+{
+  struct calls *calls = data;
+  ++calls->count;
+  snprintf(calls->argstr, sizeof calls->argstr, "%s", argstr);
+  calls->args = args->len;
+}
+
+static void bind(struct imv_binds *binds, const char *keys, const char *command)
+{
+  struct list *list = imv_bind_parse_keys(keys);
+  assert_int_equal(imv_binds_add(binds, list, command), BIND_SUCCESS);
+  list_deep_free(list);
+}
+
+static void test_bind_sequence(void **state)
+{
+  (void)state;
+  struct imv_commands *commands = imv_commands_create();
+  imv_command_register(commands, "zoom", &record);
+  struct imv_binds *binds = imv_binds_create(commands);
+  struct calls calls = {0};
+
+  bind(binds, "gg", "zoom 1");
+  bind(binds, "<Shift+G>", "zoom -1");
+
+  assert_null(imv_bind_handle_event(binds, "g"));
+  assert_int_equal(imv_bind_input_buffer(binds)->len, 1);
+  const struct list *cmds = imv_bind_handle_event(binds, "g");
+  assert_non_null(cmds);
+  assert_int_equal(imv_bind_input_buffer(binds)->len, 0);
+  assert_int_equal(imv_command_exec_list(cmds, &calls), 0);
+  assert_int_equal(calls.count, 1);
+  assert_string_equal(calls.argstr, "1");
+
+  /* A key that doesn't continue the sequence starts it afresh */
+  assert_null(imv_bind_handle_event(binds, "g"));
+  assert_null(imv_bind_handle_event(binds, "x"));
+  cmds = imv_bind_handle_event(binds, "Shift+G");
+  assert_non_null(cmds);
+  assert_int_equal(imv_command_exec_list(cmds, &calls), 0);
+  assert_int_equal(calls.count, 2);
+  assert_string_equal(calls.argstr, "-1");
+
+  imv_binds_free(binds);
+  imv_commands_free(commands);
+}
+
+static void test_compiled_alias(void **state)
+{
+  (void)state;
+  struct imv_commands *commands = imv_commands_create();
+  imv_command_register(commands, "slideshow", &record);
+  imv_command_alias(commands, "ss", "slideshow");
+  struct calls calls = {0};
+
+  struct imv_compiled_command *compiled = imv_command_compile(commands, "ss +1");
+  for (int i = 0; i < 3; ++i) {
+    assert_int_equal(imv_command_exec_compiled(compiled, &calls), 0);
+  }
+  assert_int_equal(calls.count, 3);
+  assert_int_equal(calls.args, 2);
+  assert_false(strncmp(calls.argstr, "+1", 2));
+  imv_compiled_command_free(compiled);
+
+  /* Unknown commands compile, but fail to run */
+  compiled = imv_command_compile(commands, "nonsense");
+  assert_int_equal(imv_command_exec_compiled(compiled, &calls), 1);
+  imv_compiled_command_free(compiled);
+
+  assert_int_equal(imv_command_exec(commands, "slideshow", &calls), 0);
+  assert_string_equal(calls.argstr, "");
+
+  imv_commands_free(commands);
+}
+
+static void test_bind_before_alias(void **state)
+{
+  (void)state;
+  struct imv_commands *commands = imv_commands_create();
+  imv_command_register(commands, "slideshow", &record);
+  struct imv_binds *binds = imv_binds_create(commands);
+  struct calls calls = {0};
+
+  /* As when a [binds] section comes before the [aliases] section */
+  bind(binds, "s", "ss +1");
+  bind(binds, "n", "nonsense");
+  imv_command_alias(commands, "ss", "slideshow");
+
+  for (int i = 0; i < 2; ++i) {
+    const struct list *cmds = imv_bind_handle_event(binds, "s");
+    assert_non_null(cmds);
+    assert_int_equal(imv_command_exec_list(cmds, &calls), 0);
+  }
+  assert_int_equal(calls.count, 2);
+  assert_int_equal(calls.args, 2);
+  assert_false(strncmp(calls.argstr, "+1", 2));
+
+  const struct list *cmds = imv_bind_handle_event(binds, "n");
+  assert_non_null(cmds);
+  assert_int_equal(imv_command_exec_list(cmds, &calls), 1);
+  imv_command_register(commands, "nonsense", &record);
+  assert_int_equal(imv_command_exec_list(cmds, &calls), 0);
+  assert_int_equal(calls.count, 3);
+
+  imv_binds_free(binds);
+  imv_commands_free(commands);
+}
+
+static struct imv_binds *clearing_binds;
+
+static void clear_binds(struct list *args, const char *argstr, void *data)
+{
+  (void)args;
+  (void)argstr;
+  imv_binds_clear(clearing_binds);
+  record(args, argstr, data);
+}
+
+static void test_rebind_while_running(void **state)
+{
+  (void)state;
+  struct imv_commands *commands = imv_commands_create();
+  imv_command_register(commands, "clear", &clear_binds);
+  imv_command_register(commands, "zoom", &record);
+  struct imv_binds *binds = imv_binds_create(commands);
+  clearing_binds = binds;
+  struct calls calls = {0};
+
+  bind(binds, "c", "clear");
+  bind(binds, "c", "zoom 2");
+
+  /* The rest of the bind still runs, after it's been unbound */
+  const struct list *cmds = imv_bind_handle_event(binds, "c");
+  assert_non_null(cmds);
+  assert_int_equal(imv_command_exec_list(cmds, &calls), 0);
+  assert_int_equal(calls.count, 2);
+  assert_string_equal(calls.argstr, "2");
+  assert_null(imv_bind_handle_event(binds, "c"));
+
+  imv_binds_free(binds);
+  imv_commands_free(commands);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_bind_sequence),
+    cmocka_unit_test(test_compiled_alias),
+    cmocka_unit_test(test_bind_before_alias),
+    cmocka_unit_test(test_rebind_while_running),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
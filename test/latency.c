@@ -0,0 +1,82 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+
+#include "latency.h"
+
+static void test_empty(void **state)
+{
+  (void)state;
+  struct imv_latency *latency = imv_latency_create();
+
+  assert_true(imv_latency_last(latency, IMV_LATENCY_DECODE) == 0.0);
+  assert_true(imv_latency_percentile(latency, IMV_LATENCY_DECODE, 50.0) == 0.0);
+
+  imv_latency_free(latency);
+}
+
+static void test_percentiles(void **state)
+{
+  (void)state;
+  struct imv_latency *latency = imv_latency_create();
+
+  /* Out of order, so they have to be sorted */
+  for (int i = 100; i >= 1; --i) {
+    imv_latency_add(latency, IMV_LATENCY_TOTAL, i);
+  }
+  /* Other stages are kept apart */
+  imv_latency_add(latency, IMV_LATENCY_OPEN, 1000.0);
+
+  assert_true(imv_latency_last(latency, IMV_LATENCY_TOTAL) == 1.0);
+  assert_true(imv_latency_percentile(latency, IMV_LATENCY_TOTAL, 50.0) == 50.0);
+  assert_true(imv_latency_percentile(latency, IMV_LATENCY_TOTAL, 95.0) == 95.0);
+  assert_true(imv_latency_percentile(latency, IMV_LATENCY_TOTAL, 100.0) == 100.0);
+  assert_true(imv_latency_percentile(latency, IMV_LATENCY_TOTAL, 0.0) == 1.0);
+  assert_true(imv_latency_percentile(latency, IMV_LATENCY_OPEN, 50.0) == 1000.0);
+
+  imv_latency_free(latency);
+}
+
+static void test_rolling(void **state)
+{
+  (void)state;
+  struct imv_latency *latency = imv_latency_create();
+
+  /* Old timings are pushed out by new ones */
+  for (int i = 0; i < 1000; ++i) {
+    imv_latency_add(latency, IMV_LATENCY_DRAW, i < 500 ? 1000.0 : 1.0);
+  }
+  assert_true(imv_latency_percentile(latency, IMV_LATENCY_DRAW, 100.0) == 1.0);
+
+  imv_latency_free(latency);
+}
+
+static void test_stage_names(void **state)
+{
+  (void)state;
+  for (int i = 0; i < IMV_LATENCY_STAGE_COUNT; ++i) {
+    enum imv_latency_stage stage;
+    assert_true(imv_latency_find_stage(imv_latency_stage_name(i), &stage));
+    assert_int_equal(stage, i);
+  }
+
+  enum imv_latency_stage stage;
+  assert_false(imv_latency_find_stage("nonsense", &stage));
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_empty),
+    cmocka_unit_test(test_percentiles),
+    cmocka_unit_test(test_rolling),
+    cmocka_unit_test(test_stage_names),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
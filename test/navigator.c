@@ -6,7 +6,10 @@
 #include <fcntl.h>
 #include <cmocka.h>
 #include <errno.h>
+#include <stdio.h>
+#include <string.h>
 
+#include "list.h"
 #include "navigator.h"
 
 #define FILENAME1 "example.file.1"
@@ -111,12 +114,103 @@ static void test_navigator_file_changed(void **state)
   imv_navigator_free(nav);
 }
 
+static void test_navigator_find_remove(void **state)
+{
+  (void)state;
+  struct imv_navigator *nav = imv_navigator_create();
+  char path[32];
+
+  for (int i = 0; i < 100; ++i) {
+    snprintf(path, sizeof path, "/dir%d/file%d", i % 2, i / 2);
+    assert_false(imv_navigator_add(nav, path, 0));
+  }
+
+  /* The first match wins, by full path or by the final portion */
+  assert_int_equal(imv_navigator_find_path(nav, "/dir1/file3"), 7);
+  assert_int_equal(imv_navigator_find_path(nav, "file3"), 6);
+  assert_int_equal(imv_navigator_find_path(nav, "/dir2/file3"), -1);
+
+  /* Removing paths keeps the order of the rest */
+  for (int i = 0; i < 40; ++i) {
+    snprintf(path, sizeof path, "/dir0/file%d", i);
+    imv_navigator_remove(nav, path);
+  }
+  assert_int_equal(imv_navigator_length(nav), 60);
+  assert_string_equal(imv_navigator_at(nav, 0), "/dir1/file0");
+  assert_string_equal(imv_navigator_at(nav, 39), "/dir1/file39");
+  assert_string_equal(imv_navigator_at(nav, 40), "/dir0/file40");
+  assert_int_equal(imv_navigator_find_path(nav, "file3"), 3);
+  assert_int_equal(imv_navigator_find_path(nav, "file45"), 50);
+
+  imv_navigator_free(nav);
+}
+
+static struct list *entries(const char **keys, size_t count)
+{
+  struct list *list = list_create();
+  for (size_t i = 0; i < count; ++i) {
+    struct imv_navigator_entry *entry = calloc(1, sizeof *entry);
+    entry->key = strdup(keys[i]);
+    entry->path = malloc(strlen(keys[i]) + 4);
+    strcpy(entry->path, "/d/");
+    strcat(entry->path, keys[i]);
+    list_append(list, entry);
+  }
+  imv_navigator_sort_entries(list);
+  return list;
+}
+
+static void test_navigator_add_entries(void **state)
+{
+  (void)state;
+  struct imv_navigator *nav = imv_navigator_create();
+
+  /* A scan's files go between the paths added before and after it */
+  assert_false(imv_navigator_add(nav, "/before", 0));
+  const unsigned group = imv_navigator_reserve(nav);
+  assert_false(imv_navigator_add(nav, "/after", 0));
+
+  const char *first[] = {"c", "b/x"};
+  struct list *batch = entries(first, 2);
+  imv_navigator_add_entries(nav, group, batch);
+  list_free(batch);
+  assert_int_equal(imv_navigator_length(nav), 4);
+
+  /* Paths can be held on to while others are asked for */
+  const char *held = imv_navigator_at(nav, 1);
+  assert_string_equal(imv_navigator_at(nav, 2), "/d/c");
+  assert_string_equal(held, "/d/b/x");
+  assert_ptr_equal(imv_navigator_at(nav, 1), held);
+
+  /* Later batches are merged in, as a depth first walk would order them,
+   * without moving the selection to another file */
+  imv_navigator_select_abs(nav, 2);
+  const char *second[] = {"b.png", "a", "b/a"};
+  batch = entries(second, 3);
+  imv_navigator_add_entries(nav, group, batch);
+  list_free(batch);
+
+  const char *expected[] = {
+    "/before", "/d/a", "/d/b/a", "/d/b/x", "/d/b.png", "/d/c", "/after"
+  };
+  assert_int_equal(imv_navigator_length(nav), 7);
+  for (size_t i = 0; i < 7; ++i) {
+    assert_string_equal(imv_navigator_at(nav, i), expected[i]);
+  }
+  assert_int_equal(imv_navigator_index(nav), 5);
+  assert_string_equal(imv_navigator_selection(nav), "/d/c");
+
+  imv_navigator_free(nav);
+}
+
 int main(void)
 {
   (void)test_navigator_add_remove; /* skipped for now */
   const struct CMUnitTest tests[] = {
     /* cmocka_unit_test(test_navigator_add_remove), */
     cmocka_unit_test(test_navigator_file_changed),
+    cmocka_unit_test(test_navigator_find_remove),
+    cmocka_unit_test(test_navigator_add_entries),
   };
 
   return cmocka_run_group_tests(tests, NULL, NULL);
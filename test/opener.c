@@ -0,0 +1,163 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "list.h"
+#include "opener.h"
+#include "sniff.h"
+#include "stream.h"
+
+/* How many times each fake backend's been asked to open something, and the
+ * length of what the last open_memory was given */
+static struct {
+  int tiff;
+  int png;
+  size_t memory_len;
+} calls;
+
+static enum backend_result tiff_open_memory(void *data, size_t len,
+    struct imv_source **src)
+{
+  (void)data;
+  ++calls.tiff;
+  calls.memory_len = len;
+  *src = NULL;
+  return BACKEND_SUCCESS;
+}
+
+static enum backend_result png_open_stream(struct imv_stream *stream,
+    struct imv_source **src)
+{
+  (void)stream;
+  ++calls.png;
+  *src = NULL;
+  return BACKEND_SUCCESS;
+}
+
+/* Installed in the same order as the real ones, with libtiff only able to
+ * read data once it's all arrived */
+static const struct imv_backend backend_tiff = {
+  .name = "libtiff",
+  .sniff = &imv_sniff_tiff,
+  .open_memory = &tiff_open_memory,
+};
+
+static const struct imv_backend backend_png = {
+  .name = "libpng",
+  .sniff = &imv_sniff_png,
+  .open_stream = &png_open_stream,
+};
+
+static struct imv_opener *create_opener(void)
+{
+  memset(&calls, 0, sizeof calls);
+  struct imv_opener *opener = imv_opener_create();
+  imv_opener_add_backend(opener, &backend_tiff);
+  imv_opener_add_backend(opener, &backend_png);
+  return opener;
+}
+
+/* Write a header, padded out to more than the opener sniffs */
+static void write_header(int fd, const char *magic, size_t magic_len)
+{
+  unsigned char buf[8192] = {0};
+  memcpy(buf, magic, magic_len);
+  assert_int_equal(write(fd, buf, sizeof buf), sizeof buf);
+}
+
+static void test_stream_before_memory(void **state)
+{
+  (void)state;
+  struct imv_opener *opener = create_opener();
+  int fds[2];
+  assert_int_equal(pipe(fds), 0);
+  struct imv_stream *stream = imv_stream_create(fds[0]);
+
+  /* The pipe's left open, so anything that waits for the end hangs, and the
+   * alarm fails the test */
+  write_header(fds[1], "\x89PNG\r\n\x1a\n", 8);
+  alarm(10);
+  struct imv_source *src = NULL;
+  struct list *pending = NULL;
+  assert_int_equal(imv_opener_open_stream(opener, stream, &src, &pending),
+      BACKEND_SUCCESS);
+  alarm(0);
+  assert_null(pending);
+  assert_int_equal(calls.png, 1);
+  assert_int_equal(calls.tiff, 0);
+
+  close(fds[1]);
+  imv_stream_unref(stream);
+  imv_opener_free(opener);
+}
+
+static void test_memory_pending(void **state)
+{
+  (void)state;
+  struct imv_opener *opener = create_opener();
+  int fds[2];
+  assert_int_equal(pipe(fds), 0);
+  struct imv_stream *stream = imv_stream_create(fds[0]);
+
+  write_header(fds[1], "II*\0", 4);
+  alarm(10);
+  struct imv_source *src = NULL;
+  struct list *pending = NULL;
+  assert_int_equal(imv_opener_open_stream(opener, stream, &src, &pending),
+      BACKEND_SUCCESS);
+  alarm(0);
+  assert_non_null(pending);
+  assert_int_equal(pending->len, 1);
+  assert_int_equal(calls.tiff, 0);
+  assert_int_equal(calls.png, 0);
+
+  /* It's only given the data once all of it's arrived */
+  write_header(fds[1], "", 0);
+  close(fds[1]);
+  assert_int_equal(imv_opener_open_pending(pending, stream, &src),
+      BACKEND_SUCCESS);
+  assert_int_equal(calls.tiff, 1);
+  assert_int_equal(calls.memory_len, 2 * 8192);
+  assert_int_equal(calls.png, 0);
+
+  imv_stream_unref(stream);
+  imv_opener_free(opener);
+}
+
+static void test_stream_unclaimed(void **state)
+{
+  (void)state;
+  struct imv_opener *opener = create_opener();
+  int fds[2];
+  assert_int_equal(pipe(fds), 0);
+  struct imv_stream *stream = imv_stream_create(fds[0]);
+
+  write_header(fds[1], "GIF89a", 6);
+  close(fds[1]);
+  struct imv_source *src = NULL;
+  struct list *pending = NULL;
+  assert_int_equal(imv_opener_open_stream(opener, stream, &src, &pending),
+      BACKEND_UNSUPPORTED);
+  assert_null(pending);
+  assert_int_equal(calls.tiff + calls.png, 0);
+
+  imv_stream_unref(stream);
+  imv_opener_free(opener);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_stream_before_memory),
+    cmocka_unit_test(test_memory_pending),
+    cmocka_unit_test(test_stream_unclaimed),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
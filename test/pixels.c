@@ -0,0 +1,69 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pixels.h"
+
+/* Long enough to go through the vectorised loops and their tails */
+#define NUM_PIXELS 67
+
+static void test_swap_rb(void **state)
+{
+  (void)state;
+  uint32_t src[NUM_PIXELS], dst[NUM_PIXELS];
+  for (int i = 0; i < NUM_PIXELS; ++i) {
+    src[i] = 0x80000000u | (uint32_t)i << 16 | 0x4200 | (uint32_t)(255 - i);
+  }
+
+  imv_pixels_swap_rb(dst, src, NUM_PIXELS);
+  for (int i = 0; i < NUM_PIXELS; ++i) {
+    assert_int_equal(dst[i], 0x80000000u | (uint32_t)(255 - i) << 16 | 0x4200 | (uint32_t)i);
+  }
+
+  /* In place, and back again */
+  imv_pixels_swap_rb(dst, dst, NUM_PIXELS);
+  assert_memory_equal(dst, src, sizeof src);
+}
+
+static void test_grey_to_argb(void **state)
+{
+  (void)state;
+  unsigned char src[NUM_PIXELS];
+  uint32_t dst[NUM_PIXELS];
+  for (int i = 0; i < NUM_PIXELS; ++i) {
+    src[i] = (unsigned char)(i * 3);
+  }
+
+  imv_pixels_grey_to_argb(dst, src, NUM_PIXELS);
+  for (int i = 0; i < NUM_PIXELS; ++i) {
+    const uint32_t l = src[i];
+    assert_int_equal(dst[i], 0xff000000u | l << 16 | l << 8 | l);
+  }
+}
+
+static void test_copy_rows(void **state)
+{
+  (void)state;
+  const unsigned char src[] = "abcXdefXghiX";
+  unsigned char dst[10] = {0};
+
+  imv_pixels_copy_rows(dst, 3, src, 4, 3, 3);
+  assert_memory_equal(dst, "abcdefghi", 9);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_swap_rb),
+    cmocka_unit_test(test_grey_to_argb),
+    cmocka_unit_test(test_copy_rows),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
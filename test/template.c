@@ -0,0 +1,94 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "template.h"
+
+static bool lookup(const char *name, char *buf, size_t len, void *data)
+{
+  if (!strcmp(name, "imv_scale")) {
+    snprintf(buf, len, "%d", *(int*)data);
+    return true;
+  }
+  if (!strcmp(name, "imv_current_file")) {
+    snprintf(buf, len, "%s", "a  file.png");
+    return true;
+  }
+  return false;
+}
+
+static void test_template_expand(void **state)
+{
+  (void)state;
+  int scale = 100;
+  bool changed;
+
+  struct imv_template *tmpl = imv_template_create(
+      "[${imv_scale}%]  $imv_current_file \"$imv_current_file\" 'x  $y'");
+  assert_false(imv_template_uses_shell(tmpl));
+  assert_string_equal(imv_template_expand(tmpl, &lookup, &scale, &changed),
+      "[100%] a file.png a  file.png x  $y ");
+  assert_true(changed);
+
+  /* Nothing it depends on has changed */
+  imv_template_expand(tmpl, &lookup, &scale, &changed);
+  assert_false(changed);
+
+  scale = 50;
+  assert_string_equal(imv_template_expand(tmpl, &lookup, &scale, &changed),
+      "[50%] a file.png a  file.png x  $y ");
+  assert_true(changed);
+  imv_template_free(tmpl);
+}
+
+static void test_template_environment(void **state)
+{
+  (void)state;
+  setenv("imv_test_var", "from env", 1);
+  unsetenv("imv_test_unset");
+
+  struct imv_template *tmpl = imv_template_create("$imv_test_var${imv_test_unset}!");
+  assert_string_equal(imv_template_expand(tmpl, NULL, NULL, NULL), "from env! ");
+  imv_template_free(tmpl);
+}
+
+static void test_template_shell(void **state)
+{
+  (void)state;
+  const char *formats[] = {
+    "$(echo hi)",
+    "`echo hi`",
+    "${imv_scale:-0}",
+    "~/file",
+    "a;b",
+    "\"unterminated",
+  };
+
+  for (size_t i = 0; i < sizeof formats / sizeof *formats; ++i) {
+    struct imv_template *tmpl = imv_template_create(formats[i]);
+    assert_true(imv_template_uses_shell(tmpl));
+    imv_template_free(tmpl);
+  }
+
+  struct imv_template *tmpl = imv_template_create("$(echo hi) there");
+  assert_string_equal(imv_template_expand(tmpl, NULL, NULL, NULL), "hi there ");
+  imv_template_free(tmpl);
+}
+
+int main(void)
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_template_expand),
+    cmocka_unit_test(test_template_environment),
+    cmocka_unit_test(test_template_shell),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */